@@ -0,0 +1,486 @@
+#include "bridge.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace usbcommuni {
+
+#define BRIDGE_HEAD_SIZE        4
+#define BRIDGE_MAX_MESSAGE      (16*1024*1024)
+#define BRIDGE_READ_CHUNK       65536
+#define BRIDGE_EPOLL_EVENTS     64
+
+/* how often sessions holding messages try the link again */
+#define BRIDGE_RETRY_MS         5
+
+static inline void PutBe32(char *p, uint32_t v)
+{
+    p[0] = (v >> 24u);
+    p[1] = (v >> 16u);
+    p[2] = (v >> 8u);
+    p[3] = (v & 0xFFu);
+}
+
+static inline uint32_t GetBe32(const char *p)
+{
+    const uint8_t *u = reinterpret_cast<const uint8_t*>(p);
+
+    return ((uint32_t)u[0] << 24u) | ((uint32_t)u[1] << 16u) | ((uint32_t)u[2] << 8u) | u[3];
+}
+
+Bridge::Bridge(USBCommuni &usb, uint32_t max_backlog)
+    : usb_(usb)
+{
+    max_backlog_ = max_backlog;
+    held_ = 0;
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    exit_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+Bridge::~Bridge()
+{
+    usb_.RecvHandleRegister(nullptr);
+
+    for (auto &it : sessions_) {
+        close(it.second->fd);
+        delete it.second;
+    }
+    sessions_.clear();
+
+    for (int fd : listen_fds_)
+        close(fd);
+
+    if (!unix_path_.empty())
+        unlink(unix_path_.c_str());
+
+    if (exit_fd_ >= 0)
+        close(exit_fd_);
+
+    if (epoll_fd_ >= 0)
+        close(epoll_fd_);
+}
+
+static USBCommuniErrors_t ListenOn(int epoll_fd, int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct epoll_event ev;
+
+    if ((bind(fd, addr, addrlen) != 0) || (listen(fd, 16) != 0)) {
+        fprintf(stderr, "[BRIDGE] listen failed: %s\n", strerror(errno));
+        return USBCOMMUNI_E_IO;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        return USBCOMMUNI_E_IO;
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+USBCommuniErrors_t Bridge::ListenUnix(const std::string &path)
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    if (path.empty() || (path.size() >= sizeof(addr.sun_path)) || !unix_path_.empty())
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return USBCOMMUNI_E_IO;
+
+    unlink(path.c_str());
+    if (ListenOn(epoll_fd_, fd, (struct sockaddr*)&addr, sizeof(addr)) != USBCOMMUNI_E_SUCCESS) {
+        close(fd);
+        return USBCOMMUNI_E_IO;
+    }
+
+    listen_fds_.push_back(fd);
+    unix_path_ = path;
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+USBCommuniErrors_t Bridge::ListenTcp(uint16_t port)
+{
+    int fd;
+    int on = 1;
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return USBCOMMUNI_E_IO;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (ListenOn(epoll_fd_, fd, (struct sockaddr*)&addr, sizeof(addr)) != USBCOMMUNI_E_SUCCESS) {
+        close(fd);
+        return USBCOMMUNI_E_IO;
+    }
+
+    listen_fds_.push_back(fd);
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+void Bridge::Stop()
+{
+    uint64_t u = 1;
+
+    write(exit_fd_, &u, sizeof(u));
+}
+
+USBCommuniErrors_t Bridge::Run()
+{
+    int n;
+    int fd;
+    int signal_fd;
+    bool listening;
+    sigset_t mask;
+    std::map<int, Session*>::iterator it;
+    struct epoll_event ev, events[BRIDGE_EPOLL_EVENTS];
+
+    if ((epoll_fd_ < 0) || (exit_fd_ < 0) || listen_fds_.empty())
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = exit_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, exit_fd_, &ev);
+    if (signal_fd >= 0) {
+        ev.data.fd = signal_fd;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, signal_fd, &ev);
+    }
+
+    usb_.RecvHandleRegister([this](const char *data, uint32_t len) { OnRecv(data, len); });
+
+    while (true) {
+        n = epoll_wait(epoll_fd_, events, BRIDGE_EPOLL_EVENTS, held_ ? BRIDGE_RETRY_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (held_)
+            RetryHeld();
+
+        for (int i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+
+            if ((fd == exit_fd_) || (fd == signal_fd))
+                goto out;
+
+            listening = false;
+            for (int l : listen_fds_) {
+                if (l == fd)
+                    listening = true;
+            }
+            if (listening) {
+                Accept(fd);
+                continue;
+            }
+
+            /* only this thread erases sessions, no lock needed to look one up */
+            it = sessions_.find(fd);
+            if (it == sessions_.end())
+                continue;
+
+            if (events[i].events & EPOLLOUT) {
+                std::lock_guard<std::mutex> lock(sessions_mutex_);
+                FlushSession(it->second);
+            }
+
+            /* a hangup or error shows up as end of stream and closes the session */
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                ReadSession(it->second);
+        }
+    }
+
+out:
+    usb_.RecvHandleRegister(nullptr);
+    if (signal_fd >= 0)
+        close(signal_fd);
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+void Bridge::Accept(int listen_fd)
+{
+    int fd;
+    int on = 1;
+    struct epoll_event ev;
+    Session *s;
+
+    while ((fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        /* no-op on Unix sockets */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        s = new Session;
+        s->fd = fd;
+        s->out_offset = 0;
+        s->dropped = false;
+        s->held = false;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            delete s;
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+        sessions_[fd] = s;
+        fprintf(stderr, "[BRIDGE] client %d connected, %zu total\n", fd, sessions_.size());
+    }
+}
+
+void Bridge::ReadSession(Session *s)
+{
+    ssize_t r;
+    size_t used;
+    bool eof = false;
+
+    while (true) {
+        used = s->in.size();
+        s->in.resize(used + BRIDGE_READ_CHUNK);
+        r = recv(s->fd, s->in.data() + used, BRIDGE_READ_CHUNK, MSG_DONTWAIT);
+        s->in.resize(used + ((r > 0) ? r : 0));
+
+        if (r > 0)
+            continue;
+        if ((r < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+            break;
+        if ((r < 0) && (errno == EINTR))
+            continue;
+
+        /* closed or failed, still forward what arrived before */
+        eof = true;
+        break;
+    }
+
+    if (!Forward(s))
+        return;
+
+    if (eof)
+        CloseSession(s);
+}
+
+/**
+ * Every complete message of @s goes to the phone in one batch, without
+ * waiting on the link. What it turns away for now is held, from the
+ * first such message on, so the order stays. False if @s was closed.
+ */
+bool Bridge::Forward(Session *s)
+{
+    size_t offset = 0;
+    size_t taken;
+    uint32_t len;
+    uint32_t i;
+    bool hold;
+    USBCommuniErrors_t err;
+    struct iovec v;
+    std::vector<struct iovec> iov;
+    std::vector<size_t> starts;
+    std::vector<USBCommuniErrors_t> results;
+
+    while (s->in.size() - offset >= BRIDGE_HEAD_SIZE) {
+        len = GetBe32(s->in.data() + offset);
+        if (len > BRIDGE_MAX_MESSAGE) {
+            fprintf(stderr, "[BRIDGE] client %d sent a %u byte message, dropped\n", s->fd, len);
+            CloseSession(s);
+            return false;
+        }
+
+        if (s->in.size() - offset - BRIDGE_HEAD_SIZE < len)
+            break;
+
+        if (len > 0) {
+            v.iov_base = s->in.data() + offset + BRIDGE_HEAD_SIZE;
+            v.iov_len = len;
+            iov.push_back(v);
+            starts.push_back(offset);
+        }
+        offset += BRIDGE_HEAD_SIZE + len;
+    }
+
+    taken = offset;
+    hold = false;
+
+    if (!iov.empty()) {
+        LinkNoWait nowait;
+
+        results.resize(iov.size());
+        err = usb_.SendBatch(iov.data(), iov.size(), results.data());
+
+        for (i = 0; (USBCOMMUNI_E_SUCCESS != err) && (i < iov.size()); i++) {
+            if (USBCOMMUNI_E_SUCCESS == results[i])
+                continue;
+
+            if ((USBCOMMUNI_E_TIMEOUT != results[i]) && (USBCOMMUNI_E_NOT_CONN != results[i])) {
+                fprintf(stderr, "[BRIDGE] forwarding messages of client %d failed: %d, disconnecting\n",
+                        s->fd, results[i]);
+                CloseSession(s);
+                return false;
+            }
+
+            taken = starts[i];
+            hold = true;
+            break;
+        }
+    }
+
+    s->in.erase(s->in.begin(), s->in.begin() + taken);
+
+    if (hold != s->held) {
+        std::lock_guard<std::mutex> lock(sessions_mutex_);
+
+        s->held = hold;
+        if (hold)
+            held_++;
+        else
+            held_--;
+        WatchOut(s, s->out_offset < s->out.size());
+    }
+
+    return true;
+}
+
+/* the epoll thread, once per pass while sessions hold messages */
+void Bridge::RetryHeld()
+{
+    std::vector<Session*> held;
+
+    for (auto &it : sessions_) {
+        if (it.second->held)
+            held.push_back(it.second);
+    }
+
+    for (Session *s : held)
+        Forward(s);
+}
+
+/* sessions_mutex_ held */
+void Bridge::FlushSession(Session *s)
+{
+    ssize_t r;
+
+    while (s->out_offset < s->out.size()) {
+        r = send(s->fd, s->out.data() + s->out_offset, s->out.size() - s->out_offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (r <= 0)
+            break;
+        s->out_offset += r;
+    }
+
+    if (s->out_offset == s->out.size()) {
+        s->out.clear();
+        s->out_offset = 0;
+        WatchOut(s, false);
+    } else if (s->out_offset > s->out.size() / 2) {
+        s->out.erase(s->out.begin(), s->out.begin() + s->out_offset);
+        s->out_offset = 0;
+    }
+}
+
+void Bridge::WatchOut(Session *s, bool enable)
+{
+    struct epoll_event ev;
+
+    /* no EPOLLIN while held, a hangup or error still shows */
+    ev.events = s->held ? 0u : (uint32_t)EPOLLIN;
+    if (enable)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = s->fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+void Bridge::CloseSession(Session *s)
+{
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, s->fd, nullptr);
+    close(s->fd);
+    sessions_.erase(s->fd);
+    if (s->held)
+        held_--;
+    fprintf(stderr, "[BRIDGE] client %d gone, %zu left\n", s->fd, sessions_.size());
+    delete s;
+}
+
+void Bridge::OnRecv(const char *data, uint32_t len)
+{
+    char head[BRIDGE_HEAD_SIZE];
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t r;
+    size_t sent;
+    Session *s;
+
+    PutBe32(head, len);
+
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+
+    for (auto &it : sessions_) {
+        s = it.second;
+
+        if (s->dropped)
+            continue;
+
+        if (s->out.size() - s->out_offset + BRIDGE_HEAD_SIZE + len > max_backlog_) {
+            /* the epoll thread sees the hangup and drops the session */
+            fprintf(stderr, "[BRIDGE] client %d too slow, disconnecting\n", s->fd);
+            shutdown(s->fd, SHUT_RDWR);
+            s->dropped = true;
+            continue;
+        }
+
+        sent = 0;
+        if (s->out.empty()) {
+            iov[0].iov_base = head;
+            iov[0].iov_len = BRIDGE_HEAD_SIZE;
+            iov[1].iov_base = const_cast<char*>(data);
+            iov[1].iov_len = len;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = 2;
+
+            r = sendmsg(s->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (r > 0)
+                sent = r;
+            if (sent == BRIDGE_HEAD_SIZE + len)
+                continue;
+        }
+
+        /* backlog, keep the unsent rest */
+        if (sent < BRIDGE_HEAD_SIZE)
+            s->out.insert(s->out.end(), head + sent, head + BRIDGE_HEAD_SIZE);
+        sent = (sent > BRIDGE_HEAD_SIZE) ? (sent - BRIDGE_HEAD_SIZE) : 0;
+        s->out.insert(s->out.end(), data + sent, data + len);
+        WatchOut(s, true);
+    }
+}
+
+}
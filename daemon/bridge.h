@@ -0,0 +1,82 @@
+#ifndef USBCOMMUNI_BRIDGE_H_
+#define USBCOMMUNI_BRIDGE_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "usbcommuni.h"
+
+namespace usbcommuni {
+
+/**
+ * Exposes one USBCommuni link to local clients.
+ *
+ * Clients speak length prefixed messages (4 byte big endian length,
+ * then the payload) in both directions. Messages from any client are
+ * forwarded to the phone, everything the phone sends is delivered to
+ * every client. The USB link is owned by the bridge and stays up while
+ * clients come and go.
+ *
+ * Phone data is written to the client sockets straight from the library
+ * buffer, it is only copied for clients that cannot take it right away.
+ * A client more than max_backlog bytes behind is disconnected, the USB
+ * path never waits for a client.
+ *
+ * Nor does the bridge wait for the USB path: messages the link turns
+ * away for now, short of credit or tokens or with no phone connected,
+ * stay with their session, which is not read again until they went out.
+ * The client's own socket then pushes back. A client whose messages
+ * failed for good is disconnected, the hangup tells it they were lost.
+ */
+class Bridge
+{
+public:
+    explicit Bridge(USBCommuni &usb, uint32_t max_backlog = 4*1024*1024);
+    ~Bridge();
+
+    USBCommuniErrors_t ListenUnix(const std::string &path);
+
+    /* 127.0.0.1 only */
+    USBCommuniErrors_t ListenTcp(uint16_t port);
+
+    /* epoll loop, returns after Stop(), SIGINT or SIGTERM (block them in every thread first) */
+    USBCommuniErrors_t Run();
+    void Stop();
+
+private:
+    struct Session {
+        int fd;
+        std::vector<char> in;
+        std::vector<char> out;
+        size_t out_offset;
+        bool dropped;
+        bool held;          /**< in holds messages the link turned away, not read until they are out */
+    };
+
+    void OnRecv(const char *data, uint32_t len);
+    void Accept(int listen_fd);
+    void ReadSession(Session *s);
+    bool Forward(Session *s);
+    void RetryHeld();
+    void FlushSession(Session *s);
+    void CloseSession(Session *s);
+    void WatchOut(Session *s, bool enable);
+
+private:
+    USBCommuni &usb_;
+    uint32_t max_backlog_;
+    int epoll_fd_;
+    int exit_fd_;
+    std::vector<int> listen_fds_;
+    std::string unix_path_;
+    uint32_t held_;                     /**< sessions waiting on the link, the epoll thread's own */
+
+    /* the receive callback writes to the sessions from the library thread */
+    std::mutex sessions_mutex_;
+    std::map<int, Session*> sessions_;
+};
+
+}
+
+#endif /* USBCOMMUNI_BRIDGE_H_ */
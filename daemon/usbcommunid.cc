@@ -0,0 +1,77 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "usbcommuni.h"
+#include "bridge.h"
+
+static void Usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-u unix_socket] [-t tcp_port] [-l] [-c]\n"
+                    "  -u  Unix socket path (default /tmp/usbcommunid.sock)\n"
+                    "  -t  also listen on 127.0.0.1:port\n"
+                    "  -l  use link framing (the phone app must speak it)\n"
+                    "  -c  with -l, CRC32C on every frame\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    uint16_t tcp_port = 0;
+    const char *unix_path = "/tmp/usbcommunid.sock";
+    sigset_t mask;
+    usbcommuni::USBCommuniConfig_t config;
+    usbcommuni::USBCommuniErrors_t err;
+
+    while ((opt = getopt(argc, argv, "u:t:lch")) != -1) {
+        switch (opt) {
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 't':
+            tcp_port = atoi(optarg);
+            break;
+        case 'l':
+            config.link_enable = true;
+            break;
+        case 'c':
+            config.link_crc = true;
+            break;
+        default:
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    /* before any thread exists, the bridge takes them through a signalfd */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    usbcommuni::USBCommuni usb;
+    usbcommuni::Bridge bridge(usb);
+
+    if (bridge.ListenUnix(unix_path) != usbcommuni::USBCOMMUNI_E_SUCCESS)
+        return 1;
+
+    if (tcp_port && (bridge.ListenTcp(tcp_port) != usbcommuni::USBCOMMUNI_E_SUCCESS))
+        return 1;
+
+    err = usb.Init(config);
+    if (usbcommuni::USBCOMMUNI_E_SUCCESS != err) {
+        fprintf(stderr, "usb init failed: %d\n", err);
+        return 1;
+    }
+
+    fprintf(stderr, "usbcommunid listening on %s", unix_path);
+    if (tcp_port)
+        fprintf(stderr, " and 127.0.0.1:%u", tcp_port);
+    fprintf(stderr, "\n");
+
+    bridge.Run();
+    usb.Stop();
+
+    return 0;
+}
@@ -19,16 +19,18 @@ int main(int argc, char const *argv[])
 
     int i = 0 ;
     bool connect_status = false;
+    uint64_t epoch = 0;
 
     while (1) {
-        sleep(1);
+        /* wakes up immediately on connect/disconnect, otherwise once a second */
+        usbcommuni::USBCommuniConnectStates_t state = usbm.WaitForStateChange(epoch, 1000);
 
-        if (connect_status != usbm.GetConnectStatus()) {
-            connect_status = usbm.GetConnectStatus();
+        if (connect_status != (state == usbcommuni::USBCOMMUNI_STATE_CONNECTED)) {
+            connect_status = (state == usbcommuni::USBCOMMUNI_STATE_CONNECTED);
             fprintf(stderr, "USB Device connect status : %d\n", connect_status);
         }
 
-        if (usbm.GetConnectStatus()) {
+        if (connect_status) {
             char data[256] = {0};
             uint32_t len;
             uint32_t send_bytes;
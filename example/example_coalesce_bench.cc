@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "usbcommuni.h"
+
+/**
+ * Throughput / latency of send coalescing against an echo peer, e.g.
+ *
+ *   fake_usbmuxd -m echo &
+ *   USBMUXD_SOCKET_ADDRESS=UNIX:/tmp/fake_usbmuxd.sock usbcommuniexample_bench -d 0,100,1000,5000
+ *
+ * Every message carries its sequence number and send time, the echoed
+ * stream is cut back into messages of the same size. Delay 0 runs with
+ * coalescing off.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchResult {
+    uint32_t received;
+    double seconds;
+    std::vector<uint64_t> latency_us;
+};
+
+static std::mutex rx_mutex;
+static std::vector<char> rx_stream;
+static BenchResult result;
+static std::atomic<uint32_t> rx_count(0);
+static uint32_t msg_size = 64;
+
+static uint64_t NowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+}
+
+static void OnRecv(const char *data, uint32_t len)
+{
+    uint64_t sent_us;
+    uint64_t now = NowUs();
+    size_t offset = 0;
+    std::lock_guard<std::mutex> lock(rx_mutex);
+
+    rx_stream.insert(rx_stream.end(), data, data + len);
+
+    while (rx_stream.size() - offset >= msg_size) {
+        memcpy(&sent_us, rx_stream.data() + offset + 8, sizeof(sent_us));
+        result.latency_us.push_back(now - sent_us);
+        offset += msg_size;
+        rx_count++;
+    }
+
+    rx_stream.erase(rx_stream.begin(), rx_stream.begin() + offset);
+}
+
+static uint64_t Percentile(std::vector<uint64_t> &v, double p)
+{
+    if (v.empty())
+        return 0;
+
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static bool RunPoint(uint32_t delay_us, uint32_t count, uint32_t rate)
+{
+    usbcommuni::USBCommuni usbm;
+    usbcommuni::USBCommuniConfig_t config;
+    usbcommuni::USBCommuniErrors_t err;
+    std::vector<char> msg(msg_size, 0x5a);
+    Clock::time_point start;
+    Clock::time_point last_rx;
+    uint32_t send_bytes;
+    uint32_t seen;
+    uint64_t now;
+
+    config.send_coalesce = (delay_us > 0);
+    config.send_coalesce_delay_us = delay_us;
+
+    rx_stream.clear();
+    result.latency_us.clear();
+    result.latency_us.reserve(count);
+    rx_count = 0;
+
+    usbm.RecvHandleRegister(OnRecv);
+    if (usbm.Init(config) != usbcommuni::USBCOMMUNI_E_SUCCESS)
+        return false;
+
+    if (usbm.WaitForConnect(30000) != usbcommuni::USBCOMMUNI_E_SUCCESS) {
+        fprintf(stderr, "no peer connected\n");
+        return false;
+    }
+
+    start = Clock::now();
+    for (uint64_t i = 0; i < count; i++) {
+        if (rate > 0)
+            std::this_thread::sleep_until(start + std::chrono::microseconds(i * 1000000 / rate));
+
+        now = NowUs();
+        memcpy(msg.data(), &i, sizeof(i));
+        memcpy(msg.data() + 8, &now, sizeof(now));
+
+        err = usbm.SendData(msg.data(), msg_size, send_bytes);
+        while ((err == usbcommuni::USBCOMMUNI_E_IO) && usbm.GetConnectStatus()) {
+            /* iOS send queue full, let it drain */
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            err = usbm.SendData(msg.data(), msg_size, send_bytes);
+        }
+    }
+
+    /* wait for the echoes until the stream goes quiet */
+    seen = 0;
+    last_rx = Clock::now();
+    while ((rx_count < count) && (Clock::now() - last_rx < std::chrono::seconds(2))) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (rx_count != seen) {
+            seen = rx_count;
+            last_rx = Clock::now();
+        }
+    }
+
+    usbm.Stop();
+
+    result.received = rx_count;
+    result.seconds = std::max(1e-6, std::chrono::duration<double>(last_rx - start).count());
+    std::sort(result.latency_us.begin(), result.latency_us.end());
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    uint32_t count = 100000;
+    uint32_t rate = 0;
+    std::string delays = "0,100,500,1000,5000";
+    char *token;
+
+    while ((opt = getopt(argc, argv, "n:s:r:d:h")) != -1) {
+        switch (opt) {
+        case 'n': count = atoi(optarg); break;
+        case 's': msg_size = std::max(16, atoi(optarg)); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'd': delays = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-n messages] [-s size] [-r messages/s, 0 unpaced] [-d delay_us,...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%10s %10s %10s %12s %10s %10s %10s\n", "delay_us", "received", "msg/s", "MB/s", "p50_us", "p99_us", "max_us");
+
+    for (token = strtok(&delays[0], ","); token != nullptr; token = strtok(nullptr, ",")) {
+        if (!RunPoint(atoi(token), count, rate))
+            return 1;
+
+        printf("%10s %10u %10.0f %12.2f %10lu %10lu %10lu\n", token, result.received,
+               result.received / result.seconds, result.received * (double)msg_size / result.seconds / 1e6,
+               (unsigned long)Percentile(result.latency_us, 0.5), (unsigned long)Percentile(result.latency_us, 0.99),
+               (unsigned long)(result.latency_us.empty() ? 0 : result.latency_us.back()));
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "usbcommuni.h"
+
+/**
+ * Plug to ready latency per connect stage, e.g.
+ *
+ *   usbcommuniexample_connect -f ./fake_usbmuxd -n 200
+ *
+ * drives fake_usbmuxd through its stdin, detaching and re-attaching the
+ * simulated phone, which sends data right after each connect. Stages are
+ * timed from the attach command. With -r no stand-in is started and the
+ * stages of real devices are timed from their hotplug event instead, plug
+ * the phone in and out -n times (Android adds the accessory switch and
+ * re-enumeration stages).
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+static const char *stage_names[usbcommuni::USBCOMMUNI_STAGES] = {
+    "plugged", "switched", "enumerated", "opened", "ready", "first_byte",
+};
+
+static uint64_t NowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+}
+
+static uint64_t Percentile(std::vector<uint64_t> &v, double p)
+{
+    if (v.empty())
+        return 0;
+
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static bool WaitForState(usbcommuni::USBCommuni &usbm, usbcommuni::USBCommuniConnectStates_t state, uint32_t timeout_ms)
+{
+    uint64_t epoch;
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    while (usbm.GetConnectState(&epoch) != state) {
+        if (Clock::now() >= deadline)
+            return false;
+        usbm.WaitForStateChange(epoch, 10);
+    }
+
+    return true;
+}
+
+static bool WaitForFirstByte(usbcommuni::USBCommuni &usbm, usbcommuni::USBCommuniConnectTimeline_t &timeline, uint32_t timeout_ms)
+{
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    do {
+        usbm.GetConnectTimeline(timeline);
+        if (timeline.stage_us[usbcommuni::USBCOMMUNI_STAGE_FIRST_BYTE] != 0)
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    } while (Clock::now() < deadline);
+
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    uint32_t cycles = 100;
+    bool real = false;
+    std::string fake = "./fake_usbmuxd";
+    std::string socket_path = "/tmp/usbcommuni_connect_bench.sock";
+    std::string cmd;
+    FILE *stand_in = nullptr;
+    usbcommuni::USBCommuni usbm;
+    usbcommuni::USBCommuniConfig_t config;
+    usbcommuni::USBCommuniConnectTimeline_t timeline;
+    std::vector<uint64_t> stage_us[usbcommuni::USBCOMMUNI_STAGES];
+    uint64_t start_us;
+    uint32_t done = 0;
+
+    while ((opt = getopt(argc, argv, "n:f:s:rh")) != -1) {
+        switch (opt) {
+        case 'n': cycles = atoi(optarg); break;
+        case 'f': fake = optarg; break;
+        case 's': socket_path = optarg; break;
+        case 'r': real = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-n cycles] [-f fake_usbmuxd] [-s socket] [-r real devices]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!real) {
+        unlink(socket_path.c_str());
+        cmd = fake + " -s " + socket_path + " -m gen -r 65536 -z 64 -n 1 > /dev/null";
+        stand_in = popen(cmd.c_str(), "w");
+        if (nullptr == stand_in) {
+            fprintf(stderr, "could not start %s\n", fake.c_str());
+            return 1;
+        }
+
+        for (int i = 0; (i < 500) && (access(socket_path.c_str(), F_OK) != 0); i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        setenv("USBMUXD_SOCKET_ADDRESS", ("UNIX:" + socket_path).c_str(), 1);
+    }
+
+    /* the stand-in's phone starts attached, the first connect is not timed */
+    if (usbm.Init(config) != usbcommuni::USBCOMMUNI_E_SUCCESS)
+        goto out;
+
+    for (uint32_t i = 0; i < cycles; i++) {
+        if (real) {
+            fprintf(stderr, "plug the phone in (%u/%u)\n", i + 1, cycles);
+            if (!WaitForState(usbm, usbcommuni::USBCOMMUNI_STATE_CONNECTED, 600000))
+                break;
+        } else {
+            if (!WaitForState(usbm, usbcommuni::USBCOMMUNI_STATE_CONNECTED, 10000)) {
+                fprintf(stderr, "no connect from the stand-in\n");
+                break;
+            }
+
+            fprintf(stand_in, "d\n");
+            fflush(stand_in);
+            if (!WaitForState(usbm, usbcommuni::USBCOMMUNI_STATE_IDLE, 10000)) {
+                fprintf(stderr, "detach not seen\n");
+                break;
+            }
+
+            start_us = NowUs();
+            fprintf(stand_in, "a\n");
+            fflush(stand_in);
+        }
+
+        if (!WaitForFirstByte(usbm, timeline, 10000)) {
+            fprintf(stderr, "no data after connect\n");
+            break;
+        }
+
+        if (real)
+            start_us = timeline.stage_us[usbcommuni::USBCOMMUNI_STAGE_PLUGGED];
+
+        for (uint32_t s = 0; s < usbcommuni::USBCOMMUNI_STAGES; s++) {
+            if (timeline.stage_us[s] >= start_us)
+                stage_us[s].push_back(timeline.stage_us[s] - start_us);
+        }
+        done++;
+
+        if (real) {
+            fprintf(stderr, "unplug the phone\n");
+            if (!WaitForState(usbm, usbcommuni::USBCOMMUNI_STATE_IDLE, 600000))
+                break;
+        }
+    }
+
+    printf("%u connects, us from %s\n", done, real ? "the hotplug event" : "the attach command");
+    printf("%12s %10s %10s %10s %10s %10s\n", "stage", "count", "p50_us", "p90_us", "p99_us", "max_us");
+
+    for (uint32_t s = 0; s < usbcommuni::USBCOMMUNI_STAGES; s++) {
+        std::vector<uint64_t> &v = stage_us[s];
+
+        if (v.empty())
+            continue;
+
+        std::sort(v.begin(), v.end());
+        printf("%12s %10zu %10lu %10lu %10lu %10lu\n", stage_names[s], v.size(),
+               (unsigned long)Percentile(v, 0.5), (unsigned long)Percentile(v, 0.9),
+               (unsigned long)Percentile(v, 0.99), (unsigned long)v.back());
+    }
+
+out:
+    usbm.Stop();
+
+    if (stand_in) {
+        fprintf(stand_in, "q\n");
+        pclose(stand_in);
+    }
+
+    return (done == cycles) ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <iostream>
+#include "usbcommuni_coro.h"
+
+static usbcommuni::USBCommuniTask Echo(usbcommuni::USBCommuniLink &link)
+{
+    while (true) {
+        if (co_await link.Connect() != usbcommuni::USBCOMMUNI_E_SUCCESS)
+            co_return;
+
+        usbcommuni::USBCommuniRecvResult_t r = co_await link.Recv();
+        if (r.err != usbcommuni::USBCOMMUNI_E_SUCCESS)
+            co_return;
+
+        fprintf(stderr, "[USB][RECV][%zu]\n", r.data.size());
+
+        /* echo back, the next Recv() resumes on the library's receive thread */
+        co_await link.Send(r.data.data(), r.data.size());
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    std::cout << "USB Communication Module coroutine example 1.0.0" << std::endl;
+
+    usbcommuni::USBCommuni usbm;
+    usbcommuni::USBCommuniLink link(usbm);
+
+    Echo(link);
+    usbm.Init();
+
+    while (1)
+        pause();
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "link/crc32c.h"
+
+/**
+ * CRC32C throughput of every implementation the CPU runs, e.g.
+ *
+ *   usbcommuniexample_crc -s 64,1500,16384 -t 0.5
+ *
+ * Per size: memcpy alone, the checksum alone and the checksum fused with
+ * the copy, as the link layer uses it. The implementations are checked
+ * against each other first, a mismatch exits non zero.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+#define CRC32C_IMPLS_MAX    4
+
+static volatile uint32_t sink;
+
+template <class F>
+static double Throughput(uint32_t size, double seconds, F run)
+{
+    Clock::time_point start = Clock::now();
+    uint64_t bytes = 0;
+    double elapsed;
+
+    do {
+        for (int i = 0; i < 256; i++)
+            run();
+        bytes += 256ull * size;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < seconds);
+
+    return bytes / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    double seconds = 0.5;
+    std::string sizes = "16,64,256,1500,4096,16384,65536";
+    const char *names[CRC32C_IMPLS_MAX];
+    usbcommuni::Crc32cImplFn fns[CRC32C_IMPLS_MAX];
+    size_t count;
+    uint32_t size;
+    uint32_t crc;
+    char *token;
+
+    while ((opt = getopt(argc, argv, "s:t:h")) != -1) {
+        switch (opt) {
+        case 's': sizes = optarg; break;
+        case 't': seconds = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s size,...] [-t seconds per point]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    count = usbcommuni::Crc32cImpls(names, fns, CRC32C_IMPLS_MAX);
+
+    /* odd lengths and offsets, every tail path */
+    std::vector<char> check(4099);
+    std::vector<char> copy(check.size());
+    for (size_t i = 0; i < check.size(); i++)
+        check[i] = (char)(i * 131 + 7);
+
+    for (size_t len = 0; len < 300; len++) {
+        crc = fns[0](0, nullptr, &check[len % 7], len);
+        for (size_t k = 0; k < count; k++) {
+            if ((fns[k](0, nullptr, &check[len % 7], len) != crc) ||
+                (fns[k](0, copy.data(), &check[len % 7], len) != crc) ||
+                (memcmp(copy.data(), &check[len % 7], len) != 0))
+            {
+                fprintf(stderr, "%s disagrees with %s at %zu bytes\n", names[k], names[0], len);
+                return 1;
+            }
+        }
+    }
+
+    if (fns[0](0, nullptr, "123456789", 9) != 0xE3069283) {
+        fprintf(stderr, "%s: wrong check value\n", names[0]);
+        return 1;
+    }
+
+    printf("in use: %s\n\n", usbcommuni::Crc32cImplName());
+    printf("%8s %-10s %12s %12s %12s\n", "size", "impl", "crc_MB/s", "copy+crc", "memcpy");
+
+    for (token = strtok(&sizes[0], ","); token != nullptr; token = strtok(nullptr, ",")) {
+        size = atoi(token);
+        if (size == 0)
+            continue;
+
+        std::vector<char> src(size, 0x5a);
+        std::vector<char> dst(size);
+
+        for (size_t k = 0; k < count; k++) {
+            usbcommuni::Crc32cImplFn fn = fns[k];
+            double plain, fused, copied;
+
+            plain = Throughput(size, seconds, [&]() { sink = fn(0, nullptr, src.data(), size); });
+            fused = Throughput(size, seconds, [&]() { sink = fn(0, dst.data(), src.data(), size); });
+            copied = Throughput(size, seconds, [&]() { memcpy(dst.data(), src.data(), size); sink = dst[size - 1]; });
+
+            printf("%8u %-10s %12.1f %12.1f %12.1f\n", size, names[k], plain, fused, copied);
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+}
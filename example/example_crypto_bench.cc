@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "usbcommuni.h"
+
+/**
+ * Link framing throughput with config.link_encrypt off and on, e.g.
+ *
+ *   usbcommuniexample_crypto -s 64,1024,16384 -t 2
+ *
+ * Two link layers are wired back to back in memory, no device needed:
+ * every frame is built (and sealed) by one and parsed (and opened) by
+ * the other, so the numbers are the CPU cost of the framing alone.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+static std::vector<char> wire;
+static uint64_t rx_bytes;
+
+static double RunPoint(bool encrypt, uint32_t size, double seconds)
+{
+    usbcommuni::USBCommuniConfig_t config;
+    usbcommuni::LinkLayer tx;
+    usbcommuni::LinkLayer rx;
+    std::vector<char> msg(size, 0x5a);
+    Clock::time_point start;
+    double elapsed;
+
+    config.link_enable = true;
+    config.link_encrypt = encrypt;
+    config.link_key = "usbcommuni benchmark";
+
+    tx.SetConfig(config);
+    rx.SetConfig(config);
+
+    tx.TransportRegister([](const struct iovec *iov, uint32_t iovcnt, usbcommuni::USBCommuniErrors_t *results) {
+        for (uint32_t i = 0; i < iovcnt; i++) {
+            const char *base = static_cast<const char*>(iov[i].iov_base);
+
+            wire.insert(wire.end(), base, base + iov[i].iov_len);
+            if (results)
+                results[i] = usbcommuni::USBCOMMUNI_E_SUCCESS;
+        }
+        return usbcommuni::USBCOMMUNI_E_SUCCESS;
+    });
+    rx.RecvHandleRegister([](uint8_t channel, const char *data, uint32_t len) {
+        rx_bytes += len;
+    });
+
+    rx_bytes = 0;
+    start = Clock::now();
+
+    do {
+        for (int i = 0; i < 64; i++)
+            tx.Send(0, msg.data(), size);
+
+        rx.Feed(wire.data(), wire.size());
+        wire.clear();
+
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < seconds);
+
+    return rx_bytes / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    double seconds = 1.0;
+    std::string sizes = "64,256,1024,4096,16384,65536";
+    double plain, sealed;
+    char *token;
+
+    while ((opt = getopt(argc, argv, "s:t:h")) != -1) {
+        switch (opt) {
+        case 's': sizes = optarg; break;
+        case 't': seconds = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s size,...] [-t seconds per point]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%10s %14s %14s %8s\n", "size", "plain_MB/s", "aes_gcm_MB/s", "ratio");
+
+    for (token = strtok(&sizes[0], ","); token != nullptr; token = strtok(nullptr, ",")) {
+        if (atoi(token) <= 0)
+            continue;
+
+        plain = RunPoint(false, atoi(token), seconds);
+        sealed = RunPoint(true, atoi(token), seconds);
+
+        printf("%10s %14.1f %14.1f %8.2f\n", token, plain, sealed, sealed / plain);
+        fflush(stdout);
+    }
+
+    return 0;
+}
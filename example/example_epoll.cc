@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "usbcommuni.h"
+
+/**
+ * The library on the application's own epoll loop, no library threads:
+ * its poll fd and a timerfd of the application share one epoll_wait(),
+ * whose timeout comes from GetTimeout(). Once a second a message goes
+ * out while connected, received data is printed.
+ */
+
+int main(int argc, char *argv[])
+{
+    int epfd;
+    int tfd;
+    int nfds;
+    uint32_t timeout_ms;
+    uint32_t n = 0;
+    uint32_t send_bytes;
+    uint64_t ticks;
+    char data[64];
+    struct itimerspec its = {{1, 0}, {1, 0}};
+    struct epoll_event ev, events[4];
+    usbcommuni::USBCommuni usbm;
+    usbcommuni::USBCommuniConfig_t config;
+
+    config.external_loop = true;
+
+    usbm.RecvHandleRegister([](const char *data, uint32_t length) {
+        fprintf(stderr, "[USB][RECV][%u]: %.*s\n", length, (int)length, data);
+    });
+    usbm.StateHandleRegister([](usbcommuni::USBCommuniConnectStates_t state, uint64_t epoch) {
+        fprintf(stderr, "USB link state %d (epoch %lu)\n", state, (unsigned long)epoch);
+    });
+
+    if (usbm.Init(config) != usbcommuni::USBCOMMUNI_E_SUCCESS) {
+        fprintf(stderr, "usbcommuni init failed\n");
+        return 1;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    timerfd_settime(tfd, 0, &its, nullptr);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = usbm.GetPollFd();
+    epoll_ctl(epfd, EPOLL_CTL_ADD, usbm.GetPollFd(), &ev);
+    ev.data.fd = tfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+    while (true) {
+        timeout_ms = usbm.GetTimeout();
+
+        nfds = epoll_wait(epfd, events, 4, (timeout_ms == USBCOMMUNI_WAIT_FOREVER) ? -1 : (int)timeout_ms);
+
+        for (int i = 0; i < nfds; i++) {
+            if ((events[i].data.fd != tfd) || (read(tfd, &ticks, sizeof(ticks)) != sizeof(ticks)))
+                continue;
+
+            if (!usbm.GetConnectStatus())
+                continue;
+
+            snprintf(data, sizeof(data), "Linux Message : %u\n", n++);
+            usbm.SendData(data, strlen(data), send_bytes);
+        }
+
+        /* cheap when nothing is ready, no need to check which fd fired */
+        usbm.ProcessEvents();
+    }
+
+    close(tfd);
+    close(epfd);
+    usbm.Stop();
+
+    return 0;
+}
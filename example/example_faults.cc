@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "mock_usb.h"
+
+/**
+ * Fault injection into the Android backend's transfer recovery, e.g.
+ *
+ *   usbcommuniexample_faults -b 500
+ *
+ * The backend runs on the mock of mock_usb.h, no device needed. Every
+ * case fails a transfer the way a flaky cable or a stuck peer would and
+ * checks which recovery ran, that the read ring is back in flight and
+ * that it took less than the bound. Exits non zero if a case failed.
+ */
+
+using namespace usbcommuni;
+using namespace mockusb;
+
+typedef std::chrono::steady_clock Clock;
+typedef std::function<bool (const USBCommuniRecoveryStats_t &before, const USBCommuniRecoveryStats_t &after)> Check;
+
+static USBAndroidCommuni android;
+static size_t ring;
+static uint32_t bound_ms = 1000;
+static uint32_t writes;
+static int failures;
+
+/* a completed read, so the next recovery does not count as one without progress */
+static void Progress()
+{
+    MockUsb::Get().WaitReads(MOCK_EP_IN, ring, bound_ms);
+    MockUsb::Get().Deliver(MOCK_EP_IN, "x", 1);
+}
+
+static void Send(uint32_t len)
+{
+    std::vector<char> data(len, 0x5a);
+    uint32_t send_bytes;
+
+    android.SendData(data.data(), len, send_bytes);
+}
+
+static void Expect(const char *name, std::function<void()> inject, Check check)
+{
+    USBCommuniRecoveryStats_t before, after;
+    Clock::time_point start;
+    double ms;
+    bool ok;
+
+    MockUsb::Get().WaitReads(MOCK_EP_IN, ring, bound_ms);
+    android.GetRecoveryStats(before);
+
+    start = Clock::now();
+    inject();
+
+    do {
+        android.GetRecoveryStats(after);
+        ok = check(before, after) && android.GetConnectStatus() && (MockUsb::Get().Reads(MOCK_EP_IN) >= ring);
+        ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        if (!ok)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    } while (!ok && (ms < bound_ms));
+
+    printf("%-56s %-4s %8.1f ms\n", name, ok ? "ok" : "FAIL", ms);
+    fflush(stdout);
+
+    if (!ok)
+        failures++;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    USBCommuniConfig_t config;
+    USBCommuniRecoveryStats_t stats;
+    MockUsb &mock = MockUsb::Get();
+
+    while ((opt = getopt(argc, argv, "b:h")) != -1) {
+        switch (opt) {
+        case 'b': bound_ms = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-b recovery bound ms]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    config.android_recover_retries = 2;
+    config.android_poll_ms = 20;
+    config.android_retry_ms = 50;
+
+    mock.WriteHandleRegister([](uint8_t endpoint, const unsigned char *data, int len) { writes++; });
+    mock.Start();
+
+    android.SetConfig(config);
+    android.TransferOpsRegister(MockUsb::Ops());
+    if (android.Init() != USBCOMMUNI_E_SUCCESS) {
+        fprintf(stderr, "init failed\n");
+        return 1;
+    }
+
+    android.SetDeviceInfo(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, MockUsb::Accessory(false));
+
+    for (int i = 0; (i < 1000) && !android.GetConnectStatus(); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    ring = mock.Reads(MOCK_EP_IN);
+    if (!android.GetConnectStatus() || (ring == 0)) {
+        fprintf(stderr, "the mock accessory did not connect\n");
+        return 1;
+    }
+
+    printf("connected, %zu reads in flight, up to %u ms per recovery\n\n", ring, bound_ms);
+
+    Expect("read timed out, resubmitted in place",
+        []() { MockUsb::Get().FailRead(MOCK_EP_IN, LIBUSB_TRANSFER_TIMED_OUT); },
+        [](const USBCommuniRecoveryStats_t &b, const USBCommuniRecoveryStats_t &a) {
+            return (a.resubmits == b.resubmits + 1) && (a.reopens == b.reopens);
+        });
+    Progress();
+
+    Expect("read stalled, halt cleared and ring rebuilt",
+        []() { MockUsb::Get().FailRead(MOCK_EP_IN, LIBUSB_TRANSFER_STALL); },
+        [](const USBCommuniRecoveryStats_t &b, const USBCommuniRecoveryStats_t &a) {
+            return (a.rebuilds == b.rebuilds + 1) && (a.halts_cleared == b.halts_cleared + 1) &&
+                   (a.recoveries == b.recoveries + 1) && (a.reopens == b.reopens);
+        });
+    Progress();
+
+    Expect("reads failing past the retries, ring rebuilt",
+        []() {
+            for (int i = 0; i < 3; i++) {
+                MockUsb::Get().WaitReads(MOCK_EP_IN, ring, bound_ms);
+                MockUsb::Get().FailRead(MOCK_EP_IN, LIBUSB_TRANSFER_ERROR);
+            }
+        },
+        [](const USBCommuniRecoveryStats_t &b, const USBCommuniRecoveryStats_t &a) {
+            return (a.resubmits == b.resubmits + 2) && (a.rebuilds == b.rebuilds + 1) && (a.reopens == b.reopens);
+        });
+
+    /* no completed read since that rebuild */
+    Expect("read stalled again without progress, reopened",
+        []() { MockUsb::Get().FailRead(MOCK_EP_IN, LIBUSB_TRANSFER_STALL); },
+        [](const USBCommuniRecoveryStats_t &b, const USBCommuniRecoveryStats_t &a) {
+            return (a.reopens == b.reopens + 1) && (a.recoveries == b.recoveries + 1);
+        });
+    Progress();
+
+    Expect("halt could not be cleared, reopened",
+        []() {
+            MockUsb::Get().SetClearHalt(LIBUSB_ERROR_IO);
+            MockUsb::Get().FailRead(MOCK_EP_IN, LIBUSB_TRANSFER_STALL);
+        },
+        [](const USBCommuniRecoveryStats_t &b, const USBCommuniRecoveryStats_t &a) {
+            return (a.reopens == b.reopens + 1) && (a.recoveries == b.recoveries + 1);
+        });
+    mock.SetClearHalt(LIBUSB_SUCCESS);
+    Progress();
+
+    /* the stream lost the stalled send, only a reopen resyncs the peer */
+    Expect("write stalled, halt cleared and reopened",
+        []() {
+            MockUsb::Get().FailWrite(LIBUSB_TRANSFER_STALL, 0);
+            Send(256);
+        },
+        [](const USBCommuniRecoveryStats_t &b, const USBCommuniRecoveryStats_t &a) {
+            return (a.halts_cleared == b.halts_cleared + 1) && (a.recoveries == b.recoveries + 1) &&
+                   (a.send_drops == b.send_drops + 1) && (a.reopens == b.reopens + 1);
+        });
+    Progress();
+
+    Expect("write timed out unsent, resubmitted and delivered",
+        []() {
+            writes = 0;
+            MockUsb::Get().FailWrite(LIBUSB_TRANSFER_TIMED_OUT, 0);
+            Send(256);
+        },
+        [](const USBCommuniRecoveryStats_t &b, const USBCommuniRecoveryStats_t &a) {
+            return (a.resubmits == b.resubmits + 1) && (writes == 1) && (a.reopens == b.reopens);
+        });
+
+    Expect("write timed out half sent, reopened",
+        []() {
+            MockUsb::Get().FailWrite(LIBUSB_TRANSFER_TIMED_OUT, 128);
+            Send(256);
+        },
+        [](const USBCommuniRecoveryStats_t &b, const USBCommuniRecoveryStats_t &a) {
+            return (a.reopens == b.reopens + 1) && (a.recoveries == b.recoveries + 1) &&
+                   (a.send_drops == b.send_drops + 1);
+        });
+    Progress();
+
+    /* a resubmit would go out after the send still on the bus */
+    Expect("write timed out unsent behind another, reopened",
+        []() {
+            MockUsb::Get().SetPipe(MOCK_EP_OUT, 1000000, 50000);
+            Send(256);
+            MockUsb::Get().FailWrite(LIBUSB_TRANSFER_TIMED_OUT, 0);
+            Send(256);
+        },
+        [](const USBCommuniRecoveryStats_t &b, const USBCommuniRecoveryStats_t &a) {
+            return (a.reopens == b.reopens + 1) && (a.resubmits == b.resubmits) &&
+                   (a.send_drops >= b.send_drops + 1);
+        });
+    mock.SetPipe(MOCK_EP_OUT, 0, 0);
+    Progress();
+
+    Expect("write timed out unsent, resubmit refused, reopened",
+        []() {
+            MockUsb::Get().FailWrite(LIBUSB_TRANSFER_TIMED_OUT, 0);
+            MockUsb::Get().FailSubmit(LIBUSB_ERROR_IO, 1);
+            Send(256);
+        },
+        [](const USBCommuniRecoveryStats_t &b, const USBCommuniRecoveryStats_t &a) {
+            return (a.reopens == b.reopens + 1) && (a.resubmits == b.resubmits) &&
+                   (a.send_drops == b.send_drops + 1);
+        });
+
+    android.GetRecoveryStats(stats);
+    printf("\nerrors %lu stalls %lu resubmits %lu send_drops %lu halts_cleared %lu rebuilds %lu reopens %lu (%lu opens)\n",
+           stats.transfer_errors, stats.stalls, stats.resubmits, stats.send_drops, stats.halts_cleared,
+           stats.rebuilds, stats.reopens, (uint64_t)mock.opens);
+    printf("recoveries %lu, mean %.1f ms, max %.1f ms\n", stats.recoveries,
+           stats.recoveries ? stats.recovery_us_total / 1000.0 / stats.recoveries : 0.0,
+           stats.recovery_us_max / 1000.0);
+
+    android.Deinit();
+    mock.Stop();
+
+    printf("%s\n", failures ? "FAILED" : "passed");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "mock_usb.h"
+
+/**
+ * Latency of small messages under bulk load, bulk only against
+ * config.android_int_enable, e.g.
+ *
+ *   usbcommuniexample_intbench -t 2 -l 16384 -d 4 -r 35
+ *
+ * The Android backend runs on the mock of mock_usb.h with a modelled
+ * bus: bulk OUT moves -r MB/s, the interrupt pipe one 64 byte packet per
+ * 125 us. A load thread keeps -d bulk sends of -l bytes in flight while a
+ * 32 byte probe goes out every -i us; its latency is from SendData()
+ * until the peer took it.
+ */
+
+using namespace usbcommuni;
+using namespace mockusb;
+
+typedef std::chrono::steady_clock Clock;
+
+#define PROBE_SIZE  32
+
+static const char probe_magic[8] = {'P', 'R', 'O', 'B', 'E', 0x01, 0x02, 0x03};
+
+static std::mutex lat_mutex;
+static std::vector<double> latencies;
+static std::atomic<uint64_t> load_taken;
+
+static uint64_t NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+/* the peer, probes are found anywhere in a write, the load is all zero */
+static void PeerTook(uint8_t endpoint, const unsigned char *data, int len)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = data + len;
+    uint64_t sent_ns, now_ns = NowNs();
+    int probes = 0;
+
+    while ((p = (const unsigned char*)memmem(p, end - p, probe_magic, sizeof(probe_magic))) != nullptr) {
+        memcpy(&sent_ns, p + sizeof(probe_magic), sizeof(sent_ns));
+
+        lat_mutex.lock();
+        latencies.push_back((now_ns - sent_ns) / 1000.0);
+        lat_mutex.unlock();
+
+        p += PROBE_SIZE;
+        probes++;
+    }
+
+    if (endpoint == MOCK_EP_OUT)
+        load_taken += len - probes * PROBE_SIZE;
+}
+
+static double Percentile(std::vector<double> &v, double p)
+{
+    if (v.empty())
+        return 0;
+
+    return v[std::min<size_t>(v.size() - 1, v.size() * p)];
+}
+
+static void RunMode(bool intr, double seconds, uint32_t chunk, uint32_t depth, uint32_t interval_us)
+{
+    USBCommuniConfig_t config;
+    USBAndroidCommuni android;
+    std::vector<char> load(chunk, 0);
+    char probe[PROBE_SIZE] = {0};
+    std::atomic<bool> running(true);
+    std::thread loader;
+    uint64_t load_sent = 0;
+    uint32_t send_bytes;
+    uint64_t sent_ns;
+    Clock::time_point start, next;
+
+    config.android_int_enable = intr;
+    config.android_poll_ms = 10;
+
+    latencies.clear();
+    load_taken = 0;
+
+    android.SetConfig(config);
+    android.TransferOpsRegister(MockUsb::Ops());
+    if (android.Init() != USBCOMMUNI_E_SUCCESS) {
+        fprintf(stderr, "init failed\n");
+        exit(1);
+    }
+
+    android.SetDeviceInfo(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, MockUsb::Accessory(true));
+    for (int i = 0; (i < 1000) && !android.GetConnectStatus(); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    loader = std::thread([&]() {
+        uint32_t bytes;
+
+        while (running) {
+            if (load_sent - load_taken >= (uint64_t)depth * chunk) {
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+                continue;
+            }
+            if (android.SendData(load.data(), chunk, bytes) == USBCOMMUNI_E_SUCCESS)
+                load_sent += chunk;
+        }
+    });
+
+    memcpy(probe, probe_magic, sizeof(probe_magic));
+    start = Clock::now();
+    next = start;
+
+    while (Clock::now() - start < std::chrono::duration<double>(seconds)) {
+        next += std::chrono::microseconds(interval_us);
+        std::this_thread::sleep_until(next);
+
+        sent_ns = NowNs();
+        memcpy(probe + sizeof(probe_magic), &sent_ns, sizeof(sent_ns));
+        android.SendData(probe, PROBE_SIZE, send_bytes);
+    }
+
+    running = false;
+    loader.join();
+    android.Deinit();
+
+    std::lock_guard<std::mutex> lock(lat_mutex);
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("%-10s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", intr ? "interrupt" : "bulk", latencies.size(),
+           Percentile(latencies, 0.5), Percentile(latencies, 0.9), Percentile(latencies, 0.99),
+           latencies.empty() ? 0.0 : latencies.back(), load_taken / seconds / 1e6);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    double seconds = 2.0;
+    uint32_t chunk = 16384;
+    uint32_t depth = 4;
+    uint32_t interval_us = 1000;
+    uint64_t rate = 35;
+    MockUsb &mock = MockUsb::Get();
+
+    while ((opt = getopt(argc, argv, "t:l:d:i:r:h")) != -1) {
+        switch (opt) {
+        case 't': seconds = atof(optarg); break;
+        case 'l': chunk = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 'i': interval_us = atoi(optarg); break;
+        case 'r': rate = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-t seconds per mode] [-l load bytes] [-d load depth] "
+                            "[-i probe interval us] [-r bulk MB/s]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    mock.SetPipe(MOCK_EP_OUT, rate * 1000000, 0);
+    mock.SetPipe(MOCK_INT_EP_OUT, 64 * 8000, 125);
+    mock.WriteHandleRegister(PeerTook);
+    mock.Start();
+
+    printf("%-10s %8s %10s %10s %10s %10s %10s\n", "pipe", "probes", "p50_us", "p90_us", "p99_us", "max_us", "load_MB/s");
+
+    RunMode(false, seconds, chunk, depth, interval_us);
+    RunMode(true, seconds, chunk, depth, interval_us);
+
+    mock.Stop();
+
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "realtime.h"
+
+/**
+ * Wake up jitter of an I/O thread in normal and latency mode, e.g.
+ *
+ *   sudo usbcommuniexample_jitter -t 5 -p 500 -l 4 -c 3
+ *
+ * A thread set up like the library's I/O threads, RealtimeThreadSetup()
+ * and a RealtimeAlloc() buffer it touches, is due every -p us and records
+ * how late it ran. Latency mode pins it to core -c with SCHED_FIFO, the
+ * busy poll run spins to the deadline as config.latency_busy_poll does.
+ * -l threads of CPU load run beside it. SCHED_FIFO and mlock need
+ * CAP_SYS_NICE and CAP_IPC_LOCK, without them latency mode only pins.
+ */
+
+#define JITTER_BUFFER_SIZE  16384
+
+static std::atomic<bool> loading;
+
+static uint64_t NowNs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void Load()
+{
+    volatile uint64_t spin = 0;
+
+    while (loading)
+        spin = spin + 1;
+}
+
+static double Percentile(const std::vector<double> &v, double p)
+{
+    if (v.empty())
+        return 0;
+
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static void RunMode(const char *name, const usbcommuni::USBCommuniConfig_t &config, double seconds, uint32_t period_us)
+{
+    std::vector<double> late;
+
+    std::thread io([&]() {
+        bool busy_poll = (config.latency_mode && config.latency_busy_poll);
+        uint64_t next, end, now;
+        struct timespec ts;
+        char *buffer;
+
+        usbcommuni::RealtimeThreadSetup(config, config.latency_event_cpu, name);
+        buffer = static_cast<char*>(usbcommuni::RealtimeAlloc(config, JITTER_BUFFER_SIZE));
+        late.reserve(seconds * 1000000 / period_us + 1);
+
+        next = NowNs() + period_us * 1000ull;
+        end = next + (uint64_t)(seconds * 1e9);
+
+        while (next < end) {
+            if (busy_poll) {
+                while ((now = NowNs()) < next)
+                    ;
+            } else {
+                ts.tv_sec = next / 1000000000ull;
+                ts.tv_nsec = next % 1000000000ull;
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+                now = NowNs();
+            }
+
+            /* what a completion handler would do with its transfer buffer */
+            memset(buffer, (int)now, JITTER_BUFFER_SIZE);
+
+            late.push_back((now - next) / 1000.0);
+            next += period_us * 1000ull;
+        }
+
+        free(buffer);
+    });
+    io.join();
+
+    std::sort(late.begin(), late.end());
+    printf("%-16s %8zu %10.1f %10.1f %10.1f %10.1f\n", name, late.size(), Percentile(late, 0.5),
+           Percentile(late, 0.99), Percentile(late, 0.999), Percentile(late, 1.0));
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    double seconds = 2.0;
+    uint32_t period_us = 1000;
+    uint32_t loaders = 0;
+    int cpu = -1;
+    usbcommuni::USBCommuniConfig_t normal, latency, busy;
+    std::vector<std::thread> load;
+
+    while ((opt = getopt(argc, argv, "t:p:l:c:h")) != -1) {
+        switch (opt) {
+        case 't': seconds = atof(optarg); break;
+        case 'p': period_us = atoi(optarg); break;
+        case 'l': loaders = atoi(optarg); break;
+        case 'c': cpu = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-t seconds per mode] [-p period us] [-l load threads] [-c cpu]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    latency.latency_mode = true;
+    latency.latency_event_cpu = cpu;
+    busy = latency;
+    busy.latency_busy_poll = true;
+
+    loading = true;
+    for (uint32_t i = 0; i < loaders; i++)
+        load.push_back(std::thread(Load));
+
+    printf("%-16s %8s %10s %10s %10s %10s\n", "mode", "wakeups", "p50_us", "p99_us", "p999_us", "max_us");
+
+    RunMode("normal", normal, seconds, period_us);
+    RunMode("latency", latency, seconds, period_us);
+    RunMode("latency+busy", busy, seconds, period_us);
+
+    loading = false;
+    for (std::thread &t : load)
+        t.join();
+
+    return 0;
+}
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "link/link_layer.h"
+
+/**
+ * Fault injection into the link layer, e.g.
+ *
+ *   usbcommuniexample_linkfaults
+ *
+ * Two LinkLayers talk through in memory wires, no device or backend
+ * needed. Frames queue on the wire and are fed to the other end by the
+ * test itself, so every case runs the same way each time. A wire may
+ * lose, refuse or record frames. Exits non zero if a case failed.
+ */
+
+using namespace usbcommuni;
+
+typedef std::function<USBCommuniErrors_t (const std::string &frame)> WireFilter;
+
+struct Wire {
+    std::mutex mutex;
+    std::deque<std::string> frames;
+    WireFilter filter;                  /**< success queues the frame, anything else refuses it */
+    uint32_t lose;                      /**< the next frames taken vanish, as on a bad CRC */
+};
+
+struct End {
+    LinkLayer link;
+    Wire out;
+    std::vector<std::string> got;
+};
+
+static End a, b;
+static int failures;
+
+static void Expect(const char *name, bool ok)
+{
+    printf("%-64s %s\n", name, ok ? "ok" : "FAIL");
+    fflush(stdout);
+
+    if (!ok)
+        failures++;
+}
+
+static void Attach(End &end)
+{
+    end.link.TransportRegister([&end](const struct iovec *iov, uint32_t iovcnt, USBCommuniErrors_t *results) {
+        USBCommuniErrors_t err = USBCOMMUNI_E_SUCCESS;
+        USBCommuniErrors_t r;
+        std::lock_guard<std::mutex> lock(end.out.mutex);
+
+        for (uint32_t i = 0; i < iovcnt; i++) {
+            std::string frame(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+
+            r = end.out.filter ? end.out.filter(frame) : USBCOMMUNI_E_SUCCESS;
+            if ((USBCOMMUNI_E_SUCCESS == r) && (end.out.lose > 0))
+                end.out.lose--;
+            else if (USBCOMMUNI_E_SUCCESS == r)
+                end.out.frames.push_back(frame);
+            else if (USBCOMMUNI_E_SUCCESS == err)
+                err = r;
+
+            if (results)
+                results[i] = r;
+        }
+
+        return err;
+    });
+
+    end.link.RecvHandleRegister([&end](uint8_t channel, const char *data, uint32_t len) {
+        end.got.push_back(std::string(data, len));
+    });
+}
+
+/* one frame off @from's wire into @to, false if the wire is empty */
+static bool Step(End &from, End &to)
+{
+    std::string frame;
+
+    {
+        std::lock_guard<std::mutex> lock(from.out.mutex);
+
+        if (from.out.frames.empty())
+            return false;
+
+        frame = from.out.frames.front();
+        from.out.frames.pop_front();
+    }
+
+    to.link.Feed(frame.data(), frame.size());
+
+    return true;
+}
+
+/* until both wires are empty, with the resends the frames asked for */
+static void Pump()
+{
+    bool moved;
+
+    do {
+        moved = Step(a, b);
+        moved = Step(b, a) || moved;
+        a.link.Resend();
+        b.link.Resend();
+    } while (moved);
+}
+
+/* fresh ends with @config, connected and past the handshake */
+static void Connect(const USBCommuniConfig_t &config)
+{
+    for (End *end : {&a, &b}) {
+        end->out.filter = nullptr;
+        end->out.lose = 0;
+        end->out.frames.clear();
+        end->got.clear();
+        end->link.SetConfig(config);
+    }
+
+    a.link.Resume();
+    b.link.Resume();
+    Pump();
+}
+
+static USBCommuniErrors_t Send(End &end, const std::string &data)
+{
+    LinkNoWait nowait;
+
+    return end.link.Send(0, data.data(), data.size());
+}
+
+/* @data worthless after @ttl_ms */
+static USBCommuniErrors_t SendTtl(End &end, const std::string &data, uint32_t ttl_ms)
+{
+    LinkNoWait nowait;
+    LinkDeadline deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl_ms);
+    struct iovec iov;
+
+    iov.iov_base = const_cast<char*>(data.data());
+    iov.iov_len = data.size();
+
+    return end.link.SendBatch(0, &iov, 1, nullptr, &deadline);
+}
+
+/* a copy, the receive path opens sealed frames in place */
+static void Replay(End &to, std::string frame)
+{
+    to.link.Feed(&frame[0], frame.size());
+}
+
+static USBCommuniLinkStats_t Stats(End &end)
+{
+    USBCommuniLinkStats_t stats;
+
+    end.link.GetStats(stats);
+
+    return stats;
+}
+
+int main(int argc, char *argv[])
+{
+    USBCommuniConfig_t config;
+    USBCommuniLinkStats_t before_a, before_b;
+
+    Attach(a);
+    Attach(b);
+
+    config.link_enable = true;
+    config.link_crc = true;
+    config.link_reliable = true;
+    config.link_credit_window = 4096;
+
+    /* a refused batch stays buffered for the next handshake, its credit comes back at once */
+    Connect(config);
+    a.out.filter = [](const std::string &frame) { return USBCOMMUNI_E_IO; };
+    Expect("reliable send refused by the transport, buffered",
+           Send(a, std::string(4096, 'x')) == USBCOMMUNI_E_SUCCESS);
+    a.out.filter = nullptr;
+    Expect("credit of the refused send returned",
+           Send(a, std::string(1024, 'y')) == USBCOMMUNI_E_SUCCESS);
+    Pump();
+    a.link.Reset();
+    b.link.Reset();
+    a.link.Resume();
+    b.link.Resume();
+    Pump();
+    Expect("refused frames delivered after the next handshake, in order",
+           (b.got.size() == 2) && (b.got[0] == std::string(4096, 'x')) && (b.got[1] == std::string(1024, 'y')));
+
+    /* stands in for an ACK arriving on the receive thread while the backend is busy */
+    Connect(config);
+    a.out.filter = [](const std::string &frame) {
+        USBCommuniLinkStats_t stats;
+
+        a.link.GetStats(stats);
+        return USBCOMMUNI_E_SUCCESS;
+    };
+    Expect("resend buffer unlocked while the transport runs",
+           Send(a, std::string(512, 'z')) == USBCOMMUNI_E_SUCCESS);
+    a.out.filter = nullptr;
+    Pump();
+
+    /* lost on the wire, still buffered when the NAK asks for it again, by then late */
+    Connect(config);
+    before_a = Stats(a);
+    before_b = Stats(b);
+    a.out.lose = 1;
+    SendTtl(a, "late", 20);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    Send(a, "next");
+    Pump();
+    Send(a, "after");
+    Pump();
+    Expect("late TTL frame dropped at the NAK, not resent",
+           (b.got.size() == 2) && (b.got[0] == "next") && (b.got[1] == "after") &&
+           (Stats(a).tx_expired == before_a.tx_expired + 1));
+    Expect("frames after it numbered down, no second gap", Stats(b).rx_gaps == before_b.rx_gaps + 1);
+
+    Connect(config);
+    before_a = Stats(a);
+    a.out.lose = 1;
+    SendTtl(a, "in time", 1000);
+    Send(a, "next");
+    Pump();
+    Expect("TTL frame still in time resent at the NAK, in order",
+           (b.got.size() == 2) && (b.got[0] == "in time") && (b.got[1] == "next") &&
+           (Stats(a).tx_expired == before_a.tx_expired));
+
+    /* late while the handshake is pending, never sent at all */
+    Connect(config);
+    a.link.Reset();
+    b.link.Reset();
+    before_a = Stats(a);
+    SendTtl(a, "late", 10);
+    Send(a, "kept");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    a.link.Resume();
+    b.link.Resume();
+    Pump();
+    Expect("TTL frame late before the handshake dropped",
+           (b.got.size() == 1) && (b.got[0] == "kept") &&
+           (Stats(a).tx_expired == before_a.tx_expired + 1));
+
+    /* out of credit, the refused batch must leave the rate tokens alone */
+    config.link_credit_window = 500;
+    Connect(config);
+    a.link.SetLinkRate(100, 2000);
+    Send(a, std::string(500, 'c'));
+    Expect("batch out of credit refused",
+           Send(a, std::string(2000, 'd')) == USBCOMMUNI_E_TIMEOUT);
+    Pump();
+    Expect("its rate tokens still there for the next send",
+           Send(a, std::string(100, 'e')) == USBCOMMUNI_E_SUCCESS);
+    Pump();
+
+#ifdef USBCOMMUNI_WITH_LINK_CIPHER
+    std::vector<std::string> recorded;
+    std::string forged;
+
+    config.link_reliable = false;
+    config.link_crc = false;
+    config.link_credit_window = 0;
+    config.link_encrypt = true;
+    config.link_key = "example link secret";
+
+    Connect(config);
+    a.out.filter = [&recorded](const std::string &frame) {
+        recorded.push_back(frame);
+        return USBCOMMUNI_E_SUCCESS;
+    };
+    Send(a, "one");
+    Send(a, "two");
+    a.out.filter = nullptr;
+    Pump();
+
+    before_b = Stats(b);
+    Replay(b, recorded[0]);
+    Expect("sealed frame replayed in its session, dropped",
+           (b.got.size() == 2) && (Stats(b).rx_auth_failures == before_b.rx_auth_failures + 1));
+
+    /* the same frames, the second first, as the interrupt pipe may deliver them */
+    Connect(config);
+    a.out.filter = [&recorded](const std::string &frame) {
+        recorded.push_back(frame);
+        return USBCOMMUNI_E_SUCCESS;
+    };
+    recorded.clear();
+    Send(a, "one");
+    Send(a, "two");
+    a.out.filter = nullptr;
+    a.out.frames.clear();
+    Replay(b, recorded[1]);
+    Replay(b, recorded[0]);
+    Expect("sealed frames reordered within the window, both taken",
+           (b.got.size() == 2) && (b.got[0] == "two") && (b.got[1] == "one"));
+
+    /* a new session pinned its key id, the recording is from the one before */
+    a.link.Reset();
+    b.link.Reset();
+    Send(a, "three");
+    Pump();
+    before_b = Stats(b);
+    Replay(b, recorded[0]);
+    Expect("sealed frame of the last session replayed, dropped",
+           (b.got.size() == 3) && (b.got[2] == "three") &&
+           (Stats(b).rx_auth_failures == before_b.rx_auth_failures + 1));
+
+    /* the key id is the first 8 bytes of the payload */
+    forged = recorded[1];
+    forged[LINK_FRAME_HEAD_SIZE] ^= 0x5a;
+    before_b = Stats(b);
+    Replay(b, forged);
+    Send(a, "four");
+    Pump();
+    Expect("forged key id dropped, the pinned session goes on",
+           (b.got.size() == 4) && (b.got[3] == "four") &&
+           (Stats(b).rx_auth_failures == before_b.rx_auth_failures + 1));
+#endif
+
+    printf("%s\n", failures ? "FAILED" : "passed");
+
+    return failures ? 1 : 0;
+}
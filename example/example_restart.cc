@@ -0,0 +1,166 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "usbcommuni.h"
+
+/**
+ * Start()/Stop() cycles, e.g.
+ *
+ *   usbcommuniexample_restart -n 200 -b 1500
+ *
+ * After every Stop() the open fds (/proc/self/fd) and threads
+ * (/proc/self/task) must be back where they were after the first cycle,
+ * and a Start() plus Stop() must take less than -b ms. Resident memory
+ * growth is printed only, the heap does not give everything back. Runs
+ * with or without devices plugged in, -e uses config.external_loop.
+ * Exits non zero on a leak or a slow cycle.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+static int CountEntries(const char *path)
+{
+    DIR *dir;
+    struct dirent *entry;
+    int count = 0;
+
+    dir = opendir(path);
+    if (nullptr == dir)
+        return -1;
+
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_name[0] != '.')
+            count++;
+    }
+
+    closedir(dir);
+
+    return count;
+}
+
+/* without the one opendir() holds while counting */
+static int CountFds()
+{
+    return CountEntries("/proc/self/fd") - 1;
+}
+
+static int CountThreads()
+{
+    return CountEntries("/proc/self/task");
+}
+
+static long RssKb()
+{
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (nullptr == fp)
+        return 0;
+
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* @v sorted */
+static double Percentile(const std::vector<double> &v, double p)
+{
+    if (v.empty())
+        return 0;
+
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    uint32_t cycles = 100;
+    uint32_t bound_ms = 2000;
+    usbcommuni::USBCommuniConfig_t config;
+    usbcommuni::USBCommuni usbm;
+    usbcommuni::USBCommuniErrors_t err;
+    std::vector<double> start_ms, stop_ms;
+    Clock::time_point t0, t1, t2;
+    int fds, threads, base_fds = 0, base_threads = 0;
+    long base_rss = 0;
+    int leaks = 0, slow = 0;
+
+    while ((opt = getopt(argc, argv, "n:b:eh")) != -1) {
+        switch (opt) {
+        case 'n': cycles = atoi(optarg); break;
+        case 'b': bound_ms = atoi(optarg); break;
+        case 'e': config.external_loop = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-n cycles] [-b ms per cycle] [-e]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    printf("before start: %d fds, %d threads, %ld kB resident\n", CountFds(), CountThreads(), RssKb());
+
+    for (uint32_t i = 0; i < cycles; i++) {
+        t0 = Clock::now();
+        err = usbm.Init(config);
+        t1 = Clock::now();
+        if (err != usbcommuni::USBCOMMUNI_E_SUCCESS) {
+            fprintf(stderr, "cycle %u: start failed, err %d\n", i, err);
+            return 1;
+        }
+
+        /* a turn of the loop, with -e the application's part of it */
+        if (config.external_loop)
+            usbm.ProcessEvents();
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        t2 = Clock::now();
+        usbm.Stop();
+
+        start_ms.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+        stop_ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t2).count());
+
+        if (start_ms.back() + stop_ms.back() > bound_ms) {
+            fprintf(stderr, "cycle %u: start %.1f ms + stop %.1f ms over %u ms\n",
+                    i, start_ms.back(), stop_ms.back(), bound_ms);
+            slow++;
+        }
+
+        fds = CountFds();
+        threads = CountThreads();
+
+        if (i == 0) {
+            base_fds = fds;
+            base_threads = threads;
+            base_rss = RssKb();
+            printf("after cycle 0: %d fds, %d threads, %ld kB resident\n", fds, threads, base_rss);
+            continue;
+        }
+
+        if ((fds != base_fds) || (threads != base_threads)) {
+            fprintf(stderr, "cycle %u: %d fds, %d threads, expected %d and %d\n",
+                    i, fds, threads, base_fds, base_threads);
+            leaks++;
+        }
+    }
+
+    printf("after cycle %u: %d fds, %d threads, %ld kB resident (%+ld kB)\n",
+           cycles - 1, CountFds(), CountThreads(), RssKb(), RssKb() - base_rss);
+
+    std::sort(start_ms.begin(), start_ms.end());
+    std::sort(stop_ms.begin(), stop_ms.end());
+    printf("start ms: p50 %.2f p99 %.2f max %.2f\n",
+           Percentile(start_ms, 0.5), Percentile(start_ms, 0.99), Percentile(start_ms, 1.0));
+    printf("stop  ms: p50 %.2f p99 %.2f max %.2f\n",
+           Percentile(stop_ms, 0.5), Percentile(stop_ms, 0.99), Percentile(stop_ms, 1.0));
+    printf("%u cycles, %d leaking, %d over the bound\n", cycles, leaks, slow);
+
+    return (leaks || slow) ? 1 : 0;
+}
@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <vector>
+#include "shm/shm_ring.h"
+
+/* reads what a USBCommuni started with config.shm_enable receives */
+int main(int argc, char const *argv[])
+{
+    const char *path = (argc > 1) ? argv[1] : "/tmp/usbcommuni-rx.sock";
+    usbcommuni::ShmRingConsumer reader;
+    usbcommuni::USBCommuniErrors_t err;
+    std::vector<char> frame;
+
+    err = reader.Open(path);
+    if (usbcommuni::USBCOMMUNI_E_SUCCESS != err) {
+        fprintf(stderr, "attach to %s failed: %d\n", path, err);
+        return 1;
+    }
+
+    while (1) {
+        err = reader.Read(frame, 1000);
+        if (usbcommuni::USBCOMMUNI_E_SUCCESS == err)
+            fprintf(stderr, "[SHM][RECV][%zu] lost laps: %lu\n", frame.size(), (unsigned long)reader.GetOverruns());
+    }
+
+    return 0;
+}
@@ -0,0 +1,409 @@
+#ifndef MOCK_USB_H_
+#define MOCK_USB_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "android/android_usb_communi.h"
+
+/**
+ * A stand-in for libusb under USBAndroidCommuni, through its
+ * USBTransferOps_t, so the Android backend runs without a device.
+ *
+ * Reads stay pending until Deliver() or FailRead() completes one, writes
+ * are taken by the "peer" at once unless FailWrite() or FailSubmit()
+ * scripted a fault or SetPipe() gave their endpoint a bus time. Completions run on the
+ * mock's own thread, as libusb's event thread would run them, never
+ * under the mock's lock. The ops are plain functions, so there is one
+ * mock per process.
+ */
+namespace mockusb {
+
+/* the bulk and interrupt pairs of Accessory() */
+#define MOCK_EP_IN          0x81
+#define MOCK_EP_OUT         0x02
+#define MOCK_INT_EP_IN      0x83
+#define MOCK_INT_EP_OUT     0x04
+
+typedef std::function<void (uint8_t endpoint, const unsigned char *data, int len)> MockWriteCb;
+
+class MockUsb
+{
+public:
+    static MockUsb &Get()
+    {
+        static MockUsb mock;
+        return mock;
+    }
+
+    static usbcommuni::USBTransferOps_t Ops()
+    {
+        usbcommuni::USBTransferOps_t ops;
+
+        ops.open = Open;
+        ops.close = Close;
+        ops.claim = Claim;
+        ops.release = Release;
+        ops.submit = Submit;
+        ops.cancel = Cancel;
+        ops.clear_halt = ClearHalt;
+
+        return ops;
+    }
+
+    /* an accessory as hotplug reports it, with an interrupt pair on interface 1 if @intr */
+    static usbcommuni::USBDeviceAttr_t Accessory(bool intr)
+    {
+        usbcommuni::USBDeviceAttr_t attr;
+
+        attr.id.vendor = 0x18d1;
+        attr.id.product = 0x2d01;
+        attr.ep_in = MOCK_EP_IN;
+        attr.ep_out = MOCK_EP_OUT;
+        attr.interface = 0;
+        attr.packet_size = 512;
+
+        if (intr) {
+            attr.intr.interface = 1;
+            attr.intr.ep_in = MOCK_INT_EP_IN;
+            attr.intr.ep_out = MOCK_INT_EP_OUT;
+            attr.intr.packet_size = 64;
+        }
+
+        return attr;
+    }
+
+    void Start()
+    {
+        exit_ = false;
+        thread_ = std::thread(&MockUsb::EventThread, this);
+    }
+
+    void Stop()
+    {
+        mutex_.lock();
+        exit_ = true;
+        mutex_.unlock();
+        cond_.notify_all();
+
+        if (thread_.joinable())
+            thread_.join();
+    }
+
+    /* the writes the peer takes, on the mock's thread */
+    void WriteHandleRegister(MockWriteCb writecb)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        write_handle_ = writecb;
+    }
+
+    size_t Reads(uint8_t endpoint)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        return CountReads(endpoint);
+    }
+
+    bool WaitReads(uint8_t endpoint, size_t count, uint32_t timeout_ms)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        return cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                              [&]() { return CountReads(endpoint) >= count; });
+    }
+
+    /* complete the oldest read on @endpoint with @data, false if none is pending */
+    bool Deliver(uint8_t endpoint, const char *data, uint32_t len)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        libusb_transfer *transfer = TakeRead(endpoint);
+
+        if (nullptr == transfer)
+            return false;
+
+        len = std::min<uint32_t>(len, transfer->length);
+        memcpy(transfer->buffer, data, len);
+        Complete(transfer, LIBUSB_TRANSFER_COMPLETED, len);
+
+        return true;
+    }
+
+    /* fail the oldest read on @endpoint with @status */
+    bool FailRead(uint8_t endpoint, libusb_transfer_status status)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        libusb_transfer *transfer = TakeRead(endpoint);
+
+        if (nullptr == transfer)
+            return false;
+
+        Complete(transfer, status, 0);
+
+        return true;
+    }
+
+    /* the next write ends with @status after @actual_length bytes */
+    void FailWrite(libusb_transfer_status status, int actual_length)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        write_status_ = status;
+        write_actual_ = actual_length;
+        write_fault_ = true;
+    }
+
+    /* the write submitted after the next @after ones is refused with @r */
+    void FailSubmit(int r, uint32_t after)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        submit_result_ = r;
+        submit_after_ = after;
+        submit_fault_ = true;
+    }
+
+    /**
+     * Writes on @endpoint take the bus in turn, each for @min_us or its
+     * length at @bytes_per_sec, whichever is longer. 0 takes them at once.
+     */
+    void SetPipe(uint8_t endpoint, uint64_t bytes_per_sec, uint32_t min_us)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        pipes_[endpoint].bytes_per_sec = bytes_per_sec;
+        pipes_[endpoint].min_us = min_us;
+    }
+
+    /* libusb_clear_halt() returns @r from now on */
+    void SetClearHalt(int r)
+    {
+        clear_halt_result_ = r;
+    }
+
+    std::atomic<uint64_t> opens;
+    std::atomic<uint64_t> closes;
+    std::atomic<uint64_t> clear_halts;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Completion {
+        libusb_transfer *transfer;
+        libusb_transfer_status status;
+        int actual_length;
+    };
+
+    struct Pipe {
+        uint64_t bytes_per_sec;
+        uint32_t min_us;
+        Clock::time_point busy_until;
+    };
+
+    MockUsb()
+    {
+        opens = 0;
+        closes = 0;
+        clear_halts = 0;
+        exit_ = false;
+        write_fault_ = false;
+        write_status_ = LIBUSB_TRANSFER_COMPLETED;
+        write_actual_ = 0;
+        submit_fault_ = false;
+        submit_result_ = LIBUSB_SUCCESS;
+        submit_after_ = 0;
+        clear_halt_result_ = LIBUSB_SUCCESS;
+    }
+
+    static libusb_device_handle *Open(libusb_context *ctx, uint16_t vendor, uint16_t product)
+    {
+        static char handle;
+
+        Get().opens++;
+        return reinterpret_cast<libusb_device_handle*>(&handle);
+    }
+
+    static void Close(libusb_device_handle *handle)
+    {
+        Get().closes++;
+    }
+
+    static int Claim(libusb_device_handle *handle, int interface)
+    {
+        return LIBUSB_SUCCESS;
+    }
+
+    static int Release(libusb_device_handle *handle, int interface)
+    {
+        return LIBUSB_SUCCESS;
+    }
+
+    static int Submit(libusb_transfer *transfer)
+    {
+        MockUsb &mock = Get();
+        std::lock_guard<std::mutex> lock(mock.mutex_);
+
+        if ((transfer->endpoint & 0x80) == LIBUSB_ENDPOINT_IN) {
+            mock.reads_.push_back(transfer);
+            mock.cond_.notify_all();
+            return LIBUSB_SUCCESS;
+        }
+
+        if (mock.submit_fault_ && (mock.submit_after_-- == 0)) {
+            mock.submit_fault_ = false;
+            return mock.submit_result_;
+        }
+
+        if (mock.write_fault_) {
+            mock.write_fault_ = false;
+            mock.Complete(transfer, mock.write_status_, mock.write_actual_);
+            return LIBUSB_SUCCESS;
+        }
+
+        mock.Complete(transfer, LIBUSB_TRANSFER_COMPLETED, transfer->length, mock.BusTime(transfer));
+        return LIBUSB_SUCCESS;
+    }
+
+    static int Cancel(libusb_transfer *transfer)
+    {
+        MockUsb &mock = Get();
+        std::lock_guard<std::mutex> lock(mock.mutex_);
+
+        for (auto it = mock.reads_.begin(); it != mock.reads_.end(); ++it) {
+            if (*it == transfer) {
+                mock.reads_.erase(it);
+                mock.Complete(transfer, LIBUSB_TRANSFER_CANCELLED, 0);
+                return LIBUSB_SUCCESS;
+            }
+        }
+
+        /* writes complete right away, it is on its way back already */
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    static int ClearHalt(libusb_device_handle *handle, unsigned char endpoint)
+    {
+        Get().clear_halts++;
+        return Get().clear_halt_result_;
+    }
+
+    /* mutex_ held */
+    size_t CountReads(uint8_t endpoint)
+    {
+        size_t count = 0;
+
+        for (libusb_transfer *transfer : reads_)
+            count += (transfer->endpoint == endpoint);
+
+        return count;
+    }
+
+    /* mutex_ held */
+    libusb_transfer *TakeRead(uint8_t endpoint)
+    {
+        libusb_transfer *transfer;
+
+        for (auto it = reads_.begin(); it != reads_.end(); ++it) {
+            if ((*it)->endpoint == endpoint) {
+                transfer = *it;
+                reads_.erase(it);
+                return transfer;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /* mutex_ held, when the write is off the bus */
+    Clock::time_point BusTime(libusb_transfer *transfer)
+    {
+        Clock::time_point now = Clock::now();
+        auto it = pipes_.find(transfer->endpoint);
+        uint64_t us;
+
+        if ((it == pipes_.end()) || (it->second.bytes_per_sec == 0))
+            return now;
+
+        us = std::max<uint64_t>(it->second.min_us, transfer->length * 1000000ull / it->second.bytes_per_sec);
+        it->second.busy_until = std::max(now, it->second.busy_until) + std::chrono::microseconds(us);
+
+        return it->second.busy_until;
+    }
+
+    /* mutex_ held, the callback runs on the event thread once @due */
+    void Complete(libusb_transfer *transfer, libusb_transfer_status status, int actual_length,
+                  Clock::time_point due = Clock::time_point())
+    {
+        Completion done = {transfer, status, actual_length};
+
+        done_.insert(std::make_pair(due, done));
+        cond_.notify_all();
+    }
+
+    void EventThread()
+    {
+        Completion done;
+        MockWriteCb writecb;
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        while (true) {
+            if (done_.empty()) {
+                if (exit_)
+                    break;
+                cond_.wait(lock);
+                continue;
+            }
+
+            if (done_.begin()->first > Clock::now()) {
+                cond_.wait_until(lock, done_.begin()->first);
+                continue;
+            }
+
+            done = done_.begin()->second;
+            done_.erase(done_.begin());
+            writecb = write_handle_;
+            lock.unlock();
+
+            if (((done.transfer->endpoint & 0x80) == LIBUSB_ENDPOINT_OUT) &&
+                (LIBUSB_TRANSFER_COMPLETED == done.status) && (nullptr != writecb))
+            {
+                writecb(done.transfer->endpoint, done.transfer->buffer, done.actual_length);
+            }
+
+            done.transfer->status = done.status;
+            done.transfer->actual_length = done.actual_length;
+            done.transfer->callback(done.transfer);
+
+            lock.lock();
+            cond_.notify_all();
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread thread_;
+    bool exit_;
+    std::deque<libusb_transfer*> reads_;
+    std::multimap<Clock::time_point, Completion> done_;     /**< in due order, equal ones as they came */
+    std::map<uint8_t, Pipe> pipes_;
+    MockWriteCb write_handle_;
+    bool write_fault_;
+    libusb_transfer_status write_status_;
+    int write_actual_;
+    bool submit_fault_;
+    int submit_result_;
+    uint32_t submit_after_;
+    std::atomic<int> clear_halt_result_;
+};
+
+}
+
+#endif /* MOCK_USB_H_ */
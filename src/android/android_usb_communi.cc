@@ -1,6 +1,11 @@
 #include "android_usb_communi.h"
+#include <poll.h>
+#include <sys/epoll.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <regex>
+#include "realtime.h"
 
 namespace usbcommuni {
 
@@ -14,6 +19,19 @@ namespace usbcommuni {
 #define EP_IN 0x81
 #define EP_OUT 0x02
 
+#define CANCEL_TIMEOUT_MS   1000
+
+/* a phone answers the accessory requests in a few ms, a stuck one fails the switch instead of holding the caller */
+#define AOA_CTRL_TIMEOUT_MS 50
+
+#define INT_RECV_TRANSFERS  2
+
+/* recovery actions, from the cheapest */
+#define RECOVER_READS       0x01    /* drain the read ring, clear a halt on bulk IN, submit again */
+#define RECOVER_WRITES      0x02    /* drain the sends, clear a halt on bulk OUT, then reopen */
+#define RECOVER_INT_READS   0x04    /* the same as RECOVER_READS for interrupt IN */
+#define RECOVER_REOPEN      0x08
+
 #define GOOGLE_VID 0x18d1
 #define ACCESSORY_PID 0x2d01
 #define ACCESSORY_PID_ALT 0x2d00
@@ -27,8 +45,6 @@ const USBDeviceId default_id[] = {
 const uint16_t ios_vendor_id = 0x05ac;
 const std::string ios_product_id_regx = "12[9a][0-9a-f]/*|/190[1-5]/*|/8600/*";
 
-static unsigned char g_recvbuffer[1024*1024*2];
-
 USBAndroidCommuni::USBAndroidCommuni()
 {
     gadgetacci_ = {
@@ -41,18 +57,59 @@ USBAndroidCommuni::USBAndroidCommuni()
     };
 
     context_ = nullptr;
+    event_ = LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT;
     curr_id_ = {0};
     last_id_ = {0};
     device_type_ = USBANDROID_DEVICE_UNKNOWN;
     connect_status_ = false;
     exit_enable_ = false;
     loop_thead_exist_ = false;
+    reconnect_ = false;
     event_handle_ = nullptr;
+    timeline_ = nullptr;
     recv_handle_ = nullptr;
+    int_recv_handle_ = nullptr;
+    send_idle_handle_ = nullptr;
+    int_active_ = false;
+    int_buffer_size_ = 0;
+    int_max_bytes_ = 0;
+    int_claimed_ = false;
+    ops_.open = libusb_open_device_with_vid_pid;
+    ops_.close = libusb_close;
+    ops_.claim = libusb_claim_interface;
+    ops_.release = libusb_release_interface;
+    ops_.submit = libusb_submit_transfer;
+    ops_.cancel = libusb_cancel_transfer;
+    ops_.clear_halt = libusb_clear_halt;
+    recover_ = 0;
+    errors_ = 0;
+    progress_ = false;
+    recv_hold_ = false;
+    recover_since_us_ = 0;
+    rebuilt_ = false;
+    keep_alive_ = true;
+    poll_fd_ = -1;
+    transfer_errors_ = 0;
+    stalls_ = 0;
+    resubmits_ = 0;
+    send_drops_ = 0;
+    halts_cleared_ = 0;
+    rebuilds_ = 0;
+    reopens_ = 0;
+    recoveries_ = 0;
+    recovery_us_total_ = 0;
+    recovery_us_max_ = 0;
+}
+
+static uint64_t SteadyUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 USBAndroidCommuni::~USBAndroidCommuni()
 {
+    Deinit();
 }
 
 USBCommuniErrors_t USBAndroidCommuni::Init()
@@ -60,30 +117,152 @@ USBCommuniErrors_t USBAndroidCommuni::Init()
     int r;
     USBCommuniErrors_t err;
 
+    if (nullptr != context_)
+        return USBCOMMUNI_E_SUCCESS;
+
     r = libusb_init(&context_);
     if (LIBUSB_SUCCESS != r) {
         fprintf(stderr, "Libusb Init failed, err : %s\n", libusb_error_name(r));
+        context_ = nullptr;
         return USBCOMMUNI_E_IO;
     }
 
+    exit_enable_ = false;
+    reconnect_ = false;
+    last_id_ = {0};
+    recover_ = 0;
+    errors_ = 0;
+    recv_hold_ = false;
+    recover_since_us_ = 0;
+    rebuilt_ = false;
+
+    attr_mutex_.lock();
+    event_ = LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT;
+    curr_id_ = {0};
+    device_type_ = USBANDROID_DEVICE_UNKNOWN;
+    attr_mutex_.unlock();
+
     err = HotplugEventRegister();
-    if (USBCOMMUNI_E_SUCCESS != r) {
+    if (USBCOMMUNI_E_SUCCESS != err) {
         fprintf(stderr, "USB hotplug event regitser failed\n");
+        libusb_exit(context_);
+        context_ = nullptr;
         return USBCOMMUNI_E_IO;
     }
 
-    loop_thread_ = std::thread(&USBAndroidCommuni::LoopThreadHandler, this);
-    loop_thread_.detach();
+    keep_alive_ = true;
+
+    /* the application's loop polls libusb's fds and runs both threads' work */
+    if (config_.external_loop) {
+        err = OpenPollFd();
+        if (USBCOMMUNI_E_SUCCESS != err) {
+            HotplugEventDisregister();
+            libusb_exit(context_);
+            context_ = nullptr;
+            return err;
+        }
+        open_due_ = std::chrono::steady_clock::now();
+        return USBCOMMUNI_E_SUCCESS;
+    }
 
+    loop_thead_exist_ = true;
+    loop_thread_ = std::thread(&USBAndroidCommuni::LoopThreadHandler, this);
     open_thread_ = std::thread(&USBAndroidCommuni::OpenThreadHandler, this);
-    open_thread_.detach();
 
     return USBCOMMUNI_E_SUCCESS;
 }
 
 void USBAndroidCommuni::Deinit()
 {
+    if (nullptr == context_)
+        return;
+
+    /* open thread first, it is the only one opening and closing devices */
+    exit_mutex_.lock();
     exit_enable_ = true;
+    exit_mutex_.unlock();
+    exit_cond_.notify_all();
+
+    if (open_thread_.joinable())
+        open_thread_.join();
+
+    /* the event thread is still running here and reaps the cancellations */
+    HotplugEventDisregister();
+    SetConnectStatus(false);
+    CancelTransfers();
+    CloseAccessoryDevice();
+    CloseUsbDevice();
+
+    loop_thead_exist_ = false;
+    libusb_interrupt_event_handler(context_);
+    if (loop_thread_.joinable())
+        loop_thread_.join();
+
+    ClosePollFd();
+
+    libusb_exit(context_);
+    context_ = nullptr;
+}
+
+bool USBAndroidCommuni::WaitExit(uint32_t timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(exit_mutex_);
+
+    return exit_cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms), 
+                               [this]() { return exit_enable_ || reconnect_ || recover_; });
+}
+
+void USBAndroidCommuni::Reconnect()
+{
+    exit_mutex_.lock();
+    reconnect_ = true;
+    exit_mutex_.unlock();
+    exit_cond_.notify_all();
+}
+
+void USBAndroidCommuni::CancelTransfers()
+{
+    std::unique_lock<std::mutex> lock(transfer_mutex_);
+
+    int_active_ = false;
+
+    for (libusb_transfer *transfer : recv_transfers_)
+        ops_.cancel(transfer);
+
+    for (libusb_transfer *transfer : send_transfers_)
+        ops_.cancel(transfer);
+
+    for (libusb_transfer *transfer : int_recv_)
+        ops_.cancel(transfer);
+
+    for (libusb_transfer *transfer : int_busy_)
+        ops_.cancel(transfer);
+
+    ReapTransfers(lock, [this]() { return recv_transfers_.empty() && send_transfers_.empty() &&
+                                          int_recv_.empty() && int_busy_.empty(); });
+}
+
+/**
+ * Wait up to CANCEL_TIMEOUT_MS for @done, transfer_mutex_ held in @lock.
+ * Without an event thread the cancelled transfers are reaped right here.
+ */
+bool USBAndroidCommuni::ReapTransfers(std::unique_lock<std::mutex> &lock, const std::function<bool()> &done)
+{
+    struct timeval tv = {0, 10000};
+    std::chrono::steady_clock::time_point deadline;
+
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(CANCEL_TIMEOUT_MS);
+
+    if (!config_.external_loop)
+        return transfer_cond_.wait_until(lock, deadline, done);
+
+    while (!done() && (std::chrono::steady_clock::now() < deadline)) {
+        lock.unlock();
+        libusb_handle_events_timeout_completed(context_, &tv, nullptr);
+        lock.lock();
+    }
+
+    return done();
 }
 
 static int HotplugCallback(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
@@ -168,70 +347,370 @@ void USBAndroidCommuni::HotplugEventDisregister()
     libusb_hotplug_deregister_callback(context_, hotplug_handle_);
 }
 
+void USBAndroidCommuni::TransferOpsRegister(const USBTransferOps_t &ops)
+{
+    ops_ = ops;
+}
+
+void USBAndroidCommuni::SetConfig(const USBCommuniConfig_t &config)
+{
+    config_ = config;
+}
+
 void USBAndroidCommuni::SubscribeRegister(USBCommuniEventCb eventcb)
 {
     event_handle_ = eventcb;
 }
 
+void USBAndroidCommuni::TimelineRegister(ConnectTimeline *timeline)
+{
+    timeline_ = timeline;
+}
+
 bool USBAndroidCommuni::GetConnectStatus()
 {
     return connect_status_;
 }
 
+void USBAndroidCommuni::SetConnectStatus(bool status)
+{
+    if (connect_status_.exchange(status) == status)
+        return;
+
+    if (nullptr != event_handle_)
+        event_handle_(status ? USBCOMMUNI_DEVICE_CONNECTED : USBCOMMUNI_DEVICE_DISCONNECTED);
+}
+
 static void TansferSendCallback(libusb_transfer *transfer)
 {
+    USBAndroidCommuni *android;
+
     if (nullptr == transfer)
         return;
 
+    android = (USBAndroidCommuni*)transfer->user_data;
+
+    if (nullptr != android) {
+        if (android->RetrySend(transfer))
+            return;
+
+        android->SendTransferDone(transfer);
+
+        /* the pipe has room again, what collected meanwhile goes out now */
+        if (android->GetConnectStatus())
+            android->SendCoalesced(false);
+    }
+}
+
+/**
+ * The bulk OUT pipe is a byte stream, a send that is lost leaves a hole
+ * the peer cannot parse past. Only a send alone in flight is retried in
+ * place, with others queued behind it a retry would put its bytes after
+ * theirs. Every other loss forces a reopen, which resyncs the peer.
+ */
+bool USBAndroidCommuni::RetrySend(libusb_transfer *transfer)
+{
+    bool alone;
+
     switch (transfer->status) {
     case LIBUSB_TRANSFER_COMPLETED:
-        break;
+        errors_ = 0;
+        progress_ = true;
+        return false;
+
+    case LIBUSB_TRANSFER_STALL:
+        fprintf(stderr, "bulk OUT endpoint %02x stalled\n", transfer->endpoint);
+        transfer_errors_++;
+        stalls_++;
+        send_drops_++;
+        RequestRecovery(RECOVER_WRITES);
+        return false;
+
     case LIBUSB_TRANSFER_ERROR:
-        break;
     case LIBUSB_TRANSFER_TIMED_OUT:
-        break;
-    case LIBUSB_TRANSFER_CANCELLED:
-        break;
-    case LIBUSB_TRANSFER_NO_DEVICE:
-        break;
     case LIBUSB_TRANSFER_OVERFLOW:
-        break;
+        transfer_errors_++;
+
+        /* part of it is on the wire, resending repeats bytes and dropping it cuts a frame */
+        if ((transfer->actual_length == 0) && (++errors_ <= config_.android_recover_retries) && connect_status_) {
+            /* under transfer_mutex_ no other send gets in between */
+            std::lock_guard<std::mutex> lock(transfer_mutex_);
+
+            alone = (send_transfers_.size() == 1);
+            if (alone && (LIBUSB_SUCCESS == ops_.submit(transfer))) {
+                resubmits_++;
+                return true;
+            }
+        }
+
+        /* lost, or the peer stopped reading or the pipe is broken */
+        send_drops_++;
+        RequestRecovery(RECOVER_REOPEN);
+        return false;
+
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        /* the hotplug LEFT event closes the accessory */
+    case LIBUSB_TRANSFER_CANCELLED:
     default:
-        break;
+        return false;
     }
+}
+
+void USBAndroidCommuni::SendTransferDone(libusb_transfer *transfer)
+{
+    bool idle;
+
+    transfer_mutex_.lock();
+    send_transfers_.erase(transfer);
+    idle = send_transfers_.empty() && int_busy_.empty();
+    transfer_mutex_.unlock();
+    transfer_cond_.notify_all();
 
-error:
     libusb_free_transfer(transfer);
-    transfer = nullptr;    
+
+    if (idle && (nullptr != send_idle_handle_))
+        send_idle_handle_();
+}
+
+bool USBAndroidCommuni::SendIdle()
+{
+    std::lock_guard<std::mutex> lock(attr_mutex_);
+    std::lock_guard<std::mutex> transfer_lock(transfer_mutex_);
+
+    return (nullptr != google_.handle) && coalesce_.empty() && send_transfers_.empty() && int_busy_.empty();
+}
+
+void USBAndroidCommuni::SendIdleRegister(std::function<void()> idlecb)
+{
+    send_idle_handle_ = idlecb;
 }
 
 USBCommuniErrors_t USBAndroidCommuni::SendData(const char *data, uint32_t data_size, uint32_t &send_bytes)
 {
-    int r;
-    libusb_transfer *transfer;
+    USBCommuniErrors_t err;
+    struct iovec iov;
+    std::lock_guard<std::mutex> lock(attr_mutex_);
 
     if ((nullptr == google_.handle) || (nullptr == data) || (data_size == 0))
         return USBCOMMUNI_E_INVAIL_ARG;
 
+    if (IntRoute(data_size) && SubmitIntSend(data, data_size)) {
+        send_bytes = data_size;
+        return USBCOMMUNI_E_SUCCESS;
+    }
+
+    iov.iov_base = const_cast<char*>(data);
+    iov.iov_len = data_size;
+
+    err = QueueSendTransfer(&iov, 1, data_size);
+    if (USBCOMMUNI_E_SUCCESS != err)
+        return err;
+
+    send_bytes = data_size;
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+USBCommuniErrors_t USBAndroidCommuni::SendBatch(const struct iovec *iov, uint32_t iovcnt, USBCommuniErrors_t *results)
+{
+    USBCommuniErrors_t err;
+    USBCommuniErrors_t ret = USBCOMMUNI_E_SUCCESS;
+    uint32_t i, end, k;
+    uint32_t bytes;
+    std::lock_guard<std::mutex> lock(attr_mutex_);
+
+    if ((nullptr == iov) || (iovcnt == 0))
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    /* the bulk pipe is a byte stream, runs of messages share one transfer */
+    for (i = 0; i < iovcnt; i = end) {
+        /* small ones take the interrupt pipe while it has a free transfer */
+        if (IntRoute(iov[i].iov_len) && SubmitIntSend((const char*)iov[i].iov_base, iov[i].iov_len)) {
+            if (results)
+                results[i] = USBCOMMUNI_E_SUCCESS;
+            end = i + 1;
+            continue;
+        }
+
+        bytes = 0;
+        for (end = i; end < iovcnt; end++) {
+            if ((end > i) && IntRoute(iov[end].iov_len))
+                break;
+            if ((bytes > 0) && (bytes + iov[end].iov_len > config_.send_batch_max_bytes))
+                break;
+            bytes += iov[end].iov_len;
+        }
+
+        if (nullptr == google_.handle)
+            err = USBCOMMUNI_E_INVAIL_ARG;
+        else if (bytes == 0)
+            err = USBCOMMUNI_E_SUCCESS;
+        else
+            err = QueueSendTransfer(iov + i, end - i, bytes);
+
+        for (k = i; k < end; k++) {
+            USBCommuniErrors_t r = (iov[k].iov_len > 0) ? err : USBCOMMUNI_E_INVAIL_ARG;
+
+            if (results)
+                results[k] = r;
+            if ((r != USBCOMMUNI_E_SUCCESS) && (ret == USBCOMMUNI_E_SUCCESS))
+                ret = r;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * With config.send_coalesce, an idle pipe gets the data right away while
+ * a busy one collects it until the transfer in flight completes, the
+ * delay runs out or send_coalesce_max_bytes are pending. With
+ * config.autotune the tuner moves the delay and the byte limit.
+ * attr_mutex_ held by the caller.
+ */
+USBCommuniErrors_t USBAndroidCommuni::QueueSendTransfer(const struct iovec *iov, uint32_t iovcnt, uint32_t bytes)
+{
+    USBCommuniErrors_t err;
+    bool busy;
+    bool first;
+    uint32_t max_bytes = tuner_.CoalesceMaxBytes();
+
+    if (!config_.send_coalesce)
+        return SubmitSendTransfer(iov, iovcnt, bytes);
+
+    if (coalesce_.size() + bytes > max_bytes) {
+        err = FlushCoalesced(AUTOTUNE_FLUSH_FULL);
+        if (USBCOMMUNI_E_SUCCESS != err)
+            return err;
+    }
+
+    transfer_mutex_.lock();
+    busy = !send_transfers_.empty();
+    transfer_mutex_.unlock();
+
+    if ((!busy && coalesce_.empty()) || (bytes >= max_bytes))
+        return SubmitSendTransfer(iov, iovcnt, bytes);
+
+    first = coalesce_.empty();
+    if (first)
+        coalesce_deadline_ = std::chrono::steady_clock::now() + std::chrono::microseconds(tuner_.CoalesceDelayUs());
+
+    for (uint32_t i = 0; i < iovcnt; i++) {
+        const char *base = static_cast<const char*>(iov[i].iov_base);
+        coalesce_.insert(coalesce_.end(), base, base + iov[i].iov_len);
+    }
+
+    if (coalesce_.size() >= max_bytes)
+        return FlushCoalesced(AUTOTUNE_FLUSH_FULL);
+
+    /* the event thread sleeps without a deadline, make it pick this one up */
+    if (first)
+        libusb_interrupt_event_handler(context_);
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+/* attr_mutex_ held by the caller */
+USBCommuniErrors_t USBAndroidCommuni::FlushCoalesced(AutotuneFlushes why)
+{
+    USBCommuniErrors_t err = USBCOMMUNI_E_INVAIL_ARG;
+    struct iovec iov;
+    uint32_t in_flight;
+
+    if (coalesce_.empty())
+        return USBCOMMUNI_E_SUCCESS;
+
+    iov.iov_base = coalesce_.data();
+    iov.iov_len = coalesce_.size();
+
+    transfer_mutex_.lock();
+    in_flight = send_transfers_.size();
+    transfer_mutex_.unlock();
+
+    if (nullptr != google_.handle)
+        err = SubmitSendTransfer(&iov, 1, iov.iov_len);
+
+    if (config_.autotune && (USBCOMMUNI_E_SUCCESS == err))
+        tuner_.RecordFlush(iov.iov_len, in_flight, why);
+
+    coalesce_.clear();
+
+    return err;
+}
+
+void USBAndroidCommuni::SendCoalesced(bool due_only)
+{
+    std::lock_guard<std::mutex> lock(attr_mutex_);
+
+    if (coalesce_.empty())
+        return;
+
+    if (due_only && (std::chrono::steady_clock::now() < coalesce_deadline_))
+        return;
+
+    FlushCoalesced(due_only ? AUTOTUNE_FLUSH_DUE : AUTOTUNE_FLUSH_DRAINED);
+}
+
+/* how long the event thread may sleep before coalesced data is due */
+void USBAndroidCommuni::CoalesceTimeout(struct timeval &tv)
+{
+    int64_t us = 1000000;
+    std::lock_guard<std::mutex> lock(attr_mutex_);
+
+    if (!coalesce_.empty()) {
+        us = std::chrono::duration_cast<std::chrono::microseconds>(coalesce_deadline_ - std::chrono::steady_clock::now()).count();
+        if (us < 0)
+            us = 0;
+    }
+
+    tv.tv_sec = us / 1000000;
+    tv.tv_usec = us % 1000000;
+}
+
+/* gather @iov into one bulk OUT transfer, attr_mutex_ held by the caller */
+USBCommuniErrors_t USBAndroidCommuni::SubmitSendTransfer(const struct iovec *iov, uint32_t iovcnt, uint32_t bytes)
+{
+    int r;
+    libusb_transfer *transfer;
+    unsigned char *buffer;
+    uint32_t offset = 0;
+
     transfer = libusb_alloc_transfer(0);
     if (nullptr == transfer) {
         fprintf(stderr, "usb alloc transfer fialed\n");
         return USBCOMMUNI_E_IO;
     }
 
+    /* the transfer outlives the caller's buffer, libusb frees the copy */
+    buffer = static_cast<unsigned char*>(malloc(bytes));
+    if (nullptr == buffer) {
+        libusb_free_transfer(transfer);
+        return USBCOMMUNI_E_NMEN;
+    }
+
+    for (uint32_t i = 0; i < iovcnt; i++) {
+        memcpy(buffer + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+
     libusb_fill_bulk_transfer(transfer, 
                               google_.handle, 
                               google_.ep_out, 
-                              reinterpret_cast<unsigned char*>(const_cast<char*>(data)), 
-                              data_size, 
+                              buffer, 
+                              bytes, 
                               TansferSendCallback, 
                               this, 
-                              1000);
+                              config_.android_send_timeout_ms);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+    transfer_mutex_.lock();
+    send_transfers_.insert(transfer);
+    transfer_mutex_.unlock();
 
-    r = libusb_submit_transfer(transfer);
+    r = ops_.submit(transfer);
     if (LIBUSB_SUCCESS != r) {
         fprintf(stderr, "usb submit transfer failed, err: %s\n", libusb_error_name(r));
-        libusb_free_transfer(transfer);
+        SendTransferDone(transfer);
         return USBCOMMUNI_E_IO;
     }
 
@@ -243,13 +722,48 @@ void USBAndroidCommuni::RecvHandleRegister(USBCommuniRecvHandleCb recvcb)
     recv_handle_ = recvcb;
 }
 
+/* first interface of @config with an interrupt IN and OUT endpoint */
+static void GetIntEndpoints(const libusb_config_descriptor *config, USBIntEndpoints_t &intr)
+{
+    intr = {0};
+
+    for (size_t interface_idx = 0; interface_idx < config->bNumInterfaces; interface_idx++) {
+        const libusb_interface_descriptor *intf_desc = &config->interface[interface_idx].altsetting[0];
+
+        intr.ep_in = 0;
+        intr.ep_out = 0;
+
+        for (size_t endpoints_idx = 0; endpoints_idx < intf_desc->bNumEndpoints; endpoints_idx++) {
+            const libusb_endpoint_descriptor *ep = &intf_desc->endpoint[endpoints_idx];
+
+            if ((ep->bmAttributes & 3) != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+                continue;
+
+            if ((ep->bEndpointAddress & 0x80) == LIBUSB_ENDPOINT_IN) {
+                intr.ep_in = ep->bEndpointAddress;
+            } else {
+                intr.ep_out = ep->bEndpointAddress;
+                intr.packet_size = ep->wMaxPacketSize & 0x7ff;
+            }
+        }
+
+        if ((intr.ep_in != 0) && (intr.ep_out != 0)) {
+            intr.interface = intf_desc->bInterfaceNumber;
+            return;
+        }
+    }
+
+    intr = {0};
+}
+
 static USBCommuniErrors_t GetDeviceAttr(libusb_device *device, 
                                         uint16_t &vendor_id,
                                         uint16_t &product_id,
                                         uint16_t &ep_in, 
                                         uint16_t &ep_out, 
                                         uint16_t &interface, 
-                                        uint16_t &packet_size)
+                                        uint16_t &packet_size,
+                                        USBIntEndpoints_t &intr)
 {
     int r;
     libusb_device_descriptor descriptor;
@@ -261,6 +775,7 @@ static USBCommuniErrors_t GetDeviceAttr(libusb_device *device,
     ep_out = 0;
     interface = 0;
     packet_size = 0;
+    intr = {0};
 
     if (nullptr == device)
         return USBCOMMUNI_E_INVAIL_ARG;
@@ -315,16 +830,18 @@ static USBCommuniErrors_t GetDeviceAttr(libusb_device *device,
             }
         }
 
-        if (nullptr != config) {
-            libusb_free_config_descriptor(config);
-            config = nullptr;
+        /* the descriptor lives in @config, read it before freeing */
+        if (intf_desc_found) {
+            interface = intf_desc_found->bInterfaceNumber;
+            packet_size = intf_desc_found->endpoint[0].wMaxPacketSize;
+            GetIntEndpoints(config, intr);
         }
 
-        if (!intf_desc_found)
-            continue;
+        libusb_free_config_descriptor(config);
+        config = nullptr;
 
-        interface = intf_desc_found->bInterfaceNumber;
-        packet_size = intf_desc_found->endpoint[0].wMaxPacketSize;
+        if (intf_desc_found)
+            break;
     }
 
     if (nullptr == intf_desc_found)
@@ -339,6 +856,9 @@ static USBCommuniErrors_t GetDeviceAttr(libusb_device *device,
     fprintf(stderr, "\t Endpoint output : %02x\n", ep_out);
     fprintf(stderr, "\t interface       : %d\n", interface);
     fprintf(stderr, "\t packet size     : %d\n", packet_size);
+    if (intr.ep_in != 0)
+        fprintf(stderr, "\t interrupt       : %02x/%02x, interface %d, packet size %d\n",
+                intr.ep_in, intr.ep_out, intr.interface, intr.packet_size);
     fprintf(stderr, "*************************************\n");
 
     return USBCOMMUNI_E_SUCCESS;
@@ -347,45 +867,52 @@ static USBCommuniErrors_t GetDeviceAttr(libusb_device *device,
 void USBAndroidCommuni::SetEventInfo(libusb_hotplug_event event, libusb_device *device)
 {
     USBCommuniErrors_t err;
-    uint16_t vendor_id;
-    uint16_t product_id;
-    uint16_t ep_in;
-    uint16_t ep_out;
-    uint16_t interface;
-    uint16_t packet_size;
-    USBAndroidDeviceTypes_t type;
+    USBDeviceAttr_t attr;
 
-    err = GetDeviceAttr(device, vendor_id, product_id, ep_in, ep_out, interface, packet_size);
+    err = GetDeviceAttr(device, attr.id.vendor, attr.id.product, attr.ep_in, attr.ep_out,
+                        attr.interface, attr.packet_size, attr.intr);
     if (err != USBCOMMUNI_E_SUCCESS)
         return;
 
-    if ((vendor_id == GOOGLE_VID) && 
-        ((product_id == ACCESSORY_PID) || (product_id == ACCESSORY_PID_ALT)))
+    attr.device = device;
+    SetDeviceInfo(event, attr);
+}
+
+void USBAndroidCommuni::SetDeviceInfo(libusb_hotplug_event event, const USBDeviceAttr_t &attr)
+{
+    USBDeviceAttr_t *target;
+    USBAndroidDeviceTypes_t type;
+
+    attr_mutex_.lock();
+
+    if ((attr.id.vendor == GOOGLE_VID) && 
+        ((attr.id.product == ACCESSORY_PID) || (attr.id.product == ACCESSORY_PID_ALT)))
     {
         type = USBANDROID_DEVICE_GOOGLE;
-        google_.device = device;
-        google_.id.vendor = vendor_id;
-        google_.id.product = product_id;
-        google_.ep_in = ep_in;
-        google_.ep_out = ep_out;
-        google_.interface = interface;
-        google_.packet_size = packet_size;
+        target = &google_;
     } else {
         type = USBANDROID_DEVICE_ANDROID;
-        phone_.device = device;
-        phone_.id.vendor = vendor_id;
-        phone_.id.product = product_id;
-        phone_.ep_in = ep_in;
-        phone_.ep_out = ep_out;
-        phone_.interface = interface;
-        phone_.packet_size = packet_size;
+        target = &phone_;
     }
 
+    target->device = attr.device;
+    target->id = attr.id;
+    target->ep_in = attr.ep_in;
+    target->ep_out = attr.ep_out;
+    target->interface = attr.interface;
+    target->packet_size = attr.packet_size;
+    target->intr = attr.intr;
+
     this->event_ = event;
-    this->curr_id_.vendor = vendor_id;
-    this->curr_id_.product = product_id;
+    this->curr_id_ = attr.id;
     this->device_type_ = type;
 
+    attr_mutex_.unlock();
+
+    /* the phone plugged in, then the accessory it re-enumerates as */
+    if ((nullptr != timeline_) && (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED))
+        timeline_->Mark((type == USBANDROID_DEVICE_GOOGLE) ? USBCOMMUNI_STAGE_ENUMERATED : USBCOMMUNI_STAGE_PLUGGED);
+
     if (nullptr != event_handle_)
         event_handle_(((event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) ? \
                             USBCOMMUNI_DEVICE_ADD : USBCOMMUNI_DEVICE_REMOVE));
@@ -393,147 +920,317 @@ void USBAndroidCommuni::SetEventInfo(libusb_hotplug_event event, libusb_device *
 
 void USBAndroidCommuni::LoopThreadHandler()
 {
-    loop_thead_exist_ = true;
-
-    while (true) {
-        if (true == exit_enable_)
-            break;
+    struct timeval zero = {0, 0};
+    struct timeval tv;
+    bool busy_poll = (config_.latency_mode && config_.latency_busy_poll);
+
+    RealtimeThreadSetup(config_, config_.latency_event_cpu, "USB ANDROID");
+
+    /* Deinit() clears loop_thead_exist_ and interrupts the event handler */
+    while (true == loop_thead_exist_) {
+        if (busy_poll) {
+            libusb_handle_events_timeout(context_, &zero);
+        } else if (config_.send_coalesce) {
+            CoalesceTimeout(tv);
+            libusb_handle_events_timeout(context_, &tv);
+        } else {
+            libusb_handle_events(context_);
+        }
 
-        libusb_handle_events(context_);
+        if (config_.send_coalesce)
+            SendCoalesced(true);
     }
+}
 
-    loop_thead_exist_ = false;
+static void PollfdAddedCallback(int fd, short events, void *user_data)
+{
+    ((USBAndroidCommuni *)user_data)->PollfdAdded(fd, events);
 }
 
-void USBAndroidCommuni::OpenThreadHandler()
+static void PollfdRemovedCallback(int fd, void *user_data)
 {
-    USBCommuniErrors_t err;
-    bool ck_keep_alive = true;
-
-    while (true) {
-        // fprintf(stderr, "--------------------------------------------\n");
-        // fprintf(stderr, "_OpenThreadHandler status:\n");
-        // fprintf(stderr, "\t event   : %d,        ck_keep_alive : %d\n", event, ck_keep_alive);
-        // fprintf(stderr, "\t curr_id : %04x:%04x, last_id : %04x:%04x\n", curr_id.vendor, curr_id.product, 
-        //                                                                  last_id.vendor, last_id.product);
-        // fprintf(stderr, "\t device type: %d\n", device_type);
-        // fprintf(stderr, "--------------------------------------------\n");
-
-        if ((true == exit_enable_) && (false == loop_thead_exist_))
-            break;
+    ((USBAndroidCommuni *)user_data)->PollfdRemoved(fd);
+}
 
-        if (event_ == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
-            if ((curr_id_.vendor == last_id_.vendor) && 
-                (curr_id_.product == last_id_.product))
-            {
-                ck_keep_alive = true;
-                goto delay200ms;
-            }
+/* notifiers first, a fd showing up in between is added twice and the second add fails harmlessly */
+USBCommuniErrors_t USBAndroidCommuni::OpenPollFd()
+{
+    const struct libusb_pollfd **fds;
 
-            switch (device_type_) {
-            case USBANDROID_DEVICE_ANDROID:
-                if (ck_keep_alive) {
-                    ck_keep_alive = false;
-                    goto delay2000ms;
-                }
+    poll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (poll_fd_ < 0) {
+        fprintf(stderr, "epoll_create1 failed\n");
+        return USBCOMMUNI_E_IO;
+    }
 
-                err = OpenUsbDevice();
-                if (USBCOMMUNI_E_SUCCESS != err)
-                    goto delay1000ms;
+    libusb_set_pollfd_notifiers(context_, PollfdAddedCallback, PollfdRemovedCallback, this);
 
-                err = SetupUsbToAccessory();
-                if (USBCOMMUNI_E_SUCCESS != err) {
-                    CloseUsbDevice();
-                    goto delay1000ms;
-                }
-                last_id_ = curr_id_;
-                break;
-            
-            case USBANDROID_DEVICE_GOOGLE:
-                err = OpenAccessoryDevice();
-                if (USBCOMMUNI_E_SUCCESS != err)
-                    goto delay1000ms;
-
-                err = ConfigAsyncRead();
-                if (USBCOMMUNI_E_SUCCESS != err) {
-                    CloseAccessoryDevice();
-                    goto delay1000ms;
-                }
+    fds = libusb_get_pollfds(context_);
+    if (nullptr == fds) {
+        fprintf(stderr, "libusb_get_pollfds failed\n");
+        ClosePollFd();
+        return USBCOMMUNI_E_IO;
+    }
 
-                connect_status_ = true;
-                last_id_ = curr_id_;
-                break;
+    for (int i = 0; nullptr != fds[i]; i++)
+        PollfdAdded(fds[i]->fd, fds[i]->events);
 
-            default:
-                goto delay200ms;
-                break;
-            }
-        } else {
-            if ((curr_id_.vendor == 0) && (last_id_.vendor == 0))
-                goto delay1000ms;
+    libusb_free_pollfds(fds);
 
-            if ((curr_id_.vendor != last_id_.vendor) ||
-                (curr_id_.product != last_id_.product))
-            {
-                goto delay200ms;
-            }
+    return USBCOMMUNI_E_SUCCESS;
+}
 
-            switch (device_type_) {
-            case USBANDROID_DEVICE_ANDROID:
-                CloseUsbDevice();
-                last_id_ = {0};
-                break;
-            
-            case USBANDROID_DEVICE_GOOGLE:
-                CloseAccessoryDevice();
-                connect_status_ = false;
-                last_id_ = {0};
-                break;
+void USBAndroidCommuni::ClosePollFd()
+{
+    if (poll_fd_ < 0)
+        return;
 
-            default:
-                break;
-            }
+    libusb_set_pollfd_notifiers(context_, nullptr, nullptr, nullptr);
+    close(poll_fd_);
+    poll_fd_ = -1;
+}
+
+void USBAndroidCommuni::PollfdAdded(int fd, short events)
+{
+    struct epoll_event ev;
+
+    ev.events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    epoll_ctl(poll_fd_, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void USBAndroidCommuni::PollfdRemoved(int fd)
+{
+    epoll_ctl(poll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int USBAndroidCommuni::GetPollFd()
+{
+    return poll_fd_;
+}
+
+uint32_t USBAndroidCommuni::GetTimeout()
+{
+    int64_t us;
+    struct timeval tv;
+
+    if ((nullptr == context_) || !config_.external_loop)
+        return USBCOMMUNI_WAIT_FOREVER;
+
+    if (reconnect_ || recover_)
+        return 0;
+
+    us = std::chrono::duration_cast<std::chrono::microseconds>(open_due_ - std::chrono::steady_clock::now()).count();
+
+    /* 0 when libusb has no timeouts pending or handles them on a timerfd */
+    if (1 == libusb_get_next_timeout(context_, &tv))
+        us = std::min<int64_t>(us, tv.tv_sec * 1000000 + tv.tv_usec);
+
+    if (config_.send_coalesce) {
+        CoalesceTimeout(tv);
+        us = std::min<int64_t>(us, tv.tv_sec * 1000000 + tv.tv_usec);
+    }
+
+    return (us > 0) ? (us + 999) / 1000 : 0;
+}
+
+/* what the event and open threads do, one non-blocking pass of each */
+void USBAndroidCommuni::ProcessEvents()
+{
+    struct timeval zero = {0, 0};
+
+    if ((nullptr == context_) || !config_.external_loop)
+        return;
+
+    libusb_handle_events_timeout_completed(context_, &zero, nullptr);
+
+    if (config_.send_coalesce)
+        SendCoalesced(true);
+
+    if (reconnect_ || recover_ || (std::chrono::steady_clock::now() >= open_due_))
+        open_due_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(OpenStep());
+}
+
+void USBAndroidCommuni::OpenThreadHandler()
+{
+    uint32_t delay_ms;
+
+    while (true != exit_enable_) {
+        delay_ms = OpenStep();
+        if (delay_ms > 0)
+            WaitExit(delay_ms);
+    }
+}
+
+/* one pass of the open state machine, returns the ms to wait before the next */
+uint32_t USBAndroidCommuni::OpenStep()
+{
+    USBCommuniErrors_t err;
+    libusb_hotplug_event event;
+    USBDeviceId curr_id;
+    USBAndroidDeviceTypes_t device_type;
+
+    // fprintf(stderr, "--------------------------------------------\n");
+    // fprintf(stderr, "_OpenThreadHandler status:\n");
+    // fprintf(stderr, "\t event   : %d,        keep_alive_ : %d\n", event, keep_alive_);
+    // fprintf(stderr, "\t curr_id : %04x:%04x, last_id : %04x:%04x\n", curr_id.vendor, curr_id.product, 
+    //                                                                  last_id.vendor, last_id.product);
+    // fprintf(stderr, "\t device type: %d\n", device_type);
+    // fprintf(stderr, "--------------------------------------------\n");
+
+    if (0 != recover_)
+        Recover();
+
+    /* the next pass finds the accessory closed and reopens it */
+    if (reconnect_.exchange(false) && connect_status_) {
+        SetConnectStatus(false);
+        CancelTransfers();
+        CloseAccessoryDevice();
+        last_id_ = {0};
+    }
+
+    attr_mutex_.lock();
+    event = event_;
+    curr_id = curr_id_;
+    device_type = device_type_;
+    attr_mutex_.unlock();
+
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        if ((curr_id.vendor == last_id_.vendor) && 
+            (curr_id.product == last_id_.product))
+        {
+            keep_alive_ = true;
+            goto delay200ms;
         }
 
+        switch (device_type) {
+        case USBANDROID_DEVICE_ANDROID:
+            if (keep_alive_) {
+                keep_alive_ = false;
+                goto delay2000ms;
+            }
+
+            err = OpenUsbDevice();
+            if (USBCOMMUNI_E_SUCCESS != err)
+                goto delay1000ms;
+
+            err = SetupUsbToAccessory();
+            if (USBCOMMUNI_E_SUCCESS != err) {
+                CloseUsbDevice();
+                goto delay1000ms;
+            }
+
+            if (nullptr != timeline_)
+                timeline_->Mark(USBCOMMUNI_STAGE_SWITCHED);
+            last_id_ = curr_id;
+            break;
+        
+        case USBANDROID_DEVICE_GOOGLE:
+            err = OpenAccessoryDevice();
+            if (USBCOMMUNI_E_SUCCESS != err)
+                goto delay1000ms;
+
+            if (nullptr != timeline_)
+                timeline_->Mark(USBCOMMUNI_STAGE_OPENED);
+
+            err = ConfigAsyncRead();
+            if (USBCOMMUNI_E_SUCCESS != err) {
+                CloseAccessoryDevice();
+                goto delay1000ms;
+            }
+
+            /* optional, bulk carries everything without it */
+            ConfigInterrupt();
+
+            last_id_ = curr_id;
+            SetConnectStatus(true);
+
+            /* a reopen recovery ends here */
+            RecoveryDone();
+            break;
+
+        default:
+            goto delay200ms;
+            break;
+        }
+    } else {
+        if ((curr_id.vendor == 0) && (last_id_.vendor == 0))
+            goto delay1000ms;
+
+        if ((curr_id.vendor != last_id_.vendor) ||
+            (curr_id.product != last_id_.product))
+        {
+            goto delay200ms;
+        }
+
+        switch (device_type) {
+        case USBANDROID_DEVICE_ANDROID:
+            CloseUsbDevice();
+            last_id_ = {0};
+            break;
+        
+        case USBANDROID_DEVICE_GOOGLE:
+            SetConnectStatus(false);
+            CancelTransfers();
+            CloseAccessoryDevice();
+            last_id_ = {0};
+
+            /* unplugged, nothing left to recover */
+            recover_ = 0;
+            recover_since_us_ = 0;
+            break;
+
+        default:
+            break;
+        }
+    }
+
 delay0s:
-        continue;
+    return 0;
 delay200ms:
-        usleep(200*1000);
-        continue;
+    return config_.android_poll_ms;
 delay1000ms:
-        usleep(1000*1000);
-        continue;
+    return config_.android_retry_ms;
 delay2000ms:
-        usleep(2000*1000);
-        continue;
-    }
-
-    libusb_hotplug_deregister_callback(context_, hotplug_handle_);
-    if (nullptr != context_) {
-        libusb_exit(context_);
-        context_ = nullptr;
-    }
+    return config_.android_switch_delay_ms;
 }
 
 USBCommuniErrors_t USBAndroidCommuni::OpenUsbDevice()
 {
-    phone_.handle = libusb_open_device_with_vid_pid(context_, phone_.id.vendor, phone_.id.product);
-    if (nullptr == phone_.handle) {
+    USBDeviceId id;
+    libusb_device_handle *handle;
+
+    attr_mutex_.lock();
+    id = phone_.id;
+    attr_mutex_.unlock();
+
+    handle = libusb_open_device_with_vid_pid(context_, id.vendor, id.product);
+    if (nullptr == handle) {
         fprintf(stdout, "Problem acquireing handle\n");
         return USBCOMMUNI_E_IO;
     }
 
-    libusb_claim_interface(phone_.handle, 0);
+    libusb_claim_interface(handle, 0);
+
+    std::lock_guard<std::mutex> lock(attr_mutex_);
+    phone_.handle = handle;
 
     return USBCOMMUNI_E_SUCCESS;
 }
 
 void USBAndroidCommuni::CloseUsbDevice()
 {
-    if (phone_.handle != nullptr) {
-        libusb_release_interface(phone_.handle, 0);
-        libusb_close(phone_.handle);
-        phone_.handle = nullptr;
+    libusb_device_handle *handle;
+
+    /* never hold attr_mutex_ across libusb_close, it waits for the event thread */
+    attr_mutex_.lock();
+    handle = phone_.handle;
+    phone_.handle = nullptr;
+    attr_mutex_.unlock();
+
+    if (handle != nullptr) {
+        libusb_release_interface(handle, 0);
+        libusb_close(handle);
     }
 }
 
@@ -543,13 +1240,15 @@ USBCommuniErrors_t USBAndroidCommuni::SetupUsbToAccessory()
 	int version;
 	int err;
 
-    err = libusb_control_transfer(phone_.handle, 0xC0, 51, 0, 0, io_buffer, 2, 0);
+    err = libusb_control_transfer(phone_.handle, 0xC0, 51, 0, 0, io_buffer, 2, AOA_CTRL_TIMEOUT_MS);
     if (err < 0)
         return USBCOMMUNI_E_IO;
 
 	version = io_buffer[1] << 8 | io_buffer[0];
 
-    usleep(1000);
+    /* the pause is a courtesy, ProcessEvents() must not sleep and phones take the requests back to back */
+    if (!config_.external_loop)
+        usleep(1000);
 
     if (UsbSendCtrl(gadgetacci_.manufacturer, 52, 0) != USBCOMMUNI_E_SUCCESS)
         return USBCOMMUNI_E_IO;
@@ -566,35 +1265,59 @@ USBCommuniErrors_t USBAndroidCommuni::SetupUsbToAccessory()
     if (UsbSendCtrl(nullptr, 53, 0) != USBCOMMUNI_E_SUCCESS)
         return USBCOMMUNI_E_IO;
 
-    if (phone_.handle != nullptr) {
-        libusb_release_interface(phone_.handle, 0);
-        libusb_close(phone_.handle);
-        phone_.handle = nullptr;
-    }
+    CloseUsbDevice();
 
     return USBCOMMUNI_E_SUCCESS;
 }
 
 USBCommuniErrors_t USBAndroidCommuni::OpenAccessoryDevice()
 {
-    google_.handle = libusb_open_device_with_vid_pid(context_, google_.id.vendor, google_.id.product);
-    if (nullptr == google_.handle) {
+    USBDeviceId id;
+    libusb_device_handle *handle;
+
+    attr_mutex_.lock();
+    id = google_.id;
+    attr_mutex_.unlock();
+
+    handle = ops_.open(context_, id.vendor, id.product);
+    if (nullptr == handle) {
         fprintf(stderr, "open accessory device failed\n");
         return USBCOMMUNI_E_IO;
     }
 
-    libusb_claim_interface(google_.handle, 0);
+    ops_.claim(handle, 0);
     fprintf(stdout, "Interface claimed, ready to transfer data\n");
 
+    std::lock_guard<std::mutex> lock(attr_mutex_);
+    google_.handle = handle;
+    tuner_.ResetSend(config_);
+
     return USBCOMMUNI_E_SUCCESS;
 }
 
 void USBAndroidCommuni::CloseAccessoryDevice()
 {
-    if (nullptr != google_.handle) {
-        libusb_release_interface(google_.handle, 0);
-        libusb_close(google_.handle);
-        google_.handle = nullptr;
+    libusb_device_handle *handle;
+    uint16_t int_interface;
+    bool int_claimed;
+
+    attr_mutex_.lock();
+    handle = google_.handle;
+    google_.handle = nullptr;
+    coalesce_.clear();
+    int_interface = google_.intr.interface;
+    int_claimed = int_claimed_;
+    int_claimed_ = false;
+    int_max_bytes_ = 0;
+    attr_mutex_.unlock();
+
+    FreeInterrupt();
+
+    if (nullptr != handle) {
+        if (int_claimed)
+            ops_.release(handle, int_interface);
+        ops_.release(handle, 0);
+        ops_.close(handle);
     }
 }
 
@@ -606,9 +1329,9 @@ USBCommuniErrors_t USBAndroidCommuni::UsbSendCtrl(const char *buff, int req, int
         return USBCOMMUNI_E_INVAIL_ARG;
 
     if (nullptr != buff)
-        r = libusb_control_transfer(phone_.handle, 0x40, req, 0, index, (unsigned char*)buff, (uint16_t)strlen(buff) + 1 , 0);
+        r = libusb_control_transfer(phone_.handle, 0x40, req, 0, index, (unsigned char*)buff, (uint16_t)strlen(buff) + 1, AOA_CTRL_TIMEOUT_MS);
     else
-        r = libusb_control_transfer(phone_.handle, 0x40, req, 0, index, (unsigned char*)buff, 0, 0);
+        r = libusb_control_transfer(phone_.handle, 0x40, req, 0, index, (unsigned char*)buff, 0, AOA_CTRL_TIMEOUT_MS);
 
     if (r < 0)
         return USBCOMMUNI_E_IO;
@@ -618,42 +1341,118 @@ USBCommuniErrors_t USBAndroidCommuni::UsbSendCtrl(const char *buff, int req, int
 
 static void TransferRecvCallback(libusb_transfer *transfer)
 {
-    int r;
-    USBAndroidCommuni *android = (USBAndroidCommuni*)transfer->user_data;
+    USBAndroidCommuni *android;
 
-    if ((nullptr == transfer) || (android == nullptr))
+    if (nullptr == transfer)
         return;
 
+    android = (USBAndroidCommuni*)transfer->user_data;
+    if (android == nullptr)
+        return;
+
+    android->RecvTransferDone(transfer);
+}
+
+void USBAndroidCommuni::RecvTransferDone(libusb_transfer *transfer)
+{
+    int r;
+    size_t in_flight;
+    uint32_t size;
+    unsigned char *buffer;
+
     switch (transfer->status) {
     case LIBUSB_TRANSFER_COMPLETED:
+        errors_ = 0;
+        progress_ = true;
+
         if (transfer->actual_length > 0) {
-            if (android->recv_handle_ != nullptr)
-                android->recv_handle_((const char*)transfer->buffer, transfer->actual_length);
+            if (recv_handle_ != nullptr)
+                recv_handle_((const char*)transfer->buffer, transfer->actual_length);
+        }
+
+        if ((true == exit_enable_) || (true == recv_hold_))
+            break;
+
+        if (config_.autotune) {
+            tuner_.RecordRecv(transfer->actual_length, transfer->length);
+
+            transfer_mutex_.lock();
+            in_flight = recv_transfers_.size();
+            transfer_mutex_.unlock();
+
+            /* surplus reads are retired as they complete */
+            if (in_flight > tuner_.RecvTransfers())
+                break;
+
+            size = tuner_.RecvBufferSize();
+            if (size != (uint32_t)transfer->length) {
+                buffer = static_cast<unsigned char*>(RealtimeAlloc(config_, size));
+                if (nullptr != buffer) {
+                    RealtimeUnlock(config_, transfer->buffer, transfer->length);
+                    free(transfer->buffer);
+                    transfer->buffer = buffer;
+                    transfer->length = size;
+                }
+            }
+
+            while (in_flight++ < tuner_.RecvTransfers()) {
+                if (SubmitRecvTransfer(transfer->dev_handle, transfer->endpoint, size) != USBCOMMUNI_E_SUCCESS)
+                    break;
+            }
         }
 
-        r = libusb_submit_transfer(transfer);
+        r = ops_.submit(transfer);
         if (r) {
             fprintf(stderr, "error libusb_submit_transfer : %s\n", libusb_strerror(libusb_error(r)));
-            libusb_cancel_transfer(transfer);
+            RequestRecovery(RECOVER_READS);
+            break;
         }
+        return;
+
+    case LIBUSB_TRANSFER_STALL:
+        fprintf(stderr, "bulk IN endpoint %02x stalled\n", transfer->endpoint);
+        transfer_errors_++;
+        stalls_++;
+        RequestRecovery(RECOVER_READS);
         break;
-    
-    case LIBUSB_TRANSFER_CANCELLED:
-        libusb_free_transfer(transfer);
+
+    case LIBUSB_TRANSFER_ERROR:
+    case LIBUSB_TRANSFER_TIMED_OUT:
+    case LIBUSB_TRANSFER_OVERFLOW:
+        transfer_errors_++;
+
+        if ((true == exit_enable_) || (true == recv_hold_))
+            break;
+
+        if ((++errors_ <= config_.android_recover_retries) && (LIBUSB_SUCCESS == ops_.submit(transfer))) {
+            resubmits_++;
+            return;
+        }
+
+        RequestRecovery(RECOVER_READS);
         break;
 
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        /* the hotplug LEFT event closes the accessory */
+    case LIBUSB_TRANSFER_CANCELLED:
     default:
         break;
     }
+
+    transfer_mutex_.lock();
+    recv_transfers_.erase(transfer);
+    transfer_mutex_.unlock();
+    transfer_cond_.notify_all();
+
+    RealtimeUnlock(config_, transfer->buffer, transfer->length);
+    libusb_free_transfer(transfer);
 }
 
-USBCommuniErrors_t USBAndroidCommuni::ConfigAsyncRead()
+USBCommuniErrors_t USBAndroidCommuni::SubmitRecvTransfer(libusb_device_handle *handle, uint8_t ep_in, uint32_t size)
 {
     int r;
     libusb_transfer *transfer;
-
-    if (nullptr == google_.handle)
-        return USBCOMMUNI_E_INVAIL_ARG;
+    unsigned char *buffer;
 
     transfer = libusb_alloc_transfer(0);
     if (nullptr == transfer) {
@@ -661,21 +1460,326 @@ USBCommuniErrors_t USBAndroidCommuni::ConfigAsyncRead()
         return USBCOMMUNI_E_IO;
     }
 
-    memset(g_recvbuffer, 0, sizeof(g_recvbuffer));
+    /* long lived, locked in latency mode so completions never page fault */
+    buffer = static_cast<unsigned char*>(RealtimeAlloc(config_, size));
+    if (nullptr == buffer) {
+        libusb_free_transfer(transfer);
+        return USBCOMMUNI_E_NMEN;
+    }
+
     transfer->actual_length = 0;
 
     libusb_fill_bulk_transfer(transfer,
-                              google_.handle, 
-                              google_.ep_in, 
-                              g_recvbuffer, 
-                              sizeof(g_recvbuffer),
+                              handle, 
+                              ep_in, 
+                              buffer, 
+                              size,
                               TransferRecvCallback, 
                               this,
                               0);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+    transfer_mutex_.lock();
+    recv_transfers_.insert(transfer);
+    transfer_mutex_.unlock();
 
-    r = libusb_submit_transfer(transfer);
+    r = ops_.submit(transfer);
     if (LIBUSB_SUCCESS != r) {
         fprintf(stderr, "usb submit transfer failed, err: %s\n", libusb_error_name(r));
+        transfer_mutex_.lock();
+        recv_transfers_.erase(transfer);
+        transfer_mutex_.unlock();
+        RealtimeUnlock(config_, buffer, size);
+        libusb_free_transfer(transfer);
+        return USBCOMMUNI_E_IO;
+    }
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+USBCommuniErrors_t USBAndroidCommuni::ConfigAsyncRead()
+{
+    USBCommuniErrors_t err;
+    uint32_t transfers;
+
+    if (nullptr == google_.handle)
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    tuner_.Reset(config_, config_.android_recv_buffer_size, config_.android_recv_transfers);
+    transfers = tuner_.RecvTransfers();
+
+    for (uint32_t i = 0; i < transfers; i++) {
+        err = SubmitRecvTransfer(google_.handle, google_.ep_in, config_.android_recv_buffer_size);
+        if (USBCOMMUNI_E_SUCCESS != err) {
+            /* one read in flight is enough to run */
+            if (i > 0)
+                break;
+            return err;
+        }
+    }
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+static void TransferIntRecvCallback(libusb_transfer *transfer)
+{
+    USBAndroidCommuni *android;
+
+    if (nullptr == transfer)
+        return;
+
+    android = (USBAndroidCommuni*)transfer->user_data;
+    if (android == nullptr)
+        return;
+
+    android->IntRecvTransferDone(transfer);
+}
+
+static void TransferIntSendCallback(libusb_transfer *transfer)
+{
+    USBAndroidCommuni *android;
+
+    if (nullptr == transfer)
+        return;
+
+    android = (USBAndroidCommuni*)transfer->user_data;
+    if (android == nullptr)
+        return;
+
+    android->IntSendTransferDone(transfer);
+}
+
+void USBAndroidCommuni::IntRecvHandleRegister(USBCommuniRecvHandleCb recvcb)
+{
+    int_recv_handle_ = recvcb;
+}
+
+void USBAndroidCommuni::IntRecvTransferDone(libusb_transfer *transfer)
+{
+    int r;
+
+    switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        if ((transfer->actual_length > 0) && (int_recv_handle_ != nullptr))
+            int_recv_handle_((const char*)transfer->buffer, transfer->actual_length);
+
+        /* CancelTransfers() clears int_active_ before cancelling */
+        if ((true == exit_enable_) || (false == int_active_))
+            break;
+
+        r = ops_.submit(transfer);
+        if (r) {
+            fprintf(stderr, "error libusb_submit_transfer : %s\n", libusb_strerror(libusb_error(r)));
+            RequestRecovery(RECOVER_INT_READS);
+            break;
+        }
+        return;
+
+    case LIBUSB_TRANSFER_STALL:
+        fprintf(stderr, "interrupt IN endpoint %02x stalled\n", transfer->endpoint);
+        transfer_errors_++;
+        stalls_++;
+        RequestRecovery(RECOVER_INT_READS);
+        break;
+
+    case LIBUSB_TRANSFER_ERROR:
+    case LIBUSB_TRANSFER_TIMED_OUT:
+    case LIBUSB_TRANSFER_OVERFLOW:
+        transfer_errors_++;
+
+        if ((true == exit_enable_) || (false == int_active_))
+            break;
+
+        if ((++errors_ <= config_.android_recover_retries) && (LIBUSB_SUCCESS == ops_.submit(transfer))) {
+            resubmits_++;
+            return;
+        }
+
+        RequestRecovery(RECOVER_INT_READS);
+        break;
+
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        /* the hotplug LEFT event closes the accessory */
+    case LIBUSB_TRANSFER_CANCELLED:
+    default:
+        break;
+    }
+
+    transfer_mutex_.lock();
+    int_recv_.erase(transfer);
+    transfer_mutex_.unlock();
+    transfer_cond_.notify_all();
+
+    RealtimeUnlock(config_, transfer->buffer, transfer->length);
+    libusb_free_transfer(transfer);
+}
+
+void USBAndroidCommuni::IntSendTransferDone(libusb_transfer *transfer)
+{
+    bool idle;
+
+    /* kept for the next small send, freed by CloseAccessoryDevice() */
+    transfer_mutex_.lock();
+    int_busy_.erase(transfer);
+    int_free_.push_back(transfer);
+    idle = send_transfers_.empty() && int_busy_.empty();
+    transfer_mutex_.unlock();
+    transfer_cond_.notify_all();
+
+    if (idle && (nullptr != send_idle_handle_))
+        send_idle_handle_();
+}
+
+bool USBAndroidCommuni::IntRoute(uint32_t len)
+{
+    std::lock_guard<std::mutex> lock(transfer_mutex_);
+
+    return (len > 0) && (len <= int_max_bytes_) && !int_free_.empty();
+}
+
+/* attr_mutex_ held, false if the bulk pipe has to take @data */
+bool USBAndroidCommuni::SubmitIntSend(const char *data, uint32_t len)
+{
+    int r;
+    libusb_transfer *transfer;
+
+    transfer_mutex_.lock();
+    if (int_free_.empty()) {
+        transfer_mutex_.unlock();
+        return false;
+    }
+    transfer = int_free_.back();
+    int_free_.pop_back();
+    int_busy_.insert(transfer);
+    transfer_mutex_.unlock();
+
+    memcpy(transfer->buffer, data, len);
+    transfer->length = len;
+    transfer->actual_length = 0;
+
+    r = ops_.submit(transfer);
+    if (LIBUSB_SUCCESS != r) {
+        fprintf(stderr, "usb submit interrupt transfer failed, err: %s\n", libusb_error_name(r));
+        IntSendTransferDone(transfer);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Preallocates the interrupt OUT transfers and keeps interrupt IN reads
+ * in flight when the accessory exposes an interrupt pair. Not used with
+ * config.link_reliable, its sequence numbers expect one ordered pipe.
+ */
+USBCommuniErrors_t USBAndroidCommuni::ConfigInterrupt()
+{
+    int r;
+    USBIntEndpoints_t intr;
+    libusb_device_handle *handle;
+    libusb_transfer *transfer;
+    unsigned char *buffer;
+    uint32_t size;
+
+    if (!config_.android_int_enable || config_.link_reliable)
+        return USBCOMMUNI_E_SUCCESS;
+
+    attr_mutex_.lock();
+    intr = google_.intr;
+    handle = google_.handle;
+    attr_mutex_.unlock();
+
+    if ((nullptr == handle) || (intr.ep_in == 0) || (intr.ep_out == 0) || (intr.packet_size == 0))
+        return USBCOMMUNI_E_SUCCESS;
+
+    /* the bulk pair holds interface 0, another one is claimed here and released on close */
+    if (intr.interface != 0) {
+        r = ops_.claim(handle, intr.interface);
+        if (LIBUSB_SUCCESS != r) {
+            fprintf(stderr, "claim interrupt interface %d failed, err: %s\n", intr.interface, libusb_error_name(r));
+            return USBCOMMUNI_E_IO;
+        }
+
+        attr_mutex_.lock();
+        if (handle == google_.handle)
+            int_claimed_ = true;
+        attr_mutex_.unlock();
+    }
+
+    size = intr.packet_size;
+    int_active_ = true;
+
+    transfer_mutex_.lock();
+    int_buffer_size_ = size;
+    transfer_mutex_.unlock();
+
+    for (uint32_t i = 0; i < config_.android_int_transfers; i++) {
+        transfer = libusb_alloc_transfer(0);
+        if (nullptr == transfer)
+            break;
+
+        buffer = static_cast<unsigned char*>(RealtimeAlloc(config_, size));
+        if (nullptr == buffer) {
+            libusb_free_transfer(transfer);
+            break;
+        }
+
+        libusb_fill_interrupt_transfer(transfer, handle, intr.ep_out, buffer, size,
+                                       TransferIntSendCallback, this, config_.android_send_timeout_ms);
+        transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+        transfer_mutex_.lock();
+        int_free_.push_back(transfer);
+        transfer_mutex_.unlock();
+    }
+
+    for (uint32_t i = 0; i < INT_RECV_TRANSFERS; i++) {
+        if (SubmitIntRecv(handle, intr.ep_in, size) != USBCOMMUNI_E_SUCCESS)
+            break;
+    }
+
+    attr_mutex_.lock();
+    if (handle == google_.handle)
+        int_max_bytes_ = std::min<uint32_t>(config_.android_int_max_bytes, size);
+    attr_mutex_.unlock();
+
+    fprintf(stderr, "interrupt endpoints %02x/%02x, sends up to %u bytes routed there\n",
+            intr.ep_in, intr.ep_out, std::min<uint32_t>(config_.android_int_max_bytes, size));
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+USBCommuniErrors_t USBAndroidCommuni::SubmitIntRecv(libusb_device_handle *handle, uint8_t ep_in, uint32_t size)
+{
+    int r;
+    libusb_transfer *transfer;
+    unsigned char *buffer;
+
+    transfer = libusb_alloc_transfer(0);
+    if (nullptr == transfer)
+        return USBCOMMUNI_E_IO;
+
+    buffer = static_cast<unsigned char*>(RealtimeAlloc(config_, size));
+    if (nullptr == buffer) {
+        libusb_free_transfer(transfer);
+        return USBCOMMUNI_E_NMEN;
+    }
+
+    libusb_fill_interrupt_transfer(transfer, handle, ep_in, buffer, size,
+                                   TransferIntRecvCallback, this, 0);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+    transfer_mutex_.lock();
+    int_recv_.insert(transfer);
+    transfer_mutex_.unlock();
+
+    r = ops_.submit(transfer);
+    if (LIBUSB_SUCCESS != r) {
+        fprintf(stderr, "usb submit interrupt transfer failed, err: %s\n", libusb_error_name(r));
+        transfer_mutex_.lock();
+        int_recv_.erase(transfer);
+        transfer_mutex_.unlock();
+        RealtimeUnlock(config_, buffer, size);
         libusb_free_transfer(transfer);
         return USBCOMMUNI_E_IO;
     }
@@ -683,7 +1787,191 @@ USBCommuniErrors_t USBAndroidCommuni::ConfigAsyncRead()
     return USBCOMMUNI_E_SUCCESS;
 }
 
+/* after CancelTransfers(), a send still in flight is freed next time */
+void USBAndroidCommuni::FreeInterrupt()
+{
+    std::lock_guard<std::mutex> lock(transfer_mutex_);
+
+    for (libusb_transfer *transfer : int_free_) {
+        RealtimeUnlock(config_, transfer->buffer, int_buffer_size_);
+        libusb_free_transfer(transfer);
+    }
+
+    int_free_.clear();
+}
+
+/* transfer callbacks, the open thread does the blocking part */
+void USBAndroidCommuni::RequestRecovery(uint32_t actions)
+{
+    uint64_t none = 0;
+
+    recover_since_us_.compare_exchange_strong(none, SteadyUs());
+
+    exit_mutex_.lock();
+    recover_ |= actions;
+    exit_mutex_.unlock();
+    exit_cond_.notify_all();
+}
+
+/* cancel and reap @transfers, e.g. before clearing a halt on their endpoint */
+void USBAndroidCommuni::DrainTransfers(std::set<libusb_transfer*> &transfers)
+{
+    std::unique_lock<std::mutex> lock(transfer_mutex_);
+
+    for (libusb_transfer *transfer : transfers)
+        ops_.cancel(transfer);
+
+    ReapTransfers(lock, [&transfers]() { return transfers.empty(); });
+}
+
+/**
+ * Open thread. Failed transfers are retried in place by their callbacks,
+ * android_recover_retries in a row, then the pipe is recovered here: a
+ * halt is cleared and the read ring is submitted again. A second read
+ * rebuild without a completed transfer in between, a failed clear, an
+ * empty ring or a lost send escalate to reopening the accessory.
+ */
+void USBAndroidCommuni::Recover()
+{
+    int r;
+    uint32_t actions;
+    uint32_t in_flight;
+    uint32_t int_size;
+    libusb_device_handle *handle;
+    uint8_t ep_in, ep_out, int_ep_in;
+
+    actions = recover_.exchange(0);
+
+    if (!connect_status_) {
+        recover_since_us_ = 0;
+        return;
+    }
+
+    if ((actions & RECOVER_READS) && !progress_.exchange(false) && rebuilt_)
+        actions |= RECOVER_REOPEN;
+
+    if (actions & RECOVER_REOPEN)
+        goto reopen;
+
+    attr_mutex_.lock();
+    handle = google_.handle;
+    ep_in = google_.ep_in;
+    ep_out = google_.ep_out;
+    int_ep_in = google_.intr.ep_in;
+    attr_mutex_.unlock();
+
+    if (nullptr == handle)
+        return;
+
+    /* the stalled send and those drained after it are lost, the reopen resyncs the peer */
+    if (actions & RECOVER_WRITES) {
+        transfer_mutex_.lock();
+        send_drops_ += send_transfers_.size();
+        transfer_mutex_.unlock();
+
+        DrainTransfers(send_transfers_);
+
+        r = ops_.clear_halt(handle, ep_out);
+        if (LIBUSB_SUCCESS != r)
+            fprintf(stderr, "clear halt on %02x failed, err: %s\n", ep_out, libusb_error_name(r));
+        else
+            halts_cleared_++;
+        goto reopen;
+    }
+
+    if (actions & RECOVER_READS) {
+        recv_hold_ = true;
+        DrainTransfers(recv_transfers_);
+        recv_hold_ = false;
+
+        r = ops_.clear_halt(handle, ep_in);
+        if (LIBUSB_SUCCESS != r) {
+            fprintf(stderr, "clear halt on %02x failed, err: %s\n", ep_in, libusb_error_name(r));
+            goto reopen;
+        }
+        halts_cleared_++;
+
+        transfer_mutex_.lock();
+        in_flight = recv_transfers_.size();
+        transfer_mutex_.unlock();
+
+        while (in_flight < tuner_.RecvTransfers()) {
+            if (SubmitRecvTransfer(handle, ep_in, tuner_.RecvBufferSize()) != USBCOMMUNI_E_SUCCESS)
+                break;
+            in_flight++;
+        }
+
+        if (in_flight == 0)
+            goto reopen;
+
+        rebuilds_++;
+        rebuilt_ = true;
+    }
+
+    /* int_active_ also holds the completed reads back, cleared on close */
+    if ((actions & RECOVER_INT_READS) && int_active_) {
+        int_active_ = false;
+        DrainTransfers(int_recv_);
+        int_active_ = true;
+
+        r = ops_.clear_halt(handle, int_ep_in);
+        if (LIBUSB_SUCCESS != r) {
+            fprintf(stderr, "clear halt on %02x failed, err: %s\n", int_ep_in, libusb_error_name(r));
+            goto reopen;
+        }
+        halts_cleared_++;
+
+        transfer_mutex_.lock();
+        int_size = int_buffer_size_;
+        transfer_mutex_.unlock();
+
+        for (in_flight = 0; in_flight < INT_RECV_TRANSFERS; in_flight++) {
+            if (SubmitIntRecv(handle, int_ep_in, int_size) != USBCOMMUNI_E_SUCCESS)
+                goto reopen;
+        }
+
+        rebuilds_++;
+    }
+
+    /* recovered unless more faults came in meanwhile */
+    if (0 == recover_)
+        RecoveryDone();
+    return;
+
+reopen:
+    fprintf(stderr, "transfer recovery failed, reopening the accessory\n");
+    rebuilt_ = false;
+    reopens_++;
+    Reconnect();
+}
+
+void USBAndroidCommuni::RecoveryDone()
+{
+    uint64_t since = recover_since_us_.exchange(0);
+    uint64_t us;
+
+    if (0 == since)
+        return;
 
+    us = SteadyUs() - since;
+    recoveries_++;
+    recovery_us_total_ += us;
+    if (us > recovery_us_max_)
+        recovery_us_max_ = us;
 }
 
+void USBAndroidCommuni::GetRecoveryStats(USBCommuniRecoveryStats_t &stats)
+{
+    stats.transfer_errors = transfer_errors_;
+    stats.stalls = stalls_;
+    stats.resubmits = resubmits_;
+    stats.send_drops = send_drops_;
+    stats.halts_cleared = halts_cleared_;
+    stats.rebuilds = rebuilds_;
+    stats.reopens = reopens_;
+    stats.recoveries = recoveries_;
+    stats.recovery_us_total = recovery_us_total_;
+    stats.recovery_us_max = recovery_us_max_;
+}
 
+}
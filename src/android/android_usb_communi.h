@@ -1,8 +1,17 @@
 #ifndef ANDROID_USB_COMMUNI_H_
 #define ANDROID_USB_COMMUNI_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <set>
 #include <thread>
+#include <vector>
 #include "commondef.h"
+#include "autotuner.h"
+#include "connect_timeline.h"
 #include "libusb-1.0/libusb.h"
 
 namespace usbcommuni {
@@ -27,6 +36,29 @@ typedef enum USBAndroidDeviceTypes {
     USBANDROID_DEVICE_UNKNOWN,
 } USBAndroidDeviceTypes_t;
 
+/* interrupt endpoint pair next to the bulk one, zero if absent */
+typedef struct USBIntEndpoints {
+    uint16_t interface;
+    uint16_t ep_in;
+    uint16_t ep_out;
+    uint16_t packet_size;
+} USBIntEndpoints_t;
+
+/**
+ * The libusb calls on the accessory's data path. The defaults go to
+ * libusb; a mock completes the transfers itself, through their callback,
+ * to inject faults without a device.
+ */
+typedef struct USBTransferOps {
+    libusb_device_handle* (*open)(libusb_context *ctx, uint16_t vendor, uint16_t product);
+    void (*close)(libusb_device_handle *handle);
+    int (*claim)(libusb_device_handle *handle, int interface);
+    int (*release)(libusb_device_handle *handle, int interface);
+    int (*submit)(libusb_transfer *transfer);
+    int (*cancel)(libusb_transfer *transfer);
+    int (*clear_halt)(libusb_device_handle *handle, unsigned char endpoint);
+} USBTransferOps_t;
+
 typedef struct USBDeviceAttr {
     USBDeviceId id;
     libusb_device* device;
@@ -36,6 +68,7 @@ typedef struct USBDeviceAttr {
     uint16_t ep_in;
     uint16_t ep_out;
     uint16_t packet_size;
+    USBIntEndpoints_t intr;
 
     USBDeviceAttr() {
         id = {0};
@@ -45,6 +78,8 @@ typedef struct USBDeviceAttr {
         interface = 0;
         ep_in = 0;
         ep_out = 0;
+        packet_size = 0;
+        intr = {0};
     }
 } USBDeviceAttr_t;
 
@@ -57,25 +92,90 @@ public:
     USBCommuniErrors_t Init();
     void Deinit();
 
+    /* takes effect on the next Init() */
+    void SetConfig(const USBCommuniConfig_t &config);
+
     USBCommuniErrors_t HotplugEventRegister();
     void HotplugEventDisregister();
 
     void SubscribeRegister(USBCommuniEventCb eventcb);
 
+    /* stages of the next connect are marked in @timeline */
+    void TimelineRegister(ConnectTimeline *timeline);
+
     bool GetConnectStatus();
 
     USBCommuniErrors_t SendData(const char *data, uint32_t data_size, uint32_t &send_bytes);
 
+    USBCommuniErrors_t SendBatch(const struct iovec *iov, uint32_t iovcnt, USBCommuniErrors_t *results);
+
+    /* no bulk OUT transfer in flight and nothing coalescing */
+    bool SendIdle();
+
+    /* called on the event thread when the last OUT transfer in flight completes */
+    void SendIdleRegister(std::function<void()> idlecb);
+
     void RecvHandleRegister(USBCommuniRecvHandleCb recvcb);
 
+    /**
+     * Receives the interrupt IN pipe, one call per transfer. Messages keep
+     * their boundaries but are not ordered against the bulk stream.
+     */
+    void IntRecvHandleRegister(USBCommuniRecvHandleCb recvcb);
+
     void SetEventInfo(libusb_hotplug_event event, libusb_device *device);
 
+    /* SetEventInfo() with the descriptors already read, e.g. a mock's device */
+    void SetDeviceInfo(libusb_hotplug_event event, const USBDeviceAttr_t &attr);
+
+    /* before Init(), see USBTransferOps_t */
+    void TransferOpsRegister(const USBTransferOps_t &ops);
+
+    void RecvTransferDone(libusb_transfer *transfer);
+    void SendTransferDone(libusb_transfer *transfer);
+    void IntRecvTransferDone(libusb_transfer *transfer);
+    void IntSendTransferDone(libusb_transfer *transfer);
+
+    /* a failed send is resubmitted in place, false if it is done with */
+    bool RetrySend(libusb_transfer *transfer);
+
+    /* Android only, see config.android_recover_retries */
+    void GetRecoveryStats(USBCommuniRecoveryStats_t &stats);
+
+    /* event thread, sends the coalesced data, with @due_only only once its delay ran out */
+    void SendCoalesced(bool due_only);
+
+    /* drop and reopen the accessory, e.g. when the peer stopped answering */
+    void Reconnect();
+
+    /* config.external_loop, libusb's fds in one epoll fd and the threads' work in ProcessEvents() */
+    int GetPollFd();
+    uint32_t GetTimeout();
+    void ProcessEvents();
+
+    /* libusb pollfd notifiers */
+    void PollfdAdded(int fd, short events);
+    void PollfdRemoved(int fd);
+
 public:
     USBCommuniRecvHandleCb recv_handle_;
+    USBCommuniRecvHandleCb int_recv_handle_;
+    std::function<void()> send_idle_handle_;
 
 private:
     void LoopThreadHandler();
     void OpenThreadHandler();
+    uint32_t OpenStep();
+    USBCommuniErrors_t OpenPollFd();
+    void ClosePollFd();
+    void SetConnectStatus(bool status);
+    bool WaitExit(uint32_t timeout_ms);
+    void CancelTransfers();
+    bool ReapTransfers(std::unique_lock<std::mutex> &lock, const std::function<bool()> &done);
+    void DrainTransfers(std::set<libusb_transfer*> &transfers);
+    void RequestRecovery(uint32_t actions);
+    void Recover();
+    void RecoveryDone();
     USBCommuniErrors_t OpenUsbDevice();
     void CloseUsbDevice();
     USBCommuniErrors_t SetupUsbToAccessory();
@@ -83,23 +183,89 @@ private:
     void CloseAccessoryDevice();
     USBCommuniErrors_t UsbSendCtrl(const char *buff, int req, int index);
     USBCommuniErrors_t ConfigAsyncRead();
+    USBCommuniErrors_t QueueSendTransfer(const struct iovec *iov, uint32_t iovcnt, uint32_t bytes);
+    USBCommuniErrors_t FlushCoalesced(AutotuneFlushes why);
+    void CoalesceTimeout(struct timeval &tv);
+    USBCommuniErrors_t SubmitSendTransfer(const struct iovec *iov, uint32_t iovcnt, uint32_t bytes);
+    USBCommuniErrors_t SubmitRecvTransfer(libusb_device_handle *handle, uint8_t ep_in, uint32_t size);
+    USBCommuniErrors_t ConfigInterrupt();
+    void FreeInterrupt();
+    bool IntRoute(uint32_t len);
+    bool SubmitIntSend(const char *data, uint32_t len);
+    USBCommuniErrors_t SubmitIntRecv(libusb_device_handle *handle, uint8_t ep_in, uint32_t size);
 
 private:
     struct USBGadgetAccessoryInfo gadgetacci_;
+    USBCommuniConfig_t config_;
+    Autotuner tuner_;                   /**< receive half on the event thread, send half under attr_mutex_ */
     libusb_context* context_;
     libusb_hotplug_callback_handle hotplug_handle_;
-    libusb_hotplug_event event_;
     std::thread loop_thread_;
     std::thread open_thread_;
-    USBDeviceId curr_id_;
     USBDeviceId last_id_;
+    std::atomic<bool> connect_status_;
+    std::atomic<bool> exit_enable_;
+    std::atomic<bool> loop_thead_exist_;
+    std::atomic<bool> reconnect_;
+    std::mutex exit_mutex_;
+    std::condition_variable exit_cond_;
+    USBCommuniEventCb event_handle_;
+    ConnectTimeline *timeline_;
+    bool keep_alive_;                           /**< open thread, wait before switching a phone just seen */
+
+    /* config.external_loop */
+    int poll_fd_;
+    std::chrono::steady_clock::time_point open_due_;
+
+    /* transfers in flight, reaped by the event thread on Deinit() */
+    std::mutex transfer_mutex_;
+    std::condition_variable transfer_cond_;
+    std::set<libusb_transfer*> recv_transfers_;
+    std::set<libusb_transfer*> send_transfers_;
+
+    /* interrupt pair, OUT transfers are preallocated and recycled */
+    std::vector<libusb_transfer*> int_free_;
+    std::set<libusb_transfer*> int_busy_;
+    std::set<libusb_transfer*> int_recv_;
+    uint32_t int_buffer_size_;
+    std::atomic<bool> int_active_;
+
+    /* written by the hotplug callback, guarded by attr_mutex_ */
+    std::mutex attr_mutex_;
+    libusb_hotplug_event event_;
+    USBDeviceId curr_id_;
     USBAndroidDeviceTypes_t device_type_;
-    bool connect_status_;
-    bool exit_enable_;
-    bool loop_thead_exist_;
     USBDeviceAttr_t phone_;
     USBDeviceAttr_t google_;
-    USBCommuniEventCb event_handle_;
+
+    /* sends collected while a bulk OUT transfer is in flight, guarded by attr_mutex_ */
+    std::vector<char> coalesce_;
+    std::chrono::steady_clock::time_point coalesce_deadline_;
+
+    /* sends up to this size take the interrupt pipe, 0 none, guarded by attr_mutex_ */
+    uint32_t int_max_bytes_;
+    bool int_claimed_;                          /**< the interrupt pair has an interface of its own */
+
+    /* libusb or a mock, set before Init() */
+    USBTransferOps_t ops_;
+
+    /* faults seen by transfer callbacks, recovered by the open thread */
+    std::atomic<uint32_t> recover_;
+    std::atomic<uint32_t> errors_;              /**< failed transfers since the last completed one */
+    std::atomic<bool> progress_;                /**< a transfer completed since the last rebuild */
+    std::atomic<bool> recv_hold_;               /**< completed reads are not resubmitted */
+    std::atomic<uint64_t> recover_since_us_;    /**< first unrecovered fault, 0 none */
+    bool rebuilt_;
+    std::atomic<uint64_t> transfer_errors_;
+    std::atomic<uint64_t> stalls_;
+    std::atomic<uint64_t> resubmits_;
+    std::atomic<uint64_t> send_drops_;
+    std::atomic<uint64_t> halts_cleared_;
+    std::atomic<uint64_t> rebuilds_;
+    std::atomic<uint64_t> reopens_;
+    std::atomic<uint64_t> recoveries_;
+    std::atomic<uint64_t> recovery_us_total_;
+    std::atomic<uint64_t> recovery_us_max_;
 };
 
 }
@@ -0,0 +1,171 @@
+#include "autotuner.h"
+#include <time.h>
+
+namespace usbcommuni {
+
+#define WINDOW_SAMPLES      64
+#define WINDOW_US           (250*1000)
+#define DENSE_RATE          2000    /**< reads per second worth another read in flight */
+#define SPARSE_RATE         100     /**< reads per second below which one read is dropped */
+#define COALESCE_GROWTH     4       /**< the byte limit grows up to this many times the configured one */
+#define COALESCE_SHRINK     8       /**< the delay shrinks down to the configured one over this */
+
+static uint64_t MonotonicUs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
+}
+
+static uint32_t RoundUpPow2(uint32_t v)
+{
+    uint32_t r = 1;
+
+    while ((r < v) && (r < 0x80000000u))
+        r <<= 1;
+
+    return r;
+}
+
+Autotuner::Autotuner()
+{
+    USBCommuniConfig_t config;
+
+    Reset(config, config.android_recv_buffer_size, config.android_recv_transfers);
+    ResetSend(config);
+}
+
+void Autotuner::Reset(const USBCommuniConfig_t &config, uint32_t buffer_size, uint32_t transfers)
+{
+    min_buffer_ = config.autotune_min_buffer;
+    max_buffer_ = (config.autotune_max_buffer < min_buffer_) ? min_buffer_ : config.autotune_max_buffer;
+    max_transfers_ = (config.autotune_max_transfers == 0) ? 1 : config.autotune_max_transfers;
+
+    buffer_size_ = buffer_size;
+    transfers_ = (transfers == 0) ? 1 : transfers;
+
+    window_start_us_ = MonotonicUs();
+    samples_ = 0;
+    full_samples_ = 0;
+    max_bytes_ = 0;
+}
+
+void Autotuner::RecordRecv(uint32_t bytes, uint32_t capacity)
+{
+    uint64_t now_us;
+
+    samples_++;
+    if (bytes >= capacity)
+        full_samples_++;
+    if (bytes > max_bytes_)
+        max_bytes_ = bytes;
+
+    if (samples_ < WINDOW_SAMPLES) {
+        now_us = MonotonicUs();
+        if (now_us - window_start_us_ < WINDOW_US)
+            return;
+    } else {
+        now_us = MonotonicUs();
+    }
+
+    Evaluate(now_us - window_start_us_);
+
+    window_start_us_ = now_us;
+    samples_ = 0;
+    full_samples_ = 0;
+    max_bytes_ = 0;
+}
+
+void Autotuner::Evaluate(uint64_t elapsed_us)
+{
+    uint64_t rate;
+
+    if (elapsed_us == 0)
+        elapsed_us = 1;
+
+    rate = (uint64_t)samples_ * 1000000u / elapsed_us;
+
+    /* buffer size: grow while reads fill the buffer, shrink to 2x the largest read */
+    if (full_samples_ * 4 > samples_) {
+        if (buffer_size_ < max_buffer_)
+            buffer_size_ = (buffer_size_ * 2 > max_buffer_) ? max_buffer_ : buffer_size_ * 2;
+    } else if ((uint64_t)max_bytes_ * 4 < buffer_size_) {
+        buffer_size_ = RoundUpPow2(max_bytes_ * 2);
+        if (buffer_size_ < min_buffer_)
+            buffer_size_ = min_buffer_;
+    }
+
+    /* reads in flight: hide the resubmit gap when completions are dense */
+    if ((rate > DENSE_RATE) || ((full_samples_ * 2 > samples_) && (buffer_size_ >= max_buffer_))) {
+        if (transfers_ < max_transfers_)
+            transfers_++;
+    } else if ((rate < SPARSE_RATE) && (transfers_ > 1)) {
+        transfers_--;
+    }
+}
+
+void Autotuner::ResetSend(const USBCommuniConfig_t &config)
+{
+    min_coalesce_bytes_ = config.send_coalesce_max_bytes;
+    max_coalesce_bytes_ = config.send_coalesce_max_bytes * COALESCE_GROWTH;
+    min_coalesce_delay_us_ = config.send_coalesce_delay_us / COALESCE_SHRINK;
+    max_coalesce_delay_us_ = config.send_coalesce_delay_us;
+
+    coalesce_bytes_ = min_coalesce_bytes_;
+    coalesce_delay_us_ = max_coalesce_delay_us_;
+
+    flush_start_us_ = MonotonicUs();
+    flushes_ = 0;
+    full_flushes_ = 0;
+    due_flushes_ = 0;
+    in_flight_total_ = 0;
+    max_flush_ = 0;
+}
+
+void Autotuner::RecordFlush(uint32_t bytes, uint32_t in_flight, AutotuneFlushes why)
+{
+    uint64_t now_us;
+
+    flushes_++;
+    full_flushes_ += (why == AUTOTUNE_FLUSH_FULL);
+    due_flushes_ += (why == AUTOTUNE_FLUSH_DUE);
+    in_flight_total_ += in_flight;
+    if (bytes > max_flush_)
+        max_flush_ = bytes;
+
+    now_us = MonotonicUs();
+    if ((flushes_ < WINDOW_SAMPLES) && (now_us - flush_start_us_ < WINDOW_US))
+        return;
+
+    EvaluateSend();
+
+    flush_start_us_ = now_us;
+    flushes_ = 0;
+    full_flushes_ = 0;
+    due_flushes_ = 0;
+    in_flight_total_ = 0;
+    max_flush_ = 0;
+}
+
+void Autotuner::EvaluateSend()
+{
+    /* byte limit: cut batches with two or more sends queued ahead mean the pipe is the bottleneck */
+    if ((full_flushes_ * 4 > flushes_) && (in_flight_total_ >= 2ull * flushes_)) {
+        coalesce_bytes_ = (coalesce_bytes_ * 2 > max_coalesce_bytes_) ? max_coalesce_bytes_ : coalesce_bytes_ * 2;
+    } else if ((full_flushes_ == 0) && ((uint64_t)max_flush_ * 4 < coalesce_bytes_)) {
+        coalesce_bytes_ = RoundUpPow2(max_flush_ * 2);
+        if (coalesce_bytes_ < min_coalesce_bytes_)
+            coalesce_bytes_ = min_coalesce_bytes_;
+    }
+
+    /* delay: running out on small batches it only held them back, on large ones it paid */
+    if ((due_flushes_ * 2 > flushes_) && ((uint64_t)max_flush_ * 8 < coalesce_bytes_)) {
+        coalesce_delay_us_ = (coalesce_delay_us_ / 2 < min_coalesce_delay_us_) ? min_coalesce_delay_us_ : coalesce_delay_us_ / 2;
+    } else if ((due_flushes_ > 0) && ((uint64_t)max_flush_ * 2 >= coalesce_bytes_)) {
+        coalesce_delay_us_ = (coalesce_delay_us_ * 2 > max_coalesce_delay_us_) ? max_coalesce_delay_us_ : coalesce_delay_us_ * 2;
+    }
+}
+
+}
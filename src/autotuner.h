@@ -0,0 +1,97 @@
+#ifndef AUTOTUNER_H_
+#define AUTOTUNER_H_
+
+#include <stdint.h>
+#include "commondef.h"
+
+namespace usbcommuni {
+
+/* why a batch of coalesced sends went out */
+enum AutotuneFlushes {
+    AUTOTUNE_FLUSH_DRAINED = 0,     /**< the send ahead of it completed */
+    AUTOTUNE_FLUSH_FULL,            /**< CoalesceMaxBytes() pending */
+    AUTOTUNE_FLUSH_DUE,             /**< CoalesceDelayUs() ran out */
+};
+
+/**
+ * Receive and send side autotuner.
+ *
+ * Fed with every completed read, it evaluates a window of samples and
+ * recommends the receive buffer size and the number of reads to keep in
+ * flight: buffers grow while reads keep filling them and shrink to twice
+ * the largest read seen, extra reads are queued while completions are
+ * dense and dropped again when the link is quiet.
+ *
+ * Fed with every batch of coalesced sends, it watches how many sends
+ * were queued ahead of each and tunes the coalescing: batches cut at the
+ * byte limit while sends pile up raise the limit, up to 4x
+ * send_coalesce_max_bytes, so the pipe takes fewer larger transfers. A
+ * delay that runs out on small batches only adds latency and is halved,
+ * down to 1/8 of send_coalesce_delay_us, and it is given back while it
+ * fills batches.
+ *
+ * Not thread safe. Each backend feeds the receive half from its single
+ * receive context and the send half under its send lock, the halves
+ * share no state.
+ */
+class Autotuner
+{
+public:
+    Autotuner();
+
+    void Reset(const USBCommuniConfig_t &config, uint32_t buffer_size, uint32_t transfers);
+
+    /* one completed read of @bytes into a buffer of @capacity */
+    void RecordRecv(uint32_t bytes, uint32_t capacity);
+
+    uint32_t RecvBufferSize() const { return buffer_size_; }
+    uint32_t RecvTransfers() const { return transfers_; }
+
+    /* the send half back to config.send_coalesce_max_bytes and send_coalesce_delay_us */
+    void ResetSend(const USBCommuniConfig_t &config);
+
+    /* a batch of @bytes went out for @why, with @in_flight sends queued ahead of it */
+    void RecordFlush(uint32_t bytes, uint32_t in_flight, AutotuneFlushes why);
+
+    uint32_t CoalesceMaxBytes() const { return coalesce_bytes_; }
+    uint32_t CoalesceDelayUs() const { return coalesce_delay_us_; }
+
+private:
+    void Evaluate(uint64_t elapsed_us);
+    void EvaluateSend();
+
+private:
+    uint32_t min_buffer_;
+    uint32_t max_buffer_;
+    uint32_t max_transfers_;
+
+    uint32_t buffer_size_;
+    uint32_t transfers_;
+
+    /* current evaluation window */
+    uint64_t window_start_us_;
+    uint32_t samples_;
+    uint32_t full_samples_;
+    uint32_t max_bytes_;
+
+    /* send half */
+    uint32_t min_coalesce_bytes_;
+    uint32_t max_coalesce_bytes_;
+    uint32_t min_coalesce_delay_us_;
+    uint32_t max_coalesce_delay_us_;
+
+    uint32_t coalesce_bytes_;
+    uint32_t coalesce_delay_us_;
+
+    /* current send window */
+    uint64_t flush_start_us_;
+    uint32_t flushes_;
+    uint32_t full_flushes_;
+    uint32_t due_flushes_;
+    uint64_t in_flight_total_;
+    uint32_t max_flush_;
+};
+
+}
+
+#endif /* AUTOTUNER_H_ */
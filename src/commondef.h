@@ -1,7 +1,10 @@
 #ifndef USB_COMMONDEF_H_
 #define USB_COMMONDEF_H_
 
+#include <stdint.h>
+#include <sys/uio.h>
 #include <functional>
+#include <string>
 
 namespace usbcommuni {
 
@@ -18,18 +21,271 @@ typedef enum USBCommuniErrors {
     USBCOMMUNI_E_NOT_CONN   = -3,
     USBCOMMUNI_E_VERSION    = -4,
     USBCOMMUNI_E_UNKNOWN    = -5,
-    USBCOMMUNI_E_NMEN       = -6
+    USBCOMMUNI_E_NMEN       = -6,
+    USBCOMMUNI_E_TIMEOUT    = -7,
+    USBCOMMUNI_E_CIPHER     = -8
 } USBCommuniErrors_t;
 
 typedef enum USBCommuniEventTypes {
     USBCOMMUNI_DEVICE_NONE = 0,     /**< device none occur */
     USBCOMMUNI_DEVICE_ADD,          /**< device was add */
     USBCOMMUNI_DEVICE_REMOVE,       /**< device was remove */
-    USBCOMMUNI_DEVICE_PAIRED        /**< device completed pairing process */
+    USBCOMMUNI_DEVICE_PAIRED,       /**< device completed pairing process */
+    USBCOMMUNI_DEVICE_CONNECTED,    /**< link to the phone app is ready */
+    USBCOMMUNI_DEVICE_DISCONNECTED  /**< link to the phone app was lost */
 } USBCommuniEventTypes_t;
 
+typedef enum USBCommuniConnectStates {
+    USBCOMMUNI_STATE_IDLE = 0,      /**< no device attached */
+    USBCOMMUNI_STATE_ATTACHED,      /**< device attached, link not ready */
+    USBCOMMUNI_STATE_CONNECTED      /**< link ready for data */
+} USBCommuniConnectStates_t;
+
+typedef enum USBCommuniConnectStages {
+    USBCOMMUNI_STAGE_PLUGGED = 0,   /**< hotplug or usbmuxd event of the device */
+    USBCOMMUNI_STAGE_SWITCHED,      /**< Android: accessory mode requested, re-enumeration follows */
+    USBCOMMUNI_STAGE_ENUMERATED,    /**< Android: the accessory showed up */
+    USBCOMMUNI_STAGE_OPENED,        /**< accessory opened, Peertalk port connected on iOS */
+    USBCOMMUNI_STAGE_READY,         /**< reported connected */
+    USBCOMMUNI_STAGE_FIRST_BYTE,    /**< first data received */
+    USBCOMMUNI_STAGES,
+} USBCommuniConnectStages_t;
+
+typedef struct USBCommuniConnectTimeline {
+    uint64_t stage_us[USBCOMMUNI_STAGES];   /**< steady clock microseconds, 0 not reached */
+} USBCommuniConnectTimeline_t;
+
+#define USBCOMMUNI_WAIT_FOREVER 0xFFFFFFFFu
+
+/* link channel ids are one byte */
+#define USBCOMMUNI_CHANNELS 256
+
+#define USBMUXD_DEFAUL_PORT 12345
+#define QUEUE_DEFAULT_SIZE  10000
+#define SENDBUFFER_SIZE     65536
+#define RECVBUFFER_SIZE     65536
+#define ANDROID_RECVBUFFER_SIZE (1024*1024*2)
+
+typedef struct USBCommuniConfig {
+    /* IOS (usbmuxd / Peertalk) */
+    uint16_t ios_port;                  /**< port the phone app listens on */
+    uint32_t ios_queue_size;            /**< max messages waiting for the send thread */
+    uint32_t ios_send_buffer_size;      /**< max message size, framing included */
+    uint32_t ios_recv_buffer_size;      /**< initial receive buffer size */
+    uint32_t ios_recv_timeout_ms;       /**< receive poll timeout, bounds Stop() latency */
+    uint32_t ios_connect_retry_min_ms;  /**< first delay between idevice_connect attempts */
+    uint32_t ios_connect_retry_ms;      /**< the delay doubles up to this cap */
+
+    /* Android (AOA over libusb) */
+    uint32_t android_recv_buffer_size;  /**< initial size of one bulk IN transfer */
+    uint32_t android_recv_transfers;    /**< initial bulk IN transfers kept in flight */
+    uint32_t android_send_timeout_ms;   /**< bulk OUT transfer timeout */
+    uint32_t android_poll_ms;           /**< open thread idle poll interval */
+    uint32_t android_retry_ms;          /**< delay after a failed open */
+    uint32_t android_switch_delay_ms;   /**< settle time before the accessory switch */
+    bool android_int_enable;            /**< send small messages over the interrupt pair if the accessory has one */
+    uint32_t android_int_max_bytes;     /**< largest send taking the interrupt pipe, capped at its packet size */
+    uint32_t android_int_transfers;     /**< preallocated interrupt OUT transfers */
+    uint32_t android_recover_retries;   /**< failed transfers in a row retried in place before recovering */
+
+    uint32_t send_batch_max_bytes;      /**< max bytes SendBatch() packs into one transfer */
+    uint32_t latest_max_keys;           /**< distinct keys SendLatest() holds back while the pipe is busy */
+    uint32_t deadline_max_msgs;         /**< sends with a TTL held back while the pipe is busy */
+
+    /* send coalescing, small sends share a transfer while the previous one is in flight */
+    bool send_coalesce;
+    uint32_t send_coalesce_delay_us;    /**< max time a send waits for a busy pipe (Android) */
+    uint32_t send_coalesce_max_bytes;   /**< pending bytes that force a flush */
+
+    /* link framing, see link/link_layer.h, the phone app must speak it too */
+    bool link_enable;
+    uint32_t link_max_payload;          /**< larger frames are treated as garbage */
+    uint32_t link_credit_window;        /**< credit flow control window in bytes, 0 off */
+    uint32_t link_credit_timeout_ms;    /**< max time a sender blocks without credit */
+    bool link_crc;                      /**< append a CRC32C trailer to every frame sent */
+    uint32_t heartbeat_interval_ms;     /**< PING interval while connected, 0 off */
+    uint32_t heartbeat_miss_limit;      /**< unanswered PINGs before the link is reconnected */
+    bool link_reliable;                 /**< sequence, acknowledge and resend DATA across reconnects */
+    uint32_t link_reliable_window;      /**< max unacknowledged payload bytes kept for resending */
+    bool link_encrypt;                  /**< seal every frame with AES-256-GCM, see link/link_cipher.h */
+    std::string link_key;               /**< secret shared with the phone app, session keys derive from it */
+
+    /* send rate cap of the whole link, channels via USBCommuni::SetChannelRateLimit() */
+    uint64_t rate_limit_bps;            /**< bytes per second, 0 off */
+    uint32_t rate_limit_burst;          /**< bytes saved up while idle, 0 picks 100 ms worth */
+    uint32_t rate_limit_timeout_ms;     /**< max time a sender waits for tokens */
+
+    /* shared memory fan-out of received frames, see shm/shm_ring.h */
+    bool shm_enable;
+    std::string shm_socket_path;        /**< Unix socket handing out the ring to readers */
+    uint32_t shm_ring_size;             /**< ring bytes, rounded up to a power of two */
+
+    /* latency mode, see realtime.h */
+    bool latency_mode;
+    int latency_priority;               /**< SCHED_FIFO priority of the I/O threads, 0 keeps the policy */
+    int latency_event_cpu;              /**< core of the libusb event thread, -1 any */
+    int latency_io_cpu;                 /**< core of the iOS receive/send threads, -1 any */
+    bool latency_mlock;                 /**< lock transfer buffers in RAM */
+    bool latency_busy_poll;             /**< spin on libusb events, give the event thread its own core */
+
+    /* receive buffers and send coalescing tuned to the traffic, see autotuner.h */
+    bool autotune;
+    uint32_t autotune_min_buffer;
+    uint32_t autotune_max_buffer;
+    uint32_t autotune_max_transfers;
+
+    /**
+     * No worker threads, the application's loop drives the library through
+     * USBCommuni::GetPollFd(), GetTimeout() and ProcessEvents(). Blocking
+     * calls such as WaitForConnect() must not run on that loop, credit and
+     * rate waits return USBCOMMUNI_E_TIMEOUT right away instead of blocking.
+     */
+    bool external_loop;
+
+    USBCommuniConfig() {
+        ios_port = USBMUXD_DEFAUL_PORT;
+        ios_queue_size = QUEUE_DEFAULT_SIZE;
+        ios_send_buffer_size = SENDBUFFER_SIZE;
+        ios_recv_buffer_size = RECVBUFFER_SIZE;
+        ios_recv_timeout_ms = 200;
+        ios_connect_retry_min_ms = 20;
+        ios_connect_retry_ms = 1000;
+
+        android_recv_buffer_size = ANDROID_RECVBUFFER_SIZE;
+        android_recv_transfers = 1;
+        android_send_timeout_ms = 1000;
+        android_poll_ms = 200;
+        android_retry_ms = 1000;
+        android_switch_delay_ms = 2000;
+        android_int_enable = false;
+        android_int_max_bytes = 64;
+        android_int_transfers = 8;
+        android_recover_retries = 3;
+
+        send_batch_max_bytes = 65536;
+        latest_max_keys = 64;
+        deadline_max_msgs = 1024;
+
+        send_coalesce = false;
+        send_coalesce_delay_us = 1000;
+        send_coalesce_max_bytes = 16384;
+
+        link_enable = false;
+        link_max_payload = ANDROID_RECVBUFFER_SIZE;
+        link_credit_window = 0;
+        link_credit_timeout_ms = 1000;
+        link_crc = false;
+        heartbeat_interval_ms = 0;
+        heartbeat_miss_limit = 3;
+        link_reliable = false;
+        link_reliable_window = 1024*1024;
+        link_encrypt = false;
+
+        rate_limit_bps = 0;
+        rate_limit_burst = 0;
+        rate_limit_timeout_ms = 1000;
+
+        shm_enable = false;
+        shm_socket_path = "/tmp/usbcommuni-rx.sock";
+        shm_ring_size = 4*1024*1024;
+
+        latency_mode = false;
+        latency_priority = 50;
+        latency_event_cpu = -1;
+        latency_io_cpu = -1;
+        latency_mlock = true;
+        latency_busy_poll = false;
+
+        autotune = false;
+        autotune_min_buffer = 4096;
+        autotune_max_buffer = ANDROID_RECVBUFFER_SIZE;
+        autotune_max_transfers = 8;
+
+        external_loop = false;
+    }
+} USBCommuniConfig_t;
+
+typedef struct USBCommuniLinkStats {
+    uint64_t tx_frames;
+    uint64_t rx_frames;
+    uint64_t rx_resync_bytes;           /**< garbage skipped between frames */
+    uint64_t rx_crc_errors;             /**< frames dropped for a bad CRC32C trailer */
+    uint64_t credit_blocked_count;      /**< sends that had to wait for credit */
+    uint64_t credit_blocked_us;         /**< total time spent waiting for credit */
+    uint64_t credit_timeouts;
+    uint64_t credit_grants_sent;
+    uint64_t credit_grants_received;
+    uint64_t resumes;                   /**< session handshakes completed after a connect */
+    uint64_t session_restarts;          /**< the peer came back with a new session, its old state is gone */
+    uint64_t resent_frames;             /**< DATA frames sent from the resend buffer */
+    uint64_t rx_duplicates;             /**< DATA frames dropped as already delivered */
+    uint64_t rx_gaps;                   /**< DATA frames dropped after a lost one */
+    uint64_t unacked_bytes;             /**< payload waiting for an ACK right now */
+    uint64_t rate_blocked_count;        /**< sends that had to wait for rate tokens */
+    uint64_t rate_blocked_us;           /**< total time spent waiting for tokens */
+    uint64_t rate_timeouts;
+    uint64_t rx_auth_failures;          /**< frames dropped as not sealed with the session key, or replayed */
+    uint64_t tx_seal_failures;          /**< frames not sent, sealing them failed */
+    uint64_t tx_expired;                /**< DATA frames with a TTL dropped from the resend buffer once late */
+} USBCommuniLinkStats_t;
+
+#define USBCOMMUNI_RTT_BUCKETS 16
+
+typedef struct USBCommuniRttStats {
+    uint64_t pings_sent;
+    uint64_t pongs_received;
+    uint64_t stalls;                    /**< reconnects after heartbeat_miss_limit lost PONGs */
+    uint32_t last_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint64_t sum_us;                    /**< sum_us / pongs_received is the mean */
+    /* buckets[0] counts RTTs below 64us, buckets[i] [32us << i, 64us << i), the last the rest */
+    uint64_t buckets[USBCOMMUNI_RTT_BUCKETS];
+} USBCommuniRttStats_t;
+
+typedef struct USBCommuniShmStats {
+    uint64_t published_frames;
+    uint64_t published_bytes;
+    uint64_t oversize_drops;            /**< frames larger than half the ring */
+    uint32_t consumers;
+    uint32_t slow_consumers;            /**< more than half a ring behind */
+    uint64_t consumer_overruns;         /**< times readers lost a lap, summed */
+} USBCommuniShmStats_t;
+
+typedef struct USBCommuniRecoveryStats {
+    uint64_t transfer_errors;           /**< failed bulk transfers, cancellations aside */
+    uint64_t stalls;                    /**< transfers ended by a halted endpoint */
+    uint64_t resubmits;                 /**< failures retried in place */
+    uint64_t send_drops;                /**< bulk OUT transfers lost to a fault, each forces a reopen */
+    uint64_t halts_cleared;
+    uint64_t rebuilds;                  /**< read rings drained and submitted again */
+    uint64_t reopens;                   /**< recoveries escalated to reopening the accessory */
+    uint64_t recoveries;                /**< faults recovered, counted once the link works again */
+    uint64_t recovery_us_total;         /**< fault to recovered, summed */
+    uint64_t recovery_us_max;
+} USBCommuniRecoveryStats_t;
+
+typedef struct USBCommuniLatestStats {
+    uint64_t puts;                      /**< values accepted by SendLatest() */
+    uint64_t replaced;                  /**< held back values overwritten by a newer one */
+    uint64_t sent;                      /**< values handed to the backend */
+    uint64_t failed;                    /**< refused by the backend, not retried */
+    uint64_t rejected;                  /**< new keys refused with latest_max_keys held back */
+} USBCommuniLatestStats_t;
+
+typedef struct USBCommuniDeadlineStats {
+    uint64_t queued;                    /**< sends with a TTL accepted */
+    uint64_t sent;                      /**< handed to the backend in time */
+    uint64_t failed;                    /**< refused by the backend, not retried */
+    uint64_t expired;                   /**< dropped unsent past their deadline */
+    uint64_t rejected;                  /**< refused with deadline_max_msgs held back */
+    uint64_t discarded;                 /**< held back at a disconnect */
+    uint64_t channel_expired[USBCOMMUNI_CHANNELS];  /**< expired by link channel, 0 without link framing */
+} USBCommuniDeadlineStats_t;
+
 typedef std::function<void (USBCommuniEventTypes_t)> USBCommuniEventCb;
 typedef std::function<void (const char *data, uint32_t datal)> USBCommuniRecvHandleCb;
+typedef std::function<void (USBCommuniConnectStates_t state, uint64_t epoch)> USBCommuniStateCb;
 
 }
 
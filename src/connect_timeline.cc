@@ -0,0 +1,38 @@
+#include "connect_timeline.h"
+#include <chrono>
+
+namespace usbcommuni {
+
+ConnectTimeline::ConnectTimeline()
+{
+    for (uint32_t i = 0; i < USBCOMMUNI_STAGES; i++)
+        stage_us_[i] = 0;
+}
+
+void ConnectTimeline::Mark(USBCommuniConnectStages_t stage)
+{
+    uint64_t none = 0;
+    uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    if (stage == USBCOMMUNI_STAGE_PLUGGED) {
+        for (uint32_t i = 1; i < USBCOMMUNI_STAGES; i++)
+            stage_us_[i] = 0;
+        stage_us_[stage] = now;
+        return;
+    }
+
+    /* no plug event seen, e.g. the accessory was present at Start() */
+    stage_us_[USBCOMMUNI_STAGE_PLUGGED].compare_exchange_strong(none, now);
+
+    none = 0;
+    stage_us_[stage].compare_exchange_strong(none, now);
+}
+
+void ConnectTimeline::Get(USBCommuniConnectTimeline_t &timeline) const
+{
+    for (uint32_t i = 0; i < USBCOMMUNI_STAGES; i++)
+        timeline.stage_us[i] = stage_us_[i];
+}
+
+}
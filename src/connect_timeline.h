@@ -0,0 +1,31 @@
+#ifndef CONNECT_TIMELINE_H_
+#define CONNECT_TIMELINE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include "commondef.h"
+
+namespace usbcommuni {
+
+/**
+ * Steady clock time of each stage from plugging the device in to its
+ * first received byte. A PLUGGED mark starts a new timeline, the other
+ * stages keep the first time they are reached. Marked by the backend
+ * threads, read by anyone.
+ */
+class ConnectTimeline
+{
+public:
+    ConnectTimeline();
+
+    void Mark(USBCommuniConnectStages_t stage);
+    bool Reached(USBCommuniConnectStages_t stage) const { return stage_us_[stage] != 0; }
+    void Get(USBCommuniConnectTimeline_t &timeline) const;
+
+private:
+    std::atomic<uint64_t> stage_us_[USBCOMMUNI_STAGES];
+};
+
+}
+
+#endif /* CONNECT_TIMELINE_H_ */
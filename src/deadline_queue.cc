@@ -0,0 +1,144 @@
+#include "deadline_queue.h"
+#include <algorithm>
+
+namespace usbcommuni {
+
+DeadlineQueue::DeadlineQueue()
+{
+    max_msgs_ = 1024;
+    held_ = 0;
+    queued_ = 0;
+    sent_ = 0;
+    failed_ = 0;
+    expired_ = 0;
+    rejected_ = 0;
+    discarded_ = 0;
+
+    for (uint32_t i = 0; i < USBCOMMUNI_CHANNELS; i++)
+        channel_expired_[i] = 0;
+}
+
+void DeadlineQueue::SetMaxMessages(uint32_t max_msgs)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    max_msgs_ = max_msgs;
+    queue_.clear();
+    held_ = 0;
+}
+
+/* mutex_ held by the caller */
+void DeadlineQueue::DropExpired(std::chrono::steady_clock::time_point now)
+{
+    auto expired = [this, now](const DeadlineMsg_t &msg) {
+        if (msg.deadline > now)
+            return false;
+        expired_++;
+        channel_expired_[msg.channel]++;
+        return true;
+    };
+
+    queue_.erase(std::remove_if(queue_.begin(), queue_.end(), expired), queue_.end());
+    held_ = queue_.size();
+}
+
+bool DeadlineQueue::Push(uint8_t channel, const char *data, uint32_t len, std::chrono::steady_clock::time_point deadline)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    /* a stalled pipe fills up with messages nobody wants anymore, make room from those first */
+    if (queue_.size() >= max_msgs_)
+        DropExpired(std::chrono::steady_clock::now());
+
+    if (queue_.size() >= max_msgs_) {
+        rejected_++;
+        return false;
+    }
+
+    queue_.push_back(DeadlineMsg_t());
+    queue_.back().channel = channel;
+    queue_.back().data.assign(data, len);
+    queue_.back().deadline = deadline;
+    held_ = queue_.size();
+    queued_++;
+
+    return true;
+}
+
+void DeadlineQueue::Take(std::vector<DeadlineMsg_t> &msgs)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    msgs.clear();
+    DropExpired(std::chrono::steady_clock::now());
+
+    for (DeadlineMsg_t &msg : queue_)
+        msgs.push_back(std::move(msg));
+
+    queue_.clear();
+    held_ = 0;
+}
+
+void DeadlineQueue::PutBack(std::vector<DeadlineMsg_t> &msgs)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    /* may go past max_msgs_ for a round, these were held before */
+    for (auto it = msgs.rbegin(); it != msgs.rend(); ++it)
+        queue_.push_front(std::move(*it));
+
+    msgs.clear();
+    held_ = queue_.size();
+}
+
+void DeadlineQueue::Discard(std::vector<DeadlineMsg_t> &msgs)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    discarded_ += msgs.size();
+    msgs.clear();
+}
+
+void DeadlineQueue::Expire(const DeadlineMsg_t &msg)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    expired_++;
+    channel_expired_[msg.channel]++;
+}
+
+void DeadlineQueue::Report(USBCommuniErrors_t err)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (USBCOMMUNI_E_SUCCESS == err)
+        sent_++;
+    else
+        failed_++;
+}
+
+void DeadlineQueue::Clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    discarded_ += queue_.size();
+    queue_.clear();
+    held_ = 0;
+}
+
+void DeadlineQueue::GetStats(USBCommuniDeadlineStats_t &stats)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    stats.queued = queued_;
+    stats.sent = sent_;
+    stats.failed = failed_;
+    stats.expired = expired_;
+    stats.rejected = rejected_;
+    stats.discarded = discarded_;
+
+    for (uint32_t i = 0; i < USBCOMMUNI_CHANNELS; i++)
+        stats.channel_expired[i] = channel_expired_[i];
+}
+
+}
@@ -0,0 +1,79 @@
+#ifndef DEADLINE_QUEUE_H_
+#define DEADLINE_QUEUE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "commondef.h"
+
+namespace usbcommuni {
+
+typedef struct DeadlineMsg {
+    uint8_t channel;
+    std::string data;
+    std::chrono::steady_clock::time_point deadline;
+} DeadlineMsg_t;
+
+/**
+ * Sends with a TTL, held back in order while the pipe is busy, see
+ * USBCommuni::SendData(). Messages past their deadline are dropped when
+ * taken, before they are framed, so nothing late is ever handed to a
+ * backend and nothing is cut off mid write. Thread safe.
+ */
+class DeadlineQueue
+{
+public:
+    DeadlineQueue();
+
+    /* empties the queue */
+    void SetMaxMessages(uint32_t max_msgs);
+
+    /* false if max_msgs are held that are all still in time */
+    bool Push(uint8_t channel, const char *data, uint32_t len, std::chrono::steady_clock::time_point deadline);
+
+    /* drop the expired messages and move the rest to @msgs, in order */
+    void Take(std::vector<DeadlineMsg_t> &msgs);
+
+    /* hold @msgs again, ahead of what came in meanwhile, e.g. when the link ran out of credit */
+    void PutBack(std::vector<DeadlineMsg_t> &msgs);
+
+    /* drop taken @msgs after all, the link went down before they could be held again */
+    void Discard(std::vector<DeadlineMsg_t> &msgs);
+
+    /* a taken message turned late before it was framed */
+    void Expire(const DeadlineMsg_t &msg);
+
+    /* a taken message was handed to the backend, or failed with @err */
+    void Report(USBCommuniErrors_t err);
+
+    /* drop everything held, e.g. at a disconnect */
+    void Clear();
+    bool Empty() const { return held_ == 0; }
+
+    void GetStats(USBCommuniDeadlineStats_t &stats);
+
+private:
+    void DropExpired(std::chrono::steady_clock::time_point now);
+
+private:
+    std::mutex mutex_;
+    std::deque<DeadlineMsg_t> queue_;
+    uint32_t max_msgs_;
+    std::atomic<uint32_t> held_;
+
+    uint64_t queued_;
+    uint64_t sent_;
+    uint64_t failed_;
+    uint64_t expired_;
+    uint64_t rejected_;
+    uint64_t discarded_;
+    uint64_t channel_expired_[USBCOMMUNI_CHANNELS];
+};
+
+}
+
+#endif /* DEADLINE_QUEUE_H_ */
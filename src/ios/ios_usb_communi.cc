@@ -1,40 +1,79 @@
 #include "ios_usb_communi.h"
 #include <sys/eventfd.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <unistd.h>
 #include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "realtime.h"
 
 namespace usbcommuni {
 
+#define PEERTALK_HEAD_SIZE      20
+
+/* receives per ProcessEvents(), the rest stays readable for the next pass */
+#define EXTERNAL_RECV_BURST     16
+
 enum EeventSignalTypes {
     ESIG_NONE = 0,
     ESIG_SEND_USERDATA = 1,
-    ESIG_DEVICE_REMOVE = 2
+    ESIG_DEVICE_REMOVE = 2,
+    ESIG_DEVICE_EVENT = 3,      /**< usbmuxd event queued for ProcessEvents() */
 };
 
 struct MsgData {
     char *payload;
     uint32_t length;
+    bool framed;        /**< payload already carries Peertalk headers */
 };
 
 static USBCommuniErrors_t EventSignalSend(int efd, enum EeventSignalTypes val);
+static int EpollAdd(int epfd, int fd);
 static uint32_t PeertalkProtocolHeadPacket(char *msg, const char *user_data, uint32_t len);
+static int EpollAdd(int epfd, int fd)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static idevice_error_t ConnectionSendAll(idevice_connection_t connection, const char *data, uint32_t len);
 
 USBIosCommuni::USBIosCommuni(uint16_t port)
 {
+    config_.ios_port = port;
     port_ = port;
     efd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-    queue_ = new cclqueue::BlockingQueue(QUEUE_DEFAULT_SIZE);
-    sendbuffer = static_cast<char*>(malloc(SENDBUFFER_SIZE));
+    queue_ = new cclqueue::BlockingQueue(config_.ios_queue_size);
+    queue_size_ = config_.ios_queue_size;
+    sendbuffer = static_cast<char*>(malloc(config_.ios_send_buffer_size));
+    sendbuffer_size_ = config_.ios_send_buffer_size;
 
     device_ = nullptr;
+    connection_ = nullptr;
     found_device_ = false;
     event_handle_ = nullptr;
+    timeline_ = nullptr;
     connect_status_ = false;
+    reconnect_ = false;
+    connect_now_ = false;
+    poll_fd_ = -1;
+    conn_fd_ = -1;
+    retry_ms_ = 0;
+    queued_ = 0;
+    send_idle_handle_ = nullptr;
 }
 
 USBIosCommuni::~USBIosCommuni()
 {
+    Deinit();
+
     if (queue_) {
         queue_->Free();
         delete queue_;
@@ -54,22 +93,176 @@ USBCommuniErrors_t USBIosCommuni::Init()
             return USBCOMMUNI_E_IO;
     }
 
+    port_ = config_.ios_port;
+
+    /* stopped, nothing is queued or being sent */
+    if ((queue_ != nullptr) && (queue_size_ != config_.ios_queue_size)) {
+        queue_->Free();
+        delete queue_;
+        queue_ = nullptr;
+    }
+
     if (queue_ == nullptr) {
-        if ((queue_ = new cclqueue::BlockingQueue(QUEUE_DEFAULT_SIZE)) == nullptr)
+        if ((queue_ = new cclqueue::BlockingQueue(config_.ios_queue_size)) == nullptr)
             return USBCOMMUNI_E_IO;
+        queue_size_ = config_.ios_queue_size;
+    }
+
+    if ((sendbuffer != nullptr) && (sendbuffer_size_ != config_.ios_send_buffer_size)) {
+        free(sendbuffer);
+        sendbuffer = nullptr;
     }
 
     if (sendbuffer == nullptr) {
-        if ((sendbuffer = static_cast<char*>(malloc(SENDBUFFER_SIZE))) == nullptr)
+        if ((sendbuffer = static_cast<char*>(malloc(config_.ios_send_buffer_size))) == nullptr)
+            return USBCOMMUNI_E_IO;
+        sendbuffer_size_ = config_.ios_send_buffer_size;
+    }
+
+    /* before subscribing, events are queued from the first one on */
+    if (config_.external_loop && (poll_fd_ < 0)) {
+        poll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if ((poll_fd_ < 0) || (EpollAdd(poll_fd_, efd_) != 0)) {
+            if (poll_fd_ >= 0)
+                close(poll_fd_);
+            poll_fd_ = -1;
             return USBCOMMUNI_E_IO;
+        }
     }
 
     return HotplugEventRegister();
 }
 
+void USBIosCommuni::Deinit()
+{
+    /* no more hotplug callbacks once unsubscribe returns */
+    HotplugEventDisregister();
+
+    _DeviceRemoved();
+
+    if (poll_fd_ >= 0) {
+        events_mutex_.lock();
+        events_.clear();
+        events_mutex_.unlock();
+
+        _ReleaseDevice();
+        close(poll_fd_);
+        poll_fd_ = -1;
+    } else {
+        _JoinThreads();
+    }
+
+    QueueDrain();
+}
+
+void USBIosCommuni::_DeviceRemoved()
+{
+    remove_mutex_.lock();
+    found_device_ = false;
+    remove_mutex_.unlock();
+    remove_cond_.notify_all();
+
+    EventSignalSend(efd_, ESIG_DEVICE_REMOVE);
+}
+
+void USBIosCommuni::_JoinThreads()
+{
+    if (recv_thread_.joinable())
+        recv_thread_.join();
+
+    if (send_thread_.joinable())
+        send_thread_.join();
+}
+
+bool USBIosCommuni::WaitRemove(uint32_t timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(remove_mutex_);
+
+    return remove_cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms), 
+                                 [this]() { return !found_device_ || connect_now_; });
+}
+
+void USBIosCommuni::_ConnectNow()
+{
+    remove_mutex_.lock();
+    connect_now_ = true;
+    remove_mutex_.unlock();
+    remove_cond_.notify_all();
+}
+
+/* the thread serving the device only, the send thread may be in SendConnection() meanwhile */
+void USBIosCommuni::_Disconnect()
+{
+    int fd;
+    idevice_connection_t connection;
+
+    _SetConnectStatus(false);
+
+    if (conn_fd_ >= 0) {
+        epoll_ctl(poll_fd_, EPOLL_CTL_DEL, conn_fd_, nullptr);
+        conn_fd_ = -1;
+    }
+
+    /* a send blocked on a stalled peer holds conn_mutex_, the shutdown fails it */
+    if ((connection_ != nullptr) && (idevice_connection_get_fd(connection_, &fd) == IDEVICE_E_SUCCESS))
+        shutdown(fd, SHUT_RDWR);
+
+    conn_mutex_.lock();
+    connection = connection_;
+    connection_ = nullptr;
+    conn_mutex_.unlock();
+
+    idevice_disconnect(connection);
+}
+
+/* @connection opened by the thread serving the device, the send thread picks it up */
+void USBIosCommuni::_Connected(idevice_connection_t connection)
+{
+    conn_mutex_.lock();
+    connection_ = connection;
+    conn_mutex_.unlock();
+}
+
+/* the send thread, never while _Disconnect() frees the connection */
+idevice_error_t USBIosCommuni::SendConnection(const char *data, uint32_t len)
+{
+    std::lock_guard<std::mutex> lock(conn_mutex_);
+
+    if (connection_ == nullptr)
+        return IDEVICE_E_INVALID_ARG;
+
+    return ConnectionSendAll(connection_, data, len);
+}
+
+/* what the recv thread leaves behind on its way out */
+void USBIosCommuni::_ReleaseDevice()
+{
+    if (connect_status_)
+        _Disconnect();
+
+    if (device_) {
+        idevice_free(device_);
+        device_ = nullptr;
+    }
+}
+
+void USBIosCommuni::QueueDrain()
+{
+    struct MsgData* msgdat;
+
+    if (queue_ == nullptr)
+        return;
+
+    while ((msgdat = static_cast<struct MsgData*>(queue_->Poll())) != nullptr) {
+        if (msgdat->payload)
+            free(msgdat->payload);
+        free(msgdat);
+        queued_--;
+    }
+}
+
 static void idevice_event_handle(const idevice_event_t *event, void *user_data)
 {
-    idevice_error_t err;
     USBIosCommuni *ios = (USBIosCommuni *)user_data;
 
     fprintf(stderr, "[USB IOS][Event] Occur !\n");
@@ -77,37 +270,100 @@ static void idevice_event_handle(const idevice_event_t *event, void *user_data)
     fprintf(stderr, "   event       : %d\n", event->event);
     fprintf(stderr, "   udid        : %s\n", event->udid);
 
-    switch (event->event) {
+    /* Peertalk runs over USB only, Wi-Fi sync shows the same phone again */
+    if (event->conn_type != CONNECTION_USBMUXD)
+        return;
+
+    if (ios->GetPollFd() >= 0)
+        ios->QueueEvent(event->event, event->udid);
+    else
+        ios->HandleEvent(event->event, event->udid);
+}
+
+void USBIosCommuni::QueueEvent(idevice_event_type event, const std::string &udid)
+{
+    events_mutex_.lock();
+    events_.emplace_back(event, udid);
+    events_mutex_.unlock();
+
+    EventSignalSend(efd_, ESIG_DEVICE_EVENT);
+}
+
+void USBIosCommuni::HandleEvent(idevice_event_type event, const std::string &udid)
+{
+    idevice_error_t err;
+
+    switch (event) {
+    case IDEVICE_DEVICE_PAIRED:
     case IDEVICE_DEVICE_ADD:
-        err = idevice_new_with_options(&ios->device_, nullptr, IDEVICE_LOOKUP_USBMUX);
+        if (found_device_ && (udid_ == udid)) {
+            /* trusting the host often lets a failed connect through, retry now */
+            if (event == IDEVICE_DEVICE_PAIRED)
+                _ConnectNow();
+            /* ADD is replayed on resubscribe, the device is already being served */
+            break;
+        }
+
+        /* another phone, like REMOVE it leaves the one we talk to alone */
+        if (found_device_ && connect_status_)
+            return;
+
+        /* the served phone never ran the app, or the lookup on ADD failed */
+        if (found_device_)
+            _DeviceRemoved();
+
+        /* the threads of the previous device are already on their way out */
+        if (poll_fd_ >= 0)
+            _ReleaseDevice();
+        else
+            _JoinThreads();
+
+        /* the event's device, not whichever usbmuxd happens to list first */
+        err = idevice_new_with_options(&device_, udid.c_str(), IDEVICE_LOOKUP_USBMUX);
         if (err != IDEVICE_E_SUCCESS) {
             fprintf(stderr, "[USB IOS][ERROR]: No device found!\n");
             return;
         }
 
-        ios->udid_ = event->udid;
-        ios->found_device_ = true;
+        udid_ = udid;
+        found_device_ = true;
 
-        ios->recv_thread_ = std::thread(&USBIosCommuni::_RecvThreadHandler, ios);
-        ios->recv_thread_.detach();
+        if (timeline_)
+            timeline_->Mark(USBCOMMUNI_STAGE_PLUGGED);
 
-        ios->send_thread_ = std::thread(&USBIosCommuni::_SendThreadHandler, ios);
-        ios->send_thread_.detach();
-        break;
+        /* report the arrival before the recv thread can report a connect */
+        if (event_handle_)
+            event_handle_(USBCOMMUNI_DEVICE_ADD);
+
+        /* ProcessEvents() connects right away */
+        if (poll_fd_ >= 0) {
+            tuner_.Reset(config_, config_.ios_recv_buffer_size, 1);
+            tuner_.ResetSend(config_);
+            recv_buffer_.resize(config_.ios_recv_buffer_size + 1);
+            retry_ms_ = std::min(config_.ios_connect_retry_min_ms, config_.ios_connect_retry_ms);
+            connect_now_ = false;
+            connect_due_ = std::chrono::steady_clock::now();
+            return;
+        }
+
+        recv_thread_ = std::thread(&USBIosCommuni::_RecvThreadHandler, this);
+        send_thread_ = std::thread(&USBIosCommuni::_SendThreadHandler, this);
+        return;
 
     case IDEVICE_DEVICE_REMOVE:
-        ios->found_device_ = false;
-        EventSignalSend(ios->efd_, ESIG_DEVICE_REMOVE);
+        /* another phone going away leaves ours alone */
+        if (!found_device_ || (udid_ != udid))
+            return;
+        _DeviceRemoved();
         break;
 
-    case IDEVICE_DEVICE_PAIRED:
     default:
         break;
     }
 
-    if (ios->event_handle_) {
-        USBCommuniEventTypes_t event_type = (USBCommuniEventTypes_t)event->event;
-        ios->event_handle_(event_type);
+    if (event_handle_) {
+        USBCommuniEventTypes_t event_type = (USBCommuniEventTypes_t)event;
+        event_handle_(event_type);
     }
 }
 
@@ -129,16 +385,35 @@ void USBIosCommuni::HotplugEventDisregister()
     idevice_event_unsubscribe();
 }
 
+void USBIosCommuni::SetConfig(const USBCommuniConfig_t &config)
+{
+    config_ = config;
+}
+
 void USBIosCommuni::SubscribeRegister(USBCommuniEventCb eventcb)
 {
     event_handle_ = eventcb;
 }
 
+void USBIosCommuni::TimelineRegister(ConnectTimeline *timeline)
+{
+    timeline_ = timeline;
+}
+
 bool USBIosCommuni::GetConnectStatus()
 {
     return connect_status_;
 }
 
+void USBIosCommuni::_SetConnectStatus(bool status)
+{
+    if (connect_status_.exchange(status) == status)
+        return;
+
+    if (event_handle_)
+        event_handle_(status ? USBCOMMUNI_DEVICE_CONNECTED : USBCOMMUNI_DEVICE_DISCONNECTED);
+}
+
 const std::string &USBIosCommuni::GetUdid()
 {
     return udid_;
@@ -159,10 +434,10 @@ USBCommuniErrors_t USBIosCommuni::SendData(const char *data, uint32_t data_size,
     USBCommuniErrors_t err;
     struct MsgData* msgdat;
 
-    if ((data == nullptr) || (data_size == 0) || (data_size > SENDBUFFER_SIZE))
+    if ((data == nullptr) || (data_size == 0) || (data_size + PEERTALK_HEAD_SIZE > sendbuffer_size_))
         return USBCOMMUNI_E_INVAIL_ARG;
 
-    if ((connection_ == nullptr) || (connect_status_ == false))
+    if (connect_status_ == false)
         return USBCOMMUNI_E_INVAIL_ARG;
 
     msgdat = static_cast<struct MsgData*>(malloc(sizeof(struct MsgData)));
@@ -177,8 +452,12 @@ USBCommuniErrors_t USBIosCommuni::SendData(const char *data, uint32_t data_size,
 
     memmove(msgdat->payload, data, data_size);
     msgdat->length = data_size;
+    msgdat->framed = false;
 
+    /* counted first, the send thread may take it right away */
+    queued_++;
     if (queue_->Offer(msgdat) != true) {
+        queued_--;
         err = USBCOMMUNI_E_IO;
         goto error1;
     }
@@ -196,15 +475,92 @@ error0:
     return err;
 }
 
+USBCommuniErrors_t USBIosCommuni::SendBatch(const struct iovec *iov, uint32_t iovcnt, USBCommuniErrors_t *results)
+{
+    USBCommuniErrors_t err;
+    USBCommuniErrors_t ret = USBCOMMUNI_E_SUCCESS;
+    struct MsgData* msgdat;
+    uint32_t i, end, k;
+    uint32_t bytes;
+    auto valid = [this](const struct iovec &v) {
+        return (v.iov_len > 0) && (PEERTALK_HEAD_SIZE + v.iov_len <= sendbuffer_size_);
+    };
+
+    if ((iov == nullptr) || (iovcnt == 0))
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    /* runs of messages are framed back to back into one queued chunk */
+    for (i = 0; i < iovcnt; i = end) {
+        bytes = 0;
+        for (end = i; end < iovcnt; end++) {
+            if (!valid(iov[end]))
+                continue;
+            if ((bytes > 0) && (bytes + PEERTALK_HEAD_SIZE + iov[end].iov_len > config_.send_batch_max_bytes))
+                break;
+            bytes += PEERTALK_HEAD_SIZE + iov[end].iov_len;
+        }
+
+        err = USBCOMMUNI_E_SUCCESS;
+        msgdat = nullptr;
+
+        if (connect_status_ == false) {
+            err = USBCOMMUNI_E_INVAIL_ARG;
+        } else if (bytes > 0) {
+            msgdat = static_cast<struct MsgData*>(malloc(sizeof(struct MsgData)));
+            if (msgdat != nullptr)
+                msgdat->payload = static_cast<char*>(malloc(bytes));
+
+            if ((msgdat == nullptr) || (msgdat->payload == nullptr)) {
+                free(msgdat);
+                msgdat = nullptr;
+                err = USBCOMMUNI_E_NMEN;
+            }
+        }
+
+        if (msgdat != nullptr) {
+            msgdat->length = 0;
+            msgdat->framed = true;
+            for (k = i; k < end; k++) {
+                if (!valid(iov[k]))
+                    continue;
+                msgdat->length += PeertalkProtocolHeadPacket(msgdat->payload + msgdat->length, 
+                                                             static_cast<const char*>(iov[k].iov_base), 
+                                                             iov[k].iov_len);
+            }
+
+            queued_++;
+            if (queue_->Offer(msgdat) != true) {
+                queued_--;
+                free(msgdat->payload);
+                free(msgdat);
+                err = USBCOMMUNI_E_IO;
+            } else {
+                EventSignalSend(efd_, ESIG_SEND_USERDATA);
+            }
+        }
+
+        for (k = i; k < end; k++) {
+            USBCommuniErrors_t r = valid(iov[k]) ? err : USBCOMMUNI_E_INVAIL_ARG;
+
+            if (results)
+                results[k] = r;
+            if ((r != USBCOMMUNI_E_SUCCESS) && (ret == USBCOMMUNI_E_SUCCESS))
+                ret = r;
+        }
+    }
+
+    return ret;
+}
+
+void USBIosCommuni::Reconnect()
+{
+    reconnect_ = true;
+}
+
 void USBIosCommuni::_SendThreadHandler()
 {
 #define EPOLL_EVENT_MAXNUM 5
 
-    idevice_error_t err;
-    uint32_t size;
-    uint32_t sendbytes;
-    struct MsgData* msgdat;
-
     int epollfd;
     int nfds;
     struct epoll_event ev, events[EPOLL_EVENT_MAXNUM];
@@ -213,15 +569,23 @@ void USBIosCommuni::_SendThreadHandler()
     if ((efd_ < 0) || (queue_ == nullptr))
         return;
 
+    tuner_.ResetSend(config_);
+
+    RealtimeThreadSetup(config_, config_.latency_io_cpu, "USB IOS SEND");
+    RealtimeLock(config_, sendbuffer, sendbuffer_size_);
+
     epollfd = epoll_create(EPOLL_EVENT_MAXNUM);
     ev.events = EPOLLIN | EPOLLET;
     ev.data.fd = efd_;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, efd_, &ev) != 0)
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, efd_, &ev) != 0) {
+        RealtimeUnlock(config_, sendbuffer, sendbuffer_size_);
+        close(epollfd);
         return;
+    }
 
     while (true) {
         if (found_device_ == false) {
-            queue_->Clear();
+            QueueDrain();
             break;
         }
 
@@ -233,93 +597,313 @@ void USBIosCommuni::_SendThreadHandler()
                 continue;
             } else {
                 if(events[i].data.fd == efd_) {
-                    u = ESIG_NONE;
+                    /* the signals add up, two sends read back as a remove, so only the flag tells */
                     read(events[i].data.fd, &u, sizeof(u));
-                    if (u == ESIG_DEVICE_REMOVE)
+                    if (found_device_ == false)
                         break;
 
-                    do {
-                        msgdat = static_cast<struct MsgData*>(queue_->Poll());
-
-                        if (msgdat) {
-                            size = PeertalkProtocolHeadPacket(sendbuffer, msgdat->payload, msgdat->length);
-                            err = idevice_connection_send(connection_, sendbuffer, size, &sendbytes);
-                            if (err == IDEVICE_E_SUCCESS) {
-                            } else {
-                                fprintf(stderr, "idevice_connection_send error !\n");
-                            }
-
-                            if (msgdat->payload)
-                                free(msgdat->payload);
-                            free(msgdat);
-                        }
-                    } while (msgdat);   
+                    SendQueued();
                 }
             }
         }
     }
+
+    RealtimeUnlock(config_, sendbuffer, sendbuffer_size_);
+    close(epollfd);
+}
+
+/**
+ * Send everything queued. With config.send_coalesce, whatever queued up
+ * while the previous send blocked is packed into sendbuffer and goes out
+ * in one send, a lone message still leaves right away. With
+ * config.autotune the tuner moves the byte limit, by how much is still
+ * queued behind each packed send.
+ */
+void USBIosCommuni::SendQueued()
+{
+    idevice_error_t err;
+    uint32_t size;
+    uint32_t packed = 0;
+    uint32_t taken = 0;
+    uint32_t coalesce_max = config_.send_coalesce ? std::min(tuner_.CoalesceMaxBytes(), sendbuffer_size_) : 0;
+    struct MsgData* msgdat;
+    auto SendPacked = [this, &taken](uint32_t bytes, AutotuneFlushes why) {
+        if (bytes == 0)
+            return;
+
+        if (SendConnection(sendbuffer, bytes) != IDEVICE_E_SUCCESS)
+            fprintf(stderr, "idevice_connection_send error !\n");
+        else if (config_.autotune)
+            tuner_.RecordFlush(bytes, queued_ - taken, why);
+    };
+
+    do {
+        msgdat = static_cast<struct MsgData*>(queue_->Poll());
+
+        if (msgdat) {
+            taken++;
+            size = msgdat->framed ? msgdat->length : PEERTALK_HEAD_SIZE + msgdat->length;
+            if ((packed > 0) && (packed + size > coalesce_max)) {
+                SendPacked(packed, AUTOTUNE_FLUSH_FULL);
+                packed = 0;
+            }
+
+            err = IDEVICE_E_SUCCESS;
+            if (size <= coalesce_max) {
+                if (msgdat->framed)
+                    memcpy(sendbuffer + packed, msgdat->payload, msgdat->length);
+                else
+                    PeertalkProtocolHeadPacket(sendbuffer + packed, msgdat->payload, msgdat->length);
+                packed += size;
+            } else if (msgdat->framed) {
+                err = SendConnection(msgdat->payload, msgdat->length);
+            } else {
+                size = PeertalkProtocolHeadPacket(sendbuffer, msgdat->payload, msgdat->length);
+                err = SendConnection(sendbuffer, size);
+            }
+            if (err == IDEVICE_E_SUCCESS) {
+            } else {
+                fprintf(stderr, "idevice_connection_send error !\n");
+            }
+
+            if (msgdat->payload)
+                free(msgdat->payload);
+            free(msgdat);
+        }
+    } while (msgdat);
+
+    SendPacked(packed, AUTOTUNE_FLUSH_DRAINED);
+
+    if (taken == 0)
+        return;
+
+    if ((0 == (queued_ -= taken)) && (nullptr != send_idle_handle_))
+        send_idle_handle_();
+}
+
+bool USBIosCommuni::SendIdle()
+{
+    return connect_status_ && (queued_ == 0);
+}
+
+void USBIosCommuni::SendIdleRegister(std::function<void()> idlecb)
+{
+    send_idle_handle_ = idlecb;
 }
 
 void USBIosCommuni::_RecvThreadHandler()
 {
     idevice_error_t err;
-    char recv_buffer[RECVBUFFER_SIZE];
+    idevice_connection_t connection;
+    std::vector<char> recv_buffer(config_.ios_recv_buffer_size + 1);
     uint32_t recv_bytes;
+    uint32_t retry_ms = std::min(config_.ios_connect_retry_min_ms, config_.ios_connect_retry_ms);
+
+    tuner_.Reset(config_, config_.ios_recv_buffer_size, 1);
+    connect_now_ = false;
+
+    RealtimeThreadSetup(config_, config_.latency_io_cpu, "USB IOS RECV");
+    RealtimeLock(config_, recv_buffer.data(), recv_buffer.size());
 
     while (true) {
         if (found_device_ == false) {
-            if (connect_status_) {
-                idevice_disconnect(connection_);
-                connection_ = nullptr;
-            }
-            connect_status_ = false;
+            if (connect_status_)
+                _Disconnect();
             break;
         }   
 
+        if (reconnect_.exchange(false) && connect_status_)
+            _Disconnect();
+
         if (connect_status_ == false) {
-            err = idevice_connect(device_, port_, &connection_);
+            err = idevice_connect(device_, port_, &connection);
             if (err != IDEVICE_E_SUCCESS) {
-                fprintf(stderr, "[USB IOS][ERROR]: Device connect failed!\n");
+                if (retry_ms <= config_.ios_connect_retry_min_ms)
+                    fprintf(stderr, "[USB IOS][ERROR]: Device connect failed!\n");
             } else {
-                connect_status_ = true;
+                retry_ms = std::min(config_.ios_connect_retry_min_ms, config_.ios_connect_retry_ms);
+                _Connected(connection);
+                if (timeline_)
+                    timeline_->Mark(USBCOMMUNI_STAGE_OPENED);
+                _SetConnectStatus(true);
             }
         }
 
+        /* the app's listener may be a moment away, retry soon and back off */
         if (connect_status_ == false) {
-            usleep(1000000);
+            WaitRemove(retry_ms);
+            if (connect_now_.exchange(false))
+                retry_ms = std::min(config_.ios_connect_retry_min_ms, config_.ios_connect_retry_ms);
+            else
+                retry_ms = std::min(std::max(retry_ms * 2, 1u), config_.ios_connect_retry_ms);
             continue;
         }
 
-        bzero(recv_buffer, sizeof(recv_buffer));
+        /* one byte kept back, the data is handed out zero terminated */
         err = idevice_connection_receive_timeout(connection_, 
-                                                 recv_buffer, 
-                                                 sizeof(recv_buffer), 
+                                                 recv_buffer.data(), 
+                                                 recv_buffer.size() - 1, 
                                                  &recv_bytes, 
-                                                 1000);
-        switch (err) {
-        case IDEVICE_E_SUCCESS:
-            if (recv_handle_)
-                recv_handle_(recv_buffer, recv_bytes);
-            break;
-        
-        case IDEVICE_E_UNKNOWN_ERROR:
-            connect_status_ = false;
-            idevice_disconnect(connection_);
-            connection_ = nullptr;
-            break;
-
-        case IDEVICE_E_TIMEOUT:
-        default:
-            break;
-        }
+                                                 config_.ios_recv_timeout_ms);
+        _Received(err, recv_buffer, recv_bytes);
     }
 
+    RealtimeUnlock(config_, recv_buffer.data(), recv_buffer.size());
+
     if (device_) {
         idevice_free(device_);
         device_ = nullptr;
     }
 }
 
+void USBIosCommuni::_Received(idevice_error_t err, std::vector<char> &recv_buffer, uint32_t recv_bytes)
+{
+    switch (err) {
+    case IDEVICE_E_SUCCESS:
+        recv_buffer[recv_bytes] = '\0';
+        if (recv_handle_)
+            recv_handle_(recv_buffer.data(), recv_bytes);
+
+        if (config_.autotune) {
+            tuner_.RecordRecv(recv_bytes, recv_buffer.size() - 1);
+            if (tuner_.RecvBufferSize() + 1 != recv_buffer.size()) {
+                RealtimeUnlock(config_, recv_buffer.data(), recv_buffer.size());
+                recv_buffer.resize(tuner_.RecvBufferSize() + 1);
+                RealtimeLock(config_, recv_buffer.data(), recv_buffer.size());
+            }
+        }
+        break;
+    
+    case IDEVICE_E_UNKNOWN_ERROR:
+        _Disconnect();
+        break;
+
+    case IDEVICE_E_TIMEOUT:
+    default:
+        break;
+    }
+}
+
+int USBIosCommuni::GetPollFd()
+{
+    return poll_fd_;
+}
+
+uint32_t USBIosCommuni::GetTimeout()
+{
+    int64_t us;
+
+    if ((poll_fd_ < 0) || (device_ == nullptr))
+        return USBCOMMUNI_WAIT_FOREVER;
+
+    if (!found_device_ || reconnect_ || connect_now_)
+        return 0;
+
+    if (connect_status_)
+        return USBCOMMUNI_WAIT_FOREVER;
+
+    /* the next connect attempt */
+    us = std::chrono::duration_cast<std::chrono::microseconds>(connect_due_ - std::chrono::steady_clock::now()).count();
+
+    return (us > 0) ? (us + 999) / 1000 : 0;
+}
+
+/* the work of the event callback and both threads, without blocking */
+void USBIosCommuni::ProcessEvents()
+{
+    uint64_t u;
+    std::vector<std::pair<idevice_event_type, std::string>> events;
+
+    if (poll_fd_ < 0)
+        return;
+
+    /* wakeups only, whatever they announce is looked at below */
+    read(efd_, &u, sizeof(u));
+
+    events_mutex_.lock();
+    events.swap(events_);
+    events_mutex_.unlock();
+
+    for (auto &event : events)
+        HandleEvent(event.first, event.second);
+
+    ConnectStep();
+
+    if (connect_status_)
+        SendQueued();
+    else
+        QueueDrain();
+}
+
+/* one pass of _RecvThreadHandler(), connect attempts wait for connect_due_ instead of sleeping */
+void USBIosCommuni::ConnectStep()
+{
+    idevice_error_t err;
+    idevice_connection_t connection;
+    uint32_t recv_bytes;
+    struct pollfd pfd;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if (device_ == nullptr)
+        return;
+
+    if (found_device_ == false) {
+        _ReleaseDevice();
+        return;
+    }
+
+    if (reconnect_.exchange(false) && connect_status_)
+        _Disconnect();
+
+    if (connect_status_ == false) {
+        if (connect_now_.exchange(false)) {
+            retry_ms_ = std::min(config_.ios_connect_retry_min_ms, config_.ios_connect_retry_ms);
+            connect_due_ = now;
+        }
+
+        if (now < connect_due_)
+            return;
+
+        err = idevice_connect(device_, port_, &connection);
+        if ((err == IDEVICE_E_SUCCESS) && (idevice_connection_get_fd(connection, &conn_fd_) != IDEVICE_E_SUCCESS)) {
+            idevice_disconnect(connection);
+            err = IDEVICE_E_UNKNOWN_ERROR;
+        }
+
+        /* the app's listener may be a moment away, retry soon and back off */
+        if (err != IDEVICE_E_SUCCESS) {
+            if (retry_ms_ <= config_.ios_connect_retry_min_ms)
+                fprintf(stderr, "[USB IOS][ERROR]: Device connect failed!\n");
+            connect_due_ = now + std::chrono::milliseconds(retry_ms_);
+            retry_ms_ = std::min(std::max(retry_ms_ * 2, 1u), config_.ios_connect_retry_ms);
+            return;
+        }
+
+        _Connected(connection);
+        EpollAdd(poll_fd_, conn_fd_);
+        retry_ms_ = std::min(config_.ios_connect_retry_min_ms, config_.ios_connect_retry_ms);
+        if (timeline_)
+            timeline_->Mark(USBCOMMUNI_STAGE_OPENED);
+        _SetConnectStatus(true);
+    }
+
+    /* a timeout of 0 would block for good, only read what poll() promises */
+    for (int i = 0; (i < EXTERNAL_RECV_BURST) && connect_status_; i++) {
+        pfd.fd = conn_fd_;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) <= 0)
+            break;
+
+        err = idevice_connection_receive_timeout(connection_, 
+                                                 recv_buffer_.data(), 
+                                                 recv_buffer_.size() - 1, 
+                                                 &recv_bytes, 
+                                                 1);
+        _Received(err, recv_buffer_, recv_bytes);
+    }
+}
+
 static USBCommuniErrors_t EventSignalSend(int efd, enum EeventSignalTypes val)
 {
     int r;
@@ -340,6 +924,24 @@ static USBCommuniErrors_t EventSignalSend(int efd, enum EeventSignalTypes val)
     return USBCOMMUNI_E_SUCCESS;
 }
 
+static idevice_error_t ConnectionSendAll(idevice_connection_t connection, const char *data, uint32_t len)
+{
+    idevice_error_t err;
+    uint32_t sendbytes;
+
+    while (len > 0) {
+        sendbytes = 0;
+        err = idevice_connection_send(connection, data, len, &sendbytes);
+        if (err != IDEVICE_E_SUCCESS)
+            return err;
+
+        data += sendbytes;
+        len -= sendbytes;
+    }
+
+    return IDEVICE_E_SUCCESS;
+}
+
 static uint32_t PeertalkProtocolHeadPacket(char *msg, const char *user_data, uint32_t len)
 {
     uint32_t payload_size;
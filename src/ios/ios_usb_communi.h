@@ -1,18 +1,23 @@
 #ifndef IOS_USB_COMMUNI_H_
 #define IOS_USB_COMMUNI_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 #include "commondef.h"
+#include "autotuner.h"
+#include "connect_timeline.h"
 #include "cclqueue/blocking_queue.h"
 #include "libimobiledevice/libimobiledevice.h"
 #include "plist/plist.h"
 
 namespace usbcommuni {
 
-#define USBMUXD_DEFAUL_PORT 12345
-#define QUEUE_DEFAULT_SIZE  10000
-#define SENDBUFFER_SIZE     65536
-#define RECVBUFFER_SIZE     65536
-
 class USBIosCommuni
 {
 public:
@@ -20,6 +25,10 @@ public:
     ~USBIosCommuni();
 
     USBCommuniErrors_t Init();
+    void Deinit();
+
+    /* takes effect on the next Init() */
+    void SetConfig(const USBCommuniConfig_t &config);
 
     USBCommuniErrors_t HotplugEventRegister();
 
@@ -27,6 +36,9 @@ public:
 
     void SubscribeRegister(USBCommuniEventCb eventcb);
 
+    /* stages of the next connect are marked in @timeline */
+    void TimelineRegister(ConnectTimeline *timeline);
+
     bool GetConnectStatus();
 
     const std::string &GetUdid();
@@ -37,25 +49,80 @@ public:
 
     USBCommuniErrors_t SendData(const char *data, uint32_t data_size, uint32_t &send_bytes);
 
+    USBCommuniErrors_t SendBatch(const struct iovec *iov, uint32_t iovcnt, USBCommuniErrors_t *results);
+
+    /* connected and everything queued is handed to the socket */
+    bool SendIdle();
+
+    /* called on the send thread once it has sent everything queued */
+    void SendIdleRegister(std::function<void()> idlecb);
+
+    /* drop and reopen the connection, picked up within ios_recv_timeout_ms */
+    void Reconnect();
+
+    /* config.external_loop, efd_ and the connection in one epoll fd */
+    int GetPollFd();
+    uint32_t GetTimeout();
+    void ProcessEvents();
+
+    /* usbmuxd events, HandleEvent() on the thread serving the device, QueueEvent() hands over to it */
+    void HandleEvent(idevice_event_type event, const std::string &udid);
+    void QueueEvent(idevice_event_type event, const std::string &udid);
+
     void _RecvThreadHandler();
     void _SendThreadHandler();
+    void _SetConnectStatus(bool status);
+    void _JoinThreads();
+    void _DeviceRemoved();
+    void _ConnectNow();
+    void _Connected(idevice_connection_t connection);
+    void _Disconnect();
+    void _ReleaseDevice();
+    void _Received(idevice_error_t err, std::vector<char> &recv_buffer, uint32_t recv_bytes);
 
 public:
     int efd_;
     idevice_t device_;
-    idevice_connection_t connection_;
+    idevice_connection_t connection_;  /**< written under conn_mutex_ by the thread serving the device */
     std::string udid_;
     USBCommuniEventCb event_handle_;
+    ConnectTimeline *timeline_;
     USBCommuniRecvHandleCb recv_handle_;
-    bool found_device_;
+    std::function<void()> send_idle_handle_;
+    std::atomic<bool> found_device_;
     std::thread recv_thread_;
     std::thread send_thread_;
 
 private:
+    USBCommuniConfig_t config_;
+    Autotuner tuner_;                   /**< receive half on the recv thread, send half on the send thread */
     uint16_t port_;
     cclqueue::BlockingQueue* queue_;
+    uint32_t queue_size_;
+    std::atomic<uint32_t> queued_;      /**< messages offered to queue_ and not yet sent */
     char* sendbuffer;
-    bool connect_status_;
+    uint32_t sendbuffer_size_;
+    std::atomic<bool> connect_status_;
+    std::atomic<bool> reconnect_;
+    std::atomic<bool> connect_now_;
+    std::mutex conn_mutex_;             /**< held by the send thread while it uses connection_ */
+    std::mutex remove_mutex_;
+    std::condition_variable remove_cond_;
+
+    /* config.external_loop, the recv thread's state between ConnectStep() calls */
+    int poll_fd_;
+    int conn_fd_;
+    std::mutex events_mutex_;
+    std::vector<std::pair<idevice_event_type, std::string>> events_;
+    std::vector<char> recv_buffer_;
+    uint32_t retry_ms_;
+    std::chrono::steady_clock::time_point connect_due_;
+
+    bool WaitRemove(uint32_t timeout_ms);
+    void QueueDrain();
+    void SendQueued();
+    idevice_error_t SendConnection(const char *data, uint32_t len);
+    void ConnectStep();
 };
 
 }
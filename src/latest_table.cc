@@ -0,0 +1,122 @@
+#include "latest_table.h"
+
+namespace usbcommuni {
+
+LatestTable::LatestTable()
+{
+    max_keys_ = 64;
+    held_ = 0;
+    puts_ = 0;
+    replaced_ = 0;
+    sent_ = 0;
+    failed_ = 0;
+    rejected_ = 0;
+}
+
+void LatestTable::SetMaxKeys(uint32_t max_keys)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    max_keys_ = max_keys;
+    index_.clear();
+    values_.clear();
+    held_ = 0;
+}
+
+bool LatestTable::Put(uint32_t key, const char *data, uint32_t len)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+
+    if (it != index_.end()) {
+        values_[it->second].data.assign(data, len);
+        replaced_++;
+        puts_++;
+        return true;
+    }
+
+    if (values_.size() >= max_keys_) {
+        rejected_++;
+        return false;
+    }
+
+    index_.emplace(key, values_.size());
+    values_.push_back(LatestValue_t());
+    values_.back().key = key;
+    values_.back().data.assign(data, len);
+    held_ = values_.size();
+    puts_++;
+
+    return true;
+}
+
+void LatestTable::Take(std::vector<LatestValue_t> &values)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    values.clear();
+    values.swap(values_);
+    index_.clear();
+    held_ = 0;
+}
+
+void LatestTable::PutBack(std::vector<LatestValue_t> &values, size_t from)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<LatestValue_t> newer;
+    std::unordered_map<uint32_t, size_t> newer_index;
+    size_t i;
+
+    newer.swap(values_);
+    newer_index.swap(index_);
+
+    /* may go past max_keys_ for a round, these were held before */
+    for (i = from; i < values.size(); i++) {
+        if (newer_index.count(values[i].key) != 0) {
+            replaced_++;
+            continue;
+        }
+
+        index_.emplace(values[i].key, values_.size());
+        values_.push_back(std::move(values[i]));
+    }
+
+    for (LatestValue_t &value : newer) {
+        index_.emplace(value.key, values_.size());
+        values_.push_back(std::move(value));
+    }
+
+    held_ = values_.size();
+}
+
+void LatestTable::Report(USBCommuniErrors_t err)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (USBCOMMUNI_E_SUCCESS == err)
+        sent_++;
+    else
+        failed_++;
+}
+
+void LatestTable::Clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    index_.clear();
+    values_.clear();
+    held_ = 0;
+}
+
+void LatestTable::GetStats(USBCommuniLatestStats_t &stats)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    stats.puts = puts_;
+    stats.replaced = replaced_;
+    stats.sent = sent_;
+    stats.failed = failed_;
+    stats.rejected = rejected_;
+}
+
+}
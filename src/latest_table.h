@@ -0,0 +1,70 @@
+#ifndef LATEST_TABLE_H_
+#define LATEST_TABLE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "commondef.h"
+
+namespace usbcommuni {
+
+typedef struct LatestValue {
+    uint32_t key;
+    std::string data;
+} LatestValue_t;
+
+/**
+ * Latest value per key for state that only matters when current, see
+ * USBCommuni::SendLatest(). A value put while its key is still held back
+ * overwrites the old one in place, so at most max_keys values wait no
+ * matter how long the pipe stalls. Thread safe.
+ */
+class LatestTable
+{
+public:
+    LatestTable();
+
+    /* empties the table */
+    void SetMaxKeys(uint32_t max_keys);
+
+    /* false if @key is not held yet and max_keys are */
+    bool Put(uint32_t key, const char *data, uint32_t len);
+
+    /* move the held values to @values, in the order their keys came in */
+    void Take(std::vector<LatestValue_t> &values);
+
+    /**
+     * Hold @values[@from...] again, ahead of what came in meanwhile, e.g.
+     * when the link ran out of credit. A key put again in between keeps
+     * its newer value.
+     */
+    void PutBack(std::vector<LatestValue_t> &values, size_t from);
+
+    /* a taken value was handed to the backend, or failed with @err */
+    void Report(USBCommuniErrors_t err);
+
+    void Clear();
+    bool Empty() const { return held_ == 0; }
+
+    void GetStats(USBCommuniLatestStats_t &stats);
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<uint32_t, size_t> index_;    /**< key to its slot in values_ */
+    std::vector<LatestValue_t> values_;
+    uint32_t max_keys_;
+    std::atomic<uint32_t> held_;
+
+    uint64_t puts_;
+    uint64_t replaced_;
+    uint64_t sent_;
+    uint64_t failed_;
+    uint64_t rejected_;
+};
+
+}
+
+#endif /* LATEST_TABLE_H_ */
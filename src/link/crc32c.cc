@@ -0,0 +1,255 @@
+#include "crc32c.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_ARM64
+#elif defined(__arm__) && defined(USBCOMMUNI_CRC32C_ARM32)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_ARM32
+#endif
+
+namespace usbcommuni {
+
+#define CRC32C_POLY 0x82F63B78u     /* reflected Castagnoli */
+
+typedef uint32_t (*Crc32cFn)(uint32_t crc, char *dst, const char *src, size_t len);
+
+/*
+ * Every implementation takes and returns the raw (non inverted) state and
+ * copies to @dst unless it is nullptr, so checking and copying are one pass.
+ */
+
+static uint32_t sw_table[8][256];
+
+static void SwTableInit()
+{
+    uint32_t crc;
+
+    for (uint32_t i = 0; i < 256; i++) {
+        crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : (crc >> 1);
+        sw_table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            sw_table[t][i] = (sw_table[t - 1][i] >> 8) ^ sw_table[0][sw_table[t - 1][i] & 0xFF];
+    }
+}
+
+static uint32_t Crc32cSw(uint32_t crc, char *dst, const char *src, size_t len)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(src);
+    uint64_t v;
+
+    while (len >= 8) {
+        memcpy(&v, p, 8);
+        if (dst) {
+            memcpy(dst, &v, 8);
+            dst += 8;
+        }
+
+        /* little endian load, the table layout assumes it */
+        v = (uint64_t)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24)) ^ crc;
+        crc = sw_table[7][v & 0xFF] ^ sw_table[6][(v >> 8) & 0xFF] ^
+              sw_table[5][(v >> 16) & 0xFF] ^ sw_table[4][v >> 24] ^
+              sw_table[3][p[4]] ^ sw_table[2][p[5]] ^
+              sw_table[1][p[6]] ^ sw_table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        if (dst)
+            *dst++ = *p;
+        crc = (crc >> 8) ^ sw_table[0][(crc ^ *p++) & 0xFF];
+    }
+
+    return crc;
+}
+
+#if defined(CRC32C_X86)
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cHw(uint32_t crc, char *dst, const char *src, size_t len)
+{
+#if defined(__x86_64__)
+    uint64_t v;
+    uint64_t c = crc;
+
+    while (len >= 8) {
+        memcpy(&v, src, 8);
+        if (dst) {
+            memcpy(dst, &v, 8);
+            dst += 8;
+        }
+        c = _mm_crc32_u64(c, v);
+        src += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+#else
+    uint32_t v;
+
+    while (len >= 4) {
+        memcpy(&v, src, 4);
+        if (dst) {
+            memcpy(dst, &v, 4);
+            dst += 4;
+        }
+        crc = _mm_crc32_u32(crc, v);
+        src += 4;
+        len -= 4;
+    }
+#endif
+
+    while (len--) {
+        if (dst)
+            *dst++ = *src;
+        crc = _mm_crc32_u8(crc, *src++);
+    }
+
+    return crc;
+}
+
+static bool Crc32cHwSupported()
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+
+#define CRC32C_HW_NAME "sse4.2"
+
+#elif defined(CRC32C_ARM64)
+/* .arch_extension keeps this building without -march=armv8-a+crc */
+static inline uint32_t Crc32cx(uint32_t crc, uint64_t v)
+{
+    __asm__(".arch_extension crc\n\tcrc32cx %w0, %w0, %x1" : "+r"(crc) : "r"(v));
+    return crc;
+}
+
+static inline uint32_t Crc32cb(uint32_t crc, uint8_t v)
+{
+    __asm__(".arch_extension crc\n\tcrc32cb %w0, %w0, %w1" : "+r"(crc) : "r"(v));
+    return crc;
+}
+
+static uint32_t Crc32cHw(uint32_t crc, char *dst, const char *src, size_t len)
+{
+    uint64_t v;
+
+    while (len >= 8) {
+        memcpy(&v, src, 8);
+        if (dst) {
+            memcpy(dst, &v, 8);
+            dst += 8;
+        }
+        crc = Crc32cx(crc, v);
+        src += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        if (dst)
+            *dst++ = *src;
+        crc = Crc32cb(crc, *src++);
+    }
+
+    return crc;
+}
+
+static bool Crc32cHwSupported()
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#define CRC32C_HW_NAME "armv8-crc"
+
+#elif defined(CRC32C_ARM32)
+/* crc32c_arm32.cc, the only file built with +crc so the rest still runs on armv7 */
+uint32_t Crc32cArm32(uint32_t crc, char *dst, const char *src, size_t len);
+
+static uint32_t Crc32cHw(uint32_t crc, char *dst, const char *src, size_t len)
+{
+    return Crc32cArm32(crc, dst, src, len);
+}
+
+static bool Crc32cHwSupported()
+{
+    return (getauxval(AT_HWCAP2) & HWCAP2_CRC32) != 0;
+}
+
+#define CRC32C_HW_NAME "armv8-crc"
+#endif
+
+/* the tables are filled either way, Crc32cImpls() offers the fallback too */
+static Crc32cFn Crc32cSelect(const char **name)
+{
+    SwTableInit();
+
+#if defined(CRC32C_HW_NAME)
+    if (Crc32cHwSupported()) {
+        *name = CRC32C_HW_NAME;
+        return Crc32cHw;
+    }
+#endif
+
+    *name = "sw";
+    return Crc32cSw;
+}
+
+static const char *impl_name = nullptr;
+static const Crc32cFn impl = Crc32cSelect(&impl_name);
+
+static uint32_t Crc32cSwCopy(uint32_t crc, void *dst, const void *src, size_t len)
+{
+    return ~Crc32cSw(~crc, static_cast<char*>(dst), static_cast<const char*>(src), len);
+}
+
+#if defined(CRC32C_HW_NAME)
+static uint32_t Crc32cHwCopy(uint32_t crc, void *dst, const void *src, size_t len)
+{
+    return ~Crc32cHw(~crc, static_cast<char*>(dst), static_cast<const char*>(src), len);
+}
+#endif
+
+uint32_t Crc32c(uint32_t crc, const void *data, size_t len)
+{
+    return ~impl(~crc, nullptr, static_cast<const char*>(data), len);
+}
+
+uint32_t Crc32cCopy(uint32_t crc, void *dst, const void *src, size_t len)
+{
+    return ~impl(~crc, static_cast<char*>(dst), static_cast<const char*>(src), len);
+}
+
+const char *Crc32cImplName()
+{
+    return impl_name;
+}
+
+size_t Crc32cImpls(const char **names, Crc32cImplFn *fns, size_t max)
+{
+    size_t count = 0;
+
+#if defined(CRC32C_HW_NAME)
+    if ((count < max) && (impl == Crc32cHw)) {
+        names[count] = CRC32C_HW_NAME;
+        fns[count++] = Crc32cHwCopy;
+    }
+#endif
+
+    if (count < max) {
+        names[count] = "sw";
+        fns[count++] = Crc32cSwCopy;
+    }
+
+    return count;
+}
+
+}
@@ -0,0 +1,34 @@
+#ifndef CRC32C_H_
+#define CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace usbcommuni {
+
+/**
+ * CRC32C (Castagnoli), zlib style: pass 0 to start, the previous result
+ * to continue. Uses SSE4.2 on x86 and the ARMv8 CRC instructions on arm
+ * when the CPU has them, slicing-by-8 tables otherwise.
+ */
+uint32_t Crc32c(uint32_t crc, const void *data, size_t len);
+
+/* copy @len bytes from @src to @dst and checksum them in the same pass */
+uint32_t Crc32cCopy(uint32_t crc, void *dst, const void *src, size_t len);
+
+/* "sse4.2", "armv8-crc" or "sw" */
+const char *Crc32cImplName();
+
+/* a Crc32cCopy() of one implementation, @dst may be nullptr */
+typedef uint32_t (*Crc32cImplFn)(uint32_t crc, void *dst, const void *src, size_t len);
+
+/**
+ * The implementations this CPU runs, the one in use first, e.g. to
+ * benchmark them. Fills up to @max entries of @names and @fns, returns
+ * how many.
+ */
+size_t Crc32cImpls(const char **names, Crc32cImplFn *fns, size_t max);
+
+}
+
+#endif /* CRC32C_H_ */
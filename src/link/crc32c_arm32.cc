@@ -0,0 +1,36 @@
+/* built with -march=armv8-a+crc on 32 bit arm, see src/CMakeLists.txt */
+#if defined(__arm__) && defined(USBCOMMUNI_CRC32C_ARM32)
+#include <arm_acle.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace usbcommuni {
+
+/* raw state in and out, copies to @dst unless nullptr, see crc32c.cc */
+uint32_t Crc32cArm32(uint32_t crc, char *dst, const char *src, size_t len)
+{
+    uint32_t v;
+
+    while (len >= 4) {
+        memcpy(&v, src, 4);
+        if (dst) {
+            memcpy(dst, &v, 4);
+            dst += 4;
+        }
+        crc = __crc32cw(crc, v);
+        src += 4;
+        len -= 4;
+    }
+
+    while (len--) {
+        if (dst)
+            *dst++ = *src;
+        crc = __crc32cb(crc, *src++);
+    }
+
+    return crc;
+}
+
+}
+#endif
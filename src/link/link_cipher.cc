@@ -0,0 +1,292 @@
+#include "link_cipher.h"
+#include <string.h>
+#include <random>
+#ifdef USBCOMMUNI_WITH_LINK_CIPHER
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#endif
+#include "link_frame.h"
+
+namespace usbcommuni {
+
+#ifdef USBCOMMUNI_WITH_LINK_CIPHER
+
+#define LINK_CIPHER_LABEL       "usbcommuni"
+
+static inline void PutBe64(unsigned char *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--, v >>= 8u)
+        p[i] = (v & 0xFFu);
+}
+
+static inline uint64_t GetBe64(const unsigned char *p)
+{
+    uint64_t v = 0;
+
+    for (int i = 0; i < 8; i++)
+        v = (v << 8u) | p[i];
+
+    return v;
+}
+
+LinkCipher::LinkCipher()
+{
+    tx_ctx_ = EVP_CIPHER_CTX_new();
+    rx_ctx_ = EVP_CIPHER_CTX_new();
+    tx_key_id_ = 0;
+    tx_counter_ = 0;
+    rx_key_id_ = 0;
+    rx_keyed_ = false;
+    rx_pinned_ = false;
+    rx_pinned_id_ = 0;
+    rx_top_ = 0;
+    rx_window_ = 0;
+    memset(rx_retired_, 0, sizeof(rx_retired_));
+    rx_retired_next_ = 0;
+}
+
+LinkCipher::~LinkCipher()
+{
+    EVP_CIPHER_CTX_free(tx_ctx_);
+    EVP_CIPHER_CTX_free(rx_ctx_);
+    OPENSSL_cleanse(&secret_[0], secret_.size());
+}
+
+void LinkCipher::SetKey(const std::string &secret)
+{
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex_);
+        OPENSSL_cleanse(&secret_[0], secret_.size());
+        secret_ = secret;
+    }
+
+    /* a new secret, nothing seen under the old one means anything */
+    rx_keyed_ = false;
+    rx_pinned_ = false;
+    rx_window_ = 0;
+    memset(rx_retired_, 0, sizeof(rx_retired_));
+
+    if (Enabled())
+        Rotate();
+}
+
+/* the window of the pinned id is kept, its frames may still trail the reconnect */
+void LinkCipher::Unpin()
+{
+    rx_pinned_ = false;
+}
+
+/* whether a frame under @key_id and @counter may be opened, before any work on it */
+bool LinkCipher::Fresh(uint64_t key_id, uint32_t counter)
+{
+    uint32_t age;
+
+    if (rx_window_ != 0) {
+        if (key_id == rx_pinned_id_) {
+            if (counter > rx_top_)
+                return true;
+
+            age = rx_top_ - counter;
+            return (age < LINK_CIPHER_REPLAY_WINDOW) && !(rx_window_ & (1ull << age));
+        }
+
+        /* the peer moves on to a new id only when the counter ran out, or with a new session */
+        if (rx_pinned_ && (rx_top_ < UINT32_MAX - 1))
+            return false;
+    }
+
+    for (uint32_t i = 0; i < LINK_CIPHER_RETIRED; i++) {
+        if ((rx_retired_[i] != 0) && (rx_retired_[i] == key_id))
+            return false;
+    }
+
+    return true;
+}
+
+/* @key_id and @counter opened, pin a new id or slide the window of the pinned one */
+void LinkCipher::Seen(uint64_t key_id, uint32_t counter)
+{
+    uint32_t shift;
+
+    if ((rx_window_ == 0) || (key_id != rx_pinned_id_)) {
+        if (rx_window_ != 0) {
+            rx_retired_[rx_retired_next_] = rx_pinned_id_;
+            rx_retired_next_ = (rx_retired_next_ + 1) % LINK_CIPHER_RETIRED;
+        }
+
+        rx_pinned_id_ = key_id;
+        rx_top_ = counter;
+        rx_window_ = 1;
+        rx_pinned_ = true;
+        return;
+    }
+
+    /* a frame trailing the last session does not pin its id again */
+    if (counter > rx_top_) {
+        shift = counter - rx_top_;
+        rx_window_ = (shift >= LINK_CIPHER_REPLAY_WINDOW) ? 0 : (rx_window_ << shift);
+        rx_window_ |= 1;
+        rx_top_ = counter;
+    } else {
+        rx_window_ |= 1ull << (rx_top_ - counter);
+    }
+}
+
+void LinkCipher::DeriveKey(uint64_t key_id, unsigned char *key)
+{
+    unsigned char msg[sizeof(LINK_CIPHER_LABEL) - 1 + 8];
+    unsigned int len = LINK_CIPHER_KEY_SIZE;
+
+    memcpy(msg, LINK_CIPHER_LABEL, sizeof(LINK_CIPHER_LABEL) - 1);
+    PutBe64(msg + sizeof(LINK_CIPHER_LABEL) - 1, key_id);
+
+    HMAC(EVP_sha256(), secret_.data(), secret_.size(), msg, sizeof(msg), key, &len);
+}
+
+void LinkCipher::Rotate()
+{
+    std::lock_guard<std::mutex> lock(tx_mutex_);
+
+    NewTxKey();
+}
+
+/* tx_mutex_ held */
+void LinkCipher::NewTxKey()
+{
+    unsigned char key[LINK_CIPHER_KEY_SIZE];
+    std::random_device rd;
+
+    if (secret_.empty())
+        return;
+
+    tx_key_id_ = ((uint64_t)rd() << 32u) | rd();
+    tx_counter_ = 0;
+
+    DeriveKey(tx_key_id_, key);
+    EVP_EncryptInit_ex(tx_ctx_, EVP_aes_256_gcm(), nullptr, key, nullptr);
+    OPENSSL_cleanse(key, sizeof(key));
+}
+
+bool LinkCipher::Seal(const char *aad, char *out, const char *plain, uint32_t len)
+{
+    unsigned char *iv = reinterpret_cast<unsigned char*>(out);
+    unsigned char *data = iv + LINK_CIPHER_IV_SIZE;
+    int outl;
+    std::lock_guard<std::mutex> lock(tx_mutex_);
+
+    /* an IV is never used twice under one key */
+    if (tx_counter_ == UINT32_MAX)
+        NewTxKey();
+
+    PutBe64(iv, tx_key_id_);
+    iv[8] = (tx_counter_ >> 24u);
+    iv[9] = (tx_counter_ >> 16u);
+    iv[10] = (tx_counter_ >> 8u);
+    iv[11] = (tx_counter_ & 0xFFu);
+    tx_counter_++;
+
+    if ((EVP_EncryptInit_ex(tx_ctx_, nullptr, nullptr, nullptr, iv) != 1) ||
+        (EVP_EncryptUpdate(tx_ctx_, nullptr, &outl, (const unsigned char*)aad, LINK_FRAME_HEAD_SIZE) != 1))
+        return false;
+
+    if ((len > 0) && (EVP_EncryptUpdate(tx_ctx_, data, &outl, (const unsigned char*)plain, len) != 1))
+        return false;
+
+    return (EVP_EncryptFinal_ex(tx_ctx_, data + len, &outl) == 1) &&
+           (EVP_CIPHER_CTX_ctrl(tx_ctx_, EVP_CTRL_GCM_GET_TAG, LINK_CIPHER_TAG_SIZE, data + len) == 1);
+}
+
+bool LinkCipher::Open(const char *aad, char *payload, uint32_t len)
+{
+    unsigned char *iv = reinterpret_cast<unsigned char*>(payload);
+    unsigned char *data = iv + LINK_CIPHER_IV_SIZE;
+    unsigned char key[LINK_CIPHER_KEY_SIZE];
+    uint64_t key_id;
+    uint32_t counter;
+    uint32_t n;
+    int outl;
+
+    if (len < LINK_CIPHER_OVERHEAD)
+        return false;
+
+    n = len - LINK_CIPHER_OVERHEAD;
+    key_id = GetBe64(iv);
+    counter = ((uint32_t)iv[8] << 24u) | ((uint32_t)iv[9] << 16u) | ((uint32_t)iv[10] << 8u) | iv[11];
+
+    /* a foreign id costs no key derivation, a replay no decryption */
+    if (!Fresh(key_id, counter))
+        return false;
+
+    /* the peer started a new session */
+    if (!rx_keyed_ || (key_id != rx_key_id_)) {
+        DeriveKey(key_id, key);
+        EVP_DecryptInit_ex(rx_ctx_, EVP_aes_256_gcm(), nullptr, key, nullptr);
+        OPENSSL_cleanse(key, sizeof(key));
+        rx_key_id_ = key_id;
+        rx_keyed_ = true;
+    }
+
+    if ((EVP_DecryptInit_ex(rx_ctx_, nullptr, nullptr, nullptr, iv) != 1) ||
+        (EVP_DecryptUpdate(rx_ctx_, nullptr, &outl, (const unsigned char*)aad, LINK_FRAME_HEAD_SIZE) != 1))
+        return false;
+
+    if ((n > 0) && (EVP_DecryptUpdate(rx_ctx_, data, &outl, data, n) != 1))
+        return false;
+
+    if ((EVP_CIPHER_CTX_ctrl(rx_ctx_, EVP_CTRL_GCM_SET_TAG, LINK_CIPHER_TAG_SIZE, data + n) != 1) ||
+        (EVP_DecryptFinal_ex(rx_ctx_, data + n, &outl) != 1))
+        return false;
+
+    Seen(key_id, counter);
+
+    return true;
+}
+
+#else /* !USBCOMMUNI_WITH_LINK_CIPHER */
+
+LinkCipher::LinkCipher()
+{
+    tx_ctx_ = nullptr;
+    rx_ctx_ = nullptr;
+    tx_key_id_ = 0;
+    tx_counter_ = 0;
+    rx_key_id_ = 0;
+    rx_keyed_ = false;
+    rx_pinned_ = false;
+    rx_pinned_id_ = 0;
+    rx_top_ = 0;
+    rx_window_ = 0;
+    memset(rx_retired_, 0, sizeof(rx_retired_));
+    rx_retired_next_ = 0;
+}
+
+LinkCipher::~LinkCipher()
+{
+}
+
+void LinkCipher::SetKey(const std::string &)
+{
+}
+
+void LinkCipher::Rotate()
+{
+}
+
+void LinkCipher::Unpin()
+{
+}
+
+bool LinkCipher::Seal(const char *, char *, const char *, uint32_t)
+{
+    return false;
+}
+
+bool LinkCipher::Open(const char *, char *, uint32_t)
+{
+    return false;
+}
+
+#endif
+
+}
@@ -0,0 +1,102 @@
+#ifndef LINK_CIPHER_H_
+#define LINK_CIPHER_H_
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+
+/* from <openssl/evp.h>, builds without USBCOMMUNI_LINK_ENCRYPT have no OpenSSL */
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+namespace usbcommuni {
+
+/**
+ * AES-256-GCM of link frames, see config.link_encrypt.
+ *
+ * The payload of a frame with LINK_FRAME_FLAG_ENC is
+ *
+ *   | key id (8) | counter (4) | ciphertext | tag (16) |
+ *
+ * key id and counter are the 96 bit IV, the frame header is authenticated
+ * along (its length counts the whole payload). Every session sends under
+ * a fresh random key id with the key HMAC-SHA256(secret, "usbcommuni" |
+ * key id). Both ends share config.link_key. EVP runs on AES-NI / ARMv8
+ * AES and PMULL where the CPU has them.
+ *
+ * The receiver pins the key id of the first frame that opens after
+ * Unpin(), i.e. after every (re)connect, and drops any other id without
+ * deriving a key, except a new one once the pinned id's counter ran
+ * out. The last LINK_CIPHER_RETIRED ids it pinned stay refused. Counters
+ * must rise, within a window of LINK_CIPHER_REPLAY_WINDOW frames for the
+ * interrupt pipe and concurrent senders, which may reorder them; a
+ * counter seen before or older than the window is a replay.
+ *
+ * Without USBCOMMUNI_LINK_ENCRYPT the class is an empty shell that is
+ * never enabled, USBCommuni::Start() refuses config.link_encrypt then.
+ */
+#define LINK_CIPHER_IV_SIZE     12
+#define LINK_CIPHER_TAG_SIZE    16
+#define LINK_CIPHER_OVERHEAD    (LINK_CIPHER_IV_SIZE + LINK_CIPHER_TAG_SIZE)
+#define LINK_CIPHER_KEY_SIZE    32
+#define LINK_CIPHER_REPLAY_WINDOW   64
+#define LINK_CIPHER_RETIRED     16
+
+class LinkCipher
+{
+public:
+    LinkCipher();
+    ~LinkCipher();
+
+    /* an empty @secret turns encryption off, set before the link runs */
+    void SetKey(const std::string &secret);
+    bool Enabled() const { return !secret_.empty(); }
+
+    /* send under a new key id from now on, e.g. for a new session */
+    void Rotate();
+
+    /* accept the key id of the peer's next session, receive side */
+    void Unpin();
+
+    /**
+     * IV, @len bytes of @plain encrypted and the tag to @out, which may
+     * not overlap @plain. @aad is the frame header, packed with the
+     * length of the sealed payload.
+     */
+    bool Seal(const char *aad, char *out, const char *plain, uint32_t len);
+
+    /**
+     * Verify and decrypt the sealed @payload of @len bytes in place, the
+     * plaintext is left at @payload + LINK_CIPHER_IV_SIZE. False also for
+     * a key id other than the pinned one and a replayed counter. Receive
+     * side, one thread at a time.
+     */
+    bool Open(const char *aad, char *payload, uint32_t len);
+
+private:
+    void NewTxKey();
+    void DeriveKey(uint64_t key_id, unsigned char *key);
+    bool Fresh(uint64_t key_id, uint32_t counter);
+    void Seen(uint64_t key_id, uint32_t counter);
+
+private:
+    std::string secret_;
+
+    std::mutex tx_mutex_;
+    EVP_CIPHER_CTX *tx_ctx_;
+    uint64_t tx_key_id_;
+    uint32_t tx_counter_;
+
+    EVP_CIPHER_CTX *rx_ctx_;
+    uint64_t rx_key_id_;                /**< rx_ctx_ holds its key */
+    bool rx_keyed_;
+    bool rx_pinned_;
+    uint64_t rx_pinned_id_;             /**< pinned, or until the next session pins one, the last */
+    uint32_t rx_top_;                   /**< highest counter opened under rx_pinned_id_ */
+    uint64_t rx_window_;                /**< bit n: rx_top_ - n was opened */
+    uint64_t rx_retired_[LINK_CIPHER_RETIRED];
+    uint32_t rx_retired_next_;
+};
+
+}
+
+#endif /* LINK_CIPHER_H_ */
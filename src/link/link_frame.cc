@@ -0,0 +1,174 @@
+#include "link_frame.h"
+#include <string.h>
+#include "crc32c.h"
+
+namespace usbcommuni {
+
+static inline void PutBe16(char *p, uint16_t v)
+{
+    p[0] = (v >> 8u);
+    p[1] = (v & 0xFFu);
+}
+
+static inline void PutBe32(char *p, uint32_t v)
+{
+    p[0] = (v >> 24u);
+    p[1] = (v >> 16u);
+    p[2] = (v >> 8u);
+    p[3] = (v & 0xFFu);
+}
+
+static inline uint16_t GetBe16(const char *p)
+{
+    const uint8_t *u = reinterpret_cast<const uint8_t*>(p);
+
+    return (uint16_t)((u[0] << 8u) | u[1]);
+}
+
+static inline uint32_t GetBe32(const char *p)
+{
+    const uint8_t *u = reinterpret_cast<const uint8_t*>(p);
+
+    return ((uint32_t)u[0] << 24u) | ((uint32_t)u[1] << 16u) | ((uint32_t)u[2] << 8u) | u[3];
+}
+
+void LinkFramePack(char *buf, const LinkFrameHead_t &head)
+{
+    PutBe16(buf, LINK_FRAME_MAGIC);
+    buf[2] = LINK_FRAME_VERSION;
+    buf[3] = head.type;
+    buf[4] = head.flags;
+    buf[5] = head.channel;
+    PutBe16(buf + 6, 0);
+    PutBe32(buf + 8, head.length);
+    PutBe32(buf + 12, head.arg);
+}
+
+uint32_t LinkFrameBuild(char *buf, const LinkFrameHead_t &head, const char *payload)
+{
+    uint32_t crc;
+
+    LinkFramePack(buf, head);
+
+    if (!(head.flags & LINK_FRAME_FLAG_CRC)) {
+        if (head.length > 0)
+            memcpy(buf + LINK_FRAME_HEAD_SIZE, payload, head.length);
+        return LINK_FRAME_HEAD_SIZE + head.length;
+    }
+
+    crc = Crc32c(0, buf, LINK_FRAME_HEAD_SIZE);
+    crc = Crc32cCopy(crc, buf + LINK_FRAME_HEAD_SIZE, payload, head.length);
+    PutBe32(buf + LINK_FRAME_HEAD_SIZE + head.length, crc);
+
+    return LinkFrameSize(head);
+}
+
+uint32_t LinkFrameFinish(char *buf, const LinkFrameHead_t &head)
+{
+    LinkFramePack(buf, head);
+
+    if (head.flags & LINK_FRAME_FLAG_CRC)
+        PutBe32(buf + LINK_FRAME_HEAD_SIZE + head.length, Crc32c(0, buf, LINK_FRAME_HEAD_SIZE + head.length));
+
+    return LinkFrameSize(head);
+}
+
+bool LinkFrameUnpack(const char *buf, LinkFrameHead_t &head)
+{
+    if ((GetBe16(buf) != LINK_FRAME_MAGIC) || ((uint8_t)buf[2] != LINK_FRAME_VERSION))
+        return false;
+
+    head.type = buf[3];
+    head.flags = buf[4];
+    head.channel = buf[5];
+    head.length = GetBe32(buf + 8);
+    head.arg = GetBe32(buf + 12);
+
+    return true;
+}
+
+LinkFrameParser::LinkFrameParser(uint32_t max_payload)
+{
+    max_payload_ = max_payload;
+    resync_bytes_ = 0;
+    crc_errors_ = 0;
+}
+
+void LinkFrameParser::Reset()
+{
+    pending_.clear();
+}
+
+uint32_t LinkFrameParser::Parse(const char *data, uint32_t len, const FrameCb &cb)
+{
+    LinkFrameHead_t head;
+    uint32_t skipped = 0;
+
+    while (len - skipped >= LINK_FRAME_HEAD_SIZE) {
+        if (LinkFrameUnpack(data + skipped, head) && (head.length <= max_payload_))
+            break;
+        skipped++;
+    }
+
+    if (skipped > 0) {
+        resync_bytes_ += skipped;
+        return skipped;
+    }
+
+    if ((len < LINK_FRAME_HEAD_SIZE) || (len < LinkFrameSize(head)))
+        return 0;
+
+    if ((head.flags & LINK_FRAME_FLAG_CRC) && 
+        (Crc32c(0, data, LINK_FRAME_HEAD_SIZE + head.length) != GetBe32(data + LINK_FRAME_HEAD_SIZE + head.length)))
+    {
+        crc_errors_++;
+        resync_bytes_++;
+        return 1;
+    }
+
+    cb(head, data + LINK_FRAME_HEAD_SIZE);
+
+    return LinkFrameSize(head);
+}
+
+void LinkFrameParser::Feed(const char *data, uint32_t len, const FrameCb &cb)
+{
+    uint32_t used;
+    uint32_t take;
+    LinkFrameHead_t head;
+
+    /* complete the frame left over from the previous chunk first */
+    while (!pending_.empty() && (len > 0)) {
+        if (pending_.size() < LINK_FRAME_HEAD_SIZE) {
+            take = LINK_FRAME_HEAD_SIZE - pending_.size();
+        } else {
+            LinkFrameUnpack(pending_.data(), head);
+            take = LinkFrameSize(head) - pending_.size();
+        }
+        if (take > len)
+            take = len;
+
+        pending_.insert(pending_.end(), data, data + take);
+        data += take;
+        len -= take;
+
+        while (!pending_.empty()) {
+            used = Parse(pending_.data(), pending_.size(), cb);
+            if (used == 0)
+                break;
+            pending_.erase(pending_.begin(), pending_.begin() + used);
+        }
+    }
+
+    while (len > 0) {
+        used = Parse(data, len, cb);
+        if (used == 0) {
+            pending_.assign(data, data + len);
+            break;
+        }
+        data += used;
+        len -= used;
+    }
+}
+
+}
@@ -0,0 +1,104 @@
+#ifndef LINK_FRAME_H_
+#define LINK_FRAME_H_
+
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+namespace usbcommuni {
+
+/**
+ * Link frame, carried raw on the Android bulk pipe and as the payload of
+ * a Peertalk frame on iOS. All fields are big endian.
+ *
+ *   0       2       3      4       5         6          8        12      16
+ *   | magic | ver   | type | flags | channel | reserved | length | arg   | payload ...
+ *
+ * @length is the payload length, @arg depends on @type. With
+ * LINK_FRAME_FLAG_CRC the payload is followed by the CRC32C of header
+ * and payload. With LINK_FRAME_FLAG_SEQ the @arg of a DATA frame is its
+ * sequence number in the sender's session. With LINK_FRAME_FLAG_ENC the
+ * payload is sealed, see link_cipher.h.
+ */
+#define LINK_FRAME_MAGIC        0x5543      /* "UC" */
+#define LINK_FRAME_VERSION      1
+#define LINK_FRAME_HEAD_SIZE    16
+#define LINK_FRAME_CRC_SIZE     4
+
+#define LINK_FRAME_FLAG_CRC     0x01
+#define LINK_FRAME_FLAG_SEQ     0x02
+#define LINK_FRAME_FLAG_ENC     0x04
+
+typedef enum LinkFrameTypes {
+    LINK_FRAME_DATA = 0,        /**< application payload */
+    LINK_FRAME_CREDIT,          /**< @arg: payload bytes the receiver has consumed */
+    LINK_FRAME_PING,            /**< @arg: sequence, payload is echoed back in the PONG */
+    LINK_FRAME_PONG,            /**< @arg and payload of the PING answered */
+    LINK_FRAME_ACK,             /**< @arg: last DATA sequence received in order */
+    LINK_FRAME_NAK,             /**< @arg: as ACK, a later frame was lost, resend what follows */
+    LINK_FRAME_RESUME,          /**< @arg: as ACK, payload: own and last seen peer session id */
+} LinkFrameTypes_t;
+
+typedef struct LinkFrameHead {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t channel;
+    uint32_t length;
+    uint32_t arg;
+} LinkFrameHead_t;
+
+/* header, payload and trailer */
+static inline uint32_t LinkFrameSize(const LinkFrameHead_t &head)
+{
+    return LINK_FRAME_HEAD_SIZE + head.length + ((head.flags & LINK_FRAME_FLAG_CRC) ? LINK_FRAME_CRC_SIZE : 0);
+}
+
+void LinkFramePack(char *buf, const LinkFrameHead_t &head);
+
+/**
+ * Header, @head.length bytes of @payload and, with LINK_FRAME_FLAG_CRC,
+ * the trailer, checksummed while copying. Returns LinkFrameSize().
+ */
+uint32_t LinkFrameBuild(char *buf, const LinkFrameHead_t &head, const char *payload);
+
+/* header and, with LINK_FRAME_FLAG_CRC, the trailer around the payload already in @buf */
+uint32_t LinkFrameFinish(char *buf, const LinkFrameHead_t &head);
+
+/* false if @buf does not start with a valid header */
+bool LinkFrameUnpack(const char *buf, LinkFrameHead_t &head);
+
+/**
+ * Reassembles frames from the transport byte stream. Whole frames found
+ * in the input are handed out in place, only partial frames are copied.
+ * Garbage is skipped byte by byte until the next valid header, a frame
+ * failing its CRC is treated as garbage as its length cannot be trusted.
+ */
+class LinkFrameParser
+{
+public:
+    typedef std::function<void (const LinkFrameHead_t &head, const char *payload)> FrameCb;
+
+    explicit LinkFrameParser(uint32_t max_payload = 1024*1024*2);
+
+    void Feed(const char *data, uint32_t len, const FrameCb &cb);
+    void Reset();
+
+    void SetMaxPayload(uint32_t max_payload) { max_payload_ = max_payload; }
+
+    uint64_t GetResyncBytes() const { return resync_bytes_; }
+    uint64_t GetCrcErrors() const { return crc_errors_; }
+
+private:
+    /* bytes of @data consumed, 0 if more input is needed */
+    uint32_t Parse(const char *data, uint32_t len, const FrameCb &cb);
+
+private:
+    uint32_t max_payload_;
+    std::vector<char> pending_;
+    uint64_t resync_bytes_;
+    uint64_t crc_errors_;
+};
+
+}
+
+#endif /* LINK_FRAME_H_ */
@@ -0,0 +1,1049 @@
+#include "link_layer.h"
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+namespace usbcommuni {
+
+#define LINK_RESUME_SIZE        16
+#define LINK_RESUME_RETRY_MS    1000
+#define LINK_ACK_TICK_MS        50
+
+/* wire bytes a frame adds to its payload at most */
+#define LINK_FRAME_OVERHEAD     (LINK_FRAME_HEAD_SIZE + LINK_CIPHER_OVERHEAD + LINK_FRAME_CRC_SIZE)
+
+/* set while the receive path runs application callbacks */
+static thread_local bool t_in_feed = false;
+
+/* set by LinkNoWait */
+static thread_local bool t_no_wait = false;
+
+static inline void PutBe64(char *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--, v >>= 8u)
+        p[i] = (v & 0xFFu);
+}
+
+static inline uint64_t GetBe64(const char *p)
+{
+    const uint8_t *u = reinterpret_cast<const uint8_t*>(p);
+    uint64_t v = 0;
+
+    for (int i = 0; i < 8; i++)
+        v = (v << 8u) | u[i];
+
+    return v;
+}
+
+/* sequence numbers wrap, compare them by distance */
+static inline int32_t SeqDiff(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b);
+}
+
+LinkNoWait::LinkNoWait()
+{
+    saved_ = t_no_wait;
+    t_no_wait = true;
+}
+
+LinkNoWait::~LinkNoWait()
+{
+    t_no_wait = saved_;
+}
+
+LinkLayer::LinkLayer()
+{
+    transport_ = nullptr;
+    recv_handle_ = nullptr;
+    wake_handle_ = nullptr;
+    rx_consumed_ = 0;
+    tx_credit_ = 0;
+    hb_seq_ = 0;
+    hb_missed_ = 0;
+    memset(&rtt_, 0, sizeof(rtt_));
+
+    unacked_bytes_ = 0;
+    tx_seq_ = 0;
+    tx_sent_ = 0;
+    tx_resumed_ = false;
+    tx_resend_ = false;
+    peer_session_ = 0;
+    rx_seq_ = 0;
+    ack_pending_ = false;
+    rx_ack_bytes_ = 0;
+    rx_gap_ = false;
+
+    /* tells a restarted process apart from one resuming after a re-plug */
+    do {
+        std::random_device rd;
+        session_ = ((uint64_t)rd() << 32u) | rd();
+    } while (session_ == 0);
+
+    tx_frames_ = 0;
+    rx_frames_ = 0;
+    credit_blocked_count_ = 0;
+    credit_blocked_us_ = 0;
+    credit_timeouts_ = 0;
+    credit_grants_sent_ = 0;
+    credit_grants_received_ = 0;
+    resumes_ = 0;
+    session_restarts_ = 0;
+    resent_frames_ = 0;
+    rx_duplicates_ = 0;
+    rx_gaps_ = 0;
+    rx_auth_failures_ = 0;
+    tx_seal_failures_ = 0;
+    tx_expired_ = 0;
+    rate_limits_ = 0;
+    rate_blocked_count_ = 0;
+    rate_blocked_us_ = 0;
+    rate_timeouts_ = 0;
+}
+
+void LinkLayer::SetConfig(const USBCommuniConfig_t &config)
+{
+    uint32_t max_payload;
+
+    config_ = config;
+    cipher_.SetKey(config_.link_encrypt ? config_.link_key : std::string());
+    max_payload = config_.link_max_payload + (cipher_.Enabled() ? LINK_CIPHER_OVERHEAD : 0);
+
+    rx_mutex_.lock();
+    parser_.SetMaxPayload(max_payload);
+    dgram_parser_.SetMaxPayload(max_payload);
+    rx_mutex_.unlock();
+
+    SetLinkRate(config_.rate_limit_bps, config_.rate_limit_burst);
+
+    Reset();
+}
+
+void LinkLayer::TransportRegister(LinkTransportCb transport)
+{
+    transport_ = transport;
+}
+
+void LinkLayer::RecvHandleRegister(LinkRecvCb recvcb)
+{
+    recv_handle_ = recvcb;
+}
+
+void LinkLayer::WakeRegister(std::function<void()> wakecb)
+{
+    wake_handle_ = wakecb;
+}
+
+void LinkLayer::Reset()
+{
+    rx_mutex_.lock();
+    parser_.Reset();
+    rx_consumed_ = 0;
+    rx_gap_ = false;
+    /* the peer's next session may send under a new key id, only that one is taken then */
+    cipher_.Unpin();
+    rx_mutex_.unlock();
+
+    /* new frames wait in the resend buffer until the next handshake */
+    rel_mutex_.lock();
+    tx_resumed_ = false;
+    tx_resend_ = false;
+    rel_mutex_.unlock();
+
+    tx_mutex_.lock();
+    tx_credit_ = config_.link_credit_window;
+    tx_mutex_.unlock();
+    tx_cond_.notify_all();
+
+    cipher_.Rotate();
+
+    hb_mutex_.lock();
+    hb_missed_ = 0;
+    hb_next_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(config_.heartbeat_interval_ms);
+    hb_mutex_.unlock();
+}
+
+void LinkLayer::Resume()
+{
+    if (!config_.link_enable || !config_.link_reliable)
+        return;
+
+    rel_mutex_.lock();
+    resume_sent_ = std::chrono::steady_clock::now();
+    rel_mutex_.unlock();
+
+    SendResume();
+}
+
+USBCommuniErrors_t LinkLayer::Send(uint8_t channel, const char *data, uint32_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = const_cast<char*>(data);
+    iov.iov_len = len;
+
+    return SendBatch(channel, &iov, 1, nullptr);
+}
+
+USBCommuniErrors_t LinkLayer::SendBatch(uint8_t channel, const struct iovec *iov, uint32_t iovcnt,
+                                        USBCommuniErrors_t *results, const LinkDeadline *deadlines)
+{
+    USBCommuniErrors_t err;
+    LinkFrameHead_t head;
+    uint64_t total = 0;
+    uint32_t offset = 0;
+    uint32_t len;
+    uint32_t i;
+
+    if ((nullptr == iov) || (iovcnt == 0) || (nullptr == transport_))
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    for (i = 0; i < iovcnt; i++) {
+        if ((iov[i].iov_len == 0) || (iov[i].iov_len > config_.link_max_payload))
+            return USBCOMMUNI_E_INVAIL_ARG;
+        total += iov[i].iov_len;
+    }
+
+    /* credit first, a batch that times out on it must not have spent rate tokens */
+    err = AcquireCredit(total);
+    if (USBCOMMUNI_E_SUCCESS == err) {
+        err = Throttle(channel, total);
+        if (USBCOMMUNI_E_SUCCESS != err)
+            ReturnCredit(total);
+    }
+
+    if (USBCOMMUNI_E_SUCCESS != err) {
+        if (results) {
+            for (i = 0; i < iovcnt; i++)
+                results[i] = err;
+        }
+        return err;
+    }
+
+    if (config_.link_reliable) {
+        /* a full resend buffer turns the batch away, the credit and tokens were never used */
+        err = SendReliable(channel, iov, iovcnt, total, results, deadlines);
+        if (USBCOMMUNI_E_SUCCESS != err) {
+            ReturnCredit(total);
+            Unthrottle(channel, total);
+        }
+        return err;
+    }
+
+    std::vector<char> buffer(total + (uint64_t)iovcnt * LINK_FRAME_OVERHEAD);
+    std::vector<struct iovec> frames;
+    std::vector<uint32_t> framed;
+    std::vector<USBCommuniErrors_t> frame_results(iovcnt, USBCOMMUNI_E_SUCCESS);
+    std::vector<USBCommuniErrors_t> iov_results(iovcnt, USBCOMMUNI_E_CIPHER);
+
+    frames.reserve(iovcnt);
+    framed.reserve(iovcnt);
+
+    for (i = 0; i < iovcnt; i++) {
+        head.type = LINK_FRAME_DATA;
+        head.flags = config_.link_crc ? LINK_FRAME_FLAG_CRC : 0;
+        head.channel = channel;
+        head.length = iov[i].iov_len;
+        head.arg = 0;
+
+        /* a frame that could not be sealed is never handed out */
+        len = BuildFrame(buffer.data() + offset, head, static_cast<const char*>(iov[i].iov_base));
+        if (len == 0)
+            continue;
+
+        frames.push_back(iovec());
+        frames.back().iov_base = buffer.data() + offset;
+        frames.back().iov_len = len;
+        framed.push_back(i);
+        offset += len;
+    }
+
+    err = frames.empty() ? USBCOMMUNI_E_CIPHER : transport_(frames.data(), frames.size(), frame_results.data());
+    if ((frames.size() < iovcnt) && (USBCOMMUNI_E_SUCCESS == err))
+        err = USBCOMMUNI_E_CIPHER;
+
+    for (i = 0; i < frames.size(); i++)
+        iov_results[framed[i]] = frame_results[i];
+
+    /* credit and tokens are only spent on what reached the backend */
+    total = 0;
+    for (i = 0; i < iovcnt; i++) {
+        if (iov_results[i] == USBCOMMUNI_E_SUCCESS) {
+            tx_frames_++;
+        } else {
+            ReturnCredit(iov[i].iov_len);
+            total += iov[i].iov_len;
+        }
+
+        if (results)
+            results[i] = iov_results[i];
+    }
+
+    Unthrottle(channel, total);
+
+    return err;
+}
+
+/**
+ * Accepted frames are owned by the session from here on, they go out now
+ * if the handshake is done and again after every reconnect until acked,
+ * unless they turn late first.
+ */
+USBCommuniErrors_t LinkLayer::SendReliable(uint8_t channel, const struct iovec *iov, uint32_t iovcnt,
+                                           uint64_t total, USBCommuniErrors_t *results,
+                                           const LinkDeadline *deadlines)
+{
+    USBCommuniErrors_t err = USBCOMMUNI_E_SUCCESS;
+    uint32_t timeout_ms = CanWait() ? config_.link_credit_timeout_ms : 0;
+    uint64_t refund = 0;
+    uint32_t i;
+
+    {
+        std::unique_lock<std::mutex> lock(rel_mutex_);
+
+        /* an empty buffer takes any batch, so batches larger than the window still pass */
+        if (!rel_cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this, total]() {
+                return unacked_.empty() || (unacked_bytes_ + total <= config_.link_reliable_window);
+            }))
+        {
+            err = USBCOMMUNI_E_TIMEOUT;
+        } else {
+            for (i = 0; i < iovcnt; i++) {
+                const char *base = static_cast<const char*>(iov[i].iov_base);
+
+                unacked_.push_back(Unacked());
+                unacked_.back().seq = ++tx_seq_;
+                unacked_.back().channel = channel;
+                unacked_.back().deadline = deadlines ? deadlines[i] : LinkDeadline::max();
+                unacked_.back().payload.assign(base, base + iov[i].iov_len);
+                unacked_bytes_ += iov[i].iov_len;
+            }
+        }
+    }
+
+    /*
+     * A failed transport is no loss, the next handshake sends them again,
+     * but the credit comes back now. With a resend queued they go out
+     * along with it, in order.
+     */
+    if (USBCOMMUNI_E_SUCCESS == err) {
+        tx_frames_ += Transmit(false, refund);
+        ReturnCredit(refund);
+    }
+
+    if (results) {
+        for (i = 0; i < iovcnt; i++)
+            results[i] = err;
+    }
+
+    return err;
+}
+
+/**
+ * Frames of the resend buffer to the transport in sequence order, with
+ * @resend all of them if a resend is due, else those never handed out.
+ * They are built under rel_mutex_ and sent without it, so ACKs, NAKs and
+ * RESUMEs on the receive thread never wait for a slow backend; rel_tx_mutex_
+ * keeps concurrent callers in order. Returns the frames taken, @refund
+ * the payload of first sends the transport refused or that turned late.
+ */
+uint32_t LinkLayer::Transmit(bool resend, uint64_t &refund)
+{
+    LinkFrameHead_t head;
+    uint64_t bytes = 0;
+    uint32_t offset = 0;
+    uint32_t sent = 0;
+    uint32_t after;
+    size_t from, i;
+    std::lock_guard<std::mutex> order(rel_tx_mutex_);
+    std::unique_lock<std::mutex> lock(rel_mutex_);
+
+    refund = 0;
+
+    if (nullptr == transport_)
+        return 0;
+
+    if (resend) {
+        if (!tx_resend_)
+            return 0;
+        tx_resend_ = false;
+    }
+
+    if (!tx_resumed_ || tx_resend_)
+        return 0;
+
+    /* after a NAK or RESUME the peer holds nothing of the buffer, else it may hold what went out */
+    after = tx_sent_;
+    if (resend)
+        after = unacked_.empty() ? tx_seq_ : unacked_.front().seq - 1;
+
+    refund = DropLate(after);
+    tx_sent_ = after;
+
+    for (from = 0; (from < unacked_.size()) && (SeqDiff(unacked_[from].seq, after) <= 0); from++)
+        ;
+
+    if (from >= unacked_.size())
+        return 0;
+
+    for (i = from; i < unacked_.size(); i++)
+        bytes += unacked_[i].payload.size() + LINK_FRAME_OVERHEAD;
+
+    std::vector<char> buffer(bytes);
+    std::vector<struct iovec> frames;
+    std::vector<uint32_t> lengths;
+
+    frames.reserve(unacked_.size() - from);
+    lengths.reserve(unacked_.size() - from);
+
+    for (i = from; i < unacked_.size(); i++) {
+        head.type = LINK_FRAME_DATA;
+        head.flags = LINK_FRAME_FLAG_SEQ | (config_.link_crc ? LINK_FRAME_FLAG_CRC : 0);
+        head.channel = unacked_[i].channel;
+        head.length = unacked_[i].payload.size();
+        head.arg = unacked_[i].seq;
+
+        /* the rest stays buffered, the next send, NAK or handshake tries again */
+        frames.push_back(iovec());
+        frames.back().iov_base = buffer.data() + offset;
+        frames.back().iov_len = BuildFrame(buffer.data() + offset, head, unacked_[i].payload.data());
+        if (frames.back().iov_len == 0) {
+            frames.pop_back();
+            break;
+        }
+
+        offset += frames.back().iov_len;
+        lengths.push_back(head.length);
+        tx_sent_ = unacked_[i].seq;
+    }
+
+    lock.unlock();
+
+    if (frames.empty())
+        return 0;
+
+    std::vector<USBCommuniErrors_t> results(frames.size(), USBCOMMUNI_E_SUCCESS);
+    transport_(frames.data(), frames.size(), results.data());
+
+    for (i = 0; i < frames.size(); i++) {
+        if (USBCOMMUNI_E_SUCCESS == results[i])
+            sent++;
+        else if (!resend)
+            refund += lengths[i];
+    }
+
+    return sent;
+}
+
+/**
+ * Drop the frames past their deadline among those after @after, which
+ * the peer does not hold, and number the rest on from @after so it sees
+ * no gap. Returns the payload of dropped frames never handed out, their
+ * credit was never used. rel_mutex_ held.
+ */
+uint64_t LinkLayer::DropLate(uint32_t after)
+{
+    LinkDeadline now = std::chrono::steady_clock::now();
+    uint64_t unused = 0;
+    uint32_t seq = after;
+    bool dropped = false;
+
+    for (auto it = unacked_.begin(); it != unacked_.end(); ) {
+        if (SeqDiff(it->seq, after) <= 0) {
+            ++it;
+            continue;
+        }
+
+        if (it->deadline <= now) {
+            if (SeqDiff(it->seq, tx_sent_) > 0)
+                unused += it->payload.size();
+            unacked_bytes_ -= it->payload.size();
+            tx_expired_++;
+            it = unacked_.erase(it);
+            dropped = true;
+            continue;
+        }
+
+        it->seq = ++seq;
+        ++it;
+    }
+
+    if (dropped) {
+        tx_seq_ = seq;
+        rel_cond_.notify_all();
+    }
+
+    return unused;
+}
+
+/* the peer has everything up to @seq, rel_mutex_ held */
+void LinkLayer::Trim(uint32_t seq)
+{
+    while (!unacked_.empty() && (SeqDiff(seq, unacked_.front().seq) >= 0)) {
+        unacked_bytes_ -= unacked_.front().payload.size();
+        unacked_.pop_front();
+    }
+
+    rel_cond_.notify_all();
+}
+
+/* true if the DATA frame is the next in order and to be delivered, rx_mutex_ held */
+bool LinkLayer::OnSequenced(const LinkFrameHead_t &head)
+{
+    int32_t diff = SeqDiff(head.arg, rx_seq_);
+
+    if (diff <= 0) {
+        /* sent again after a resume or NAK, delivered before */
+        rx_duplicates_++;
+        return false;
+    }
+
+    if (diff > 1) {
+        /* something in between failed its CRC, one NAK until the gap closes */
+        rx_gaps_++;
+        if (!rx_gap_)
+            rx_gap_ = (SendControl(LINK_FRAME_NAK, rx_seq_) == USBCOMMUNI_E_SUCCESS);
+        return false;
+    }
+
+    rx_seq_ = head.arg;
+    rx_gap_ = false;
+
+    /* ACK every quarter window, the tick sends the rest */
+    rx_ack_bytes_ += head.length;
+    if (rx_ack_bytes_ >= config_.link_reliable_window / 4) {
+        if (SendControl(LINK_FRAME_ACK, rx_seq_) == USBCOMMUNI_E_SUCCESS) {
+            rx_ack_bytes_ = 0;
+            ack_pending_ = false;
+            return true;
+        }
+    }
+    ack_pending_ = true;
+
+    return true;
+}
+
+void LinkLayer::OnNak(uint32_t seq)
+{
+    {
+        std::lock_guard<std::mutex> lock(rel_mutex_);
+
+        Trim(seq);
+
+        /* before the handshake there is nothing to repeat, it sends the buffer anyway */
+        if (!tx_resumed_)
+            return;
+        tx_resend_ = true;
+    }
+
+    if (wake_handle_)
+        wake_handle_();
+}
+
+/* what OnNak() and OnResume() asked for, a blocking transport must not stall the receive thread */
+void LinkLayer::Resend()
+{
+    uint64_t refund;
+
+    resent_frames_ += Transmit(true, refund);
+}
+
+void LinkLayer::OnResume(const LinkFrameHead_t &head, const char *payload)
+{
+    uint64_t peer;
+    uint64_t known;
+    bool resumed;
+
+    if (!config_.link_reliable || (head.length < LINK_RESUME_SIZE))
+        return;
+
+    peer = GetBe64(payload);
+    known = GetBe64(payload + 8);
+
+    /* a new peer session numbers its frames from the start */
+    if (peer != peer_session_) {
+        if (peer_session_ != 0)
+            session_restarts_++;
+        peer_session_ = peer;
+        rx_seq_ = 0;
+        rx_ack_bytes_ = 0;
+        rx_gap_ = false;
+        ack_pending_ = false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(rel_mutex_);
+
+        if (known == session_) {
+            Trim(head.arg);
+        } else {
+            /* the peer never saw our session, what it holds of it is nothing */
+            tx_seq_ = 0;
+            for (Unacked &u : unacked_)
+                u.seq = ++tx_seq_;
+        }
+
+        resumed = tx_resumed_;
+        tx_resumed_ = true;
+        tx_resend_ = true;
+    }
+
+    resumes_++;
+
+    if (wake_handle_)
+        wake_handle_();
+
+    /* a second RESUME on this link means ours never arrived */
+    if (resumed)
+        SendResume();
+}
+
+void LinkLayer::SendResume()
+{
+    char payload[LINK_RESUME_SIZE];
+
+    PutBe64(payload, session_);
+    PutBe64(payload + 8, peer_session_);
+
+    SendControl(LINK_FRAME_RESUME, rx_seq_, payload, sizeof(payload));
+}
+
+/* flushes the pending ACK and repeats an unanswered RESUME */
+uint32_t LinkLayer::ReliableTick()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    bool resend;
+
+    if (ack_pending_.exchange(false))
+        SendControl(LINK_FRAME_ACK, rx_seq_);
+
+    /* a caller without WakeRegister() picks up resends here */
+    Resend();
+
+    rel_mutex_.lock();
+    resend = !tx_resumed_ && (now - resume_sent_ >= std::chrono::milliseconds(LINK_RESUME_RETRY_MS));
+    if (resend)
+        resume_sent_ = now;
+    rel_mutex_.unlock();
+
+    if (resend)
+        SendResume();
+
+    return LINK_ACK_TICK_MS;
+}
+
+void LinkLayer::SetLinkRate(uint64_t bytes_per_sec, uint32_t burst)
+{
+    std::lock_guard<std::mutex> lock(rate_mutex_);
+
+    /* Throttle() skips the lock while no bucket has a cap */
+    if (link_bucket_.Unlimited() && (bytes_per_sec != 0))
+        rate_limits_++;
+    else if (!link_bucket_.Unlimited() && (bytes_per_sec == 0))
+        rate_limits_--;
+
+    link_bucket_.SetRate(bytes_per_sec, burst);
+    rate_cond_.notify_all();
+}
+
+void LinkLayer::SetChannelRate(uint8_t channel, uint64_t bytes_per_sec, uint32_t burst)
+{
+    std::lock_guard<std::mutex> lock(rate_mutex_);
+    TokenBucket &bucket = channel_buckets_[channel];
+
+    /* Throttle() skips the lock while no bucket has a cap */
+    if (bucket.Unlimited() && (bytes_per_sec != 0))
+        rate_limits_++;
+    else if (!bucket.Unlimited() && (bytes_per_sec == 0))
+        rate_limits_--;
+
+    bucket.SetRate(bytes_per_sec, burst);
+    rate_cond_.notify_all();
+}
+
+USBCommuniErrors_t LinkLayer::Throttle(uint8_t channel, uint64_t bytes)
+{
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point now;
+    std::chrono::steady_clock::time_point deadline;
+    uint64_t wait_us;
+    bool blocked = false;
+
+    if (rate_limits_ == 0)
+        return USBCOMMUNI_E_SUCCESS;
+
+    start = std::chrono::steady_clock::now();
+    deadline = start + std::chrono::milliseconds(config_.rate_limit_timeout_ms);
+
+    std::unique_lock<std::mutex> lock(rate_mutex_);
+
+    while (true) {
+        now = std::chrono::steady_clock::now();
+        wait_us = std::max(link_bucket_.WaitUs(now), channel_buckets_[channel].WaitUs(now));
+        if (wait_us == 0)
+            break;
+
+        /* no point sleeping past the deadline, nor where sleeping stalls the receive path */
+        if (!CanWait() || (now + std::chrono::microseconds(wait_us) > deadline)) {
+            rate_timeouts_++;
+            return USBCOMMUNI_E_TIMEOUT;
+        }
+
+        blocked = true;
+        rate_cond_.wait_for(lock, std::chrono::microseconds(wait_us));
+    }
+
+    link_bucket_.Take(bytes);
+    channel_buckets_[channel].Take(bytes);
+
+    if (blocked) {
+        rate_blocked_count_++;
+        rate_blocked_us_ += std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+    }
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+void LinkLayer::Unthrottle(uint8_t channel, uint64_t bytes)
+{
+    if ((rate_limits_ == 0) || (bytes == 0))
+        return;
+
+    rate_mutex_.lock();
+    link_bucket_.Give(bytes);
+    channel_buckets_[channel].Give(bytes);
+    rate_mutex_.unlock();
+    rate_cond_.notify_all();
+}
+
+/* false inside a receive callback or on an external loop, the waiter would block its own wakeup */
+bool LinkLayer::CanWait() const
+{
+    return !t_in_feed && !t_no_wait && !config_.external_loop;
+}
+
+USBCommuniErrors_t LinkLayer::AcquireCredit(uint32_t bytes)
+{
+    uint32_t timeout_ms;
+    bool granted;
+
+    if (config_.link_credit_window == 0)
+        return USBCOMMUNI_E_SUCCESS;
+
+    std::unique_lock<std::mutex> lock(tx_mutex_);
+
+    /* a sender inside a receive callback would wait for its own thread */
+    if (tx_credit_ <= 0) {
+        timeout_ms = CanWait() ? config_.link_credit_timeout_ms : 0;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        granted = tx_cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms), 
+                                    [this]() { return tx_credit_ > 0; });
+
+        credit_blocked_count_++;
+        credit_blocked_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - start).count();
+
+        if (!granted) {
+            credit_timeouts_++;
+            return USBCOMMUNI_E_TIMEOUT;
+        }
+    }
+
+    /* may overshoot by one frame, so frames larger than the window still pass */
+    tx_credit_ -= bytes;
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+void LinkLayer::ReturnCredit(uint32_t bytes)
+{
+    if (config_.link_credit_window == 0)
+        return;
+
+    tx_mutex_.lock();
+    tx_credit_ += bytes;
+    if (tx_credit_ > (int64_t)config_.link_credit_window)
+        tx_credit_ = config_.link_credit_window;
+    tx_mutex_.unlock();
+    tx_cond_.notify_all();
+}
+
+USBCommuniErrors_t LinkLayer::SendControl(uint8_t type, uint32_t arg, const char *payload, uint32_t len)
+{
+    char frame[64 + LINK_FRAME_OVERHEAD];
+    LinkFrameHead_t head;
+    struct iovec iov;
+
+    if (nullptr == transport_)
+        return USBCOMMUNI_E_NOT_CONN;
+
+    if (len > sizeof(frame) - LINK_FRAME_OVERHEAD)
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    head.type = type;
+    head.flags = config_.link_crc ? LINK_FRAME_FLAG_CRC : 0;
+    head.channel = 0;
+    head.length = len;
+    head.arg = arg;
+
+    iov.iov_base = frame;
+    iov.iov_len = BuildFrame(frame, head, payload);
+    if (iov.iov_len == 0)
+        return USBCOMMUNI_E_CIPHER;
+
+    return transport_(&iov, 1, nullptr);
+}
+
+uint32_t LinkLayer::Heartbeat(bool &stalled)
+{
+    uint32_t next = Ping(stalled);
+
+    if (config_.link_enable && config_.link_reliable)
+        next = std::min(next, ReliableTick());
+
+    return next;
+}
+
+uint32_t LinkLayer::Ping(bool &stalled)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    int64_t stamp;
+    uint32_t seq;
+
+    stalled = false;
+
+    if (!config_.link_enable || (config_.heartbeat_interval_ms == 0))
+        return USBCOMMUNI_WAIT_FOREVER;
+
+    {
+        std::lock_guard<std::mutex> lock(hb_mutex_);
+
+        if (now < hb_next_)
+            return std::chrono::duration_cast<std::chrono::milliseconds>(hb_next_ - now).count() + 1;
+
+        hb_next_ = now + std::chrono::milliseconds(config_.heartbeat_interval_ms);
+
+        if (hb_missed_ >= config_.heartbeat_miss_limit) {
+            hb_missed_ = 0;
+            rtt_.stalls++;
+            stalled = true;
+            return config_.heartbeat_interval_ms;
+        }
+
+        hb_missed_++;
+        seq = ++hb_seq_;
+        rtt_.pings_sent++;
+    }
+
+    /* opaque to the peer, it only echoes the payload */
+    stamp = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+    SendControl(LINK_FRAME_PING, seq, reinterpret_cast<const char*>(&stamp), sizeof(stamp));
+
+    return config_.heartbeat_interval_ms;
+}
+
+void LinkLayer::OnPong(const LinkFrameHead_t &head, const char *payload)
+{
+    int64_t stamp;
+    int64_t now;
+    uint32_t rtt;
+    uint32_t bucket;
+
+    if (head.length != sizeof(stamp))
+        return;
+
+    memcpy(&stamp, payload, sizeof(stamp));
+    now = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    if (now < stamp)
+        return;
+
+    rtt = (now - stamp > UINT32_MAX) ? UINT32_MAX : (uint32_t)(now - stamp);
+
+    for (bucket = 0; bucket < USBCOMMUNI_RTT_BUCKETS - 1; bucket++) {
+        if (rtt < (64u << bucket))
+            break;
+    }
+
+    std::lock_guard<std::mutex> lock(hb_mutex_);
+
+    hb_missed_ = 0;
+    rtt_.pongs_received++;
+    rtt_.last_us = rtt;
+    rtt_.sum_us += rtt;
+    if ((rtt_.min_us == 0) || (rtt < rtt_.min_us))
+        rtt_.min_us = rtt;
+    if (rtt > rtt_.max_us)
+        rtt_.max_us = rtt;
+    rtt_.buckets[bucket]++;
+}
+
+void LinkLayer::GetRttStats(USBCommuniRttStats_t &stats)
+{
+    std::lock_guard<std::mutex> lock(hb_mutex_);
+
+    stats = rtt_;
+}
+
+/* sealed while copying the payload in, 0 if that failed, callers must not send it then */
+uint32_t LinkLayer::BuildFrame(char *buf, LinkFrameHead_t &head, const char *payload)
+{
+    uint32_t len = head.length;
+
+    if (!cipher_.Enabled())
+        return LinkFrameBuild(buf, head, payload);
+
+    head.flags |= LINK_FRAME_FLAG_ENC;
+    head.length += LINK_CIPHER_OVERHEAD;
+    LinkFramePack(buf, head);
+
+    if (!cipher_.Seal(buf, buf + LINK_FRAME_HEAD_SIZE, payload, len)) {
+        tx_seal_failures_++;
+        return 0;
+    }
+
+    return LinkFrameFinish(buf, head);
+}
+
+/* parser output, opened before OnFrame() sees it, rx_mutex_ held */
+void LinkLayer::OnWireFrame(const LinkFrameHead_t &head, const char *payload)
+{
+    LinkFrameHead_t plain;
+    bool sealed = (head.flags & LINK_FRAME_FLAG_ENC);
+
+    if (!cipher_.Enabled() && !sealed) {
+        OnFrame(head, payload);
+        return;
+    }
+
+    /*
+     * The payload lies in the backend's receive buffer or the parser's own,
+     * with the header right in front of it, both are free to overwrite.
+     */
+    if (!cipher_.Enabled() || !sealed ||
+        !cipher_.Open(payload - LINK_FRAME_HEAD_SIZE, const_cast<char*>(payload), head.length))
+    {
+        rx_auth_failures_++;
+        return;
+    }
+
+    plain = head;
+    plain.flags &= ~LINK_FRAME_FLAG_ENC;
+    plain.length -= LINK_CIPHER_OVERHEAD;
+
+    OnFrame(plain, payload + LINK_CIPHER_IV_SIZE);
+}
+
+void LinkLayer::OnFrame(const LinkFrameHead_t &head, const char *payload)
+{
+    bool deliver;
+
+    switch (head.type) {
+    case LINK_FRAME_DATA:
+        rx_frames_++;
+        deliver = !(config_.link_reliable && (head.flags & LINK_FRAME_FLAG_SEQ)) || OnSequenced(head);
+        if (deliver && recv_handle_)
+            recv_handle_(head.channel, payload, head.length);
+
+        /* dropped frames were paid for by the sender all the same */
+        if (config_.link_credit_window == 0)
+            break;
+
+        rx_consumed_ += head.length;
+        if (rx_consumed_ >= config_.link_credit_window / 4) {
+            if (SendControl(LINK_FRAME_CREDIT, rx_consumed_) == USBCOMMUNI_E_SUCCESS) {
+                credit_grants_sent_++;
+                rx_consumed_ = 0;
+            }
+        }
+        break;
+
+    case LINK_FRAME_CREDIT:
+        credit_grants_received_++;
+        ReturnCredit(head.arg);
+        break;
+
+    case LINK_FRAME_PING:
+        SendControl(LINK_FRAME_PONG, head.arg, payload, head.length);
+        break;
+
+    case LINK_FRAME_PONG:
+        OnPong(head, payload);
+        break;
+
+    case LINK_FRAME_ACK:
+        if (config_.link_reliable) {
+            std::lock_guard<std::mutex> lock(rel_mutex_);
+            Trim(head.arg);
+        }
+        break;
+
+    case LINK_FRAME_NAK:
+        if (config_.link_reliable)
+            OnNak(head.arg);
+        break;
+
+    case LINK_FRAME_RESUME:
+        OnResume(head, payload);
+        break;
+
+    default:
+        /* unknown types are skipped, newer peers may send them */
+        break;
+    }
+}
+
+void LinkLayer::Feed(const char *data, uint32_t len)
+{
+    std::lock_guard<std::mutex> lock(rx_mutex_);
+
+    t_in_feed = true;
+    parser_.Feed(data, len, [this](const LinkFrameHead_t &head, const char *payload) { OnWireFrame(head, payload); });
+    t_in_feed = false;
+}
+
+void LinkLayer::FeedDatagram(const char *data, uint32_t len)
+{
+    std::lock_guard<std::mutex> lock(rx_mutex_);
+
+    /* a partial frame never continues in the next transfer */
+    t_in_feed = true;
+    dgram_parser_.Feed(data, len, [this](const LinkFrameHead_t &head, const char *payload) { OnWireFrame(head, payload); });
+    dgram_parser_.Reset();
+    t_in_feed = false;
+}
+
+void LinkLayer::GetStats(USBCommuniLinkStats_t &stats)
+{
+    stats.tx_frames = tx_frames_;
+    stats.rx_frames = rx_frames_;
+    stats.credit_blocked_count = credit_blocked_count_;
+    stats.credit_blocked_us = credit_blocked_us_;
+    stats.credit_timeouts = credit_timeouts_;
+    stats.credit_grants_sent = credit_grants_sent_;
+    stats.credit_grants_received = credit_grants_received_;
+    stats.resumes = resumes_;
+    stats.session_restarts = session_restarts_;
+    stats.resent_frames = resent_frames_;
+    stats.rx_duplicates = rx_duplicates_;
+    stats.rx_gaps = rx_gaps_;
+    stats.rate_blocked_count = rate_blocked_count_;
+    stats.rate_blocked_us = rate_blocked_us_;
+    stats.rate_timeouts = rate_timeouts_;
+    stats.rx_auth_failures = rx_auth_failures_;
+    stats.tx_seal_failures = tx_seal_failures_;
+    stats.tx_expired = tx_expired_;
+
+    rel_mutex_.lock();
+    stats.unacked_bytes = unacked_bytes_;
+    rel_mutex_.unlock();
+
+    rx_mutex_.lock();
+    stats.rx_resync_bytes = parser_.GetResyncBytes() + dgram_parser_.GetResyncBytes();
+    stats.rx_crc_errors = parser_.GetCrcErrors() + dgram_parser_.GetCrcErrors();
+    rx_mutex_.unlock();
+}
+
+}
@@ -0,0 +1,242 @@
+#ifndef LINK_LAYER_H_
+#define LINK_LAYER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "commondef.h"
+#include "link_cipher.h"
+#include "link_frame.h"
+#include "token_bucket.h"
+
+namespace usbcommuni {
+
+/* hands complete frames to the active backend, one frame per iovec */
+typedef std::function<USBCommuniErrors_t (const struct iovec *iov, uint32_t iovcnt,
+                                          USBCommuniErrors_t *results)> LinkTransportCb;
+
+/* when a DATA payload turns worthless, max() for never */
+typedef std::chrono::steady_clock::time_point LinkDeadline;
+
+/* DATA payloads with the channel they arrived on */
+typedef std::function<void (uint8_t channel, const char *data, uint32_t len)> LinkRecvCb;
+
+/**
+ * While one lives, sends of the thread that made it fail with
+ * USBCOMMUNI_E_TIMEOUT instead of waiting for credit, tokens or room in
+ * the resend buffer.
+ */
+class LinkNoWait
+{
+public:
+    LinkNoWait();
+    ~LinkNoWait();
+
+private:
+    bool saved_;
+};
+
+/**
+ * Framing and flow control between USBCommuni and the backends.
+ *
+ * With config.link_credit_window set, the sender may only put DATA
+ * payload on the wire while it holds credit. Both ends start with one
+ * window of credit on every (re)connect, and the receiver returns credit
+ * in CREDIT frames once the application has consumed a quarter window.
+ * A sender out of credit blocks up to config.link_credit_timeout_ms.
+ *
+ * With config.heartbeat_interval_ms set, PINGs are sent while connected
+ * and the peer must echo each one in a PONG; the round trip times feed
+ * a histogram, and config.heartbeat_miss_limit unanswered PINGs in a
+ * row declare the link stalled.
+ *
+ * With config.link_reliable, DATA frames carry sequence numbers and stay
+ * in a resend buffer of config.link_reliable_window bytes until the peer
+ * acknowledges them. On every connect both ends exchange a RESUME with
+ * their session id and the last sequence they received; a peer that
+ * knows our session gets everything after that sequence again, a peer
+ * that does not gets the whole buffer under fresh numbers. Sends are
+ * held in the buffer until the handshake is done, also while unplugged.
+ * A sender finding the buffer full blocks up to link_credit_timeout_ms.
+ * A message sent with a deadline is dropped from the buffer once late,
+ * the frames after it are numbered down so the peer sees no gap.
+ * Resends the peer asks for leave the receive thread to the caller's
+ * loop, see WakeRegister().
+ *
+ * Sends may be capped per link and per channel with token buckets, a
+ * send has to pass both. Control frames and resends are not counted.
+ *
+ * With config.link_encrypt every frame is sealed while it is built, in
+ * one pass over the payload, and opened in place in the receive buffer.
+ * Each connect starts a new key.
+ */
+class LinkLayer
+{
+public:
+    LinkLayer();
+
+    void SetConfig(const USBCommuniConfig_t &config);
+    void TransportRegister(LinkTransportCb transport);
+    void RecvHandleRegister(LinkRecvCb recvcb);
+
+    /**
+     * Called on the receive thread when a NAK or RESUME wants frames
+     * resent, the caller's loop should run Resend() soon.
+     */
+    void WakeRegister(std::function<void()> wakecb);
+
+    /* send what the peer asked for again, off the receive thread */
+    void Resend();
+
+    /* the link came up or went down, drop partial frames and restart credit */
+    void Reset();
+
+    /* the link is up, start the session handshake of config.link_reliable */
+    void Resume();
+
+    USBCommuniErrors_t Send(uint8_t channel, const char *data, uint32_t len);
+
+    /**
+     * With @deadlines (optional, @iovcnt entries) a reliable session
+     * drops a message from the resend buffer once late, instead of
+     * sending it again after a NAK or reconnect.
+     */
+    USBCommuniErrors_t SendBatch(uint8_t channel, const struct iovec *iov, uint32_t iovcnt,
+                                 USBCommuniErrors_t *results, const LinkDeadline *deadlines = nullptr);
+
+    /* raw bytes from the backend, decrypted in place with config.link_encrypt */
+    void Feed(const char *data, uint32_t len);
+
+    /* one transfer of a message pipe, holds whole frames only */
+    void FeedDatagram(const char *data, uint32_t len);
+
+    void GetStats(USBCommuniLinkStats_t &stats);
+
+    /**
+     * Send a PING and session ACKs if due. Returns the ms until the next
+     * call is wanted, @stalled is set when the peer stopped answering.
+     */
+    uint32_t Heartbeat(bool &stalled);
+
+    void GetRttStats(USBCommuniRttStats_t &stats);
+
+    /* send rate caps in bytes per second, 0 lifts one, waiting senders re-check at once */
+    void SetLinkRate(uint64_t bytes_per_sec, uint32_t burst);
+    void SetChannelRate(uint8_t channel, uint64_t bytes_per_sec, uint32_t burst);
+
+    /**
+     * Wait for the tokens of @bytes on @channel, up to
+     * config.rate_limit_timeout_ms. Also used for unframed sends, on
+     * channel 0.
+     */
+    USBCommuniErrors_t Throttle(uint8_t channel, uint64_t bytes);
+
+    /* give back the tokens Throttle() took for @bytes that were not sent after all */
+    void Unthrottle(uint8_t channel, uint64_t bytes);
+
+private:
+    bool CanWait() const;
+    USBCommuniErrors_t AcquireCredit(uint32_t bytes);
+    void ReturnCredit(uint32_t bytes);
+    uint32_t BuildFrame(char *buf, LinkFrameHead_t &head, const char *payload);
+    void OnWireFrame(const LinkFrameHead_t &head, const char *payload);
+    void OnFrame(const LinkFrameHead_t &head, const char *payload);
+    USBCommuniErrors_t SendControl(uint8_t type, uint32_t arg, const char *payload = nullptr, uint32_t len = 0);
+    void OnPong(const LinkFrameHead_t &head, const char *payload);
+    uint32_t Ping(bool &stalled);
+
+    USBCommuniErrors_t SendReliable(uint8_t channel, const struct iovec *iov, uint32_t iovcnt,
+                                    uint64_t total, USBCommuniErrors_t *results, const LinkDeadline *deadlines);
+    uint32_t Transmit(bool resend, uint64_t &refund);
+    uint64_t DropLate(uint32_t after);
+    void Trim(uint32_t seq);
+    bool OnSequenced(const LinkFrameHead_t &head);
+    void OnNak(uint32_t seq);
+    void OnResume(const LinkFrameHead_t &head, const char *payload);
+    void SendResume();
+    uint32_t ReliableTick();
+
+private:
+    USBCommuniConfig_t config_;
+    LinkTransportCb transport_;
+    LinkRecvCb recv_handle_;
+    std::function<void()> wake_handle_;
+    LinkCipher cipher_;
+
+    /* receive side, fed by one backend thread at a time */
+    std::mutex rx_mutex_;
+    LinkFrameParser parser_;
+    LinkFrameParser dgram_parser_;
+    uint32_t rx_consumed_;
+
+    /* send side credit */
+    std::mutex tx_mutex_;
+    std::condition_variable tx_cond_;
+    int64_t tx_credit_;
+
+    /* heartbeat, driven by the caller's timer, PONGs land on the receive thread */
+    std::mutex hb_mutex_;
+    std::chrono::steady_clock::time_point hb_next_;
+    uint32_t hb_seq_;
+    uint32_t hb_missed_;
+    USBCommuniRttStats_t rtt_;
+
+    /* reliable session, send side */
+    struct Unacked {
+        uint32_t seq;
+        uint8_t channel;
+        LinkDeadline deadline;
+        std::vector<char> payload;
+    };
+    std::mutex rel_tx_mutex_;           /**< frames on the wire in sequence order, taken before rel_mutex_ */
+    std::mutex rel_mutex_;
+    std::condition_variable rel_cond_;
+    std::deque<Unacked> unacked_;
+    uint64_t unacked_bytes_;
+    uint32_t tx_seq_;
+    uint32_t tx_sent_;                  /**< the last sequence handed to the transport */
+    bool tx_resumed_;
+    bool tx_resend_;                    /**< Resend() due, new frames wait for it */
+    std::chrono::steady_clock::time_point resume_sent_;
+    uint64_t session_;
+
+    /* reliable session, receive side, written under rx_mutex_ */
+    std::atomic<uint64_t> peer_session_;
+    std::atomic<uint32_t> rx_seq_;
+    std::atomic<bool> ack_pending_;
+    uint32_t rx_ack_bytes_;
+    bool rx_gap_;
+
+    std::atomic<uint64_t> tx_frames_;
+    std::atomic<uint64_t> rx_frames_;
+    std::atomic<uint64_t> credit_blocked_count_;
+    std::atomic<uint64_t> credit_blocked_us_;
+    std::atomic<uint64_t> credit_timeouts_;
+    std::atomic<uint64_t> credit_grants_sent_;
+    std::atomic<uint64_t> credit_grants_received_;
+
+    /* send rate caps, refilled lazily by the senders themselves */
+    std::mutex rate_mutex_;
+    std::condition_variable rate_cond_;
+    TokenBucket link_bucket_;
+    TokenBucket channel_buckets_[USBCOMMUNI_CHANNELS];
+    std::atomic<uint32_t> rate_limits_;
+    std::atomic<uint64_t> rate_blocked_count_;
+    std::atomic<uint64_t> rate_blocked_us_;
+    std::atomic<uint64_t> rate_timeouts_;
+    std::atomic<uint64_t> resumes_;
+    std::atomic<uint64_t> session_restarts_;
+    std::atomic<uint64_t> resent_frames_;
+    std::atomic<uint64_t> rx_duplicates_;
+    std::atomic<uint64_t> rx_gaps_;
+    std::atomic<uint64_t> rx_auth_failures_;
+    std::atomic<uint64_t> tx_seal_failures_;
+    std::atomic<uint64_t> tx_expired_;
+};
+
+}
+
+#endif /* LINK_LAYER_H_ */
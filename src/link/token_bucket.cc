@@ -0,0 +1,68 @@
+#include "token_bucket.h"
+#include <algorithm>
+#include <cmath>
+
+namespace usbcommuni {
+
+TokenBucket::TokenBucket()
+{
+    rate_ = 0;
+    burst_ = 0;
+    tokens_ = 0;
+    last_ = std::chrono::steady_clock::now();
+}
+
+void TokenBucket::SetRate(uint64_t rate, uint64_t burst)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    bool was_unlimited = Unlimited();
+
+    /* settle what was earned at the old rate */
+    Refill(now);
+
+    rate_ = rate;
+    burst_ = burst ? burst : std::max<uint64_t>(rate / 10, 1);
+
+    /* a new cap starts with a full bucket */
+    if (was_unlimited)
+        tokens_ = burst_;
+
+    tokens_ = std::min(tokens_, burst_);
+    last_ = now;
+}
+
+void TokenBucket::Refill(std::chrono::steady_clock::time_point now)
+{
+    if (Unlimited() || (now <= last_))
+        return;
+
+    tokens_ = std::min(burst_, tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+    last_ = now;
+}
+
+uint64_t TokenBucket::WaitUs(std::chrono::steady_clock::time_point now)
+{
+    if (Unlimited())
+        return 0;
+
+    Refill(now);
+
+    if (tokens_ > 0)
+        return 0;
+
+    return (uint64_t)std::ceil((1.0 - tokens_) * 1e6 / rate_);
+}
+
+void TokenBucket::Take(uint64_t bytes)
+{
+    if (!Unlimited())
+        tokens_ -= bytes;
+}
+
+void TokenBucket::Give(uint64_t bytes)
+{
+    if (!Unlimited())
+        tokens_ = std::min(burst_, tokens_ + bytes);
+}
+
+}
@@ -0,0 +1,47 @@
+#ifndef TOKEN_BUCKET_H_
+#define TOKEN_BUCKET_H_
+
+#include <stdint.h>
+#include <chrono>
+
+namespace usbcommuni {
+
+/**
+ * Byte rate limiter refilled lazily from the time passed since the last
+ * call, no timer involved. A send is admitted while the bucket is not in
+ * debt and then takes its full size, so sends larger than the burst
+ * still pass and are paid off afterwards.
+ *
+ * Not thread safe, LinkLayer guards its buckets with one mutex.
+ */
+class TokenBucket
+{
+public:
+    TokenBucket();
+
+    /* @rate bytes per second, 0 unlimited; @burst max bytes saved up, 0 picks 100 ms worth */
+    void SetRate(uint64_t rate, uint64_t burst);
+
+    bool Unlimited() const { return rate_ == 0; }
+
+    /* us until a send is admitted, 0 right now */
+    uint64_t WaitUs(std::chrono::steady_clock::time_point now);
+
+    void Take(uint64_t bytes);
+
+    /* hand back what Take() charged for bytes that were never sent, up to the burst */
+    void Give(uint64_t bytes);
+
+private:
+    void Refill(std::chrono::steady_clock::time_point now);
+
+private:
+    uint64_t rate_;
+    double burst_;
+    double tokens_;
+    std::chrono::steady_clock::time_point last_;
+};
+
+}
+
+#endif /* TOKEN_BUCKET_H_ */
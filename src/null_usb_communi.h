@@ -0,0 +1,61 @@
+#ifndef NULL_USB_COMMUNI_H_
+#define NULL_USB_COMMUNI_H_
+
+#include <string.h>
+#include "commondef.h"
+#include "connect_timeline.h"
+
+namespace usbcommuni {
+
+/**
+ * Stands in for a backend left out of the build (USBCOMMUNI_ANDROID /
+ * USBCOMMUNI_IOS off) or out of a BasicUSBCommuni. It never finds a
+ * device, so the core never dispatches to it, and the inline no-ops
+ * compile away.
+ */
+class USBNullCommuni
+{
+public:
+    USBCommuniErrors_t Init() { return USBCOMMUNI_E_SUCCESS; }
+    void Deinit() {}
+
+    void SetConfig(const USBCommuniConfig_t &) {}
+
+    USBCommuniErrors_t HotplugEventRegister() { return USBCOMMUNI_E_SUCCESS; }
+    void HotplugEventDisregister() {}
+
+    void SubscribeRegister(USBCommuniEventCb) {}
+    void TimelineRegister(ConnectTimeline *) {}
+    void RecvHandleRegister(USBCommuniRecvHandleCb) {}
+    void IntRecvHandleRegister(USBCommuniRecvHandleCb) {}
+
+    bool GetConnectStatus() { return false; }
+
+    USBCommuniErrors_t SendData(const char *, uint32_t, uint32_t &send_bytes)
+    {
+        send_bytes = 0;
+        return USBCOMMUNI_E_INVAIL_ARG;
+    }
+
+    USBCommuniErrors_t SendBatch(const struct iovec *, uint32_t iovcnt, USBCommuniErrors_t *results)
+    {
+        for (uint32_t i = 0; results && (i < iovcnt); i++)
+            results[i] = USBCOMMUNI_E_INVAIL_ARG;
+        return USBCOMMUNI_E_INVAIL_ARG;
+    }
+
+    bool SendIdle() { return false; }
+    void SendIdleRegister(std::function<void()>) {}
+
+    void GetRecoveryStats(USBCommuniRecoveryStats_t &stats) { memset(&stats, 0, sizeof(stats)); }
+
+    void Reconnect() {}
+
+    int GetPollFd() { return -1; }
+    uint32_t GetTimeout() { return USBCOMMUNI_WAIT_FOREVER; }
+    void ProcessEvents() {}
+};
+
+}
+
+#endif /* NULL_USB_COMMUNI_H_ */
@@ -0,0 +1,81 @@
+#include "realtime.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace usbcommuni {
+
+static inline bool LockEnabled(const USBCommuniConfig_t &config)
+{
+    return (config.latency_mode && config.latency_mlock);
+}
+
+void RealtimeThreadSetup(const USBCommuniConfig_t &config, int cpu, const char *name)
+{
+    int r;
+    cpu_set_t cpus;
+    struct sched_param param;
+
+    if (!config.latency_mode)
+        return;
+
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (r != 0)
+            fprintf(stderr, "[%s] set cpu affinity %d failed: %s\n", name, cpu, strerror(r));
+    }
+
+    if (config.latency_priority > 0) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config.latency_priority;
+        r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (r != 0)
+            fprintf(stderr, "[%s] set SCHED_FIFO %d failed: %s\n", name, config.latency_priority, strerror(r));
+    }
+}
+
+void *RealtimeAlloc(const USBCommuniConfig_t &config, size_t size)
+{
+    void *buffer;
+    size_t page;
+
+    if (!LockEnabled(config))
+        return malloc(size);
+
+    /* whole pages, so unlocking never touches a neighbour's memory */
+    page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+    if (posix_memalign(&buffer, page, size) != 0)
+        return nullptr;
+
+    if (mlock(buffer, size) != 0)
+        fprintf(stderr, "mlock %zu bytes failed: %s\n", size, strerror(errno));
+
+    return buffer;
+}
+
+void RealtimeLock(const USBCommuniConfig_t &config, const void *buffer, size_t size)
+{
+    if (!LockEnabled(config) || (nullptr == buffer) || (size == 0))
+        return;
+
+    if (mlock(buffer, size) != 0)
+        fprintf(stderr, "mlock %zu bytes failed: %s\n", size, strerror(errno));
+}
+
+void RealtimeUnlock(const USBCommuniConfig_t &config, const void *buffer, size_t size)
+{
+    if (!LockEnabled(config) || (nullptr == buffer) || (size == 0))
+        return;
+
+    munlock(buffer, size);
+}
+
+}
@@ -0,0 +1,29 @@
+#ifndef REALTIME_H_
+#define REALTIME_H_
+
+#include <stddef.h>
+#include "commondef.h"
+
+namespace usbcommuni {
+
+/**
+ * Latency mode helpers, all of them no-ops unless config.latency_mode.
+ *
+ * SCHED_FIFO and mlock need CAP_SYS_NICE / CAP_IPC_LOCK (or matching
+ * rlimits), failures are reported once per thread and the thread keeps
+ * running with the default policy.
+ */
+
+/* pin the calling thread to @cpu (-1 any core) and raise it to SCHED_FIFO */
+void RealtimeThreadSetup(const USBCommuniConfig_t &config, int cpu, const char *name);
+
+/* page aligned, whole page buffer, locked in RAM with config.latency_mlock, release with free() */
+void *RealtimeAlloc(const USBCommuniConfig_t &config, size_t size);
+
+/* lock / unlock a buffer that was not allocated by RealtimeAlloc() */
+void RealtimeLock(const USBCommuniConfig_t &config, const void *buffer, size_t size);
+void RealtimeUnlock(const USBCommuniConfig_t &config, const void *buffer, size_t size);
+
+}
+
+#endif /* REALTIME_H_ */
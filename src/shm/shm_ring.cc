@@ -0,0 +1,555 @@
+#include "shm_ring.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <chrono>
+#include <new>
+
+namespace usbcommuni {
+
+#define SHM_RING_MAGIC          0x55435252      /* "UCRR" */
+#define SHM_RING_VERSION        1
+#define SHM_RING_MAX_CONSUMERS  16
+#define SHM_RING_HEAD_SPACE     4096            /* data starts on its own page */
+
+#define SHM_RECORD_DATA         0
+#define SHM_RECORD_PAD          1               /* fills the ring end, the frame follows at 0 */
+
+struct ShmRingConsumerSlot {
+    std::atomic<int32_t> pid;                   /**< 0 while free */
+    std::atomic<uint64_t> read_pos;
+    std::atomic<uint64_t> overruns;
+};
+
+/*
+ * Positions are byte offsets that only grow, taken modulo @capacity.
+ * @reserve is raised before a record is written and @head once it is
+ * complete, a reader validates its copy against @reserve afterwards.
+ */
+struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    std::atomic<uint64_t> reserve;
+    std::atomic<uint64_t> head;
+    std::atomic<uint32_t> futex;
+    std::atomic<uint32_t> waiters;
+    ShmRingConsumerSlot consumers[SHM_RING_MAX_CONSUMERS];
+};
+
+struct ShmRecord {
+    uint32_t length;
+    uint32_t type;
+};
+
+static_assert(sizeof(ShmRingHeader) <= SHM_RING_HEAD_SPACE, "ring header exceeds its page");
+
+static inline uint64_t RecordSize(uint32_t len)
+{
+    return (sizeof(ShmRecord) + len + 7) & ~(uint64_t)7;
+}
+
+static int FutexWait(std::atomic<uint32_t> *addr, uint32_t val, const struct timespec *timeout)
+{
+    /* shared between processes, no FUTEX_PRIVATE_FLAG */
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT, val, timeout, nullptr, 0);
+}
+
+static int FutexWake(std::atomic<uint32_t> *addr)
+{
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static USBCommuniErrors_t SocketAddr(const std::string &path, struct sockaddr_un &addr)
+{
+    if (path.empty() || (path.size() >= sizeof(addr.sun_path)))
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+ShmRingPublisher::ShmRingPublisher()
+{
+    header_ = nullptr;
+    data_ = nullptr;
+    map_size_ = 0;
+    write_pos_ = 0;
+    published_frames_ = 0;
+    published_bytes_ = 0;
+    oversize_drops_ = 0;
+    memfd_ = -1;
+    listen_fd_ = -1;
+    exit_fd_ = -1;
+}
+
+ShmRingPublisher::~ShmRingPublisher()
+{
+    Close();
+}
+
+USBCommuniErrors_t ShmRingPublisher::Open(const std::string &socket_path, uint32_t capacity)
+{
+    USBCommuniErrors_t err;
+    struct sockaddr_un addr;
+    uint64_t size = 4096;
+    void *map;
+
+    if (header_)
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    err = SocketAddr(socket_path, addr);
+    if (USBCOMMUNI_E_SUCCESS != err)
+        return err;
+
+    while (size < capacity)
+        size <<= 1;
+
+    memfd_ = memfd_create("usbcommuni-ring", MFD_CLOEXEC);
+    if (memfd_ < 0) {
+        fprintf(stderr, "memfd_create failed: %s\n", strerror(errno));
+        return USBCOMMUNI_E_IO;
+    }
+
+    map_size_ = SHM_RING_HEAD_SPACE + size;
+    if (ftruncate(memfd_, map_size_) != 0)
+        goto error;
+
+    map = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+    if (MAP_FAILED == map)
+        goto error;
+
+    header_ = new (map) ShmRingHeader;
+    data_ = static_cast<char*>(map) + SHM_RING_HEAD_SPACE;
+
+    header_->magic = SHM_RING_MAGIC;
+    header_->version = SHM_RING_VERSION;
+    header_->capacity = size;
+    header_->reserve = 0;
+    header_->head = 0;
+    header_->futex = 0;
+    header_->waiters = 0;
+    for (int i = 0; i < SHM_RING_MAX_CONSUMERS; i++) {
+        header_->consumers[i].pid = 0;
+        header_->consumers[i].read_pos = 0;
+        header_->consumers[i].overruns = 0;
+    }
+    write_pos_ = 0;
+
+    exit_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((exit_fd_ < 0) || (listen_fd_ < 0))
+        goto error;
+
+    /* a stale socket left by a crashed publisher */
+    unlink(socket_path.c_str());
+    if ((bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) != 0) || (listen(listen_fd_, 8) != 0)) {
+        fprintf(stderr, "ring socket %s: %s\n", socket_path.c_str(), strerror(errno));
+        goto error;
+    }
+
+    socket_path_ = socket_path;
+    accept_thread_ = std::thread(&ShmRingPublisher::AcceptThreadHandler, this);
+
+    return USBCOMMUNI_E_SUCCESS;
+
+error:
+    Close();
+    return USBCOMMUNI_E_IO;
+}
+
+void ShmRingPublisher::Close()
+{
+    uint64_t u = 1;
+
+    if ((exit_fd_ >= 0) && accept_thread_.joinable()) {
+        write(exit_fd_, &u, sizeof(u));
+        accept_thread_.join();
+    }
+
+    if (listen_fd_ >= 0) {
+        close(listen_fd_);
+        listen_fd_ = -1;
+        unlink(socket_path_.c_str());
+        socket_path_.clear();
+    }
+
+    if (exit_fd_ >= 0) {
+        close(exit_fd_);
+        exit_fd_ = -1;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    /* attached readers keep their own mapping */
+    if (header_) {
+        munmap(header_, map_size_);
+        header_ = nullptr;
+        data_ = nullptr;
+    }
+
+    if (memfd_ >= 0) {
+        close(memfd_);
+        memfd_ = -1;
+    }
+}
+
+void ShmRingPublisher::AcceptThreadHandler()
+{
+    int fd;
+    struct pollfd fds[2];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char version = SHM_RING_VERSION;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    fds[0].fd = listen_fd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = exit_fd_;
+    fds[1].events = POLLIN;
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        memset(&msg, 0, sizeof(msg));
+        memset(control, 0, sizeof(control));
+        iov.iov_base = &version;
+        iov.iov_len = sizeof(version);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &memfd_, sizeof(int));
+
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0)
+            fprintf(stderr, "ring fd handover failed: %s\n", strerror(errno));
+
+        close(fd);
+    }
+}
+
+void ShmRingPublisher::Publish(const char *data, uint32_t len)
+{
+    ShmRecord rec;
+    uint64_t capacity;
+    uint64_t size;
+    uint64_t pad = 0;
+    uint64_t offset;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (nullptr == header_)
+        return;
+
+    capacity = header_->capacity;
+    size = RecordSize(len);
+    if (size > capacity / 2) {
+        oversize_drops_++;
+        return;
+    }
+
+    offset = write_pos_ & (capacity - 1);
+    if (capacity - offset < size)
+        pad = capacity - offset;
+
+    /* readers still copying from the span being overwritten will notice */
+    header_->reserve.store(write_pos_ + pad + size, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if (pad > 0) {
+        rec.length = 0;
+        rec.type = SHM_RECORD_PAD;
+        memcpy(data_ + offset, &rec, sizeof(rec));
+        offset = 0;
+    }
+
+    rec.length = len;
+    rec.type = SHM_RECORD_DATA;
+    memcpy(data_ + offset, &rec, sizeof(rec));
+    memcpy(data_ + offset + sizeof(rec), data, len);
+
+    write_pos_ += pad + size;
+    header_->head.store(write_pos_, std::memory_order_release);
+
+    header_->futex.fetch_add(1);
+    if (header_->waiters.load() > 0)
+        FutexWake(&header_->futex);
+
+    published_frames_++;
+    published_bytes_ += len;
+}
+
+void ShmRingPublisher::GetStats(USBCommuniShmStats_t &stats)
+{
+    int32_t pid;
+    uint64_t lag;
+
+    memset(&stats, 0, sizeof(stats));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    stats.published_frames = published_frames_;
+    stats.published_bytes = published_bytes_;
+    stats.oversize_drops = oversize_drops_;
+
+    if (nullptr == header_)
+        return;
+
+    for (int i = 0; i < SHM_RING_MAX_CONSUMERS; i++) {
+        ShmRingConsumerSlot &slot = header_->consumers[i];
+
+        pid = slot.pid.load();
+        if (pid == 0)
+            continue;
+
+        /* reader died without detaching */
+        if ((kill(pid, 0) != 0) && (errno == ESRCH)) {
+            slot.pid.compare_exchange_strong(pid, 0);
+            continue;
+        }
+
+        stats.consumers++;
+        stats.consumer_overruns += slot.overruns.load();
+
+        lag = write_pos_ - slot.read_pos.load();
+        if (lag > header_->capacity / 2)
+            stats.slow_consumers++;
+    }
+}
+
+ShmRingConsumer::ShmRingConsumer()
+{
+    header_ = nullptr;
+    data_ = nullptr;
+    map_size_ = 0;
+    slot_ = nullptr;
+    read_pos_ = 0;
+    overruns_ = 0;
+    lost_bytes_ = 0;
+}
+
+ShmRingConsumer::~ShmRingConsumer()
+{
+    Close();
+}
+
+USBCommuniErrors_t ShmRingConsumer::Open(const std::string &socket_path)
+{
+    USBCommuniErrors_t err;
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct stat st;
+    char version = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    int sock;
+    int memfd = -1;
+    int32_t free_pid;
+    void *map;
+
+    if (header_)
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    err = SocketAddr(socket_path, addr);
+    if (USBCOMMUNI_E_SUCCESS != err)
+        return err;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return USBCOMMUNI_E_IO;
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return USBCOMMUNI_E_NOT_CONN;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &version;
+    iov.iov_len = sizeof(version);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) > 0) {
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+            memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    close(sock);
+
+    if (memfd < 0)
+        return USBCOMMUNI_E_IO;
+
+    if ((version != SHM_RING_VERSION) || (fstat(memfd, &st) != 0) || (st.st_size <= SHM_RING_HEAD_SPACE)) {
+        close(memfd);
+        return USBCOMMUNI_E_IO;
+    }
+
+    map_size_ = st.st_size;
+    map = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (MAP_FAILED == map)
+        return USBCOMMUNI_E_IO;
+
+    header_ = static_cast<ShmRingHeader*>(map);
+    data_ = static_cast<char*>(map) + SHM_RING_HEAD_SPACE;
+
+    if ((header_->magic != SHM_RING_MAGIC) || (header_->capacity + SHM_RING_HEAD_SPACE != map_size_)) {
+        Close();
+        return USBCOMMUNI_E_IO;
+    }
+
+    read_pos_ = header_->head.load(std::memory_order_acquire);
+
+    /* a slot lets the publisher see how far behind we are, reading works without one */
+    for (int i = 0; i < SHM_RING_MAX_CONSUMERS; i++) {
+        free_pid = 0;
+        if (header_->consumers[i].pid.compare_exchange_strong(free_pid, getpid())) {
+            slot_ = &header_->consumers[i];
+            slot_->read_pos = read_pos_;
+            slot_->overruns = 0;
+            break;
+        }
+    }
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+void ShmRingConsumer::Close()
+{
+    if (slot_) {
+        slot_->pid = 0;
+        slot_ = nullptr;
+    }
+
+    if (header_) {
+        munmap(header_, map_size_);
+        header_ = nullptr;
+        data_ = nullptr;
+    }
+}
+
+void ShmRingConsumer::Overrun(uint64_t head)
+{
+    overruns_++;
+    lost_bytes_ += head - read_pos_;
+    read_pos_ = head;
+
+    if (slot_) {
+        slot_->overruns.fetch_add(1, std::memory_order_relaxed);
+        slot_->read_pos.store(read_pos_, std::memory_order_relaxed);
+    }
+}
+
+USBCommuniErrors_t ShmRingConsumer::Read(std::vector<char> &data, uint32_t timeout_ms)
+{
+    ShmRecord rec;
+    uint64_t head;
+    uint64_t capacity;
+    uint64_t offset;
+    uint64_t next;
+    uint32_t seq;
+    int64_t left_ms;
+    struct timespec ts;
+    std::chrono::steady_clock::time_point deadline;
+
+    if (nullptr == header_)
+        return USBCOMMUNI_E_NOT_CONN;
+
+    capacity = header_->capacity;
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    while (true) {
+        head = header_->head.load(std::memory_order_acquire);
+
+        if (read_pos_ == head) {
+            if (timeout_ms != USBCOMMUNI_WAIT_FOREVER) {
+                left_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                deadline - std::chrono::steady_clock::now()).count();
+                if (left_ms <= 0)
+                    return USBCOMMUNI_E_TIMEOUT;
+                ts.tv_sec = left_ms / 1000;
+                ts.tv_nsec = (left_ms % 1000) * 1000000;
+            }
+
+            /* announce ourselves first, the publisher skips the wake otherwise */
+            header_->waiters.fetch_add(1);
+            seq = header_->futex.load();
+            if (header_->head.load(std::memory_order_acquire) == read_pos_)
+                FutexWait(&header_->futex, seq, (timeout_ms == USBCOMMUNI_WAIT_FOREVER) ? nullptr : &ts);
+            header_->waiters.fetch_sub(1);
+            continue;
+        }
+
+        if (head - read_pos_ > capacity) {
+            Overrun(head);
+            continue;
+        }
+
+        offset = read_pos_ & (capacity - 1);
+        memcpy(&rec, data_ + offset, sizeof(rec));
+
+        if (rec.type == SHM_RECORD_PAD) {
+            next = read_pos_ + (capacity - offset);
+        } else {
+            next = read_pos_ + RecordSize(rec.length);
+            if ((rec.type == SHM_RECORD_DATA) && (RecordSize(rec.length) <= capacity - offset))
+                data.assign(data_ + offset + sizeof(rec), data_ + offset + sizeof(rec) + rec.length);
+        }
+
+        /* anything the publisher reserved a lap past us may have been torn */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ((header_->reserve.load(std::memory_order_relaxed) - read_pos_ > capacity) ||
+            (next > head) || ((rec.type != SHM_RECORD_PAD) && (rec.type != SHM_RECORD_DATA)))
+        {
+            Overrun(header_->head.load(std::memory_order_acquire));
+            continue;
+        }
+
+        read_pos_ = next;
+        if (slot_)
+            slot_->read_pos.store(read_pos_, std::memory_order_relaxed);
+
+        if (rec.type == SHM_RECORD_DATA)
+            return USBCOMMUNI_E_SUCCESS;
+    }
+}
+
+}
@@ -0,0 +1,98 @@
+#ifndef SHM_RING_H_
+#define SHM_RING_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "commondef.h"
+
+namespace usbcommuni {
+
+struct ShmRingHeader;
+struct ShmRingConsumerSlot;
+
+/**
+ * Single producer, multi consumer broadcast ring in a memfd.
+ *
+ * The publisher never waits for readers: every consumer keeps its own
+ * read position and a reader that falls a full ring behind notices on
+ * its next Read(), counts an overrun and rejoins at the newest frame.
+ * Consumers sleep on a futex in the ring header, the publisher only
+ * issues the wake syscall while someone is actually sleeping.
+ *
+ * The memfd is handed out over a Unix socket (SCM_RIGHTS), so readers
+ * in other processes only need the socket path.
+ */
+class ShmRingPublisher
+{
+public:
+    ShmRingPublisher();
+    ~ShmRingPublisher();
+
+    /* @capacity is rounded up to a power of two */
+    USBCommuniErrors_t Open(const std::string &socket_path, uint32_t capacity);
+    void Close();
+
+    /* frames larger than half the ring are dropped */
+    void Publish(const char *data, uint32_t len);
+
+    void GetStats(USBCommuniShmStats_t &stats);
+
+private:
+    void AcceptThreadHandler();
+
+private:
+    std::mutex mutex_;
+    ShmRingHeader *header_;
+    char *data_;
+    size_t map_size_;
+    uint64_t write_pos_;
+    uint64_t published_frames_;
+    uint64_t published_bytes_;
+    uint64_t oversize_drops_;
+
+    std::string socket_path_;
+    int memfd_;
+    int listen_fd_;
+    int exit_fd_;
+    std::thread accept_thread_;
+};
+
+class ShmRingConsumer
+{
+public:
+    ShmRingConsumer();
+    ~ShmRingConsumer();
+
+    /* attach to the ring published at @socket_path, reading starts at the newest frame */
+    USBCommuniErrors_t Open(const std::string &socket_path);
+    void Close();
+
+    /**
+     * Copy the next frame into @data, waiting up to @timeout_ms
+     * (USBCOMMUNI_WAIT_FOREVER without limit).
+     */
+    USBCommuniErrors_t Read(std::vector<char> &data, uint32_t timeout_ms);
+
+    /* times this reader fell a ring behind, and the bytes it skipped */
+    uint64_t GetOverruns() const { return overruns_; }
+    uint64_t GetLostBytes() const { return lost_bytes_; }
+
+private:
+    void Overrun(uint64_t head);
+
+private:
+    ShmRingHeader *header_;
+    char *data_;
+    size_t map_size_;
+    ShmRingConsumerSlot *slot_;
+    uint64_t read_pos_;
+    uint64_t overruns_;
+    uint64_t lost_bytes_;
+};
+
+}
+
+#endif /* SHM_RING_H_ */
@@ -1,46 +1,308 @@
 #ifndef USBCOMMUNI_H_
 #define USBCOMMUNI_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 #include "commondef.h"
+#include "deadline_queue.h"
+#include "latest_table.h"
+#include "null_usb_communi.h"
+#include "link/link_layer.h"
+#include "shm/shm_ring.h"
+
+/* backends picked with the USBCOMMUNI_ANDROID / USBCOMMUNI_IOS CMake options */
+#ifdef USBCOMMUNI_WITH_ANDROID
 #include "android/android_usb_communi.h"
+#endif
+
+#ifdef USBCOMMUNI_WITH_IOS
 #include "ios/ios_usb_communi.h"
+#endif
 
 namespace usbcommuni {
 
-class USBCommuni
+#ifndef USBCOMMUNI_WITH_ANDROID
+typedef USBNullCommuni USBAndroidCommuni;
+#endif
+
+#ifndef USBCOMMUNI_WITH_IOS
+typedef USBNullCommuni USBIosCommuni;
+#endif
+
+/**
+ * The default sink of BasicUSBCommuni, where received data and state
+ * changes go: the handlers registered on the core, a std::function call
+ * each. Any class with the same Recv() and State() may take its place,
+ * its calls are direct and inline then; the core's *Register() calls
+ * only compile if it has the members they set. Both run on the library
+ * thread that got the data or changed the state.
+ */
+class USBCommuniHandlers
+{
+public:
+    void Recv(uint8_t channel, const char *data, uint32_t len)
+    {
+        const USBCommuniRecvHandleCb &handle = channel_handles[channel];
+
+        if (handle)
+            handle(data, len);
+        else if (recv_handle)
+            recv_handle(data, len);
+    }
+
+    void State(USBCommuniConnectStates_t state, uint64_t epoch)
+    {
+        if (state_handle)
+            state_handle(state, epoch);
+    }
+
+    USBCommuniRecvHandleCb recv_handle;
+    USBCommuniRecvHandleCb channel_handles[USBCOMMUNI_CHANNELS];
+    USBCommuniStateCb state_handle;
+};
+
+/**
+ * The core over one Android and one iOS backend, picked at compile time,
+ * handing what it receives to @Sink. Calls into them are direct and
+ * inline where the backend allows, a USBNullCommuni in either place
+ * leaves that kind of device out: it is never subscribed to and its
+ * calls compile away. usbcommuni.cc builds the combinations named below,
+ * a core over another sink includes usbcommuni_impl.h.
+ */
+template <class Android, class Ios, class Sink = USBCommuniHandlers>
+class BasicUSBCommuni
 {
 public:
-    USBCommuni();
-    ~USBCommuni();
+    BasicUSBCommuni();
+    ~BasicUSBCommuni();
 
+    /* same as Start(), kept for existing users */
     USBCommuniErrors_t Init();
 
+    /* Start() with @config, call Stop() first to apply a new one */
+    USBCommuniErrors_t Init(const USBCommuniConfig_t &config);
+
+    /**
+     * Start the backends and worker threads. Stop() joins every worker,
+     * cancels in-flight transfers and releases all USB resources, after
+     * which Start() may be called again.
+     */
+    USBCommuniErrors_t Start();
+    void Stop();
+
     bool GetConnectStatus();
 
+    /**
+     * Current link state; @epoch (optional) receives the state epoch,
+     * which is bumped on every state transition.
+     */
+    USBCommuniConnectStates_t GetConnectState(uint64_t *epoch = nullptr);
+
+    /**
+     * Block until the link is connected or @timeout_ms expires
+     * (USBCOMMUNI_WAIT_FOREVER waits without limit).
+     */
+    USBCommuniErrors_t WaitForConnect(uint32_t timeout_ms);
+
+    /**
+     * Block until the state epoch differs from @epoch or @timeout_ms expires.
+     * @epoch is updated to the epoch of the returned state.
+     */
+    USBCommuniConnectStates_t WaitForStateChange(uint64_t &epoch, uint32_t timeout_ms);
+
+    /* called on the thread that changed the state, after waiters are woken */
+    void StateHandleRegister(USBCommuniStateCb statecb);
+
     void RecvHandleRegister(USBCommuniRecvHandleCb recvcb);
 
-    USBCommuniErrors_t SendData(const char *data, uint32_t len, uint32_t &send_bytes);
+    /**
+     * Route the frames of link @channel to @recvcb instead of the
+     * RecvHandleRegister() handler, a table lookup per frame. Without
+     * config.link_enable the whole stream counts as channel 0. Register
+     * before Start() or while nothing arrives on @channel.
+     */
+    void ChannelHandleRegister(uint8_t channel, USBCommuniRecvHandleCb recvcb);
+
+    /**
+     * With @ttl_ms the message is worthless after that long: while the
+     * backend has sends in flight it is held back, in order with other
+     * such messages, and dropped unsent once late. Never waits for credit
+     * or tokens, short of them the messages stay held. With
+     * config.link_reliable a late message is also dropped from the resend
+     * buffer instead of being sent again. Needs a connected link, up to
+     * config.deadline_max_msgs are held, USBCOMMUNI_E_NMEN beyond.
+     */
+    USBCommuniErrors_t SendData(const char *data, uint32_t len, uint32_t &send_bytes, uint32_t ttl_ms = 0);
+
+    /**
+     * Send @iovcnt messages with as few transfers as the backend allows.
+     * @results (optional, @iovcnt entries) receives the per message result,
+     * the first failure is returned.
+     */
+    USBCommuniErrors_t SendBatch(const struct iovec *iov, uint32_t iovcnt, USBCommuniErrors_t *results = nullptr);
+
+    /* SendData() on link @channel, needs config.link_enable */
+    USBCommuniErrors_t SendChannel(uint8_t channel, const char *data, uint32_t len, uint32_t ttl_ms = 0);
+
+    /**
+     * SendData() for state where only the newest value of @key matters.
+     * While the backend has sends in flight the value is held back and a
+     * newer one of the same key replaces it in place, the held values go
+     * out together once the pipe drains, without waiting for credit or
+     * tokens. Up to config.latest_max_keys keys are held, USBCOMMUNI_E_NMEN
+     * beyond. Dropped on disconnect.
+     */
+    USBCommuniErrors_t SendLatest(uint32_t key, const char *data, uint32_t len);
+
+    /**
+     * Cap the send rate of the whole link at @bytes_per_sec (0 lifts the
+     * cap), saving up at most @burst bytes while idle. Takes effect right
+     * away, senders over the rate wait up to config.rate_limit_timeout_ms.
+     * Start() applies config.rate_limit_bps again.
+     */
+    void SetLinkRateLimit(uint64_t bytes_per_sec, uint32_t burst = 0);
+
+    /* the same for one link channel, on top of the link cap */
+    void SetChannelRateLimit(uint8_t channel, uint64_t bytes_per_sec, uint32_t burst = 0);
+
+    /* counters of the link layer, zero unless config.link_enable is set */
+    void GetLinkStats(USBCommuniLinkStats_t &stats);
+
+    /* heartbeat round trip times, see config.heartbeat_interval_ms */
+    void GetRttStats(USBCommuniRttStats_t &stats);
+
+    /* received frames published to other processes, see config.shm_enable */
+    void GetShmStats(USBCommuniShmStats_t &stats);
+
+    /* when the latest device reached each stage from plug to first data */
+    void GetConnectTimeline(USBCommuniConnectTimeline_t &timeline);
+
+    /* transfer faults of the Android backend and how they were recovered */
+    void GetRecoveryStats(USBCommuniRecoveryStats_t &stats);
+
+    /* values conflated by SendLatest() */
+    void GetLatestStats(USBCommuniLatestStats_t &stats);
+
+    /* sends with a TTL, and how many expired per channel */
+    void GetDeadlineStats(USBCommuniDeadlineStats_t &stats);
+
+    /**
+     * With config.external_loop, an epoll fd that turns readable when
+     * ProcessEvents() has work, add it to the application's loop. Valid from
+     * Start() to Stop(), -1 otherwise.
+     */
+    int GetPollFd();
+
+    /**
+     * Max ms to wait for the poll fd before ProcessEvents() is due anyway,
+     * USBCOMMUNI_WAIT_FOREVER if there are no timers.
+     */
+    uint32_t GetTimeout();
+
+    /* run whatever is ready without blocking, on the loop thread only */
+    void ProcessEvents();
+
+    /* set it up before Start(), it is called from the library threads after */
+    Sink &GetSink();
 
 private:
+    USBCommuniErrors_t BackendSendBatch(const struct iovec *iov, uint32_t iovcnt, USBCommuniErrors_t *results);
+    bool BackendSendIdle();
+    void SendIdleHandler();
+    void LinkWakeHandler();
+    USBCommuniErrors_t SendExpiring(uint8_t channel, const char *data, uint32_t len, uint32_t ttl_ms);
+    bool SendHeld();
+    bool FlushHeld();
+    USBCommuniErrors_t SendHeldBatch(uint8_t channel, const LinkDeadline *deadlines);
+    void RecvHandler(const char *data, uint32_t len);
+    void DatagramHandler(const char *data, uint32_t len);
+    void DeliverRecv(uint8_t channel, const char *data, uint32_t len);
     void AndroidSubscribeHandler(USBCommuniEventTypes_t event);
     void IosSubscribeHandler(USBCommuniEventTypes_t event);
+    void LinkEventHandler(USBCommuniEventTypes_t event);
+    void SetConnectState(USBCommuniConnectStates_t state);
+    void SetAttachState();
+    void CheckHeartbeat(uint32_t &wait_ms);
+    uint32_t LoopStep();
     void LoopHandler();
 
 private:
-    USBAndroidCommuni android_;
-    USBIosCommuni ios_;
-    USBCommuniDeviceTypes_t type_;
-    USBCommuniRecvHandleCb recvhandle_;
+    Android android_;
+    Ios ios_;
+    USBCommuniConfig_t config_;
+    LinkLayer link_;
+    ShmRingPublisher shm_;
+    ConnectTimeline timeline_;
+    std::atomic<USBCommuniDeviceTypes_t> type_;
+    Sink sink_;
     std::thread loop_thread_;
+    std::mutex loop_mutex_;
+    std::condition_variable loop_cond_;
+    bool loop_exit_;
+    bool running_;
+
+    /* hotplug housekeeping, run by LoopStep() */
+    std::chrono::steady_clock::time_point loop_tick_;
+    std::chrono::steady_clock::time_point loop_due_;
+    bool loop_doonce_;
+    int loop_count_;
+    int poll_fd_;
 
-    enum {
+    enum IosActions {
         USBCOMMUNI_IOS_ACTION_IDLE = 0,
         USBCOMMUNI_IOS_ACTION_ARRIVED,
         USBCOMMUNI_IOS_ACTION_REMOVE,
-    } ios_actions_;
+    };
+    std::atomic<IosActions> ios_actions_;
+
+    /* SendLatest() values and sends with a TTL, flushed by the sender or, once the pipe drains, the loop */
+    LatestTable latest_;
+    DeadlineQueue deadline_;
+    std::mutex held_mutex_;
+    bool held_busy_;                    /**< a flush runs, the vectors below are its own */
+    bool held_again_;                   /**< asked for while busy, the flush does another round */
+    std::vector<LatestValue_t> latest_values_;
+    std::vector<DeadlineMsg_t> deadline_msgs_;
+    std::vector<DeadlineMsg_t> deadline_back_;
+    std::vector<struct iovec> held_iov_;
+    std::vector<LinkDeadline> held_deadlines_;
+    std::vector<size_t> held_index_;
+    std::vector<USBCommuniErrors_t> held_results_;
+    std::atomic<bool> held_kick_;
+    std::atomic<bool> held_retry_;      /**< out of credit or tokens, the loop tries again shortly */
+
+    /* resends the link layer asked for, run by the loop */
+    std::atomic<bool> link_kick_;
+
+    std::mutex state_mutex_;
+    std::condition_variable state_cond_;
+    std::atomic<USBCommuniConnectStates_t> state_;
+    std::atomic<uint64_t> state_epoch_;
 };
 
+/* every backend the build has */
+typedef BasicUSBCommuni<USBAndroidCommuni, USBIosCommuni> USBCommuni;
+
+/* one kind of device only, without the other backend's startup, threads and subscriptions */
+#ifdef USBCOMMUNI_WITH_ANDROID
+typedef BasicUSBCommuni<USBAndroidCommuni, USBNullCommuni> USBAndroidOnlyCommuni;
+#endif
+
+#ifdef USBCOMMUNI_WITH_IOS
+typedef BasicUSBCommuni<USBNullCommuni, USBIosCommuni> USBIosOnlyCommuni;
+#endif
+
+/* built once, in usbcommuni.cc */
+extern template class BasicUSBCommuni<USBAndroidCommuni, USBIosCommuni>;
+
+#if defined(USBCOMMUNI_WITH_ANDROID) && defined(USBCOMMUNI_WITH_IOS)
+extern template class BasicUSBCommuni<USBAndroidCommuni, USBNullCommuni>;
+extern template class BasicUSBCommuni<USBNullCommuni, USBIosCommuni>;
+#endif
+
 }
 
 #endif /* USBCOMMUNI_H_ */
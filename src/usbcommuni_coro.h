@@ -0,0 +1,260 @@
+#ifndef USBCOMMUNI_CORO_H_
+#define USBCOMMUNI_CORO_H_
+
+#if __cplusplus < 202002L
+#error "usbcommuni_coro.h needs C++20, configure with -DUSBCOMMUNI_COROUTINES=ON"
+#endif
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include "usbcommuni.h"
+
+namespace usbcommuni {
+
+/* runs a resumed coroutine, nullptr resumes inline on the library thread */
+typedef std::function<void (std::coroutine_handle<>)> USBCommuniExecutor;
+
+/* eager fire-and-forget coroutine, for callers without their own task type */
+struct USBCommuniTask {
+    struct promise_type {
+        USBCommuniTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+typedef struct USBCommuniRecvResult {
+    USBCommuniErrors_t err;
+    std::vector<char> data;
+} USBCommuniRecvResult_t;
+
+/**
+ * Awaitable view of a started USBCommuni.
+ *
+ *   co_await link.Connect();                   // suspends until connected
+ *   co_await link.Send(buf, len);              // waits for the link, then queues
+ *   USBCommuniRecvResult_t r = co_await link.Recv();
+ *
+ * Nothing blocks a thread: suspended coroutines are resumed from the
+ * library's state/receive callbacks, either inline or through @executor.
+ * The link takes over the USBCommuni state and receive handlers. Recv()
+ * yields data as the transport delivered it; chunks that arrive with no
+ * Recv() pending are buffered, the oldest dropped beyond @max_pending.
+ */
+class USBCommuniLink
+{
+public:
+    struct Waiter {
+        std::coroutine_handle<> handle;
+        USBCommuniErrors_t err;
+    };
+
+    class ConnectAwaiter : public Waiter {
+    public:
+        explicit ConnectAwaiter(USBCommuniLink &link) : link_(link) { err = USBCOMMUNI_E_SUCCESS; }
+
+        bool await_ready() { return link_.usb_.GetConnectStatus(); }
+        bool await_suspend(std::coroutine_handle<> h) { return link_.SuspendConnect(this, h); }
+        USBCommuniErrors_t await_resume() { return err; }
+
+    private:
+        USBCommuniLink &link_;
+    };
+
+    class SendAwaiter : public Waiter {
+    public:
+        SendAwaiter(USBCommuniLink &link, const char *data, uint32_t len)
+            : link_(link), data_(data), len_(len), sent_(false) { err = USBCOMMUNI_E_SUCCESS; }
+
+        bool await_ready() {
+            if (!link_.usb_.GetConnectStatus())
+                return false;
+            Send();
+            return true;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) { return link_.SuspendConnect(this, h); }
+
+        USBCommuniErrors_t await_resume() {
+            if (!sent_ && (err == USBCOMMUNI_E_SUCCESS))
+                Send();
+            return err;
+        }
+
+    private:
+        void Send() {
+            uint32_t send_bytes = 0;
+            err = link_.usb_.SendData(data_, len_, send_bytes);
+            sent_ = true;
+        }
+
+        USBCommuniLink &link_;
+        const char *data_;
+        uint32_t len_;
+        bool sent_;
+    };
+
+    class RecvAwaiter : public Waiter {
+    public:
+        explicit RecvAwaiter(USBCommuniLink &link) : link_(link) { err = USBCOMMUNI_E_SUCCESS; }
+
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> h) { return link_.SuspendRecv(this, h); }
+        USBCommuniRecvResult_t await_resume() { return { err, std::move(data) }; }
+
+        std::vector<char> data;
+
+    private:
+        USBCommuniLink &link_;
+    };
+
+    explicit USBCommuniLink(USBCommuni &usb, USBCommuniExecutor executor = nullptr, size_t max_pending = 1024)
+        : usb_(usb), executor_(executor), max_pending_(max_pending), closed_(false), dropped_(0)
+    {
+        usb_.StateHandleRegister([this](USBCommuniConnectStates_t state, uint64_t) { OnState(state); });
+        usb_.RecvHandleRegister([this](const char *data, uint32_t len) { OnRecv(data, len); });
+    }
+
+    ~USBCommuniLink()
+    {
+        Close();
+        usb_.RecvHandleRegister(nullptr);
+        usb_.StateHandleRegister(nullptr);
+    }
+
+    ConnectAwaiter Connect() { return ConnectAwaiter(*this); }
+    SendAwaiter Send(const char *data, uint32_t len) { return SendAwaiter(*this, data, len); }
+    RecvAwaiter Recv() { return RecvAwaiter(*this); }
+
+    /* resume every suspended coroutine with USBCOMMUNI_E_NOT_CONN */
+    void Close()
+    {
+        std::vector<Waiter*> waiters;
+
+        mutex_.lock();
+        closed_ = true;
+        waiters.swap(connect_waiters_);
+        waiters.insert(waiters.end(), recv_waiters_.begin(), recv_waiters_.end());
+        recv_waiters_.clear();
+        mutex_.unlock();
+
+        for (Waiter *w : waiters) {
+            w->err = USBCOMMUNI_E_NOT_CONN;
+            Resume(w->handle);
+        }
+    }
+
+    /* received chunks discarded because no Recv() kept up */
+    uint64_t GetDropped()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return dropped_;
+    }
+
+private:
+    bool SuspendConnect(Waiter *w, std::coroutine_handle<> h)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (closed_) {
+            w->err = USBCOMMUNI_E_NOT_CONN;
+            return false;
+        }
+
+        /* connected between await_ready() and here */
+        if (usb_.GetConnectStatus())
+            return false;
+
+        w->handle = h;
+        connect_waiters_.push_back(w);
+        return true;
+    }
+
+    bool SuspendRecv(RecvAwaiter *w, std::coroutine_handle<> h)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (!pending_.empty()) {
+            w->data = std::move(pending_.front());
+            pending_.pop_front();
+            return false;
+        }
+
+        if (closed_) {
+            w->err = USBCOMMUNI_E_NOT_CONN;
+            return false;
+        }
+
+        w->handle = h;
+        recv_waiters_.push_back(w);
+        return true;
+    }
+
+    void OnState(USBCommuniConnectStates_t state)
+    {
+        std::vector<Waiter*> waiters;
+
+        if (state != USBCOMMUNI_STATE_CONNECTED)
+            return;
+
+        mutex_.lock();
+        waiters.swap(connect_waiters_);
+        mutex_.unlock();
+
+        for (Waiter *w : waiters)
+            Resume(w->handle);
+    }
+
+    void OnRecv(const char *data, uint32_t len)
+    {
+        RecvAwaiter *w = nullptr;
+
+        mutex_.lock();
+        if (!recv_waiters_.empty()) {
+            w = recv_waiters_.front();
+            recv_waiters_.pop_front();
+        } else {
+            if (pending_.size() >= max_pending_) {
+                pending_.pop_front();
+                dropped_++;
+            }
+            pending_.emplace_back(data, data + len);
+        }
+        mutex_.unlock();
+
+        if (w) {
+            w->data.assign(data, data + len);
+            Resume(w->handle);
+        }
+    }
+
+    void Resume(std::coroutine_handle<> h)
+    {
+        if (executor_)
+            executor_(h);
+        else
+            h.resume();
+    }
+
+private:
+    USBCommuni &usb_;
+    USBCommuniExecutor executor_;
+    size_t max_pending_;
+
+    std::mutex mutex_;
+    bool closed_;
+    uint64_t dropped_;
+    std::vector<Waiter*> connect_waiters_;
+    std::deque<RecvAwaiter*> recv_waiters_;
+    std::deque<std::vector<char>> pending_;
+};
+
+}
+
+#endif /* USBCOMMUNI_CORO_H_ */
@@ -0,0 +1,957 @@
+#ifndef USBCOMMUNI_IMPL_H_
+#define USBCOMMUNI_IMPL_H_
+
+/**
+ * The members of BasicUSBCommuni. usbcommuni.cc instantiates them for
+ * the combinations usbcommuni.h names, include this only to build one
+ * over a sink of your own.
+ */
+#include "usbcommuni.h"
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+
+namespace usbcommuni {
+
+/* held back messages that found no credit or tokens are tried again this much later */
+#define HELD_RETRY_MS   5
+
+template <class Android, class Ios, class Sink>
+BasicUSBCommuni<Android, Ios, Sink>::BasicUSBCommuni()
+{
+    type_ = USBCOMMUNI_DEVICE_TYPE_UNKNOWD;
+    ios_actions_ = USBCOMMUNI_IOS_ACTION_IDLE;
+    state_ = USBCOMMUNI_STATE_IDLE;
+    state_epoch_ = 0;
+    running_ = false;
+    loop_exit_ = false;
+    loop_doonce_ = false;
+    loop_count_ = 0;
+    poll_fd_ = -1;
+    held_busy_ = false;
+    held_again_ = false;
+    held_kick_ = false;
+    held_retry_ = false;
+    link_kick_ = false;
+}
+
+template <class Android, class Ios, class Sink>
+BasicUSBCommuni<Android, Ios, Sink>::~BasicUSBCommuni()
+{
+    Stop();
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniErrors_t BasicUSBCommuni<Android, Ios, Sink>::Init()
+{
+    return Start();
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniErrors_t BasicUSBCommuni<Android, Ios, Sink>::Init(const USBCommuniConfig_t &config)
+{
+    if (running_)
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    config_ = config;
+
+    return Start();
+}
+
+static inline int CoreEpollAdd(int epfd, int fd)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniErrors_t BasicUSBCommuni<Android, Ios, Sink>::Start()
+{
+    USBCommuniErrors_t err;
+    USBCommuniEventCb ios_subscribe_cb = [this](USBCommuniEventTypes_t event){IosSubscribeHandler(event);};
+    USBCommuniEventCb android_subscribe_cb = [this](USBCommuniEventTypes_t event){AndroidSubscribeHandler(event);};
+    USBCommuniRecvHandleCb recv_cb = [this](const char *data, uint32_t len){RecvHandler(data, len);};
+
+    if (running_)
+        return USBCOMMUNI_E_SUCCESS;
+
+#ifndef USBCOMMUNI_WITH_LINK_CIPHER
+    /* never fall back to sending in the clear */
+    if (config_.link_encrypt) {
+        fprintf(stderr, "link_encrypt set, but built without USBCOMMUNI_LINK_ENCRYPT\n");
+        return USBCOMMUNI_E_INVAIL_ARG;
+    }
+#endif
+
+    ios_.SetConfig(config_);
+    android_.SetConfig(config_);
+
+    link_.SetConfig(config_);
+    link_.RecvHandleRegister([this](uint8_t channel, const char *data, uint32_t len){DeliverRecv(channel, data, len);});
+    link_.TransportRegister([this](const struct iovec *iov, uint32_t iovcnt, USBCommuniErrors_t *results) {
+        return BackendSendBatch(iov, iovcnt, results);
+    });
+    link_.WakeRegister([this](){LinkWakeHandler();});
+    link_kick_ = false;
+    ios_.RecvHandleRegister(recv_cb);
+    android_.RecvHandleRegister(recv_cb);
+    android_.IntRecvHandleRegister([this](const char *data, uint32_t len){DatagramHandler(data, len);});
+
+    ios_.TimelineRegister(&timeline_);
+    android_.TimelineRegister(&timeline_);
+
+    latest_.SetMaxKeys(config_.latest_max_keys);
+    deadline_.SetMaxMessages(config_.deadline_max_msgs);
+    held_kick_ = false;
+    held_retry_ = false;
+    ios_.SendIdleRegister([this](){SendIdleHandler();});
+    android_.SendIdleRegister([this](){SendIdleHandler();});
+
+    /* before Init(), hotplug enumeration reports present devices right away */
+    ios_.SubscribeRegister(ios_subscribe_cb);
+    android_.SubscribeRegister(android_subscribe_cb);
+
+    if (config_.shm_enable) {
+        err = shm_.Open(config_.shm_socket_path, config_.shm_ring_size);
+        if (USBCOMMUNI_E_SUCCESS != err)
+            return err;
+    }
+
+    err = ios_.Init();
+    if (USBCOMMUNI_E_SUCCESS != err) {
+        shm_.Close();
+        return err;
+    }
+
+    err = android_.Init();
+    if (USBCOMMUNI_E_SUCCESS != err) {
+        ios_.Deinit();
+        shm_.Close();
+        return err;
+    }
+
+    loop_tick_ = std::chrono::steady_clock::now();
+    loop_due_ = loop_tick_;
+    loop_doonce_ = false;
+    loop_count_ = 0;
+
+    if (config_.external_loop) {
+        poll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if ((poll_fd_ < 0) || 
+            ((android_.GetPollFd() >= 0) && (CoreEpollAdd(poll_fd_, android_.GetPollFd()) != 0)) || 
+            ((ios_.GetPollFd() >= 0) && (CoreEpollAdd(poll_fd_, ios_.GetPollFd()) != 0)))
+        {
+            fprintf(stderr, "external loop poll fd setup failed\n");
+            if (poll_fd_ >= 0)
+                close(poll_fd_);
+            poll_fd_ = -1;
+            android_.Deinit();
+            ios_.Deinit();
+            shm_.Close();
+            return USBCOMMUNI_E_IO;
+        }
+    } else {
+        loop_exit_ = false;
+        loop_thread_ = std::thread(&BasicUSBCommuni::LoopHandler, this);
+    }
+    running_ = true;
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::Stop()
+{
+    if (!running_)
+        return;
+
+    loop_mutex_.lock();
+    loop_exit_ = true;
+    loop_mutex_.unlock();
+    loop_cond_.notify_all();
+
+    if (loop_thread_.joinable())
+        loop_thread_.join();
+
+    ios_.Deinit();
+    android_.Deinit();
+    shm_.Close();
+
+    if (poll_fd_ >= 0) {
+        close(poll_fd_);
+        poll_fd_ = -1;
+    }
+
+    type_ = USBCOMMUNI_DEVICE_TYPE_UNKNOWD;
+    ios_actions_ = USBCOMMUNI_IOS_ACTION_IDLE;
+    SetConnectState(USBCOMMUNI_STATE_IDLE);
+    running_ = false;
+}
+
+template <class Android, class Ios, class Sink>
+bool BasicUSBCommuni<Android, Ios, Sink>::GetConnectStatus()
+{
+    return (state_ == USBCOMMUNI_STATE_CONNECTED);
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniConnectStates_t BasicUSBCommuni<Android, Ios, Sink>::GetConnectState(uint64_t *epoch)
+{
+    std::lock_guard<std::mutex> lock(state_mutex_);
+
+    if (epoch)
+        *epoch = state_epoch_;
+
+    return state_;
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniErrors_t BasicUSBCommuni<Android, Ios, Sink>::WaitForConnect(uint32_t timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(state_mutex_);
+    auto connected = [this]() { return (state_ == USBCOMMUNI_STATE_CONNECTED); };
+
+    if (timeout_ms == USBCOMMUNI_WAIT_FOREVER) {
+        state_cond_.wait(lock, connected);
+        return USBCOMMUNI_E_SUCCESS;
+    }
+
+    if (!state_cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms), connected))
+        return USBCOMMUNI_E_TIMEOUT;
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniConnectStates_t BasicUSBCommuni<Android, Ios, Sink>::WaitForStateChange(uint64_t &epoch, uint32_t timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(state_mutex_);
+    uint64_t last = epoch;
+    auto changed = [this, last]() { return (state_epoch_ != last); };
+
+    if (timeout_ms == USBCOMMUNI_WAIT_FOREVER)
+        state_cond_.wait(lock, changed);
+    else
+        state_cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms), changed);
+
+    epoch = state_epoch_;
+
+    return state_;
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::StateHandleRegister(USBCommuniStateCb statecb)
+{
+    sink_.state_handle = statecb;
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::RecvHandleRegister(USBCommuniRecvHandleCb recvcb)
+{
+    sink_.recv_handle = recvcb;
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::RecvHandler(const char *data, uint32_t len)
+{
+    if (config_.link_enable)
+        link_.Feed(data, len);
+    else
+        DeliverRecv(0, data, len);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::DatagramHandler(const char *data, uint32_t len)
+{
+    if (config_.link_enable)
+        link_.FeedDatagram(data, len);
+    else
+        DeliverRecv(0, data, len);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::ChannelHandleRegister(uint8_t channel, USBCommuniRecvHandleCb recvcb)
+{
+    sink_.channel_handles[channel] = recvcb;
+}
+
+template <class Android, class Ios, class Sink>
+Sink &BasicUSBCommuni<Android, Ios, Sink>::GetSink()
+{
+    return sink_;
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::DeliverRecv(uint8_t channel, const char *data, uint32_t len)
+{
+    if (!timeline_.Reached(USBCOMMUNI_STAGE_FIRST_BYTE))
+        timeline_.Mark(USBCOMMUNI_STAGE_FIRST_BYTE);
+
+    sink_.Recv(channel, data, len);
+
+    /* never blocks, readers that fall behind lose data on their side */
+    if (config_.shm_enable)
+        shm_.Publish(data, len);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::GetShmStats(USBCommuniShmStats_t &stats)
+{
+    shm_.GetStats(stats);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::GetConnectTimeline(USBCommuniConnectTimeline_t &timeline)
+{
+    timeline_.Get(timeline);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::GetRecoveryStats(USBCommuniRecoveryStats_t &stats)
+{
+    android_.GetRecoveryStats(stats);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::GetLinkStats(USBCommuniLinkStats_t &stats)
+{
+    link_.GetStats(stats);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::GetRttStats(USBCommuniRttStats_t &stats)
+{
+    link_.GetRttStats(stats);
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniErrors_t BasicUSBCommuni<Android, Ios, Sink>::SendData(const char *data, uint32_t len, uint32_t &send_bytes, uint32_t ttl_ms)
+{
+    USBCommuniErrors_t err = USBCOMMUNI_E_NOT_CONN;
+
+    if (ttl_ms > 0) {
+        err = SendExpiring(0, data, len, ttl_ms);
+        send_bytes = (USBCOMMUNI_E_SUCCESS == err) ? len : 0;
+        return err;
+    }
+
+    if (config_.link_enable) {
+        /* a reliable session keeps what is sent while unplugged for the next connect */
+        if ((type_ == USBCOMMUNI_DEVICE_TYPE_UNKNOWD) && !config_.link_reliable)
+            return err;
+
+        err = link_.Send(0, data, len);
+        send_bytes = (USBCOMMUNI_E_SUCCESS == err) ? len : 0;
+        return err;
+    }
+
+    if (link_.Throttle(0, len) != USBCOMMUNI_E_SUCCESS)
+        return USBCOMMUNI_E_TIMEOUT;
+
+    switch (type_) {
+    case USBCOMMUNI_DEVICE_TYPE_ANDROID:
+        err = android_.SendData(data, len, send_bytes);
+        break;
+    
+    case USBCOMMUNI_DEVICE_TYPE_IOS:
+        err = ios_.SendData(data, len, send_bytes);
+        break;
+
+    default:
+        break;
+    }
+
+    return err;
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniErrors_t BasicUSBCommuni<Android, Ios, Sink>::SendBatch(const struct iovec *iov, uint32_t iovcnt, USBCommuniErrors_t *results)
+{
+    uint64_t total = 0;
+
+    if (config_.link_enable && ((type_ != USBCOMMUNI_DEVICE_TYPE_UNKNOWD) || config_.link_reliable))
+        return link_.SendBatch(0, iov, iovcnt, results);
+
+    for (uint32_t i = 0; (iov != nullptr) && (i < iovcnt); i++)
+        total += iov[i].iov_len;
+
+    if (link_.Throttle(0, total) != USBCOMMUNI_E_SUCCESS) {
+        if (results) {
+            for (uint32_t i = 0; i < iovcnt; i++)
+                results[i] = USBCOMMUNI_E_TIMEOUT;
+        }
+        return USBCOMMUNI_E_TIMEOUT;
+    }
+
+    return BackendSendBatch(iov, iovcnt, results);
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniErrors_t BasicUSBCommuni<Android, Ios, Sink>::SendChannel(uint8_t channel, const char *data, uint32_t len, uint32_t ttl_ms)
+{
+    if (!config_.link_enable)
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    if (ttl_ms > 0)
+        return SendExpiring(channel, data, len, ttl_ms);
+
+    if ((type_ == USBCOMMUNI_DEVICE_TYPE_UNKNOWD) && !config_.link_reliable)
+        return USBCOMMUNI_E_NOT_CONN;
+
+    return link_.Send(channel, data, len);
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniErrors_t BasicUSBCommuni<Android, Ios, Sink>::SendLatest(uint32_t key, const char *data, uint32_t len)
+{
+    if ((nullptr == data) || (0 == len))
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    if (!GetConnectStatus())
+        return USBCOMMUNI_E_NOT_CONN;
+
+    if (!latest_.Put(key, data, len))
+        return USBCOMMUNI_E_NMEN;
+
+    /* short of credit or tokens, the loop takes over the retries */
+    if (!SendHeld())
+        SendIdleHandler();
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniErrors_t BasicUSBCommuni<Android, Ios, Sink>::SendExpiring(uint8_t channel, const char *data, uint32_t len, uint32_t ttl_ms)
+{
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl_ms);
+
+    if ((nullptr == data) || (0 == len))
+        return USBCOMMUNI_E_INVAIL_ARG;
+
+    if (!GetConnectStatus())
+        return USBCOMMUNI_E_NOT_CONN;
+
+    if (!deadline_.Push(channel, data, len, deadline))
+        return USBCOMMUNI_E_NMEN;
+
+    if (!SendHeld())
+        SendIdleHandler();
+
+    return USBCOMMUNI_E_SUCCESS;
+}
+
+/**
+ * The held back messages go out only into an idle pipe, one flush at a
+ * time keeps them in order. The flush runs without held_mutex_ and never
+ * waits for credit or tokens, so neither the loop nor the callers of
+ * SendLatest() block behind it; what does not fit is held again and
+ * retried HELD_RETRY_MS later. Returns false in that case.
+ */
+template <class Android, class Ios, class Sink>
+bool BasicUSBCommuni<Android, Ios, Sink>::SendHeld()
+{
+    uint64_t epoch;
+    bool flushed;
+    std::unique_lock<std::mutex> lock(held_mutex_);
+
+    held_kick_ = false;
+
+    if (held_busy_) {
+        held_again_ = true;
+        return true;
+    }
+
+    held_busy_ = true;
+    held_retry_ = false;
+
+    do {
+        held_again_ = false;
+
+        if ((latest_.Empty() && deadline_.Empty()) || !BackendSendIdle())
+            break;
+
+        epoch = state_epoch_;
+        deadline_.Take(deadline_msgs_);
+        latest_.Take(latest_values_);
+
+        lock.unlock();
+        flushed = FlushHeld();
+        lock.lock();
+
+        if (!flushed) {
+            /* held again, unless the link went down meanwhile and dropped the rest */
+            if (state_epoch_ == epoch) {
+                deadline_.PutBack(deadline_back_);
+                latest_.PutBack(latest_values_, 0);
+            } else {
+                deadline_.Discard(deadline_back_);
+            }
+            latest_values_.clear();
+            held_retry_ = true;
+        }
+    } while (held_again_ && !held_retry_);
+
+    held_busy_ = false;
+
+    return !held_retry_;
+}
+
+/**
+ * Late messages are dropped right before their batch is framed, what is
+ * in time goes first, then the newest state. A message the backend
+ * refused is not retried, it would only be later. Short of credit or
+ * tokens, returns false with the rest in deadline_back_ and
+ * latest_values_. held_busy_ owned.
+ */
+template <class Android, class Ios, class Sink>
+bool BasicUSBCommuni<Android, Ios, Sink>::FlushHeld()
+{
+    USBCommuniErrors_t err;
+    std::chrono::steady_clock::time_point now;
+    size_t i, end, k;
+
+    /* one batch per run of a link channel */
+    for (i = 0; i < deadline_msgs_.size(); i = end) {
+        now = std::chrono::steady_clock::now();
+        held_iov_.clear();
+        held_index_.clear();
+        held_deadlines_.clear();
+
+        for (end = i; (end < deadline_msgs_.size()) && (deadline_msgs_[end].channel == deadline_msgs_[i].channel); end++) {
+            if (deadline_msgs_[end].deadline <= now) {
+                deadline_.Expire(deadline_msgs_[end]);
+                continue;
+            }
+
+            held_index_.push_back(end);
+            held_iov_.push_back(iovec());
+            held_iov_.back().iov_base = &deadline_msgs_[end].data[0];
+            held_iov_.back().iov_len = deadline_msgs_[end].data.size();
+            held_deadlines_.push_back(deadline_msgs_[end].deadline);
+        }
+
+        if (held_iov_.empty())
+            continue;
+
+        err = SendHeldBatch(deadline_msgs_[i].channel, held_deadlines_.data());
+
+        /* out of credit or tokens, nothing of the batch went out, it and the rest wait in order */
+        if (USBCOMMUNI_E_TIMEOUT == err) {
+            for (k = 0; k < held_index_.size(); k++)
+                deadline_back_.push_back(std::move(deadline_msgs_[held_index_[k]]));
+            for (k = end; k < deadline_msgs_.size(); k++)
+                deadline_back_.push_back(std::move(deadline_msgs_[k]));
+
+            deadline_msgs_.clear();
+            return false;
+        }
+
+        for (k = 0; k < held_results_.size(); k++)
+            deadline_.Report(held_results_[k]);
+    }
+
+    deadline_msgs_.clear();
+
+    if (latest_values_.empty())
+        return true;
+
+    held_iov_.resize(latest_values_.size());
+    for (i = 0; i < latest_values_.size(); i++) {
+        held_iov_[i].iov_base = &latest_values_[i].data[0];
+        held_iov_[i].iov_len = latest_values_[i].data.size();
+    }
+
+    err = SendHeldBatch(0, nullptr);
+    if (USBCOMMUNI_E_TIMEOUT == err)
+        return false;
+
+    for (k = 0; k < held_results_.size(); k++)
+        latest_.Report(held_results_[k]);
+
+    latest_values_.clear();
+
+    return true;
+}
+
+/* held_iov_ on link @channel without waiting, per message results in held_results_, @deadlines for the resend buffer */
+template <class Android, class Ios, class Sink>
+USBCommuniErrors_t BasicUSBCommuni<Android, Ios, Sink>::SendHeldBatch(uint8_t channel, const LinkDeadline *deadlines)
+{
+    LinkNoWait nowait;
+
+    /* an argument error returns before any result is filled in */
+    held_results_.assign(held_iov_.size(), USBCOMMUNI_E_UNKNOWN);
+
+    if (config_.link_enable)
+        return link_.SendBatch(channel, held_iov_.data(), held_iov_.size(), held_results_.data(), deadlines);
+
+    return SendBatch(held_iov_.data(), held_iov_.size(), held_results_.data());
+}
+
+/* backend threads, the pipe drained, have the loop send what was held back meanwhile; also a sender handing over its retries */
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::SendIdleHandler()
+{
+    if (latest_.Empty() && deadline_.Empty())
+        return;
+
+    loop_mutex_.lock();
+    held_kick_ = true;
+    loop_mutex_.unlock();
+    loop_cond_.notify_all();
+}
+
+/* receive thread, a NAK or RESUME wants frames resent, have the loop do it */
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::LinkWakeHandler()
+{
+    loop_mutex_.lock();
+    link_kick_ = true;
+    loop_mutex_.unlock();
+    loop_cond_.notify_all();
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::GetLatestStats(USBCommuniLatestStats_t &stats)
+{
+    latest_.GetStats(stats);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::GetDeadlineStats(USBCommuniDeadlineStats_t &stats)
+{
+    deadline_.GetStats(stats);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::SetLinkRateLimit(uint64_t bytes_per_sec, uint32_t burst)
+{
+    link_.SetLinkRate(bytes_per_sec, burst);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::SetChannelRateLimit(uint8_t channel, uint64_t bytes_per_sec, uint32_t burst)
+{
+    link_.SetChannelRate(channel, bytes_per_sec, burst);
+}
+
+template <class Android, class Ios, class Sink>
+USBCommuniErrors_t BasicUSBCommuni<Android, Ios, Sink>::BackendSendBatch(const struct iovec *iov, uint32_t iovcnt, USBCommuniErrors_t *results)
+{
+    USBCommuniErrors_t err = USBCOMMUNI_E_NOT_CONN;
+
+    switch (type_) {
+    case USBCOMMUNI_DEVICE_TYPE_ANDROID:
+        err = android_.SendBatch(iov, iovcnt, results);
+        break;
+    
+    case USBCOMMUNI_DEVICE_TYPE_IOS:
+        err = ios_.SendBatch(iov, iovcnt, results);
+        break;
+
+    default:
+        if (results) {
+            for (uint32_t i = 0; i < iovcnt; i++)
+                results[i] = err;
+        }
+        break;
+    }
+
+    return err;
+}
+
+template <class Android, class Ios, class Sink>
+bool BasicUSBCommuni<Android, Ios, Sink>::BackendSendIdle()
+{
+    switch (type_) {
+    case USBCOMMUNI_DEVICE_TYPE_ANDROID:
+        return android_.SendIdle();
+
+    case USBCOMMUNI_DEVICE_TYPE_IOS:
+        return ios_.SendIdle();
+
+    default:
+        return false;
+    }
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::AndroidSubscribeHandler(USBCommuniEventTypes_t event)
+{
+    switch (event) {
+    case USBCOMMUNI_DEVICE_ADD:
+        type_ = USBCOMMUNI_DEVICE_TYPE_ANDROID;
+        SetAttachState();
+        break;
+
+    case USBCOMMUNI_DEVICE_REMOVE:
+        type_ = USBCOMMUNI_DEVICE_TYPE_UNKNOWD;
+        SetConnectState(USBCOMMUNI_STATE_IDLE);
+        break;
+
+    default:
+        LinkEventHandler(event);
+        break;
+    }
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::IosSubscribeHandler(USBCommuniEventTypes_t event)
+{
+    switch (event) {
+    case USBCOMMUNI_DEVICE_ADD:
+        type_ = USBCOMMUNI_DEVICE_TYPE_IOS;
+        ios_actions_ = USBCOMMUNI_IOS_ACTION_ARRIVED;
+        SetAttachState();
+        break;
+
+    case USBCOMMUNI_DEVICE_REMOVE:
+        type_ = USBCOMMUNI_DEVICE_TYPE_UNKNOWD;
+        ios_actions_ = USBCOMMUNI_IOS_ACTION_REMOVE;
+        SetConnectState(USBCOMMUNI_STATE_IDLE);
+        break;
+
+    case USBCOMMUNI_DEVICE_CONNECTED:
+    case USBCOMMUNI_DEVICE_DISCONNECTED:
+        LinkEventHandler(event);
+        break;
+
+    default:
+        break;
+    }
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::LinkEventHandler(USBCommuniEventTypes_t event)
+{
+    switch (event) {
+    case USBCOMMUNI_DEVICE_CONNECTED:
+        link_.Reset();
+        link_.Resume();
+        SetConnectState(USBCOMMUNI_STATE_CONNECTED);
+        break;
+
+    case USBCOMMUNI_DEVICE_DISCONNECTED:
+        /* wakes senders blocked on credit */
+        link_.Reset();
+        /* the device may already be gone, REMOVE could arrive first */
+        SetConnectState((type_ != USBCOMMUNI_DEVICE_TYPE_UNKNOWD) ? \
+                            USBCOMMUNI_STATE_ATTACHED : USBCOMMUNI_STATE_IDLE);
+        break;
+
+    default:
+        break;
+    }
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::SetConnectState(USBCommuniConnectStates_t state)
+{
+    uint64_t epoch;
+
+    {
+        std::lock_guard<std::mutex> lock(state_mutex_);
+
+        if (state_ == state)
+            return;
+
+        state_ = state;
+        epoch = ++state_epoch_;
+        state_cond_.notify_all();
+    }
+
+    if (state == USBCOMMUNI_STATE_CONNECTED) {
+        timeline_.Mark(USBCOMMUNI_STAGE_READY);
+    } else {
+        /* under held_mutex_, a flush running meanwhile must not hold its rest again */
+        std::lock_guard<std::mutex> lock(held_mutex_);
+        latest_.Clear();
+        deadline_.Clear();
+    }
+
+    sink_.State(state, epoch);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::SetAttachState()
+{
+    uint64_t epoch;
+
+    {
+        std::lock_guard<std::mutex> lock(state_mutex_);
+
+        /* ADD is replayed on resubscribe, never hide an established link */
+        if (state_ != USBCOMMUNI_STATE_IDLE)
+            return;
+
+        state_ = USBCOMMUNI_STATE_ATTACHED;
+        epoch = ++state_epoch_;
+        state_cond_.notify_all();
+    }
+
+    sink_.State(USBCOMMUNI_STATE_ATTACHED, epoch);
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::CheckHeartbeat(uint32_t &wait_ms)
+{
+    bool stalled = false;
+    uint32_t next_ms;
+
+    if (!GetConnectStatus())
+        return;
+
+    next_ms = link_.Heartbeat(stalled);
+    if (next_ms < wait_ms)
+        wait_ms = next_ms;
+
+    if (!stalled)
+        return;
+
+    /* the backend reports DISCONNECTED and reconnects, on its own threads or in ProcessEvents() */
+    fprintf(stderr, "link stalled, no PONG for %u PINGs, reconnecting\n", config_.heartbeat_miss_limit);
+
+    switch (type_) {
+    case USBCOMMUNI_DEVICE_TYPE_ANDROID:
+        android_.Reconnect();
+        break;
+
+    case USBCOMMUNI_DEVICE_TYPE_IOS:
+        ios_.Reconnect();
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* one pass of the housekeeping, returns the ms until the next one is due */
+template <class Android, class Ios, class Sink>
+uint32_t BasicUSBCommuni<Android, Ios, Sink>::LoopStep()
+{
+    uint32_t wait_ms;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if (now < loop_tick_)
+        goto heartbeat;
+    loop_tick_ = now + std::chrono::milliseconds(500);
+
+    if (loop_doonce_ && loop_count_++ > 4) {
+        loop_doonce_ = false;
+        loop_count_ = 0;
+        ios_.HotplugEventRegister();
+        android_.HotplugEventRegister();
+    }
+
+    switch (ios_actions_.exchange(USBCOMMUNI_IOS_ACTION_IDLE)) {
+    case USBCOMMUNI_IOS_ACTION_ARRIVED:
+        android_.HotplugEventDisregister();
+        fprintf(stderr, "USBCOMMUNI_IOS_ACTION_ARRIVED\n");
+        break;
+
+    case USBCOMMUNI_IOS_ACTION_REMOVE:
+        loop_doonce_ = true;
+        ios_.HotplugEventDisregister();
+        break;
+
+    case USBCOMMUNI_IOS_ACTION_IDLE:
+    default:
+        break;
+    }
+
+heartbeat:
+    /* hotplug housekeeping every 500ms, heartbeats in between */
+    wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(loop_tick_ - now).count();
+    CheckHeartbeat(wait_ms);
+
+    return wait_ms;
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::LoopHandler()
+{
+    uint32_t wait_ms;
+    std::unique_lock<std::mutex> lock(loop_mutex_, std::defer_lock);
+
+    while (true) {
+        wait_ms = LoopStep();
+        if (held_retry_)
+            wait_ms = std::min(wait_ms, (uint32_t)HELD_RETRY_MS);
+
+        lock.lock();
+        loop_cond_.wait_for(lock, std::chrono::milliseconds(wait_ms), [this]() {
+            return loop_exit_ || held_kick_ || link_kick_;
+        });
+        if (loop_exit_)
+            break;
+        lock.unlock();
+
+        if (link_kick_.exchange(false))
+            link_.Resend();
+
+        if (held_kick_ || held_retry_)
+            SendHeld();
+    }
+}
+
+template <class Android, class Ios, class Sink>
+int BasicUSBCommuni<Android, Ios, Sink>::GetPollFd()
+{
+    return poll_fd_;
+}
+
+template <class Android, class Ios, class Sink>
+uint32_t BasicUSBCommuni<Android, Ios, Sink>::GetTimeout()
+{
+    int64_t us;
+    uint32_t timeout_ms;
+
+    if (!running_ || !config_.external_loop)
+        return USBCOMMUNI_WAIT_FOREVER;
+
+    if (held_kick_ || link_kick_)
+        return 0;
+
+    /* rounded up, waking a little early would only spin */
+    us = std::chrono::duration_cast<std::chrono::microseconds>(loop_due_ - std::chrono::steady_clock::now()).count();
+    timeout_ms = (us > 0) ? (us + 999) / 1000 : 0;
+
+    if (held_retry_)
+        timeout_ms = std::min(timeout_ms, (uint32_t)HELD_RETRY_MS);
+
+    timeout_ms = std::min(timeout_ms, android_.GetTimeout());
+    timeout_ms = std::min(timeout_ms, ios_.GetTimeout());
+
+    return timeout_ms;
+}
+
+template <class Android, class Ios, class Sink>
+void BasicUSBCommuni<Android, Ios, Sink>::ProcessEvents()
+{
+    std::chrono::steady_clock::time_point now;
+
+    if (!running_ || !config_.external_loop)
+        return;
+
+    android_.ProcessEvents();
+    ios_.ProcessEvents();
+
+    if (link_kick_.exchange(false))
+        link_.Resend();
+
+    if (held_kick_ || held_retry_)
+        SendHeld();
+
+    now = std::chrono::steady_clock::now();
+    if (now >= loop_due_)
+        loop_due_ = now + std::chrono::milliseconds(LoopStep());
+}
+
+}
+
+#endif /* USBCOMMUNI_IMPL_H_ */
@@ -0,0 +1,631 @@
+/**
+ * Stand-in for usbmuxd and an iPhone running a Peertalk app, to drive
+ * USBIosCommuni without hardware:
+ *
+ *   fake_usbmuxd -s /tmp/fake_usbmuxd.sock -m echo &
+ *   USBMUXD_SOCKET_ADDRESS=UNIX:/tmp/fake_usbmuxd.sock usbcommuniexample
+ *
+ * Speaks the plist flavour of the usbmuxd protocol (Listen, ListDevices,
+ * Connect, ReadBUID), simulates devices being plugged in and out and
+ * serves connections to the Peertalk port. Frames from the host are
+ * Peertalk framed, data towards the host is sent raw like the phone app
+ * does. Type "a [id]", "d [id]", "s" or "q" on stdin to attach, detach,
+ * print stats or quit.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "plist/plist.h"
+
+#define MUX_HEAD_SIZE           16
+#define MUX_PROTO_PLIST         1
+#define MUX_MESSAGE_PLIST       8
+
+#define MUX_RESULT_OK           0
+#define MUX_RESULT_BADCOMMAND   1
+#define MUX_RESULT_BADDEV       2
+#define MUX_RESULT_CONNREFUSED  3
+#define MUX_RESULT_BADVERSION   6
+
+#define PEERTALK_HEAD_SIZE      16
+#define TICK_MS                 10
+#define MAX_BACKLOG             (1024*1024)
+
+enum PeerModes {
+    PEER_ECHO,
+    PEER_SINK,
+    PEER_GENERATE,
+};
+
+struct Options {
+    std::string socket_path;
+    uint16_t port;
+    uint32_t devices;
+    PeerModes mode;
+    uint64_t rate;              /**< generated bytes per second */
+    uint32_t frame_size;        /**< generated chunk size */
+    uint32_t flap_ms;           /**< detach and re-attach everything, 0 off */
+};
+
+struct Device {
+    uint32_t id;
+    std::string udid;
+    bool attached;
+};
+
+struct Client {
+    int fd;
+    bool tunnel;                /**< after a successful Connect, raw Peertalk stream */
+    bool listening;
+    uint32_t device_id;
+    std::vector<char> in;
+    std::vector<char> out;
+    double tokens;
+    uint64_t rx_bytes;
+    uint64_t rx_frames;
+    uint64_t tx_bytes;
+};
+
+static Options options;
+static int epoll_fd = -1;
+static std::map<int, Client*> clients;
+static std::vector<Device> devices;
+
+static uint32_t GetBe32(const char *p)
+{
+    const uint8_t *u = reinterpret_cast<const uint8_t*>(p);
+
+    return ((uint32_t)u[0] << 24u) | ((uint32_t)u[1] << 16u) | ((uint32_t)u[2] << 8u) | u[3];
+}
+
+static void Watch(Client *c, bool out)
+{
+    struct epoll_event ev;
+
+    ev.events = out ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.fd = c->fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void Flush(Client *c)
+{
+    ssize_t r;
+    size_t sent = 0;
+
+    while (sent < c->out.size()) {
+        r = send(c->fd, c->out.data() + sent, c->out.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (r <= 0)
+            break;
+        sent += r;
+    }
+
+    c->out.erase(c->out.begin(), c->out.begin() + sent);
+    Watch(c, !c->out.empty());
+}
+
+static void Send(Client *c, const char *data, size_t len)
+{
+    c->out.insert(c->out.end(), data, data + len);
+    if (c->tunnel)
+        c->tx_bytes += len;
+    Flush(c);
+}
+
+static void CloseClient(Client *c)
+{
+    if (c->tunnel)
+        fprintf(stderr, "tunnel %d closed: rx %llu bytes in %llu frames, tx %llu bytes\n", c->fd,
+                (unsigned long long)c->rx_bytes, (unsigned long long)c->rx_frames, (unsigned long long)c->tx_bytes);
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+    close(c->fd);
+    clients.erase(c->fd);
+    delete c;
+}
+
+static void SendPlist(Client *c, uint32_t tag, plist_t dict)
+{
+    char head[MUX_HEAD_SIZE];
+    char *xml = nullptr;
+    uint32_t xml_len = 0;
+    uint32_t v[4];
+
+    plist_to_xml(dict, &xml, &xml_len);
+    plist_free(dict);
+    if (nullptr == xml)
+        return;
+
+    /* the usbmuxd header is little endian */
+    v[0] = MUX_HEAD_SIZE + xml_len;
+    v[1] = MUX_PROTO_PLIST;
+    v[2] = MUX_MESSAGE_PLIST;
+    v[3] = tag;
+    for (int i = 0; i < 4; i++) {
+        head[i * 4 + 0] = v[i] & 0xFF;
+        head[i * 4 + 1] = (v[i] >> 8) & 0xFF;
+        head[i * 4 + 2] = (v[i] >> 16) & 0xFF;
+        head[i * 4 + 3] = (v[i] >> 24) & 0xFF;
+    }
+
+    Send(c, head, sizeof(head));
+    Send(c, xml, xml_len);
+    free(xml);
+}
+
+static void SendResult(Client *c, uint32_t tag, uint64_t number)
+{
+    plist_t dict = plist_new_dict();
+
+    plist_dict_set_item(dict, "MessageType", plist_new_string("Result"));
+    plist_dict_set_item(dict, "Number", plist_new_uint(number));
+    SendPlist(c, tag, dict);
+}
+
+static plist_t DeviceAttachedPlist(const Device &d)
+{
+    plist_t dict = plist_new_dict();
+    plist_t props = plist_new_dict();
+
+    plist_dict_set_item(props, "ConnectionSpeed", plist_new_uint(480000000));
+    plist_dict_set_item(props, "ConnectionType", plist_new_string("USB"));
+    plist_dict_set_item(props, "DeviceID", plist_new_uint(d.id));
+    plist_dict_set_item(props, "LocationID", plist_new_uint(0x14100000 + d.id));
+    plist_dict_set_item(props, "ProductID", plist_new_uint(0x12a8));
+    plist_dict_set_item(props, "SerialNumber", plist_new_string(d.udid.c_str()));
+
+    plist_dict_set_item(dict, "DeviceID", plist_new_uint(d.id));
+    plist_dict_set_item(dict, "MessageType", plist_new_string("Attached"));
+    plist_dict_set_item(dict, "Properties", props);
+
+    return dict;
+}
+
+static Device *FindDevice(uint32_t id)
+{
+    for (Device &d : devices) {
+        if (d.id == id)
+            return &d;
+    }
+
+    return nullptr;
+}
+
+static void SetAttached(Device &d, bool attached)
+{
+    plist_t dict;
+    std::vector<Client*> gone;
+
+    if (d.attached == attached)
+        return;
+
+    d.attached = attached;
+    fprintf(stderr, "device %u (%s) %s\n", d.id, d.udid.c_str(), attached ? "attached" : "detached");
+
+    for (auto &it : clients) {
+        Client *c = it.second;
+
+        if (c->tunnel && (c->device_id == d.id) && !attached) {
+            gone.push_back(c);
+            continue;
+        }
+
+        if (!c->listening)
+            continue;
+
+        if (attached) {
+            dict = DeviceAttachedPlist(d);
+        } else {
+            dict = plist_new_dict();
+            plist_dict_set_item(dict, "DeviceID", plist_new_uint(d.id));
+            plist_dict_set_item(dict, "MessageType", plist_new_string("Detached"));
+        }
+        SendPlist(c, 0, dict);
+    }
+
+    /* unplugging drops every connection to the device */
+    for (Client *c : gone)
+        CloseClient(c);
+}
+
+static void HandleConnect(Client *c, uint32_t tag, plist_t msg)
+{
+    uint64_t id = 0;
+    uint64_t port = 0;
+    plist_t node;
+    Device *d;
+
+    if ((node = plist_dict_get_item(msg, "DeviceID")))
+        plist_get_uint_val(node, &id);
+    if ((node = plist_dict_get_item(msg, "PortNumber")))
+        plist_get_uint_val(node, &port);
+
+    /* the port travels in network byte order */
+    port = ntohs((uint16_t)port);
+
+    d = FindDevice(id);
+    if ((nullptr == d) || !d->attached) {
+        SendResult(c, tag, MUX_RESULT_BADDEV);
+        return;
+    }
+
+    if (port != options.port) {
+        SendResult(c, tag, MUX_RESULT_CONNREFUSED);
+        return;
+    }
+
+    SendResult(c, tag, MUX_RESULT_OK);
+    c->tunnel = true;
+    c->device_id = d->id;
+    c->tokens = 0;
+    fprintf(stderr, "tunnel %d to device %u port %u\n", c->fd, d->id, options.port);
+}
+
+static void HandleMessage(Client *c, uint32_t tag, plist_t msg)
+{
+    char *type = nullptr;
+    plist_t node;
+    plist_t dict;
+    plist_t list;
+
+    if ((node = plist_dict_get_item(msg, "MessageType")))
+        plist_get_string_val(node, &type);
+
+    if (nullptr == type) {
+        SendResult(c, tag, MUX_RESULT_BADCOMMAND);
+        return;
+    }
+
+    if (strcmp(type, "Listen") == 0) {
+        SendResult(c, tag, MUX_RESULT_OK);
+        c->listening = true;
+        for (Device &d : devices) {
+            if (d.attached)
+                SendPlist(c, 0, DeviceAttachedPlist(d));
+        }
+    } else if (strcmp(type, "ListDevices") == 0) {
+        dict = plist_new_dict();
+        list = plist_new_array();
+        for (Device &d : devices) {
+            if (d.attached)
+                plist_array_append_item(list, DeviceAttachedPlist(d));
+        }
+        plist_dict_set_item(dict, "DeviceList", list);
+        SendPlist(c, tag, dict);
+    } else if (strcmp(type, "Connect") == 0) {
+        HandleConnect(c, tag, msg);
+    } else if (strcmp(type, "ReadBUID") == 0) {
+        dict = plist_new_dict();
+        plist_dict_set_item(dict, "BUID", plist_new_string("00000000-FAKE-0000-0000-000000000000"));
+        SendPlist(c, tag, dict);
+    } else if (strcmp(type, "ReadPairRecord") == 0) {
+        /* no lockdown behind us, the Peertalk path never needs pairing */
+        SendResult(c, tag, MUX_RESULT_BADDEV);
+    } else {
+        SendResult(c, tag, MUX_RESULT_BADCOMMAND);
+    }
+
+    free(type);
+}
+
+static uint32_t GetLe32(const char *p)
+{
+    const uint8_t *u = reinterpret_cast<const uint8_t*>(p);
+
+    return ((uint32_t)u[3] << 24u) | ((uint32_t)u[2] << 16u) | ((uint32_t)u[1] << 8u) | u[0];
+}
+
+/* returns false once the client has to go */
+static bool ProcessControl(Client *c)
+{
+    size_t offset = 0;
+    uint32_t len;
+    plist_t msg;
+
+    while (!c->tunnel && (c->in.size() - offset >= MUX_HEAD_SIZE)) {
+        len = GetLe32(c->in.data() + offset);
+        if ((len < MUX_HEAD_SIZE) || (len > 1024*1024))
+            return false;
+        if (c->in.size() - offset < len)
+            break;
+
+        if ((GetLe32(c->in.data() + offset + 4) != MUX_PROTO_PLIST) ||
+            (GetLe32(c->in.data() + offset + 8) != MUX_MESSAGE_PLIST))
+        {
+            SendResult(c, GetLe32(c->in.data() + offset + 12), MUX_RESULT_BADVERSION);
+            offset += len;
+            continue;
+        }
+
+        msg = nullptr;
+        plist_from_xml(c->in.data() + offset + MUX_HEAD_SIZE, len - MUX_HEAD_SIZE, &msg);
+        if (msg) {
+            HandleMessage(c, GetLe32(c->in.data() + offset + 12), msg);
+            plist_free(msg);
+        }
+        offset += len;
+    }
+
+    c->in.erase(c->in.begin(), c->in.begin() + offset);
+
+    return true;
+}
+
+static void ProcessTunnel(Client *c)
+{
+    size_t offset = 0;
+    uint32_t payload_size;
+    uint32_t len;
+    const char *payload;
+
+    while (c->in.size() - offset >= PEERTALK_HEAD_SIZE) {
+        payload_size = GetBe32(c->in.data() + offset + 12);
+        if (c->in.size() - offset - PEERTALK_HEAD_SIZE < payload_size)
+            break;
+
+        /* PTExampleTextFrame: 4 byte length, then the message */
+        payload = c->in.data() + offset + PEERTALK_HEAD_SIZE;
+        len = (payload_size >= 4) ? GetBe32(payload) : 0;
+        if (len > payload_size - 4)
+            len = payload_size - 4;
+
+        c->rx_frames++;
+        c->rx_bytes += len;
+
+        if ((options.mode == PEER_ECHO) && (len > 0))
+            Send(c, payload + 4, len);
+
+        offset += PEERTALK_HEAD_SIZE + payload_size;
+    }
+
+    c->in.erase(c->in.begin(), c->in.begin() + offset);
+}
+
+static void ReadClient(Client *c)
+{
+    char buf[65536];
+    ssize_t r;
+
+    while ((r = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        c->in.insert(c->in.end(), buf, buf + r);
+
+        if (!c->tunnel && !ProcessControl(c)) {
+            CloseClient(c);
+            return;
+        }
+        /* data may follow the Connect reply in the same read */
+        if (c->tunnel)
+            ProcessTunnel(c);
+    }
+
+    if ((r == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+        CloseClient(c);
+}
+
+static void Generate(double seconds)
+{
+    std::vector<char> chunk(options.frame_size);
+    static uint32_t counter = 0;
+
+    for (auto &it : clients) {
+        Client *c = it.second;
+
+        if (!c->tunnel)
+            continue;
+
+        c->tokens += options.rate * seconds;
+        while ((c->tokens >= options.frame_size) && (c->out.size() < MAX_BACKLOG)) {
+            memset(chunk.data(), 'A' + (counter++ % 26), chunk.size());
+            Send(c, chunk.data(), chunk.size());
+            c->tokens -= options.frame_size;
+        }
+
+        /* a host that cannot keep up does not earn a burst later */
+        if (c->tokens > options.frame_size)
+            c->tokens = options.frame_size;
+    }
+}
+
+static void PrintStats()
+{
+    for (auto &it : clients) {
+        Client *c = it.second;
+
+        if (c->tunnel)
+            fprintf(stderr, "tunnel %d: rx %llu bytes in %llu frames, tx %llu bytes, backlog %zu\n", c->fd,
+                    (unsigned long long)c->rx_bytes, (unsigned long long)c->rx_frames,
+                    (unsigned long long)c->tx_bytes, c->out.size());
+    }
+}
+
+/* returns false on "q" */
+static bool HandleCommand()
+{
+    char line[128];
+    char cmd = 0;
+    unsigned int id = 0;
+    ssize_t r;
+
+    r = read(STDIN_FILENO, line, sizeof(line) - 1);
+    if (r <= 0)
+        return true;
+    line[r] = '\0';
+
+    if (sscanf(line, " %c %u", &cmd, &id) < 1)
+        return true;
+
+    for (Device &d : devices) {
+        if ((id != 0) && (d.id != id))
+            continue;
+        if (cmd == 'a')
+            SetAttached(d, true);
+        else if (cmd == 'd')
+            SetAttached(d, false);
+    }
+
+    if (cmd == 's')
+        PrintStats();
+
+    return (cmd != 'q');
+}
+
+static void Usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s socket] [-p port] [-n devices] [-m echo|sink|gen] [-r bytes/s] [-z size] [-f flap_ms]\n"
+                    "  -s  Unix socket to serve (default /tmp/fake_usbmuxd.sock)\n"
+                    "  -p  Peertalk port accepting connections (default 12345)\n"
+                    "  -n  simulated devices, attached on start (default 1)\n"
+                    "  -m  peer behaviour: echo frames back, sink them or generate traffic\n"
+                    "  -r  generated bytes per second per connection (default 1048576)\n"
+                    "  -z  generated chunk size (default 1024)\n"
+                    "  -f  detach and re-attach all devices every flap_ms\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int fd;
+    int listen_fd;
+    int timer_fd;
+    int n;
+    bool running = true;
+    struct sockaddr_un addr;
+    struct itimerspec its;
+    struct epoll_event ev, events[64];
+    uint64_t expirations;
+    uint64_t ticks = 0;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point now;
+
+    options.socket_path = "/tmp/fake_usbmuxd.sock";
+    options.port = 12345;
+    options.devices = 1;
+    options.mode = PEER_ECHO;
+    options.rate = 1024*1024;
+    options.frame_size = 1024;
+    options.flap_ms = 0;
+
+    while ((opt = getopt(argc, argv, "s:p:n:m:r:z:f:h")) != -1) {
+        switch (opt) {
+        case 's': options.socket_path = optarg; break;
+        case 'p': options.port = atoi(optarg); break;
+        case 'n': options.devices = atoi(optarg); break;
+        case 'r': options.rate = strtoull(optarg, nullptr, 0); break;
+        case 'z': options.frame_size = atoi(optarg); break;
+        case 'f': options.flap_ms = atoi(optarg); break;
+        case 'm':
+            if (strcmp(optarg, "echo") == 0)
+                options.mode = PEER_ECHO;
+            else if (strcmp(optarg, "sink") == 0)
+                options.mode = PEER_SINK;
+            else if (strcmp(optarg, "gen") == 0)
+                options.mode = PEER_GENERATE;
+            else {
+                Usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((options.frame_size == 0) || (options.socket_path.size() >= sizeof(addr.sun_path))) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (uint32_t i = 1; i <= options.devices; i++) {
+        char udid[64];
+        snprintf(udid, sizeof(udid), "00008030-FAKE%011X", i);
+        devices.push_back({i, udid, true});
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, options.socket_path.c_str(), options.socket_path.size());
+    unlink(options.socket_path.c_str());
+    if ((listen_fd < 0) || (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) || (listen(listen_fd, 16) != 0)) {
+        fprintf(stderr, "listen on %s failed: %s\n", options.socket_path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = TICK_MS * 1000000;
+    its.it_value = its.it_interval;
+    timerfd_settime(timer_fd, 0, &its, nullptr);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.fd = timer_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+    ev.data.fd = STDIN_FILENO;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+
+    fprintf(stderr, "export USBMUXD_SOCKET_ADDRESS=UNIX:%s\n", options.socket_path.c_str());
+
+    while (running) {
+        n = epoll_wait(epoll_fd, events, 64, -1);
+
+        for (int i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+
+            if (fd == listen_fd) {
+                while ((fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    Client *c = new Client();
+                    c->fd = fd;
+                    clients[fd] = c;
+                    ev.events = EPOLLIN;
+                    ev.data.fd = fd;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+                }
+            } else if (fd == timer_fd) {
+                read(timer_fd, &expirations, sizeof(expirations));
+                now = std::chrono::steady_clock::now();
+                if (options.mode == PEER_GENERATE)
+                    Generate(std::chrono::duration<double>(now - last).count());
+                last = now;
+
+                ticks += expirations;
+                if (options.flap_ms && (ticks * TICK_MS >= options.flap_ms)) {
+                    ticks = 0;
+                    for (Device &d : devices) {
+                        SetAttached(d, !d.attached);
+                    }
+                }
+            } else if (fd == STDIN_FILENO) {
+                running = HandleCommand();
+            } else if (clients.count(fd)) {
+                Client *c = clients[fd];
+
+                if (events[i].events & EPOLLOUT)
+                    Flush(c);
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    ReadClient(c);
+            }
+        }
+    }
+
+    PrintStats();
+    unlink(options.socket_path.c_str());
+
+    return 0;
+}